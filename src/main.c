@@ -65,6 +65,14 @@
 #include "pigun.h"
 #include "pigun-hid.h"
 #include "pigun-gpio.h"
+#include "pigun-control.h"
+#include "pigun-imu.h"
+#include "pigun-input.h"
+#include "pigun-solenoid.h"
+#include "pigun-timer.h"
+#include "pigun-usb.h"
+#include "pigun-hogp.h"
+#include "pigun-hci.h"
 
 
 #include "btstack_config.h"
@@ -121,6 +129,11 @@ static btstack_uart_config_t uart_config;
 
 static int main_argc;
 static const char ** main_argv;
+static int main_usb = 0;    // 1 for the wired mode (--usb): the bluetooth controller is not used
+static int main_ble = 0;    // 1 for HID over GATT on bluetooth LE (--ble) instead of classic HID
+static int main_hci = -1;   // Linux bluetooth device to use instead of the Pi UART (--hci <n>), e.g. a virtual one
+static const char* main_gpiochip = INPUT_CHIP;  // GPIO character device of the buttons (--gpiochip <path>), e.g. a gpio-sim one
+static int main_solenoid_sim = 0;               // 1 to record the solenoid pulses instead of firing them (--solenoid-sim)
 
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 
@@ -221,14 +234,18 @@ static void sigint_handler(int param){
     // program halts there and waits for gunthread to end
     
     // close the gpio system
+    pigun_input_stop();
+    pigun_solenoid_stop();
     pigun_GPIO_stop();
     
     // reset anyway
     btstack_stdin_reset();
 
     // power down
-    hci_power_control(HCI_POWER_OFF);
-    hci_close();
+    if (!main_usb) {
+        hci_power_control(HCI_POWER_OFF);
+        hci_close();
+    }
 
     log_info("Good bye, see you.\n");
     exit(0);
@@ -337,20 +354,29 @@ static uart_type_t raspi_get_bluetooth_uart_type(void){
 }
 
 static void phase2(int status);
-int main(int argc, const char * argv[]){
 
-    /// GET STARTED with BTstack ///
-    btstack_memory_init();
+// the HID device on the controller: classic, or HID over GATT with --ble
+static void app_main(void){
+    if (main_ble) pigun_hogp_main();
+    else btstack_main(main_argc, main_argv);
+}
 
-    // log into file using HCI_DUMP_PACKETLOGGER format
-    const char * pklg_path = "/tmp/hci_dump.pklg";
-    hci_dump_posix_fs_open(pklg_path, HCI_DUMP_PACKETLOGGER);
-    const hci_dump_t * hci_dump_impl = hci_dump_posix_fs_get_instance();
-    //hci_dump_init(hci_dump_impl);
-    //printf("Packet Log: %s\n", pklg_path);
+/// Starts the HID device on a Linux bluetooth device, through the HCI user channel.
+/// There is no chipset setup and no firmware to load: the kernel driver did that already.
+static int hci_user_start(void){
 
-    // setup run loop
-    btstack_run_loop_init(btstack_run_loop_posix_get_instance());
+    hci_init(pigun_hci_transport(main_hci), NULL);
+
+    // inform about BTstack state
+    hci_event_callback_registration.callback = &packet_handler;
+    hci_add_event_handler(&hci_event_callback_registration);
+
+    app_main();
+    return 0;
+}
+
+/// Sets up the bluetooth controller and starts the HID device on it.
+static int bluetooth_start(void){
 
     // pick serial port and configure uart block driver
     transport_config.device_name = "/dev/serial1";
@@ -440,12 +466,6 @@ int main(int argc, const char * argv[]){
     hci_event_callback_registration.callback = &packet_handler;
     hci_add_event_handler(&hci_event_callback_registration);
 
-    // handle CTRL-c
-    signal(SIGINT, sigint_handler);
-
-    main_argc = argc;
-    main_argv = argv;
-
     // power cycle Bluetooth controller on older models without flowcontrol
     if (power_cycle){
         btstack_control_raspi_set_bt_reg_en_pin(bt_reg_en_pin);
@@ -456,12 +476,6 @@ int main(int argc, const char * argv[]){
         control->on();
     }
 
-    // SETUP THE GPIO SYSTEM
-    if (pigun_GPIO_init() != 0) { // stop everything if error
-        return 0;
-    }
-
-
     if (transport_config.flowcontrol){
 
         // re-use current terminal speed (if there was no power cycle)
@@ -470,7 +484,7 @@ int main(int argc, const char * argv[]){
         }
 
         // with flowcontrol, we use h4 and are done
-        btstack_main(main_argc, main_argv);
+        app_main();
 
     }
     else {
@@ -485,6 +499,76 @@ int main(int argc, const char * argv[]){
         btstack_chipset_bcm_download_firmware(uart_driver, transport_config.baudrate_main, &phase2);
     }
 
+    return 0;
+}
+
+int main(int argc, const char * argv[]){
+
+    // startup options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--usb") == 0) main_usb = 1;
+        else if (strcmp(argv[i], "--ble") == 0) main_ble = 1;
+        else if (strcmp(argv[i], "--hci") == 0 && i + 1 < argc) main_hci = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--gpiochip") == 0 && i + 1 < argc) main_gpiochip = argv[++i];
+        else if (strcmp(argv[i], "--solenoid-sim") == 0) main_solenoid_sim = 1;
+        else if (strcmp(argv[i], "--dump-descriptor") == 0) {
+            // the report descriptor for the USB gadget, see usb-gadget.sh
+            fwrite(hid_descriptor_joystick_mode, 1, hid_descriptor_joystick_mode_size, stdout);
+            return 0;
+        }
+    }
+
+    /// GET STARTED with BTstack ///
+    btstack_memory_init();
+
+    // log into file using HCI_DUMP_PACKETLOGGER format
+    const char * pklg_path = "/tmp/hci_dump.pklg";
+    hci_dump_posix_fs_open(pklg_path, HCI_DUMP_PACKETLOGGER);
+    const hci_dump_t * hci_dump_impl = hci_dump_posix_fs_get_instance();
+    //hci_dump_init(hci_dump_impl);
+    //printf("Packet Log: %s\n", pklg_path);
+
+    // setup run loop
+    btstack_run_loop_init(btstack_run_loop_posix_get_instance());
+
+    // handle CTRL-c
+    signal(SIGINT, sigint_handler);
+
+    main_argc = argc;
+    main_argv = argv;
+
+    // timers of the LEDs, the reports and the reconnection, in the run loop
+    if (pigun_timer_init() != 0) return -1;
+
+    // SETUP THE GPIO SYSTEM
+    if (pigun_GPIO_init() != 0) { // stop everything if error
+        return 0;
+    }
+
+    // button edges on their own thread - if not available, the camera thread polls them
+    pigun_input_init(main_gpiochip);
+
+    // recoil pulses on their own timer thread
+    pigun_solenoid_init(main_solenoid_sim ? &pigun_solenoid_sim : &pigun_solenoid_gpio);
+
+    // local control interface - the gun works without it
+    pigun_control_init();
+
+#ifdef PIGUN_GYRO
+    // the gyro is optional: without it the aim comes from the camera only
+    pigun_imu_init();
+#endif
+
+
+    // wired or bluetooth: the run loop is the same, with the USB gadget or the bluetooth controller in it
+    if (main_usb) {
+        if (pigun_usb_init() != 0) return -1;
+    }
+    else if (main_hci >= 0) {
+        if (hci_user_start() != 0) return -1;
+    }
+    else if (bluetooth_start() != 0) return -1;
+
 
     // at this point we can start the core of the pigun and camera stuff
     // setup the pigun
@@ -511,6 +595,6 @@ static void phase2(int status){
     printf("Phase 2: Main app\n");
 
     // setup app
-    btstack_main(main_argc, main_argv);
+    app_main();
 }
 
@@ -1,6 +1,9 @@
+#include <math.h>
+
 #include "pigun.h"
 #include "pigun-hid.h"
 #include "pigun-mmal.h"
+#include "pigun-imu.h"
 
 /*
 * at this point the peaks are:
@@ -10,63 +13,189 @@
 * |      |
 * 2------3
 * 
-* but the inverse projection assumes the peaks are in a different order:
-* 
-* A------C
-* |      |
-* |      |
-* B------D
+* and they are mapped to the corners of the unit square, in the normalised beacon frame:
 * 
-* (so we just fix this in the definitions of x1,x2,...)
+* (0,0)--(1,0)
+* |          |
+* |          |
+* (0,1)--(1,1)
 * 
-* the resulting matrix C is stored in CMatrix, linearised
-* the x,y, screen point then corresponds to
-* P = cmat . {x, y, 1} / (cmat . {x, y, 1})[z]
-* in recrangle coordinates
-* P = (0,0) => A
-* P = (1,1) => D
-* it puzzles me that there is NO dependence on the rectangle aspect ratio?!
+* The homography H maps a camera point {x, y, 1} (full frame px) to the beacon frame:
+* P = H . {x, y, 1} / (H . {x, y, 1})[z]
+* It is built once per frame and can then be applied to any camera point.
+* The aim is where the boresight point (the camera pixel the sights are aligned with) lands.
 * 
+* The quad is checked before it is used: it has to be convex and not too close to
+* degenerate (3 beacons nearly aligned, or 2 almost on top of each other).
+* The condition number of H (with the camera coordinates scaled to ~[-1,1]) measures this.
 */
-void pigun_calculate_aim() {
+
+
+/// @brief Builds the homography from camera space to the normalised beacon frame.
+/// @param peaks the 4 ordered peaks, in full frame coordinates.
+/// @param H output homography, works on full frame px.
+/// @param cond output condition number of the quad, INFINITY if degenerate.
+/// @return 0 if the quad is good, 1 if it is degenerate and H should not be used.
+int pigun_homography_compute(const pigun_peak_t* peaks, pigun_homography_t* H, float* cond) {
+
+	// camera coordinates are centered and scaled, so that the condition number does not
+	// depend on the resolution: u = (col - cx) / s, v = (row - cy) / s
+	const float cx = PIGUN_RES_X / 2.0f, cy = PIGUN_RES_Y / 2.0f;
+	const float s = PIGUN_RES_X / 2.0f;
+
+	// quad corners going around the square: (0,0) (1,0) (1,1) (0,1)
+	const int order[4] = { 0, 1, 3, 2 };
+	float x[4], y[4];
+	for (int i = 0; i < 4; i++) {
+		x[i] = (peaks[order[i]].col - cx) / s;
+		y[i] = (peaks[order[i]].row - cy) / s;
+	}
+
+	*cond = INFINITY;
+
+	// square -> quad (Heckbert), S = {a b c, d e f, g h 1}
+	float a, b, c, d, e, f, g, h;
+	float sx = x[0] - x[1] + x[2] - x[3];
+	float sy = y[0] - y[1] + y[2] - y[3];
+	float dx1 = x[1] - x[2], dx2 = x[3] - x[2];
+	float dy1 = y[1] - y[2], dy2 = y[3] - y[2];
+	float den = dx1 * dy2 - dx2 * dy1;
+	if (fabsf(den) < 1e-9f) return 1;
+
+	g = (sx * dy2 - dx2 * sy) / den;
+	h = (dx1 * sy - sx * dy1) / den;
+	a = x[1] - x[0] + g * x[1];
+	b = x[3] - x[0] + h * x[3];
+	c = x[0];
+	d = y[1] - y[0] + g * y[1];
+	e = y[3] - y[0] + h * y[3];
+	f = y[0];
+
+	// the quad is convex only if the corners of the square stay on the same side of the
+	// line at infinity: w = g u + h v + 1 > 0 on all corners
+	if (1 + g <= 0 || 1 + h <= 0 || 1 + g + h <= 0) return 1;
+
+	// invert S with the adjugate
+	float inv[9] = {
+		e - f * h,		c * h - b,		b * f - c * e,
+		f * g - d,		a - c * g,		c * d - a * f,
+		d * h - e * g,	b * g - a * h,	a * e - b * d
+	};
+	float det = a * inv[0] + b * inv[3] + c * inv[6];
+	if (fabsf(det) < 1e-9f) return 1;
+
+	float ns = 0, ni = 0;
+	float sm[9] = { a, b, c, d, e, f, g, h, 1 };
+	for (int i = 0; i < 9; i++) {
+		inv[i] /= det;
+		ns += sm[i] * sm[i];
+		ni += inv[i] * inv[i];
+	}
+	*cond = sqrtf(ns * ni);
+
+	// fold the camera scaling in: H = S^-1 . N, N = {1/s 0 -cx/s, 0 1/s -cy/s, 0 0 1}
+	for (int r = 0; r < 3; r++) {
+		H->m[3 * r + 0] = inv[3 * r + 0] / s;
+		H->m[3 * r + 1] = inv[3 * r + 1] / s;
+		H->m[3 * r + 2] = inv[3 * r + 2] - (inv[3 * r + 0] * cx + inv[3 * r + 1] * cy) / s;
+	}
+
+	return (*cond > AIMER_MAXCOND) ? 1 : 0;
+}
+
+
+/// @brief Maps a camera point to the normalised beacon frame.
+/// @param H homography from pigun_homography_compute.
+/// @param x column in full frame px.
+/// @param y row in full frame px.
+/// @return the point in the beacon frame - (0,0) is the top-left beacon, (1,1) the low-right.
+pigun_aimpoint_t pigun_homography_apply(const pigun_homography_t* H, float x, float y) {
+
+	pigun_aimpoint_t p;
+	float w = H->m[6] * x + H->m[7] * y + H->m[8];
+	p.x = (H->m[0] * x + H->m[1] * y + H->m[2]) / w;
+	p.y = (H->m[3] * x + H->m[4] * y + H->m[5]) / w;
+	return p;
+}
+
+
+/// @brief Computes the aim from the detected peaks and writes it in the HID report.
+/// If the quad is bad, the report keeps the previous aim.
+/// @return 0 if the aim was updated, 1 if the frame was rejected.
+int pigun_calculate_aim() {
 	
 	float aim_x, aim_y;
-	float x1 = pigun.detector.peaks[0].col;
-	float x2 = pigun.detector.peaks[2].col;
-	float x3 = pigun.detector.peaks[1].col;
-	float x4 = pigun.detector.peaks[3].col;
-	float y1 = pigun.detector.peaks[0].row;
-	float y2 = pigun.detector.peaks[2].row;
-	float y3 = pigun.detector.peaks[1].row;
-	float y4 = pigun.detector.peaks[3].row;
 
 #ifdef PIGUN_DEBUG
-	printf("peaks: %f-%f/%f  %f-%f/%f  %f-%f/%f  %f-%f/%f \n",
-	x1,y1,pigun.detector.peaks[0].total,
-	x2,y2,pigun.detector.peaks[2].total,
-	x3,y3,pigun.detector.peaks[1].total,
-	x4,y4,pigun.detector.peaks[3].total);
+	for (int i = 0; i < 4; i++)
+		printf("peak %i: %f-%f/%f\n", i, pigun.detector.peaks[i].col, pigun.detector.peaks[i].row, pigun.detector.peaks[i].total);
 #endif
 
-	// build the transformation matrix using the 4 points and apply it to the center of camera image
-	// check out the mathematica notebook for some more insight
-	float dy = (y1 - y2);
-	float dxy = x1 * y2 - x2 * y1;
-	float d1 = 1.0 / (x4 * dy + dxy - x1 * y4 + x2 * y4);
-	aim_x = (dy * (PIGUN_RES_X / 2) + (x2 - x1) * (PIGUN_RES_Y / 2) + dxy) * d1;
-
-	dy = (y1 - y3);
-	dxy = x1 * y3 - x3 * y1;
-	d1 = 1.0 / (x4 * dy + dxy - x1 * y4 + x3 * y4);
-	aim_y = (dy * (PIGUN_RES_X / 2) + (x3 - x1) * (PIGUN_RES_Y / 2) + dxy) * d1;
+	if (pigun.detector.error) {
+		pigun.aim_rejected++;
+		pigun.aim_reject = 1;
+		return 1;
+	}
+
+	// build the transformation matrix using the 4 points and apply it to the boresight point
+	pigun_homography_t H;
+	if (pigun_homography_compute(pigun.detector.peaks, &H, &(pigun.aim_cond))) {
+		pigun.aim_rejected++;
+		pigun.aim_reject = 1;
+#ifdef PIGUN_DEBUG
+		printf("aimer: quad rejected, condition number %f\n", pigun.aim_cond);
+#endif
+		return 1;
+	}
+	pigun.homography = H;
+
+	float bcol = pigun.boresight.x * PIGUN_RES_X;
+	float brow = pigun.boresight.y * PIGUN_RES_Y;
+	pigun_aimpoint_t aim = pigun_homography_apply(&H, bcol, brow);
+	aim_x = aim.x;
+	aim_y = aim.y;
+
+	// with a barrel offset, add the parallax between the sights and the camera to the homography aim
+	// (the pose is solved anyway, for the control interface)
+	pigun_pose_t* pose = &(pigun.pose);
+	uint8_t barrel = (pose->barrel[0] != 0 || pose->barrel[1] != 0 || pose->barrel[2] != 0);
+	float px, py;
+	if (pigun_pose_solve(pose, H.m) == 0 && barrel && pigun_pose_parallax(pose, bcol, brow, &px, &py) == 0) {
+		aim_x += px;
+		aim_y += py;
+	}
 
 	// save the normalised aim position before messing with it - meaning 0,0 and 1,1 are the TR,LL corner LEDs
 	pigun.aim_normalised.x = aim_x;
 	pigun.aim_normalised.y = aim_y;
+	pigun.aim_reject = 0;
+
+	// with the gyro running, the report is written by the gyro thread and this frame only corrects its drift
+	if (pigun_imu_camera(pigun.timing.frame.t_sensor, aim_x, aim_y, H.m, bcol, brow))
+		return 0;
+
+	// compensate the latency: predict where the aim will be when the report goes out
+	pigun_predict_run(&(pigun.predictor), &aim_x, &aim_y, pigun.timing.frame.t_sensor);
+
+	pigun_aim_output(aim_x, aim_y, &(pigun.timing.frame));
+	return 0;
+}
+
+
+/// @brief Filters and calibrates a normalised aim, and writes it in the HID report.
+/// Called by the camera thread, or by the gyro thread when it is running.
+/// @param aim_x normalised aim x.
+/// @param aim_y normalised aim y.
+/// @param frame camera frame the aim comes from, NULL when it comes from the gyro.
+void pigun_aim_output(float aim_x, float aim_y, const pigun_frame_t* frame) {
+
+	// smooth out the jitter
+	pigun_filter_run(&(pigun.filter), &aim_x, &aim_y, (frame != NULL) ? frame->t_sensor : pigun_now_us());
 
 	// apply calibration
-	aim_x = (aim_x - pigun.cal_topleft.x) / (pigun.cal_lowright.x - pigun.cal_topleft.x);
-	aim_y = (aim_y - pigun.cal_topleft.y) / (pigun.cal_lowright.y - pigun.cal_topleft.y);
+	pigun_aimpoint_t aim = pigun_calibration_apply(aim_x, aim_y);
+	aim_x = aim.x;
+	aim_y = aim.y;
 
 	// clamp between 0 and 1
 	aim_x = (aim_x < 0) ? 0 : aim_x;
@@ -78,48 +207,13 @@ void pigun_calculate_aim() {
 	printf("aimer output: x=%f y=%f \n",aim_x, aim_y);
 #endif
 
-	// write in report
-	pigun.report.x = (int16_t)((2 * aim_x - 1) * 32767);
-	pigun.report.y = (int16_t)((2 * aim_y - 1) * 32767);
+	// write in report, the bluetooth thread is told if it changed
+	int16_t rx = (int16_t)((2 * aim_x - 1) * 32767);
+	int16_t ry = (int16_t)((2 * aim_y - 1) * 32767);
+	pigun_report_set_aim(rx, ry, frame);
 
 	//printf("HID report: x=%i y=%i bt=%d\n", global_pigun_report.x, global_pigun_report.y, global_pigun_report.buttons);
 }
 
 
 
-/*
-// ORIGINAL CODE
-void pigun_compute_4corners(Peak* ABCD, float aspectRatio, float* CMatrix) {
-
-	float x1 = ABCD[0].col;
-	float x2 = ABCD[1].col;
-	float x3 = ABCD[2].col;
-	float x4 = ABCD[3].col;
-	float y1 = ABCD[0].row;
-	float y2 = ABCD[1].row;
-	float y3 = ABCD[2].row;
-	float y4 = ABCD[3].row;
-
-	// build the transformation matrix using the 4 points
-	// check out the mathematica notebook for some more insight
-	float d1 = 1.0 / (x4 * (y1 - y2) + x1 * (y2 - y4) + x2 * (y4 - y1));
-	CMatrix[0] = (y1 - y2) * d1; // dy
-	CMatrix[1] = (x2 - x1) * d1;
-	CMatrix[2] = (x1 * y2 - x2 * y1) * d1; // dxy
-
-	float d2 = 1.0 / (-x3 * y1 + x4 * y1 + x1 * y3 - x4 * y3 - x1 * y4 + x3 * y4);
-	CMatrix[3] = (y1 - y3) * d2;
-	CMatrix[4] = (x3 - x1) * d2;
-	CMatrix[5] = (x1 * y3 - x3 * y1) * d2;
-
-	float d3 = 1.0 / (x3 * y2 - x4 * y2 - x2 * y3 + x4 * y3 + x2 * y4 - x3 * y4);
-	CMatrix[6] = CMatrix[0] + CMatrix[3] + (y2 - y3) * d3;
-	CMatrix[7] = CMatrix[1] + CMatrix[4] + (x3 - x2) * d3;
-	CMatrix[8] = CMatrix[2] + CMatrix[5] + (x2 * y3 - x3 * y2) * d3;
-
-	// all that is left to do is cmat.{x,y,1} = aiming point
-	// x,y is the aiming point in camera space, which always is in the middle (XRES/2, YRES/2)
-}
-*/
-
-
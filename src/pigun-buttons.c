@@ -0,0 +1,92 @@
+/*
+* Button state machine on whole registers.
+*
+* Each sample reads GPEDS0 (falling edges) and GPLEV0 once, clears the events of the button pins
+* with one write, and moves every button at once with bit operations:
+*	ready (not pressed, not recharging) + edge		-> pressed, new press
+*	pressed + pin high								-> released, recharging for `delay` samples
+*	recharging										-> one sample less
+* which is the per-pin logic of the polled buttons, all buttons in parallel. The recharge count
+* is a vertical counter: bit i of plane k is bit k of the count of button i, so counting all the
+* buttons down is a few ANDs and XORs.
+*
+* The register access goes through pigun_buttons_regs_t, so the machine runs off the Pi too.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pigun-buttons.h"
+
+
+// moves the bits of the button pins to the button positions
+static inline uint16_t buttons_gather(const pigun_buttons_t* b, uint32_t pins) {
+
+	uint16_t mask = 0;
+	for (int i = 0; i < b->count; i++)
+		mask |= (uint16_t)(((pins >> b->pin[i]) & 1) << i);
+	return mask;
+}
+
+
+/// @brief Sets up the state machine, all buttons released and ready.
+/// @param regs register access.
+/// @param pins GPIO pin of each button, in the order of the masks.
+/// @param count number of buttons (16 at most).
+/// @param delay samples a released button waits before it takes a new press (BUTTONS_MAXDELAY at most).
+void pigun_buttons_init(pigun_buttons_t* b, const pigun_buttons_regs_t* regs, const int* pins, int count, uint8_t delay) {
+
+	memset(b, 0, sizeof(pigun_buttons_t));
+	b->regs = regs;
+	b->count = (count > 16) ? 16 : (uint8_t)count;
+	for (int i = 0; i < b->count; i++) {
+		b->pin[i] = (uint8_t)pins[i];
+		b->pinmask |= UINT32_C(1) << pins[i];
+	}
+	b->delay = (delay > BUTTONS_MAXDELAY) ? BUTTONS_MAXDELAY : delay;
+}
+
+/// @brief Buttons still recharging after a release.
+uint16_t pigun_buttons_recharging(const pigun_buttons_t* b) {
+
+	uint16_t r = 0;
+	for (int k = 0; k < BUTTONS_DELAYBITS; k++) r |= b->recharge[k];
+	return r;
+}
+
+/// @brief Samples the registers and moves all the buttons.
+/// @param newpress output buttons pressed in this sample.
+/// @return the pressed buttons.
+uint16_t pigun_buttons_sample(pigun_buttons_t* b, uint16_t* newpress) {
+
+	// one read of each register, one write to clear the events, whether they made a press or not
+	// (otherwise the edge detection does not fire again)
+	uint32_t events = b->regs->events() & b->pinmask;
+	uint32_t level = b->regs->level();
+	if (events) b->regs->clear(events);
+
+	uint16_t edge = buttons_gather(b, events);
+	uint16_t high = buttons_gather(b, level);
+	uint16_t recharging = pigun_buttons_recharging(b);
+
+	uint16_t press = edge & ~b->pressed & ~recharging;
+	uint16_t release = b->pressed & high;
+
+	// count down the recharging buttons: subtract 1 with the borrow going up the planes
+	uint16_t borrow = recharging;
+	for (int k = 0; k < BUTTONS_DELAYBITS; k++) {
+		uint16_t c = b->recharge[k];
+		b->recharge[k] = c ^ borrow;
+		borrow &= ~c;
+	}
+
+	// the released buttons start recharging
+	for (int k = 0; k < BUTTONS_DELAYBITS; k++) {
+		if ((b->delay >> k) & 1) b->recharge[k] |= release;
+		else b->recharge[k] &= ~release;
+	}
+
+	b->pressed = (b->pressed & ~release) | press;
+	*newpress = press;
+	return b->pressed;
+}
@@ -0,0 +1,39 @@
+#include <stdint.h>
+
+#ifndef PIGUN_BUTTONS_SM
+#define PIGUN_BUTTONS_SM
+
+
+#define BUTTONS_DELAYBITS 3							// bit planes of the recharge counter
+#define BUTTONS_MAXDELAY ((1 << BUTTONS_DELAYBITS) - 1)	// longest recharge, in samples
+
+
+/// @brief Access to the GPIO bank 0 registers, one read or write for all the pins.
+/// The bcm2835 one is in pigun-gpio.c, any other (a fake, a recording) can stand in for it.
+typedef struct {
+	uint32_t	(*level)(void);			// GPLEV0: bit n is 1 if pin n is high
+	uint32_t	(*events)(void);		// GPEDS0: bit n is 1 if an edge was detected on pin n
+	void		(*clear)(uint32_t pins);	// GPEDS0 write: clears the events of the pins with a 1
+} pigun_buttons_regs_t;
+
+/// @brief State of all the buttons, bit i is button i (the order of the MASK_ definitions).
+typedef struct {
+
+	const pigun_buttons_regs_t* regs;
+	uint8_t		pin[16];			// pin of each button
+	uint8_t		count;				// buttons in use
+	uint32_t	pinmask;			// all the button pins
+	uint8_t		delay;				// samples a released button waits before a new press
+
+	uint16_t	pressed;			// pressed and not released yet (the HID state)
+	uint16_t	recharge[BUTTONS_DELAYBITS];	// vertical counter: plane k has bit k of the samples left, per button
+
+} pigun_buttons_t;
+
+
+void pigun_buttons_init(pigun_buttons_t* b, const pigun_buttons_regs_t* regs, const int* pins, int count, uint8_t delay);
+uint16_t pigun_buttons_sample(pigun_buttons_t* b, uint16_t* newpress);
+uint16_t pigun_buttons_recharging(const pigun_buttons_t* b);
+
+
+#endif
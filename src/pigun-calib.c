@@ -0,0 +1,288 @@
+/*
+* Calibration: maps the normalised aim (beacon frame) to the play area on the screen.
+*
+* Two methods:
+*	2-point: the top-left and low-right corners of the play area define a linear scale
+*	grid: a 3x3 or 5x5 grid of points on the play area is shot in service mode, a smooth
+*		polynomial is fitted on them (quadratic for 3x3, cubic for 5x5) and baked into a
+*		table of CAL_LUT_N x CAL_LUT_N nodes. Per frame, the aim is one bilinear lookup.
+*		This corrects beacons that are not exactly at the screen corners, curved screens and
+*		non-linearities near the edges.
+*
+* The calibration file (cdata.bin) is versioned:
+*	uint32 CAL_FILE_MAGIC, uint32 version
+*	aimpoint topleft, lowright, boresight
+*	uint32 grid size n (0 = no grid), n*n aimpoint samples
+*	(version 3) float beacon width, height, barrel offset x, y, z
+* Older files without header (2 points, optionally followed by the boresight) are still read.
+* The grid samples are stored rather than the table, so the fit can change between versions.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pigun.h"
+
+
+#define CAL_FILE "cdata.bin"
+#define CAL_FILE_MAGIC 0x44434750	// "PGCD"
+#define CAL_FILE_VERSION 3
+
+#define CAL_MAXTERMS 10	// terms of the cubic polynomial
+
+
+/// @brief Save the calibration data for future use.
+void pigun_calibration_save() {
+
+	FILE* fbin = fopen(CAL_FILE, "wb");
+	if (fbin == NULL) {
+		printf("PIGUN ERROR: unable to save the calibration data\n");
+		return;
+	}
+
+	uint32_t header[2] = { CAL_FILE_MAGIC, CAL_FILE_VERSION };
+	uint32_t n = pigun.calgrid.n;
+	fwrite(header, sizeof(uint32_t), 2, fbin);
+	fwrite(&(pigun.cal_topleft),  sizeof(pigun_aimpoint_t), 1, fbin);
+	fwrite(&(pigun.cal_lowright), sizeof(pigun_aimpoint_t), 1, fbin);
+	fwrite(&(pigun.boresight),    sizeof(pigun_aimpoint_t), 1, fbin);
+	fwrite(&n, sizeof(uint32_t), 1, fbin);
+	fwrite(pigun.calgrid.samples, sizeof(pigun_aimpoint_t), n * n, fbin);
+	fwrite(&(pigun.pose.beacon_w), sizeof(float), 1, fbin);
+	fwrite(&(pigun.pose.beacon_h), sizeof(float), 1, fbin);
+	fwrite(pigun.pose.barrel, sizeof(float), 3, fbin);
+	fclose(fbin);
+}
+
+
+/// @brief Resets the calibration and loads the saved one, if available.
+void pigun_calibration_load() {
+
+	pigun.cal_topleft.x = pigun.cal_topleft.y = 0;
+	pigun.cal_lowright.x = pigun.cal_lowright.y = 1;
+	pigun.boresight.x = pigun.boresight.y = 0.5f;
+	pigun.calgrid.n = 0;
+	pigun.calgrid.count = 0;
+	pigun_pose_init(&(pigun.pose));
+
+	FILE* fbin = fopen(CAL_FILE, "rb");
+	if (fbin == NULL) {
+		printf("PIGUN: no calibration data found\n");
+		return;
+	}
+
+	uint32_t header[2];
+	if (fread(header, sizeof(uint32_t), 2, fbin) != 2) {
+		printf("PIGUN ERROR: calibration data is too short\n");
+		fclose(fbin);
+		return;
+	}
+
+	pigun_aimpoint_t p[3];
+	if (header[0] != CAL_FILE_MAGIC) {
+
+		// old file: 2 points, maybe followed by the boresight
+		rewind(fbin);
+		int np = fread(p, sizeof(pigun_aimpoint_t), 3, fbin);
+		if (np >= 2) {
+			pigun.cal_topleft = p[0];
+			pigun.cal_lowright = p[1];
+		}
+		if (np == 3) pigun.boresight = p[2];
+		fclose(fbin);
+		return;
+	}
+
+	if (header[1] > CAL_FILE_VERSION) {
+		printf("PIGUN ERROR: calibration data version %u is not supported\n", header[1]);
+		fclose(fbin);
+		return;
+	}
+
+	uint32_t n = 0;
+	if (fread(p, sizeof(pigun_aimpoint_t), 3, fbin) != 3 || fread(&n, sizeof(uint32_t), 1, fbin) != 1) {
+		printf("PIGUN ERROR: calibration data is corrupted\n");
+		fclose(fbin);
+		return;
+	}
+	pigun.cal_topleft = p[0];
+	pigun.cal_lowright = p[1];
+	pigun.boresight = p[2];
+
+	if (n == 3 || n == 5) {
+		pigun_calgrid_t* grid = &(pigun.calgrid);
+		if (fread(grid->samples, sizeof(pigun_aimpoint_t), n * n, fbin) == n * n) {
+			grid->n = n;
+			grid->count = n * n;
+			if (pigun_calgrid_fit(grid) != 0) grid->n = 0;
+		}
+		if (grid->n == 0) printf("PIGUN ERROR: grid calibration data is not usable\n");
+		else printf("PIGUN: using %ux%u grid calibration\n", n, n);
+	}
+	else if (n != 0) {
+		printf("PIGUN ERROR: grid calibration data is corrupted\n");
+		fclose(fbin);
+		return;
+	}
+
+	// beacon geometry - version 2 files keep the defaults
+	float geometry[5];
+	if (header[1] >= 3 && fread(geometry, sizeof(float), 5, fbin) == 5 && geometry[0] > 0 && geometry[1] > 0) {
+		pigun.pose.beacon_w = geometry[0];
+		pigun.pose.beacon_h = geometry[1];
+		memcpy(pigun.pose.barrel, geometry + 2, 3 * sizeof(float));
+	}
+	fclose(fbin);
+}
+
+
+/// @brief Screen point of a grid calibration sample.
+/// @param n grid size.
+/// @param k sample index, row by row from the top-left.
+/// @return the point as fraction of the play area, (0,0) top-left and (1,1) low-right.
+pigun_aimpoint_t pigun_calgrid_target(int n, int k) {
+
+	pigun_aimpoint_t t;
+	t.x = (float)(k % n) / (n - 1);
+	t.y = (float)(k / n) / (n - 1);
+	return t;
+}
+
+
+// polynomial terms up to cubic, in the order they are added
+static int calgrid_terms(double x, double y, int nterms, double* t) {
+
+	double all[CAL_MAXTERMS] = { 1, x, y, x * y, x * x, y * y, x * x * y, x * y * y, x * x * x, y * y * y };
+	for (int i = 0; i < nterms; i++) t[i] = all[i];
+	return nterms;
+}
+
+// solves a . c = b in place (gaussian elimination with partial pivoting)
+static int calgrid_solve(double a[CAL_MAXTERMS][CAL_MAXTERMS], double* b, int n) {
+
+	for (int i = 0; i < n; i++) {
+		int piv = i;
+		for (int r = i + 1; r < n; r++)
+			if (fabs(a[r][i]) > fabs(a[piv][i])) piv = r;
+		if (fabs(a[piv][i]) < 1e-12) return 1;
+
+		if (piv != i) {
+			for (int c = 0; c < n; c++) {
+				double tmp = a[i][c]; a[i][c] = a[piv][c]; a[piv][c] = tmp;
+			}
+			double tmp = b[i]; b[i] = b[piv]; b[piv] = tmp;
+		}
+
+		for (int r = i + 1; r < n; r++) {
+			double f = a[r][i] / a[i][i];
+			for (int c = i; c < n; c++) a[r][c] -= f * a[i][c];
+			b[r] -= f * b[i];
+		}
+	}
+	for (int i = n - 1; i >= 0; i--) {
+		for (int c = i + 1; c < n; c++) b[i] -= a[i][c] * b[c];
+		b[i] /= a[i][i];
+	}
+	return 0;
+}
+
+
+/// @brief Fits the grid samples and bakes the screen warp table.
+/// @param grid grid calibration with n and all samples set.
+/// @return 0 if the fit worked, 1 if the samples are degenerate.
+int pigun_calgrid_fit(pigun_calgrid_t* grid) {
+
+	int n = grid->n;
+	int ns = n * n;
+	int nterms = (n >= 5) ? 10 : 6;
+
+	// center and scale the samples, for a better conditioned fit
+	float xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+	for (int k = 0; k < ns; k++) {
+		xmin = fminf(xmin, grid->samples[k].x);
+		xmax = fmaxf(xmax, grid->samples[k].x);
+		ymin = fminf(ymin, grid->samples[k].y);
+		ymax = fmaxf(ymax, grid->samples[k].y);
+	}
+	if (xmax - xmin < 1e-3f || ymax - ymin < 1e-3f) return 1;
+	double mx = (xmax + xmin) / 2, sx = (xmax - xmin) / 2;
+	double my = (ymax + ymin) / 2, sy = (ymax - ymin) / 2;
+
+	// least squares with the normal equations, one right hand side for each screen axis
+	double ata[CAL_MAXTERMS][CAL_MAXTERMS], ata2[CAL_MAXTERMS][CAL_MAXTERMS];
+	double cu[CAL_MAXTERMS], cv[CAL_MAXTERMS], t[CAL_MAXTERMS];
+	memset(ata, 0, sizeof(ata));
+	memset(cu, 0, sizeof(cu));
+	memset(cv, 0, sizeof(cv));
+
+	for (int k = 0; k < ns; k++) {
+		pigun_aimpoint_t target = pigun_calgrid_target(n, k);
+		calgrid_terms((grid->samples[k].x - mx) / sx, (grid->samples[k].y - my) / sy, nterms, t);
+		for (int i = 0; i < nterms; i++) {
+			for (int j = 0; j < nterms; j++) ata[i][j] += t[i] * t[j];
+			cu[i] += t[i] * target.x;
+			cv[i] += t[i] * target.y;
+		}
+	}
+	memcpy(ata2, ata, sizeof(ata));
+	if (calgrid_solve(ata, cu, nterms) || calgrid_solve(ata2, cv, nterms)) return 1;
+
+	// bake the table on the sample bounding box plus margin
+	grid->x0 = xmin - CAL_LUT_MARGIN * (xmax - xmin);
+	grid->y0 = ymin - CAL_LUT_MARGIN * (ymax - ymin);
+	grid->dx = (1 + 2 * CAL_LUT_MARGIN) * (xmax - xmin) / (CAL_LUT_N - 1);
+	grid->dy = (1 + 2 * CAL_LUT_MARGIN) * (ymax - ymin) / (CAL_LUT_N - 1);
+
+	for (int r = 0; r < CAL_LUT_N; r++) {
+		for (int c = 0; c < CAL_LUT_N; c++) {
+			double x = (grid->x0 + c * grid->dx - mx) / sx;
+			double y = (grid->y0 + r * grid->dy - my) / sy;
+			calgrid_terms(x, y, nterms, t);
+			double u = 0, v = 0;
+			for (int i = 0; i < nterms; i++) {
+				u += cu[i] * t[i];
+				v += cv[i] * t[i];
+			}
+			grid->lut[r][c].x = u;
+			grid->lut[r][c].y = v;
+		}
+	}
+	return 0;
+}
+
+
+/// @brief Maps the normalised aim to the play area.
+/// With the grid calibration, this is a bilinear lookup in the warp table (extrapolated linearly
+/// outside of it), otherwise the linear scale between the 2 calibration points.
+/// @param x normalised aim x.
+/// @param y normalised aim y.
+/// @return the aim as fraction of the play area, not clamped.
+pigun_aimpoint_t pigun_calibration_apply(float x, float y) {
+
+	pigun_aimpoint_t a;
+	const pigun_calgrid_t* grid = &(pigun.calgrid);
+
+	if (grid->n == 0) {
+		a.x = (x - pigun.cal_topleft.x) / (pigun.cal_lowright.x - pigun.cal_topleft.x);
+		a.y = (y - pigun.cal_topleft.y) / (pigun.cal_lowright.y - pigun.cal_topleft.y);
+		return a;
+	}
+
+	float fx = (x - grid->x0) / grid->dx;
+	float fy = (y - grid->y0) / grid->dy;
+	int c = (int)floorf(fx);
+	int r = (int)floorf(fy);
+	c = (c < 0) ? 0 : (c > CAL_LUT_N - 2) ? CAL_LUT_N - 2 : c;
+	r = (r < 0) ? 0 : (r > CAL_LUT_N - 2) ? CAL_LUT_N - 2 : r;
+	float tx = fx - c, ty = fy - r;
+
+	const pigun_aimpoint_t* p00 = &(grid->lut[r][c]);
+	const pigun_aimpoint_t* p01 = &(grid->lut[r][c + 1]);
+	const pigun_aimpoint_t* p10 = &(grid->lut[r + 1][c]);
+	const pigun_aimpoint_t* p11 = &(grid->lut[r + 1][c + 1]);
+
+	a.x = (1 - ty) * ((1 - tx) * p00->x + tx * p01->x) + ty * ((1 - tx) * p10->x + tx * p11->x);
+	a.y = (1 - ty) * ((1 - tx) * p00->y + tx * p01->y) + ty * ((1 - tx) * p10->y + tx * p11->y);
+	return a;
+}
@@ -0,0 +1,505 @@
+/*
+* Local control interface: text commands on a UDP socket bound to localhost.
+* The socket is served by the BTstack run loop, so commands run on the main thread.
+*
+* Example:
+*	echo "camera shutter 2000" | nc -u -w1 127.0.0.1 5010
+*
+* Commands:
+*	camera							print the current camera settings
+*	camera <setting> <value>		change a camera setting (exposure, shutter, again, dgain, blur, fps)
+*	aim								print the boresight point and the quad statistics
+*	aim boresight <x> <y>			set the camera point the sights are aligned with (fraction of the frame) and save it
+*	predict							print the aim predictor settings
+*	predict horizon <us>			set how far ahead the aim is extrapolated (0 = off)
+*	predict score					replay the recent aim with several horizons and print the errors
+*	filter							print the aim filter parameters
+*	filter profile <name>			load a filter profile (default, smooth, fast, bypass)
+*	filter <param> <value>			tune a filter parameter (mincutoff, beta, dcutoff, deadzone)
+*	filter bench					replay the recent aim through each profile and print jitter and lag
+*	hid								print the report transmission counters and the time to first report
+*	hid keepalive <ms>				send the report at least this often even if it does not change (0 = never)
+*	hid telemetry <ms>				send the telemetry report this often (0 = only when the host asks)
+*	link							print the bluetooth link mode and the negotiated QoS/flush timeout (or LE interval)
+*	link idle <ms>					time without changes before the link is allowed to sniff (0 = never)
+*	reconnect						print the paging of the known hosts and how the connections were made
+*	param							print the runtime parameters (see pigun-param.c)
+*	param <name> [<value>]			print the range of a parameter, or set it (the frame processing ones at the next frame)
+*	pose							print the gun position (m) and orientation (degrees) with respect to the beacons
+*	pose beacons <w> <h>			set the size of the beacon rectangle in m, and save it
+*	pose barrel <x> <y> <z>			set the barrel line of sight origin with respect to the camera in m
+*									(x right, y down, z forward), and save it
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "btstack.h"
+
+#include "pigun.h"
+#include "pigun-mmal.h"
+#include "pigun-control.h"
+#include "pigun-param.h"
+#include "pigun-link.h"
+#include "pigun-reconnect.h"
+#include "pigun-gpio.h"
+
+
+static btstack_data_source_t control_source;
+
+
+static int control_camera(char* name, char* value, char* reply, int maxlen) {
+
+	pigun_camera_params_t params;
+	pigun_camera_get(&params);
+
+	if (name == NULL) {
+		snprintf(reply, maxlen, "OK exposure %u shutter %u again %.2f dgain %.2f blur %u fps %u\n",
+			params.exposure, params.shutter, params.again / 100.0f, params.dgain / 100.0f, params.blur, params.fps);
+		return 0;
+	}
+	if (value == NULL) {
+		snprintf(reply, maxlen, "ERROR missing value for %s\n", name);
+		return 1;
+	}
+
+	float v = atof(value);
+	uint8_t mask = 0;
+
+	if (strcmp(name, "exposure") == 0) {
+		params.exposure = (v != 0);
+		mask = CAMERA_SET_EXPOSURE;
+	}
+	else if (strcmp(name, "shutter") == 0 && v >= 0 && v <= 1000000) {
+		params.shutter = (uint32_t)v;
+		mask = CAMERA_SET_SHUTTER;
+	}
+	else if (strcmp(name, "again") == 0 && v >= 0 && v <= 16) {
+		params.again = (uint16_t)(v * 100);
+		mask = CAMERA_SET_GAINS;
+	}
+	else if (strcmp(name, "dgain") == 0 && v >= 0 && v <= 64) {
+		params.dgain = (uint16_t)(v * 100);
+		mask = CAMERA_SET_GAINS;
+	}
+	else if (strcmp(name, "blur") == 0) {
+		params.blur = (v != 0);
+		mask = CAMERA_SET_BLUR;
+	}
+	else if (strcmp(name, "fps") == 0 && v >= 1 && v <= 90) {
+		params.fps = (uint8_t)v;
+		mask = CAMERA_SET_FPS;
+	}
+	else {
+		snprintf(reply, maxlen, "ERROR invalid camera setting %s %s\n", name, value);
+		return 1;
+	}
+
+	pigun_camera_set(&params, mask);
+	snprintf(reply, maxlen, "OK %s %s\n", name, value);
+	return 0;
+}
+
+
+static int control_aim(char* name, char* x, char* y, char* reply, int maxlen) {
+
+	if (name == NULL) {
+		snprintf(reply, maxlen, "OK boresight %.4f %.4f cond %.1f rejected %u\n",
+			pigun.boresight.x, pigun.boresight.y, pigun.aim_cond, pigun.aim_rejected);
+		return 0;
+	}
+	if (strcmp(name, "boresight") != 0 || x == NULL || y == NULL) {
+		snprintf(reply, maxlen, "ERROR usage: aim boresight <x> <y>\n");
+		return 1;
+	}
+
+	float bx = atof(x), by = atof(y);
+	if (bx < 0 || bx > 1 || by < 0 || by > 1) {
+		snprintf(reply, maxlen, "ERROR boresight must be within the frame [0,1]\n");
+		return 1;
+	}
+
+	// the camera thread reads the two floats separately, a torn update only lasts one frame
+	pigun.boresight.x = bx;
+	pigun.boresight.y = by;
+	pigun_calibration_save();
+
+	snprintf(reply, maxlen, "OK boresight %.4f %.4f\n", bx, by);
+	return 0;
+}
+
+
+static int control_predict(char* name, char* value, char* reply, int maxlen) {
+
+	pigun_predictor_t* pr = &(pigun.predictor);
+
+	if (name == NULL) {
+		snprintf(reply, maxlen, "OK horizon %i q %g r %g resets %u\n", pr->horizon, pr->q, pr->r, pr->nresets);
+		return 0;
+	}
+
+	if (strcmp(name, "horizon") == 0 && value != NULL) {
+		int h = atoi(value);
+		if (h < 0 || h > PREDICT_MAXHORIZON) {
+			snprintf(reply, maxlen, "ERROR horizon must be within 0-%i us\n", PREDICT_MAXHORIZON);
+			return 1;
+		}
+		// through the registry, so the camera thread picks it up between two frames
+		pigun_param_set(pigun_param_find("horizon"), h, 0);
+		snprintf(reply, maxlen, "OK horizon %i\n", h);
+		return 0;
+	}
+
+	if (strcmp(name, "score") == 0) {
+		const int32_t horizons[] = { 0, 10000, 20000, 30000, 40000, 60000 };
+		float hold[6], pred[6];
+		int ns = pigun_predict_score(pr, horizons, 6, hold, pred);
+		int len = snprintf(reply, maxlen, "OK %i frames, rms error hold/predicted:", ns);
+		for (int k = 0; k < 6 && len < maxlen; k++)
+			len += snprintf(reply + len, maxlen - len, " %ims %.4f/%.4f", horizons[k] / 1000, hold[k], pred[k]);
+		if (len < maxlen) snprintf(reply + len, maxlen - len, "\n");
+		return 0;
+	}
+
+	snprintf(reply, maxlen, "ERROR usage: predict [horizon <us> | score]\n");
+	return 1;
+}
+
+
+static int control_filter(char* name, char* value, char* reply, int maxlen) {
+
+	pigun_filter_t* f = &(pigun.filter);
+	pigun_filter_params_t* p = &(f->params);
+
+	if (name == NULL) {
+		snprintf(reply, maxlen, "OK profile %s oneeuro %i mincutoff %g beta %g dcutoff %g deadzone %g\n",
+			pigun_filter_profiles[f->profile].name, (p->stages & FILTER_ONEEURO) ? 1 : 0,
+			p->mincutoff, p->beta, p->dcutoff, (p->stages & FILTER_DEADZONE) ? p->deadzone : 0);
+		return 0;
+	}
+
+	if (strcmp(name, "bench") == 0) {
+		static pigun_predict_sample_t trace[PREDICT_TRACE];
+		int ns = pigun_predict_trace(&(pigun.predictor), trace);
+		float jitter, lag;
+		int used = pigun_filter_bench(p, trace, ns, &jitter, &lag);
+		int len = snprintf(reply, maxlen, "OK %i/%i frames, jitter/lag: current %.5f/%.1fms", used, ns, jitter, lag);
+		for (int k = 0; k < pigun_filter_nprofiles && len < maxlen; k++) {
+			pigun_filter_bench(&(pigun_filter_profiles[k]), trace, ns, &jitter, &lag);
+			len += snprintf(reply + len, maxlen - len, " %s %.5f/%.1fms", pigun_filter_profiles[k].name, jitter, lag);
+		}
+		if (len < maxlen) snprintf(reply + len, maxlen - len, "\n");
+		return 0;
+	}
+
+	if (value == NULL) {
+		snprintf(reply, maxlen, "ERROR missing value for %s\n", name);
+		return 1;
+	}
+
+	// the changes go through the registry, so the aim output never sees half of one
+	if (strcmp(name, "profile") == 0) {
+		int k = 0;
+		while (k < pigun_filter_nprofiles && strcmp(value, pigun_filter_profiles[k].name) != 0) k++;
+		if (k == pigun_filter_nprofiles) {
+			snprintf(reply, maxlen, "ERROR unknown filter profile %s\n", value);
+			return 1;
+		}
+		pigun_param_set(pigun_param_find("profile"), k, 0);
+		snprintf(reply, maxlen, "OK profile %s\n", value);
+		return 0;
+	}
+
+	// tuning a parameter turns its stage on (see the registry setters)
+	int id = -1;
+	if (strcmp(name, "mincutoff") == 0 || strcmp(name, "beta") == 0 || strcmp(name, "dcutoff") == 0 || strcmp(name, "deadzone") == 0)
+		id = pigun_param_find(name);
+	if (id < 0 || pigun_param_set(id, pigun_param_parse(pigun_param_info(id), value), 0) != PARAM_PENDING) {
+		snprintf(reply, maxlen, "ERROR invalid filter setting %s %s\n", name, value);
+		return 1;
+	}
+
+	snprintf(reply, maxlen, "OK %s %s\n", name, value);
+	return 0;
+}
+
+
+static int control_pose(char* name, char** values, int nvalues, char* reply, int maxlen) {
+
+	pigun_pose_t* pose = &(pigun.pose);
+
+	if (name == NULL) {
+		if (!pose->valid) {
+			snprintf(reply, maxlen, "OK no pose, beacons %.3f %.3f\n", pose->beacon_w, pose->beacon_h);
+			return 0;
+		}
+		float yaw, pitch, roll;
+		pigun_pose_angles(pose, &yaw, &pitch, &roll);
+		snprintf(reply, maxlen, "OK distance %.3f position %.3f %.3f %.3f yaw %.1f pitch %.1f roll %.1f\n",
+			pose->distance, pose->position[0], pose->position[1], pose->position[2], yaw, pitch, roll);
+		return 0;
+	}
+
+	float v[3];
+	for (int i = 0; i < nvalues; i++) v[i] = (values[i] != NULL) ? atof(values[i]) : NAN;
+
+	if (strcmp(name, "beacons") == 0 && v[0] > 0 && v[0] < 10 && v[1] > 0 && v[1] < 10) {
+		pose->beacon_w = v[0];
+		pose->beacon_h = v[1];
+	}
+	else if (strcmp(name, "barrel") == 0 && fabsf(v[0]) < 1 && fabsf(v[1]) < 1 && fabsf(v[2]) < 1) {
+		memcpy(pose->barrel, v, 3 * sizeof(float));
+	}
+	else {
+		snprintf(reply, maxlen, "ERROR usage: pose [beacons <w> <h> | barrel <x> <y> <z>]\n");
+		return 1;
+	}
+
+	pigun_calibration_save();
+	snprintf(reply, maxlen, "OK %s\n", name);
+	return 0;
+}
+
+
+static int control_hid(char* name, char* value, char* reply, int maxlen) {
+
+	if (name == NULL) {
+		pigun_hid_stats_t hs;
+		pigun_hid_stats(&hs);
+		snprintf(reply, maxlen, "OK sent %u suppressed %u coalesced %u keepalives %u telemetry %u keepalive %u telemetry %u ttfr %u reconnects %u last %u max %u\n",
+			hs.sent, hs.suppressed, hs.coalesced, hs.keepalives, hs.telemetry, pigun_hid_get_keepalive(), pigun_hid_get_telemetry(),
+			hs.ttfr_start, hs.reconnects, hs.ttfr_last, hs.ttfr_max);
+		return 0;
+	}
+	int ms = (value != NULL) ? atoi(value) : -1;
+	if (ms < 0 || ms > 10000) {
+		snprintf(reply, maxlen, "ERROR usage: hid [keepalive | telemetry] <0-10000 ms>\n");
+		return 1;
+	}
+	if (strcmp(name, "keepalive") == 0) pigun_hid_keepalive(ms);
+	else if (strcmp(name, "telemetry") == 0) pigun_hid_telemetry(ms);
+	else {
+		snprintf(reply, maxlen, "ERROR usage: hid [keepalive | telemetry] <0-10000 ms>\n");
+		return 1;
+	}
+	snprintf(reply, maxlen, "OK %s %i\n", name, ms);
+	return 0;
+}
+
+
+static int control_link(char* name, char* value, char* reply, int maxlen) {
+
+	if (name == NULL) {
+		pigun_link_info_t li;
+		pigun_link_info(&li);
+		if (li.handle == HCI_CON_HANDLE_INVALID) {
+			snprintf(reply, maxlen, "OK not connected, idle %u\n", pigun_link_get_idle());
+			return 0;
+		}
+		if (li.le) {
+			snprintf(reply, maxlen, "OK LE %s interval %u latency %u updates %u idle %u\n",
+				li.lowlatency ? "lowlatency" : "idle", li.le_interval, li.le_latency, li.le_updates, pigun_link_get_idle());
+			return 0;
+		}
+		snprintf(reply, maxlen, "OK %s mode %u interval %u sniffs %u flush %u qos 0x%02x service %u latency %u variation %u idle %u\n",
+			li.lowlatency ? "lowlatency" : "idle", li.mode, li.interval, li.nsniff, li.flush,
+			li.qos_status, li.qos_service, li.qos_latency, li.qos_variation, pigun_link_get_idle());
+		return 0;
+	}
+	int ms = (value != NULL) ? atoi(value) : -1;
+	if (strcmp(name, "idle") != 0 || ms < 0 || ms > 3600000) {
+		snprintf(reply, maxlen, "ERROR usage: link idle <0-3600000 ms>\n");
+		return 1;
+	}
+	pigun_link_idle(ms);
+	snprintf(reply, maxlen, "OK idle %i\n", ms);
+	return 0;
+}
+
+
+static int control_reconnect(char* reply, int maxlen) {
+
+	pigun_reconnect_info_t ri;
+	pigun_reconnect_info(&ri);
+	snprintf(reply, maxlen, "OK hosts %u paging %u host %u pages %u rounds %u incoming %u outgoing %u\n",
+		ri.hosts, ri.paging, ri.host, ri.pages, ri.rounds, ri.incoming, ri.outgoing);
+	return 0;
+}
+
+
+static int control_recoil(char* name, char* value, char* reply, int maxlen) {
+
+	if (name == NULL) {
+		pigun_solenoid_stats_t ss;
+		pigun_solenoid_stats(&ss);
+		const pigun_solenoid_pin_t* pin = pigun_solenoid_get_output();
+		snprintf(reply, maxlen, "OK mode %u output %s pulse %u period %u duty %u pulses %u denied %u dropped %u credit %lld late %lld queued %u hold %u\n",
+			pigun.recoilMode, (pin != NULL) ? pin->name : "none", pigun_solenoid_get_pulse(), pigun_solenoid_get_period(), pigun_solenoid_get_duty(),
+			ss.pulses, ss.denied, ss.dropped, (long long)ss.credit, (long long)ss.late_max, ss.queued, ss.hold);
+		return 0;
+	}
+
+	if (strcmp(name, "fire") == 0) {
+		int n = (value != NULL) ? atoi(value) : 1;
+		if (n < 1 || n > SOLENOID_QUEUE) {
+			snprintf(reply, maxlen, "ERROR usage: recoil fire [1-%i]\n", SOLENOID_QUEUE);
+			return 1;
+		}
+		pigun_solenoid_fire(n, n > 1);
+		snprintf(reply, maxlen, "OK fire %i\n", n);
+		return 0;
+	}
+
+	if (strcmp(name, "output") == 0 && value != NULL && (strcmp(value, "gpio") == 0 || strcmp(value, "sim") == 0)) {
+		pigun_solenoid_output(strcmp(value, "sim") == 0 ? &pigun_solenoid_sim : &pigun_solenoid_gpio);
+		snprintf(reply, maxlen, "OK output %s\n", value);
+		return 0;
+	}
+
+	// last edges of the simulated pin (as many as fit in a reply): time from the first one and level, in us
+	if (strcmp(name, "edges") == 0) {
+		pigun_solenoid_edge_t edges[16];
+		int n = pigun_solenoid_edges(edges, 16);
+		int len = snprintf(reply, maxlen, "OK %i", n);
+		for (int i = 0; i < n && len < maxlen; i++)
+			len += snprintf(reply + len, maxlen - len, " %lld:%u", (long long)(edges[i].t - edges[0].t), edges[i].fire);
+		if (len < maxlen) snprintf(reply + len, maxlen - len, "\n");
+		return 0;
+	}
+
+	snprintf(reply, maxlen, "ERROR usage: recoil [fire [n] | output gpio|sim | edges]\n");
+	return 1;
+}
+
+
+static int control_param(char* name, char* value, char* reply, int maxlen) {
+
+	char text[16], lo[16], hi[16];
+
+	if (name == NULL) {
+		int len = snprintf(reply, maxlen, "OK");
+		for (int i = 0; i < pigun_param_count() && len < maxlen; i++) {
+			const pigun_param_t* p = pigun_param_info(i);
+			pigun_param_format(p, p->get(), text, sizeof(text));
+			len += snprintf(reply + len, maxlen - len, " %s %s", p->name, text);
+		}
+		if (len < maxlen) snprintf(reply + len, maxlen - len, "\n");
+		return 0;
+	}
+
+	int id = pigun_param_find(name);
+	if (id < 0) {
+		snprintf(reply, maxlen, "ERROR unknown parameter %s\n", name);
+		return 1;
+	}
+	const pigun_param_t* p = pigun_param_info(id);
+	pigun_param_format(p, p->min, lo, sizeof(lo));
+	pigun_param_format(p, p->max, hi, sizeof(hi));
+
+	if (value == NULL) {
+		pigun_param_format(p, p->get(), text, sizeof(text));
+		snprintf(reply, maxlen, "OK %s %s id %i range %s %s%s\n", name, text, id, lo, hi, pigun_param_pending(id) ? " pending" : "");
+		return 0;
+	}
+
+	if (pigun_param_set(id, pigun_param_parse(p, value), 0) != PARAM_PENDING) {
+		snprintf(reply, maxlen, "ERROR %s must be within %s-%s\n", name, lo, hi);
+		return 1;
+	}
+	snprintf(reply, maxlen, "OK %s %s\n", name, value);
+	return 0;
+}
+
+
+/// @brief Executes one text command.
+/// @param cmd the command (modified by the parser).
+/// @param reply buffer for the reply text.
+/// @param maxlen size of the reply buffer.
+/// @return 0 if the command was good.
+int pigun_control_command(char* cmd, char* reply, int maxlen) {
+
+	char* save = NULL;
+	char* verb = strtok_r(cmd, " \t\r\n", &save);
+	char* arg1 = strtok_r(NULL, " \t\r\n", &save);
+	char* arg2 = strtok_r(NULL, " \t\r\n", &save);
+	char* arg3 = strtok_r(NULL, " \t\r\n", &save);
+	char* arg4 = strtok_r(NULL, " \t\r\n", &save);
+	char* values[3] = { arg2, arg3, arg4 };
+
+	if (verb == NULL) {
+		snprintf(reply, maxlen, "ERROR empty command\n");
+		return 1;
+	}
+
+	if (strcmp(verb, "camera") == 0) return control_camera(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "aim") == 0) return control_aim(arg1, arg2, arg3, reply, maxlen);
+	if (strcmp(verb, "predict") == 0) return control_predict(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "filter") == 0) return control_filter(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "hid") == 0) return control_hid(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "link") == 0) return control_link(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "reconnect") == 0) return control_reconnect(reply, maxlen);
+	if (strcmp(verb, "param") == 0) return control_param(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "recoil") == 0) return control_recoil(arg1, arg2, reply, maxlen);
+	if (strcmp(verb, "pose") == 0) return control_pose(arg1, values, 3, reply, maxlen);
+
+	snprintf(reply, maxlen, "ERROR unknown command %s\n", verb);
+	return 1;
+}
+
+
+static void control_process(btstack_data_source_t* ds, btstack_data_source_callback_type_t callback_type) {
+
+	char cmd[PIGUN_CONTROL_MAXLEN];
+	char reply[PIGUN_CONTROL_MAXLEN];
+	struct sockaddr_in from;
+	socklen_t fromlen = sizeof(from);
+
+	if (callback_type != DATA_SOURCE_CALLBACK_READ) return;
+
+	ssize_t n = recvfrom(ds->source.fd, cmd, sizeof(cmd) - 1, 0, (struct sockaddr*)&from, &fromlen);
+	if (n <= 0) return;
+	cmd[n] = 0;
+
+	pigun_control_command(cmd, reply, sizeof(reply));
+	sendto(ds->source.fd, reply, strlen(reply), 0, (struct sockaddr*)&from, fromlen);
+}
+
+
+/// @brief Opens the control socket and adds it to the BTstack run loop.
+/// @return 0 if everything went fine.
+int pigun_control_init() {
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		printf("PIGUN ERROR: unable to create the control socket\n");
+		return 1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(PIGUN_CONTROL_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		printf("PIGUN ERROR: unable to bind the control socket to port %i\n", PIGUN_CONTROL_PORT);
+		close(fd);
+		return 1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	btstack_run_loop_set_data_source_fd(&control_source, fd);
+	btstack_run_loop_set_data_source_handler(&control_source, &control_process);
+	btstack_run_loop_enable_data_source_callbacks(&control_source, DATA_SOURCE_CALLBACK_READ);
+	btstack_run_loop_add_data_source(&control_source);
+
+	printf("PIGUN: control interface on udp://127.0.0.1:%i\n", PIGUN_CONTROL_PORT);
+	return 0;
+}
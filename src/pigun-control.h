@@ -0,0 +1,15 @@
+#include <stdint.h>
+
+#ifndef PIGUN_CONTROL
+#define PIGUN_CONTROL
+
+
+#define PIGUN_CONTROL_PORT 5010		// UDP port of the local control interface (localhost only)
+#define PIGUN_CONTROL_MAXLEN 256	// max length of a command or reply
+
+
+int pigun_control_init(void);
+int pigun_control_command(char* cmd, char* reply, int maxlen);
+
+
+#endif
@@ -0,0 +1,93 @@
+/*
+* Beacon-following sensor crop.
+*
+* The camera sees the full 1640x1232 FoV and scales it down to PIGUN_RES_X x PIGUN_RES_Y,
+* but the beacons only cover a fraction of it. When enabled, the crop controller sets the
+* ISP input crop to the bounding box of the 4 beacons (plus some room for motion), so the
+* same output buffer has more pixels on each beacon. When tracking is lost, the crop goes
+* back to the full FoV.
+*
+* The detector works in the coordinates of the cropped frame: peaks are mapped back to
+* the full frame (still in output pixel units) before the aimer uses them, so the aimer
+* and the calibration do not need to know about the crop.
+*
+* This is only the decision, on normalised rectangles: no camera and no globals, so
+* tools/pigun-crop-sim can drive it with synthetic beacon trajectories. The frame loop in
+* pigun.c maps the peaks, applies the crop on the camera and waits for it to settle.
+*/
+
+#include <math.h>
+
+#include "pigun-crop.h"
+
+
+static const pigun_rect_t crop_full = { 0, 0, 1, 1 };
+
+
+/// @brief Decides where the crop should go next. This only does the math, it does not touch the camera.
+/// @param current crop currently applied.
+/// @param beacons bounding box of the 4 beacons, normalised on the full frame (ignored if error is set).
+/// @param error detector error flag for this frame.
+/// @param lost number of consecutive frames with detector errors.
+/// @param next output: the new crop, only valid if the return value is 1.
+/// @return 1 if the crop should change, 0 otherwise.
+int pigun_crop_next(const pigun_rect_t* current, const pigun_rect_t* beacons, uint8_t error, uint16_t lost, pigun_rect_t* next) {
+
+	uint8_t isfull = (current->w >= 1 && current->h >= 1);
+
+	// tracking lost: widen back to full view, but give the detector a few frames first
+	if (error) {
+		if (lost >= CROP_LOST && !isfull) {
+			*next = crop_full;
+			return 1;
+		}
+		return 0;
+	}
+
+	float x0 = beacons->x, y0 = beacons->y;
+	float x1 = beacons->x + beacons->w, y1 = beacons->y + beacons->h;
+
+	// crop that fits the beacons with the motion margin
+	// w and h are kept equal so the crop has the same aspect ratio of the sensor (no pixel stretching)
+	float size = x1 - x0;
+	if (y1 - y0 > size) size = y1 - y0;
+	size += 2 * CROP_MARGIN;
+	if (size < CROP_MINSIZE) size = CROP_MINSIZE;
+
+	pigun_rect_t want;
+	if (size >= 1) want = crop_full;
+	else {
+		want.w = want.h = size;
+		want.x = (x0 + x1 - size) / 2;
+		want.y = (y0 + y1 - size) / 2;
+
+		// keep it inside the sensor
+		if (want.x < 0) want.x = 0;
+		if (want.y < 0) want.y = 0;
+		if (want.x + size > 1) want.x = 1 - size;
+		if (want.y + size > 1) want.y = 1 - size;
+	}
+
+	// hysteresis: every crop change costs a few frames, so only move when necessary
+	// 1. a beacon is getting close to the edge of the current window
+	float ex = CROP_EDGE * current->w;
+	float ey = CROP_EDGE * current->h;
+	uint8_t atedge = !isfull && (
+		x0 < current->x + ex || x1 > current->x + current->w - ex ||
+		y0 < current->y + ey || y1 > current->y + current->h - ey);
+
+	// 2. the beacons use a small part of the current window
+	uint8_t toobig = (want.w < CROP_SHRINK * current->w);
+
+	if (!atedge && !toobig) return 0;
+
+	// beacons at the sensor edge: the crop cannot follow them any further
+	// but a small move is still made to put the crop against the edge, or they get out of it
+	uint8_t toedge = (want.x <= 0 && current->x > 0) || (want.y <= 0 && current->y > 0) ||
+		(want.x >= 1 - want.w && current->x < 1 - current->w) || (want.y >= 1 - want.h && current->y < 1 - current->h);
+	if (!toedge && fabsf(want.x - current->x) < 0.01f && fabsf(want.y - current->y) < 0.01f && fabsf(want.w - current->w) < 0.01f)
+		return 0;
+
+	*next = want;
+	return 1;
+}
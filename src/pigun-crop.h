@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+#ifndef PIGUN_CROP
+#define PIGUN_CROP
+
+
+#define CROP_MARGIN 0.12f	// room left around the beacons for motion, fraction of the full FoV
+#define CROP_EDGE 0.04f		// recrop when a beacon gets closer than this to the crop edge
+#define CROP_MINSIZE 0.3f	// smallest crop window - below ~PIGUN_RES_X/PIGUN_CAM_X there is no extra resolution to gain
+#define CROP_SHRINK 0.6f	// zoom in only when the beacons need less than this fraction of the current window
+#define CROP_SETTLE 3		// frames it takes for a new crop to show up at the video port
+#define CROP_LOST 5			// frames without 4 peaks before going back to the full FoV
+
+
+/// @brief Rectangle on the sensor in normalised coordinates: the full FoV is {0, 0, 1, 1}.
+typedef struct {
+	float x, y, w, h;
+} pigun_rect_t;
+
+/// @brief State of the beacon-following crop controller.
+typedef struct {
+
+	uint8_t			enabled;	// 1 if the crop follows the beacons, 0 for the full FoV
+	uint8_t			settle;		// frames left before the last crop change reaches the camera output
+	uint16_t		lost;		// number of consecutive frames without 4 peaks
+	pigun_rect_t	current;	// crop currently set on the camera
+
+} pigun_crop_t;
+
+
+int pigun_crop_next(const pigun_rect_t* current, const pigun_rect_t* beacons, uint8_t error, uint16_t lost, pigun_rect_t* next);
+
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdint.h>
+
+#include "pigun-report.h"
+
+#ifndef PIGUN_DESCRIPTOR
+#define PIGUN_DESCRIPTOR
+
+/// @brief HID descriptor for joystick with extra output report (data)
+/// Only pigun-hid.c includes this in the gun, the rest uses hid_descriptor_joystick_mode.
+static const uint8_t pigun_descriptor[] = {
+	0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
+	0x09, 0x04,        // Usage (Joystick)
+	0xA1, 0x01,        // Collection (Application)
+		0x09, 0x01,        //   Usage (Pointer)
+		0xA1, 0x00,        //   Collection (Physical)
+			0x85, PIGUN_REPORT_ID,		   // 	Report ID 3
+
+			0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
+			0x16, 0x01, 0x80,  //   Logical Minimum 0x8001 (-32767)  
+			0x26, 0xFF, 0x7F,  //   Logical Maximum 0x7FFF (32767)
+			0x09, 0x30,        //     Usage (X)
+			0x09, 0x31,        //     Usage (Y)
+			0x75, 0x10,        //     Report Size (16)
+			0x95, 0x02,        //     Report Count (2)
+			0x81, 0x02,        //     Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+
+			0x05, 0x09,        //   Usage Page (Button)
+			0x19, 0x01,        //   Usage Minimum (0x01)
+			0x29, 0x08,        //   Usage Maximum (0x08)
+			0x15, 0x00,        //   Logical Minimum (0)
+			0x25, 0x01,        //   Logical Maximum (1)
+			0x75, 0x01,        //   Report Size (1)
+			0x95, 0x08,        //   Report Count (8)
+			0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
+
+
+			0x09, 0x03,		  	// usage ID vendor defined
+			0x15, 0x00,			// Logical Minimum (0)
+			0x26, 0xFF, 0x00,  	// Logical Maximum (1)
+			0x75, 0x08,        	// Report Size (8)
+			0x95, 0x01,        	// Report Count (1)
+			0x91, 0x02,			// output (data,Var,Abs)
+
+		0xC0,              //   End Collection   --- 27 bytes
+	0xC0,              // End Collection --- 44 bytes
+
+	// telemetry: separate vendor collection, so games only see the joystick
+	0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,        // Usage (0x01)
+	0xA1, 0x01,        // Collection (Application)
+		0x85, PIGUN_TELEMETRY_ID,	// 	Report ID 4
+		0x09, 0x02,        //   Usage (0x02)
+		0x15, 0x00,        //   Logical Minimum (0)
+		0x26, 0xFF, 0x00,  //   Logical Maximum (255)
+		0x75, 0x08,        //   Report Size (8)
+		0x95, HID_TELEMETRY_SIZE, //   Report Count (16)
+		0x81, 0x02,        //   Input (Data,Var,Abs)
+
+		// runtime parameters: request and read-back, see pigun-param.c
+		0x85, PIGUN_PARAM_ID,		// 	Report ID 5
+		0x09, 0x03,        //   Usage (0x03)
+		0x95, HID_PARAM_SIZE, //   Report Count (32)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs)
+		0x09, 0x04,        //   Usage (0x04)
+		0x81, 0x02,        //   Input (Data,Var,Abs): the same answer, where GET_REPORT is not served (usb)
+	0xC0               // End Collection
+};
+
+
+#endif
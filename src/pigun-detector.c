@@ -20,6 +20,9 @@ void pigun_detector_init(){
     memset(pigun.detector.oldpeaks, 0, sizeof(pigun_peak_t)*4);
 
     pigun.detector.error = 0;
+    pigun.detector.fast = 0;
+    pigun.detector.threshold = DETECTOR_THRESHOLD;
+    pigun.detector.dx = DETECTOR_DX;
 }
 
 void pigun_detector_free(){
@@ -170,11 +173,42 @@ void pigun_detector_run(unsigned char* data) {
     printf("detecting...\n");
 #endif
 
-    // These parameters have to be tuned to optimize the search
-    const uint8_t threshold = 130;          // The minimum threshold for pixel intensity in a blob
+    // These parameters have to be tuned to optimize the search: they can be changed at runtime, see pigun-param.c
+    const uint8_t threshold = pigun.detector.threshold;   // The minimum threshold for pixel intensity in a blob
+
+    // area and step of the sweep: by default the whole image
+    uint32_t dx = pigun.detector.dx;
+    uint32_t nx = floor((float)(PIGUN_RES_X) / (float)(dx));
+    uint32_t ny = floor((float)(PIGUN_RES_Y) / (float)(dx));
+    uint32_t i0 = 0, j0 = 0;
+
+    // fast mode: only sweep a box around the old peaks, or the whole image with a bigger step if there are none
+    if (pigun.detector.fast) {
+        float c0 = PIGUN_RES_X, r0 = PIGUN_RES_Y, c1 = -1, r1 = -1;
+        for (uint8_t i = 0; i < 4; i++) {
+            pigun_peak_t *peak = &(pigun.detector.oldpeaks[i]);
+            if (peak->blobsize == 0) continue;
+            if (peak->col < c0) c0 = peak->col;
+            if (peak->col > c1) c1 = peak->col;
+            if (peak->row < r0) r0 = peak->row;
+            if (peak->row > r1) r1 = peak->row;
+        }
 
-    const uint32_t nx = floor((float)(PIGUN_RES_X) / (float)(DETECTOR_DX));
-    const uint32_t ny = floor((float)(PIGUN_RES_Y) / (float)(DETECTOR_DX));
+        if (c1 < 0) {
+            dx = DETECTOR_DX_FAST;
+            nx = PIGUN_RES_X / dx;
+            ny = PIGUN_RES_Y / dx;
+        } else {
+            c0 = (c0 > DETECTOR_ROI_MARGIN) ? c0 - DETECTOR_ROI_MARGIN : 0;
+            r0 = (r0 > DETECTOR_ROI_MARGIN) ? r0 - DETECTOR_ROI_MARGIN : 0;
+            c1 += DETECTOR_ROI_MARGIN;
+            r1 += DETECTOR_ROI_MARGIN;
+            i0 = (uint32_t)c0 / dx;
+            j0 = (uint32_t)r0 / dx;
+            if ((uint32_t)c1 / dx + 1 < nx) nx = (uint32_t)c1 / dx + 1;
+            if ((uint32_t)r1 / dx + 1 < ny) ny = (uint32_t)r1 / dx + 1;
+        }
+    }
 
     // Reset the boolean array for marking pixels as checked.
     memset(pigun.detector.checked, 0, PIGUN_RES_X * PIGUN_RES_Y * sizeof(uint8_t));
@@ -215,11 +249,11 @@ void pigun_detector_run(unsigned char* data) {
     if(blobID != DETECTOR_NBLOBS) {
         
         // Here the order actually matters: we loop in this order to get better cache hit rate
-        for (uint32_t j = 0; j < ny; ++j) {
-            for (uint32_t i = 0; i < nx; ++i) {
+        for (uint32_t j = j0; j < ny; ++j) {
+            for (uint32_t i = i0; i < nx; ++i) {
 
                 // pixel index in the buffer
-                uint32_t idx = j * DETECTOR_DX * PIGUN_RES_X + i * DETECTOR_DX;
+                uint32_t idx = j * dx * PIGUN_RES_X + i * dx;
                 uint8_t value = data[idx];
 
                 // check if px is bright enough and not seen by the bfs before
@@ -250,6 +284,7 @@ void pigun_detector_run(unsigned char* data) {
 
     // at this point we should have all the blobs we wanted
     // or maybe we are short
+    pigun.detector.npeaks = blobID;
     if (blobID != DETECTOR_NBLOBS) {
         // if we are short or too many, tell the callback we got an error
         pigun.detector.error = 1;
@@ -6,10 +6,13 @@
 #define PIGUN_DETECTOR
 
 
-#define DETECTOR_DX 4               // number of skipped pixels in the coarse search
+#define DETECTOR_DX 4               // number of skipped pixels in the coarse search (default)
+#define DETECTOR_THRESHOLD 130      // minimum pixel intensity in a blob (default)
 #define DETECTOR_MINBLOBSIZE 20     // minimum number of bright px that can be considered a blob
 #define DETECTOR_MAXBLOBSIZE 1000   // maximum numer of pixels for a blob
 #define DETECTOR_NBLOBS 4           // number of blobs that the detector will look for
+#define DETECTOR_DX_FAST 8          // coarse search step in fast mode, when there is no ROI
+#define DETECTOR_ROI_MARGIN 24      // px around the previous peaks that are searched in fast mode
 
 
 /// @brief Describes a peak in the camera image.
@@ -25,6 +28,10 @@ typedef struct {
 typedef struct {
 
     uint8_t         error;      // 1 if there was an error after detecting
+    uint8_t         fast;       // 1 for the cheap mode: sweep only near the old peaks, or with a coarser step
+    uint8_t         npeaks;     // number of peaks found in the last frame
+    uint8_t         threshold;  // minimum pixel intensity in a blob
+    uint8_t         dx;         // coarse search step, when not in fast mode
     uint8_t         *checked;   // one element for each px in the image
     uint32_t        *pxbuffer;  // this is used by blob_detect to store the px indexes in the queue - the total allocation is PIGUN_RES_X* PIGUN_RES_Y
     pigun_peak_t    *peaks;     // peaks detected
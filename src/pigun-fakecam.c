@@ -0,0 +1,118 @@
+/*
+* Synthetic camera source. Build with PIGUN_FAKECAM to use it instead of the PiCamera.
+*
+* A thread draws 4 beacons moving slowly around the image and passes the frames to
+* pigun_frame_process at PIGUN_FPS, the same way the MMAL callback does.
+* SIGUSR1 stalls the frame delivery until the source is restarted: this simulates a camera
+* that stops delivering frames, to check that the watchdog brings it back.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "pigun.h"
+#include "pigun-mmal.h"
+
+
+#define FAKECAM_BLOB_R 4		// beacon radius in px
+#define FAKECAM_BEACON_W 0.4f	// beacon rectangle size, as fraction of the image
+#define FAKECAM_BEACON_H 0.3f
+#define FAKECAM_PERIOD 4.0f		// time for the aim to go around once, in s
+
+
+static pthread_t fakecam_thread;
+static volatile int fakecam_running = 0;
+static volatile sig_atomic_t fakecam_stalled = 0;
+static unsigned char fakecam_frame[PIGUN_NPX];
+
+
+static void fakecam_stall(int sig) {
+	UNUSED(sig);
+	fakecam_stalled = 1;
+}
+
+static void fakecam_draw_blob(float cx, float cy) {
+
+	int x0 = (int)cx - FAKECAM_BLOB_R, x1 = (int)cx + FAKECAM_BLOB_R;
+	int y0 = (int)cy - FAKECAM_BLOB_R, y1 = (int)cy + FAKECAM_BLOB_R;
+
+	for (int y = y0; y <= y1; y++) {
+		if (y < 0 || y >= PIGUN_RES_Y) continue;
+		for (int x = x0; x <= x1; x++) {
+			if (x < 0 || x >= PIGUN_RES_X) continue;
+			float r2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+			if (r2 > FAKECAM_BLOB_R * FAKECAM_BLOB_R) continue;
+			fakecam_frame[y * PIGUN_RES_X + x] = (unsigned char)(255 - 100 * r2 / (FAKECAM_BLOB_R * FAKECAM_BLOB_R));
+		}
+	}
+}
+
+static void* fakecam_cycle(void* nullargs) {
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	int64_t t0 = pigun_now_us();
+
+	while (fakecam_running) {
+
+		// wait for the next frame time
+		next.tv_nsec += 1000000000 / PIGUN_FPS;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		if (fakecam_stalled) continue;
+
+		// the beacons go around the center of the image
+		int64_t t = pigun_now_us();
+		float phase = 2 * M_PI * (t - t0) / (FAKECAM_PERIOD * 1000000.0f);
+		float cx = PIGUN_RES_X * (0.5f + 0.1f * cosf(phase));
+		float cy = PIGUN_RES_Y * (0.5f + 0.1f * sinf(phase));
+		float hw = PIGUN_RES_X * FAKECAM_BEACON_W / 2;
+		float hh = PIGUN_RES_Y * FAKECAM_BEACON_H / 2;
+
+		memset(fakecam_frame, 16, PIGUN_NPX);
+		fakecam_draw_blob(cx - hw, cy - hh);
+		fakecam_draw_blob(cx + hw, cy - hh);
+		fakecam_draw_blob(cx - hw, cy + hh);
+		fakecam_draw_blob(cx + hw, cy + hh);
+
+		pigun_frame_process(fakecam_frame, t);
+	}
+
+	return NULL;
+}
+
+
+/// @brief Starts the synthetic camera.
+/// @return 0 if everything went fine.
+int pigun_fakecam_init() {
+
+	printf("PIGUN: starting fake camera (SIGUSR1 to stall it)\n");
+
+	fakecam_stalled = 0;
+	signal(SIGUSR1, fakecam_stall);
+
+	fakecam_running = 1;
+	if (pthread_create(&fakecam_thread, NULL, fakecam_cycle, NULL) != 0) {
+		printf("PIGUN ERROR: unable to start the fake camera thread\n");
+		fakecam_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void pigun_fakecam_stop() {
+
+	if (!fakecam_running) return;
+	fakecam_running = 0;
+	pthread_join(fakecam_thread, NULL);
+	printf("PIGUN: fake camera stopped.\n");
+}
@@ -0,0 +1,179 @@
+/*
+* Output filter chain on the aim: removes the centroid jitter when the gun is held still,
+* without adding lag when it moves.
+*
+* Stages, each one optional:
+*	1. One-Euro low-pass: the cutoff grows with the aim speed, so the aim is heavily smoothed
+*	   at rest and passes almost untouched during fast swings
+*	2. deadzone: the output only moves when the input leaves a tiny circle around it, then it
+*	   is dragged along (no jump)
+* With no stages the filter is a bypass.
+*
+* The parameters come from a profile and can be tuned at runtime. Everything works in place on
+* the filter state, nothing is allocated per frame.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pigun-filter.h"
+
+
+const pigun_filter_params_t pigun_filter_profiles[FILTER_PROFILES] = {
+	//name		stages								mincutoff	beta	dcutoff	deadzone
+	{"default",	FILTER_ONEEURO,						1.0f,		60.0f,	1.0f,	0},
+	{"smooth",	FILTER_ONEEURO | FILTER_DEADZONE,	0.5f,		20.0f,	1.0f,	0.0005f},
+	{"fast",	FILTER_ONEEURO,						1.5f,		120.0f,	1.0f,	0},
+	{"bypass",	0,									1.0f,		60.0f,	1.0f,	0},
+};
+const int pigun_filter_nprofiles = sizeof(pigun_filter_profiles) / sizeof(pigun_filter_params_t);
+
+
+static inline float filter_alpha(float cutoff, float dt) {
+	float tau = 1.0f / (2 * M_PI * cutoff);
+	return 1.0f / (1.0f + tau / dt);
+}
+
+
+void pigun_filter_init(pigun_filter_t* f) {
+
+	memset(f, 0, sizeof(pigun_filter_t));
+	f->params = pigun_filter_profiles[0];
+	f->profile = 0;
+}
+
+/// @brief Loads the parameters of a profile.
+/// @param f filter.
+/// @param name profile name.
+/// @return 0 if the profile exists.
+int pigun_filter_profile(pigun_filter_t* f, const char* name) {
+
+	for (int i = 0; i < pigun_filter_nprofiles; i++) {
+		if (strcmp(name, pigun_filter_profiles[i].name) != 0) continue;
+		f->params = pigun_filter_profiles[i];
+		f->profile = i;
+		f->ready = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/// @brief Forgets the filter state: the next measurement passes through unfiltered.
+void pigun_filter_reset(pigun_filter_t* f) {
+	f->ready = 0;
+}
+
+
+/// @brief Filters one aim point.
+/// @param f filter.
+/// @param x normalised aim x, replaced by the filtered one.
+/// @param y normalised aim y, replaced by the filtered one.
+/// @param t timestamp of the aim, in us.
+void pigun_filter_run(pigun_filter_t* f, float* x, float* y, int64_t t) {
+
+	const pigun_filter_params_t* p = &(f->params);
+	int64_t dt = t - f->t_last;
+	f->t_last = t;
+
+	if (!f->ready || dt <= 0 || dt > FILTER_GAP) {
+		f->x = f->hx = *x;
+		f->y = f->hy = *y;
+		f->dx = f->dy = 0;
+		f->ready = 1;
+		return;
+	}
+
+	if (p->stages & FILTER_ONEEURO) {
+
+		float dts = dt * 1.0e-6f;
+
+		// filtered speed sets the cutoff of the position filter
+		float a = filter_alpha(p->dcutoff, dts);
+		f->dx += a * ((*x - f->x) / dts - f->dx);
+		f->dy += a * ((*y - f->y) / dts - f->dy);
+
+		float cutoff = p->mincutoff + p->beta * sqrtf(f->dx * f->dx + f->dy * f->dy);
+		a = filter_alpha(cutoff, dts);
+		f->x += a * (*x - f->x);
+		f->y += a * (*y - f->y);
+
+		*x = f->x;
+		*y = f->y;
+	}
+
+	if (p->stages & FILTER_DEADZONE) {
+
+		float ex = *x - f->hx, ey = *y - f->hy;
+		float d = sqrtf(ex * ex + ey * ey);
+		if (d > p->deadzone) {
+			// drag the output along, so it stays on the edge of the deadzone
+			f->hx += ex * (1 - p->deadzone / d);
+			f->hy += ey * (1 - p->deadzone / d);
+		}
+		*x = f->hx;
+		*y = f->hy;
+	}
+}
+
+
+/// @brief Runs a parameter set on recorded measurements and measures jitter and lag.
+/// The reference aim is the centered average of 5 measurements, and the speed comes from
+/// the same window. Jitter is the RMS frame-to-frame motion of the output while the aim is at rest,
+/// lag is how far behind the reference the output is while moving, in time.
+/// @param params filter parameters.
+/// @param trace measurements in chronological order (see pigun_predict_trace).
+/// @param n number of measurements.
+/// @param jitter output jitter at rest, in normalised units (0 if the aim was never at rest).
+/// @param lag output average lag during motion, in ms (0 if the aim never moved fast).
+/// @return number of measurements at rest + in motion that were used.
+int pigun_filter_bench(const pigun_filter_params_t* params, const pigun_predict_sample_t* trace, int n, float* jitter, float* lag) {
+
+	pigun_filter_t f;
+	memset(&f, 0, sizeof(pigun_filter_t));
+	f.params = *params;
+
+	double sj = 0, sl = 0;
+	int nj = 0, nl = 0;
+	float ox = 0, oy = 0;
+
+	for (int i = 0; i < n; i++) {
+
+		float x = trace[i].x, y = trace[i].y;
+		uint8_t cont = f.ready && (trace[i].t - f.t_last) > 0 && (trace[i].t - f.t_last) <= FILTER_GAP;
+		pigun_filter_run(&f, &x, &y, trace[i].t);
+
+		float px = ox, py = oy;
+		ox = x;
+		oy = y;
+		if (!cont || i < 2 || i + 2 >= n) continue;
+
+		// the window has to be free of gaps
+		float rx = 0, ry = 0;
+		uint8_t gap = 0;
+		for (int k = -2; k <= 2; k++) {
+			rx += trace[i + k].x / 5;
+			ry += trace[i + k].y / 5;
+			int64_t step = trace[i + k].t - trace[i + k - 1].t;
+			if (k > -2 && (step <= 0 || step > FILTER_GAP)) gap = 1;
+		}
+		if (gap) continue;
+		float dts = (trace[i + 2].t - trace[i - 2].t) * 1.0e-6f;
+		float vx = (trace[i + 2].x - trace[i - 2].x) / dts;
+		float vy = (trace[i + 2].y - trace[i - 2].y) / dts;
+		float v2 = vx * vx + vy * vy;
+
+		if (v2 < FILTER_REST_SPEED * FILTER_REST_SPEED) {
+			sj += (x - px) * (x - px) + (y - py) * (y - py);
+			nj++;
+		}
+		else if (v2 > FILTER_MOVE_SPEED * FILTER_MOVE_SPEED) {
+			sl += ((rx - x) * vx + (ry - y) * vy) / v2;
+			nl++;
+		}
+	}
+
+	*jitter = (nj > 0) ? sqrt(sj / nj) : 0;
+	*lag = (nl > 0) ? 1000 * sl / nl : 0;
+	return nj + nl;
+}
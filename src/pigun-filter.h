@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+#include "pigun-predict.h"
+
+#ifndef PIGUN_FILTER
+#define PIGUN_FILTER
+
+
+#define FILTER_ONEEURO 0x01		// speed-adaptive low-pass stage
+#define FILTER_DEADZONE 0x02	// deadzone stage - bypass is no stages at all
+#define FILTER_PROFILES 4		// profiles in pigun_filter_profiles
+
+#define FILTER_GAP 100000		// a gap in the measurements longer than this resets the filter, in us
+#define FILTER_REST_SPEED 0.05f	// the aim is at rest below this speed, in normalised units/s (for the benchmark)
+#define FILTER_MOVE_SPEED 0.5f	// the aim is moving above this speed (for the benchmark)
+
+
+/// @brief Parameters of the output filter chain, one set per profile.
+typedef struct {
+	const char*	name;
+	uint8_t		stages;		// FILTER_ONEEURO | FILTER_DEADZONE
+	float		mincutoff;	// cutoff at rest, in Hz
+	float		beta;		// cutoff increase with speed, in Hz per normalised unit/s
+	float		dcutoff;	// cutoff of the speed estimate, in Hz
+	float		deadzone;	// radius of the deadzone, in normalised units
+} pigun_filter_params_t;
+
+/// @brief State of the output filter chain.
+typedef struct {
+
+	pigun_filter_params_t params;	// active parameters (a copy of the profile, can be tuned)
+	uint8_t		profile;			// index of the profile the parameters came from
+
+	uint8_t		ready;		// 0 until the first measurement after a reset
+	int64_t		t_last;		// time of the last measurement, in us
+	float		x, y;		// low-pass output
+	float		dx, dy;		// filtered speed
+	float		hx, hy;		// deadzone output
+
+} pigun_filter_t;
+
+
+extern const pigun_filter_params_t pigun_filter_profiles[FILTER_PROFILES];
+extern const int pigun_filter_nprofiles;
+
+void pigun_filter_init(pigun_filter_t* f);
+int pigun_filter_profile(pigun_filter_t* f, const char* name);
+void pigun_filter_reset(pigun_filter_t* f);
+void pigun_filter_run(pigun_filter_t* f, float* x, float* y, int64_t t);
+
+int pigun_filter_bench(const pigun_filter_params_t* params, const pigun_predict_sample_t* trace, int n, float* jitter, float* lag);
+
+
+#endif
@@ -0,0 +1,124 @@
+/*
+* Gyro + camera fusion core.
+*
+* No I/O and no globals: everything comes in with explicit timestamps, so recorded or
+* simulated gyro and frame streams can be replayed through it offline.
+*
+* The gyro rates are turned into the motion of the boresight pixel on the camera image
+* (focal length x angle, done by the caller) and then into the motion of the aim with the
+* jacobian of the last homography. Between frames the aim follows the gyro; at each frame the
+* difference between the camera aim and the fused aim at the exposure time is corrected by a
+* fraction FUSION_GAIN, which removes the gyro drift.
+*/
+
+#include <string.h>
+
+#include "pigun-fusion.h"
+
+
+void pigun_fusion_init(pigun_fusion_t* f) {
+
+	memset(f, 0, sizeof(pigun_fusion_t));
+	f->gain = FUSION_GAIN;
+}
+
+
+/// @brief Integrates one gyro sample.
+/// @param f fusion state.
+/// @param t time of the sample, in us.
+/// @param dcol rate of the boresight pixel across the image, in px/s (focal length x yaw rate, right is positive).
+/// @param drow rate of the boresight pixel down the image, in px/s (focal length x pitch rate, down is positive).
+void pigun_fusion_gyro(pigun_fusion_t* f, int64_t t, float dcol, float drow) {
+
+	int64_t dt = t - f->t_gyro;
+	f->t_gyro = t;
+	if (dt <= 0 || dt > FUSION_MAXDT) return;
+
+	float s = dt * 1.0e-6f;
+	f->dx += (f->jac[0] * dcol + f->jac[1] * drow) * s;
+	f->dy += (f->jac[2] * dcol + f->jac[3] * drow) * s;
+
+	pigun_fusion_sample_t* h = &(f->hist[f->nhist % FUSION_HISTORY]);
+	h->t = t;
+	h->dx = f->dx;
+	h->dy = f->dy;
+	f->nhist++;
+}
+
+
+// integrated gyro motion at time t, interpolated in the history
+static void fusion_motion_at(const pigun_fusion_t* f, int64_t t, float* dx, float* dy) {
+
+	*dx = f->dx;
+	*dy = f->dy;
+
+	int n = (f->nhist < FUSION_HISTORY) ? f->nhist : FUSION_HISTORY;
+	for (int k = 0; k < n; k++) {
+
+		// walk back from the newest sample
+		const pigun_fusion_sample_t* h = &(f->hist[(f->nhist - 1 - k) % FUSION_HISTORY]);
+		if (h->t > t) {
+			*dx = h->dx;	// the oldest sample is the best guess if t is older than the history
+			*dy = h->dy;
+			continue;
+		}
+		if (k == 0) return; // t is after the newest sample
+
+		const pigun_fusion_sample_t* h1 = &(f->hist[(f->nhist - k) % FUSION_HISTORY]);
+		float a = (float)(t - h->t) / (h1->t - h->t);
+		*dx = h->dx + a * (h1->dx - h->dx);
+		*dy = h->dy + a * (h1->dy - h->dy);
+		return;
+	}
+}
+
+
+/// @brief Corrects the fusion with one camera frame.
+/// @param f fusion state.
+/// @param t_sensor sensor timestamp of the frame, in us.
+/// @param x normalised aim measured on the frame.
+/// @param y normalised aim measured on the frame.
+/// @param H homography of the frame (camera px -> normalised), row-major 3x3.
+/// @param bcol boresight pixel column.
+/// @param brow boresight pixel row.
+void pigun_fusion_camera(pigun_fusion_t* f, int64_t t_sensor, float x, float y, const float* H, float bcol, float brow) {
+
+	// jacobian of the homography at the boresight
+	float w = H[6] * bcol + H[7] * brow + H[8];
+	float px = (H[0] * bcol + H[1] * brow + H[2]) / w;
+	float py = (H[3] * bcol + H[4] * brow + H[5]) / w;
+	f->jac[0] = (H[0] - px * H[6]) / w;
+	f->jac[1] = (H[1] - px * H[7]) / w;
+	f->jac[2] = (H[3] - py * H[6]) / w;
+	f->jac[3] = (H[4] - py * H[7]) / w;
+
+	float dx, dy;
+	fusion_motion_at(f, t_sensor, &dx, &dy);
+
+	if (!f->ready || t_sensor - f->t_camera > FUSION_MAXGAP) {
+		// (re)start from the camera aim
+		f->ox = x - dx;
+		f->oy = y - dy;
+	}
+	else {
+		f->ox += f->gain * (x - (dx + f->ox));
+		f->oy += f->gain * (y - (dy + f->oy));
+	}
+	f->t_camera = t_sensor;
+	f->ready = 1;
+}
+
+
+/// @brief Fused aim.
+/// @param f fusion state.
+/// @param t current time, in us.
+/// @param x output normalised aim.
+/// @param y output normalised aim.
+/// @return 0 if the fused aim is usable, 1 if the camera has not been seen for too long.
+int pigun_fusion_aim(const pigun_fusion_t* f, int64_t t, float* x, float* y) {
+
+	if (!f->ready || t - f->t_camera > FUSION_MAXGAP) return 1;
+	*x = f->dx + f->ox;
+	*y = f->dy + f->oy;
+	return 0;
+}
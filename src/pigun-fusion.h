@@ -0,0 +1,45 @@
+#include <stdint.h>
+
+#ifndef PIGUN_FUSION
+#define PIGUN_FUSION
+
+
+#define FUSION_HISTORY 128		// gyro samples kept to line up with the camera latency (128 ms at 1 kHz)
+#define FUSION_GAIN 0.2f		// fraction of the camera error corrected at each frame
+#define FUSION_MAXGAP 200000	// without camera frames for this long the fused aim is not used, in us
+#define FUSION_MAXDT 50000		// gyro samples further apart than this are not integrated, in us
+
+
+/// @brief Integrated gyro motion at one time.
+typedef struct {
+	int64_t t;
+	float dx, dy;
+} pigun_fusion_sample_t;
+
+/// @brief Complementary fusion of the gyro and the camera aim.
+/// The gyro moves the aim between frames; each camera frame pulls it back towards the measured aim,
+/// compared with the fused aim at the time the frame was exposed (not at the time it arrived).
+typedef struct {
+
+	float		gain;		// camera correction gain
+	float		jac[4];		// d aim / d boresight px, from the last homography (row-major 2x2)
+
+	uint8_t		ready;		// 1 after the first camera frame
+	float		dx, dy;		// gyro motion integrated since the start, in normalised units
+	float		ox, oy;		// offset between the camera aim and the integrated gyro motion
+	int64_t		t_gyro;		// time of the last gyro sample, in us
+	int64_t		t_camera;	// sensor time of the last camera frame, in us
+
+	pigun_fusion_sample_t	hist[FUSION_HISTORY];
+	uint32_t	nhist;		// total samples recorded, the ring index is nhist % FUSION_HISTORY
+
+} pigun_fusion_t;
+
+
+void pigun_fusion_init(pigun_fusion_t* f);
+void pigun_fusion_gyro(pigun_fusion_t* f, int64_t t, float dcol, float drow);
+void pigun_fusion_camera(pigun_fusion_t* f, int64_t t_sensor, float x, float y, const float* H, float bcol, float brow);
+int pigun_fusion_aim(const pigun_fusion_t* f, int64_t t, float* x, float* y);
+
+
+#endif
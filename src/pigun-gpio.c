@@ -10,14 +10,17 @@
 #include "pigun-hid.h"
 #include "pigun-gpio.h"
 #include "pigun-mmal.h"
+#include "pigun-input.h"
+#include "pigun-buttons.h"
+#include "pigun-imu.h"
 
 
 
 int pigun_GPIO_inited;
-int button_delay = 3;		// delay between consecutive button presses
+int button_delay = 3;		// delay between consecutive button presses, in frames (when polled)
 
 // List of gpio code that will be used as the 8 buttons
-int pigun_button_pin[9] = {
+int pigun_button_pin[PIGUN_BUTTONS] = {
 	PIN_TRG,PIN_RLD,PIN_MAG,					// handle buttons
 	PIN_BT0,PIN_BTU,PIN_BTD,PIN_BTL,PIN_BTR,	// d-pad buttons
 	PIN_CAL										// calibration is last
@@ -28,12 +31,20 @@ int pigun_solenoid_timer = 0;
 uint16_t pigun_button_state = 0;					// stores value at the bit position corresponding to button id, 1 if the button was just pressed
 uint16_t pigun_button_newpress = 0;					// stores value at the bit position corresponding to button id, 1 if the button was just pressed
 
-int pigun_button_holder[9] = { 0,0,0,0,0,0,0,0,0 }; // frame counters for each button
+// polled buttons: press, release and recharge of all of them on the bank registers
+static pigun_buttons_t pigun_buttons;
 
-// status=0: ready to be pressed
-// status=1: button is currently pressed
-// status<0: button has been released as is "recharging"
-int pigun_button_status[9] = {0,0,0,0,0,0,0,0,0};
+// bank 0 registers through libbcm2835: the offsets are in bytes, the register pointer in words
+static uint32_t gpio_level() {
+	return bcm2835_peri_read(bcm2835_gpio + BCM2835_GPLEV0 / 4);
+}
+static uint32_t gpio_events() {
+	return bcm2835_peri_read(bcm2835_gpio + BCM2835_GPEDS0 / 4);
+}
+static void gpio_clear(uint32_t pins) {
+	bcm2835_peri_write(bcm2835_gpio + BCM2835_GPEDS0 / 4, pins);
+}
+static const pigun_buttons_regs_t gpio_regs = { gpio_level, gpio_events, gpio_clear };
 
 
 /// @brief Initialises te GPIO system.
@@ -55,18 +66,19 @@ int pigun_GPIO_init() {
 	bcm2835_gpio_fsel(PIN_OUT_CAL, BCM2835_GPIO_FSEL_OUTP); bcm2835_gpio_write(PIN_OUT_CAL, LOW);
 
 	// setup the pins for input buttons
-	for (int i = 0; i < 9; i++) {
+	for (int i = 0; i < PIGUN_BUTTONS; i++) {
 		bcm2835_gpio_fsel(pigun_button_pin[i], BCM2835_GPIO_FSEL_INPT);		// set as input
 		bcm2835_gpio_set_pud(pigun_button_pin[i], BCM2835_GPIO_PUD_UP);		// give it a pullup resistor
 
 		bcm2835_gpio_fen(pigun_button_pin[i]);								// detect falling edge (should happen when button is pressed=grounded)
 	}
 	
-	// setup solenoid - start ON because it is connected to the 555 trigger
-	bcm2835_gpio_fsel(PIN_OUT_SOL, BCM2835_GPIO_FSEL_OUTP); bcm2835_gpio_write(PIN_OUT_SOL, HIGH);
+	// setup solenoid - start in the hold state (HIGH when it is connected to the 555 trigger)
+	bcm2835_gpio_fsel(PIN_OUT_SOL, BCM2835_GPIO_FSEL_OUTP); bcm2835_gpio_write(PIN_OUT_SOL, SOL_HOLD);
 
 	pigun_button_state = 0;
 	pigun_button_newpress = 0;
+	pigun_buttons_init(&pigun_buttons, &gpio_regs, pigun_button_pin, PIGUN_BUTTONS, button_delay);
 
 	pigun_solenoid_timer = 0;
 
@@ -79,8 +91,8 @@ int pigun_GPIO_stop() {
 
 	if (pigun_GPIO_inited == 0) return 0;
 
-	// set solenoid trigger to HIGH because it is attached to the 555
-	bcm2835_gpio_write(PIN_OUT_SOL, HIGH);
+	// solenoid in the hold state (HIGH when it is attached to the 555)
+	bcm2835_gpio_write(PIN_OUT_SOL, SOL_HOLD);
 
 	// switch off all LEDS
 	bcm2835_gpio_write(PIN_OUT_AOK, LOW);
@@ -108,87 +120,79 @@ void pigun_service_off(){
 }
 
 
-void pigun_recoil_fire(){
+// grid calibration being collected in service mode
+static pigun_calgrid_t service_calgrid;
 
-	// turn on the GPIO that triggers the solenoid
-	bcm2835_gpio_write(PIN_OUT_SOL, SOL_FIRE);
-	
-	// duration of the trigger pulse
-	pigun.recoilPulseTimer = -1; // has to be at least 1 frame to produce a pulse!
+// camera settings that can be selected in service mode
+static const uint32_t service_shutter[] = { 0, 250, 500, 1000, 2000, 4000, 8000, 16000 }; // us, 0 = auto
+static const uint16_t service_again[] = { 0, 100, 200, 400, 800 }; // x100, 0 = auto
 
-}
+/// @brief Moves the camera shutter and analog gain up or down one step.
+/// @param dshutter -1, 0 or +1
+/// @param dgain -1, 0 or +1
+void pigun_service_camera(int dshutter, int dgain) {
 
+	pigun_camera_params_t params;
+	pigun_camera_get(&params);
 
-void pigun_buttons_process() {
+	// find the current steps
+	int ns = sizeof(service_shutter) / sizeof(uint32_t);
+	int ng = sizeof(service_again) / sizeof(uint16_t);
+	int is = 0, ig = 0;
+	while (is < ns - 1 && service_shutter[is] < params.shutter) is++;
+	while (ig < ng - 1 && service_again[ig] < params.again) ig++;
 
-	/* BUTTON SYSTEM
-	* 
-	* button pins are kept HIGH by the pizero and grounded (LOW) when the user presses the physical switch
-	* the bcm2835 lib detects falling edge events (FEE)
-	* the FEE only registers as a button press if the button is in the released state
-	* after the press is registered, the button is locked in pressed state for X frames to avoid jitter
-	* once the x frames are passed, we check if the pin state is still LOW
-	* when it is not low, the button becomes released
-	* 
-	*/
+	is += dshutter; if (is < 0) is = 0; if (is >= ns) is = ns - 1;
+	ig += dgain; if (ig < 0) ig = 0; if (ig >= ng) ig = ng - 1;
 
-	// mark all buttons as not being in "new press" state
-	pigun_button_newpress = 0;
-
-	// check all the buttons to detect new presses and formulate the HID report byte
-	for (int i = 0; i < 9; i++) {
+	params.shutter = service_shutter[is];
+	params.again = service_again[ig];
+	pigun_camera_set(&params, CAMERA_SET_SHUTTER | CAMERA_SET_GAINS);
+	printf("PIGUN: camera shutter %u us, analog gain %.1f\n", params.shutter, params.again / 100.0f);
+}
 
-		// if button was just pressed now AND we are allowed to register
-		if (bcm2835_gpio_eds(pigun_button_pin[i])) { // this checks the status flag, which is true when a falling edge is detected
 
-			// clear GPIO event flag
-			// this is done every time the event was detected, regardless of whether the
-			// event really was a valid press, otherwise the BCM2835 wont detect it again!
-			bcm2835_gpio_set_eds(pigun_button_pin[i]);
+// solenoid output for the pulse thread (pigun-solenoid.c)
+static void solenoid_gpio_write(uint8_t fire) {
+	bcm2835_gpio_write(PIN_OUT_SOL, fire ? SOL_FIRE : SOL_HOLD);
+}
+const pigun_solenoid_pin_t pigun_solenoid_gpio = { "gpio", solenoid_gpio_write };
 
-			// if the button was being reloaded, nothing should happen
-			//if(pigun_button_status[i] < 0) continue;
+void pigun_recoil_fire(){
 
-			// register the press event if the button was released & ready to be pressed again
-			if (pigun_button_status[i] == 0) {
+	// one pulse, timed by the solenoid thread
+	pigun_solenoid_fire(1, 0);
+}
 
-				pigun_button_newpress |= (uint16_t)(1 << i);	// mark a good press event internally?
-				pigun_button_state |= (uint16_t)(1 << i);		// this is for the HID report
-				pigun_button_status[i] = 1;						// this is for internal use
 
-				// ignore the rest of the code since it is dealing with button releases
-				continue;
-			} 
-			
-			// if the button is not in 0 state, then it is not ready to process this button-press event
-		}
+// polls the buttons, when the input thread is not running (see pigun-input.c)
+static void pigun_buttons_poll() {
 
-		// code here => the press event was NOT registered for this button
+	/* BUTTON SYSTEM
+	* 
+	* button pins are kept HIGH by the pizero and grounded (LOW) when the user presses the physical switch
+	* the bcm2835 detects falling edge events (FEE)
+	* the FEE only registers as a button press if the button is in the released state
+	* once pressed, the button is released when its pin is HIGH again
+	* after the release, the button is locked for button_delay frames to avoid jitter
+	* 
+	* all the buttons are moved at once from one read of the event and level registers (pigun-buttons.c)
+	*/
+	pigun_button_state = pigun_buttons_sample(&pigun_buttons, &pigun_button_newpress);
 
-		// if button status 1 (pressed) and now it is at HIGH level (not grounded -> released)
-		if (bcm2835_gpio_lev(pigun_button_pin[i]) == HIGH && pigun_button_status[i] == 1) {
-			// set the status to negative # of frames this takes to recharge
-			pigun_button_status[i] = -button_delay;
-			pigun_button_state &= ~(uint16_t)(1 << i);
-			continue;
-		}
+	// send the state to the HID report (only LSB), the bluetooth thread is told if it changed
+	pigun_report_set_buttons((uint8_t)pigun_button_state);
+}
 
-		// if the state is negative, increase by one (recharge), regardless of the actual state of the pin
-		if(pigun_button_status[i] < 0) pigun_button_status[i]++;
 
-	}
+void pigun_buttons_process() {
 
-	pigun.report.buttons = pigun_button_state;	// send the state to the HID report (only LSB)
+	// the input thread already put the state in the report, as soon as it changed
+	if (pigun_input_running()) pigun_input_take(&pigun_button_state, &pigun_button_newpress);
+	else pigun_buttons_poll();
 
-	// recharge the solenoid trigger
-	if(pigun.recoilCooldownTimer < 0) {
-		
-		pigun.recoilCooldownTimer++;
-		
-		// if recharge complete, switch the trigger pin
-		//if(pigun.recoilCooldownTimer == 0)
-			//bcm2835_gpio_write(PIN_OUT_SOL, SOL_HOLD);
-	}
+	// auto fire while the trigger is held, the solenoid thread keeps the period
+	pigun_solenoid_hold(pigun.state == STATE_IDLE && pigun.recoilMode == RECOIL_AUTO && (pigun_button_state & MASK_TRG));
 
 
 	// *** deal with some specific buttons *** *****************************
@@ -199,13 +203,6 @@ void pigun_buttons_process() {
 		
 		// process the trigger
 		switch(pigun.recoilMode){
-			case RECOIL_AUTO:
-				// fire if the button is down and cooldown timer is 0
-				if((pigun_button_state & 1) && pigun.recoilCooldownTimer == 0){
-					pigun_recoil_fire();
-					pigun.recoilCooldownTimer = -6; // hard-coded cooldown
-				}
-				break;
 			case RECOIL_SELF:
 				// fire on newpress events - no need to check cooldown
 				if(pigun_button_newpress & MASK_TRG)
@@ -233,6 +230,7 @@ void pigun_buttons_process() {
 					pigun.detector.peaks[i].col,pigun.detector.peaks[i].row,
 					pigun.detector.peaks[i].blobsize);
 			}
+			pigun_timing_print();
 
 			pigun.state = STATE_SERVICE;
 		}
@@ -261,6 +259,12 @@ void pigun_buttons_process() {
 
 
 
+		// d-pad changes the camera settings: up/down for the shutter, left/right for the gain
+		if (pigun_button_newpress & MASK_BTU) pigun_service_camera(+1, 0);
+		if (pigun_button_newpress & MASK_BTD) pigun_service_camera(-1, 0);
+		if (pigun_button_newpress & MASK_BTR) pigun_service_camera(0, +1);
+		if (pigun_button_newpress & MASK_BTL) pigun_service_camera(0, -1);
+
 		// TODO: add other functions
 
 
@@ -272,9 +276,19 @@ void pigun_buttons_process() {
 		}
 	}
 	else if(pigun.state == STATE_CAL_TL){
-		if (pigun_button_newpress & 1) { // on TRG set the top-left and wait for next corner
+		if (pigun_button_newpress & (MASK_BTU | MASK_BTD)) { // d-pad up/down starts a 3x3/5x5 grid calibration instead
 			
+			service_calgrid.n = (pigun_button_newpress & MASK_BTU) ? 3 : 5;
+			service_calgrid.count = 0;
+			printf("PIGUN: %ix%i grid calibration, aim at the top-left corner\n", service_calgrid.n, service_calgrid.n);
+			pigun.state = STATE_CAL_GRID;
+		}
+		else if (pigun_button_newpress & 1) { // on TRG set the top-left and wait for next corner
+			
+			// with the gyro, the calibration is read by the gyro thread too
+			pigun_imu_lock();
 			pigun.cal_topleft = pigun.aim_normalised;
+			pigun_imu_unlock();
 			printf("PIGUN: calibration top-left {%f, %f}\n", pigun.cal_topleft.x, pigun.cal_topleft.y);
 
 			// save the calibration data
@@ -289,10 +303,12 @@ void pigun_buttons_process() {
 	else if(pigun.state == STATE_CAL_BR){
 		if (pigun_button_newpress & 1) { // if TRIGGER was just pressed
 			
+			// save the calibration data - the 2 points replace the grid calibration
+			pigun_imu_lock();
 			pigun.cal_lowright = pigun.aim_normalised;
+			pigun.calgrid.n = 0;
+			pigun_imu_unlock();
 			printf("PIGUN: calibration low-right {%f, %f}\n", pigun.cal_lowright.x, pigun.cal_lowright.y);
-
-			// save the calibration data
 			pigun_calibration_save();
 
 			// back to idle mode
@@ -303,12 +319,49 @@ void pigun_buttons_process() {
 			pigun_service_off();
 		}
 	}
+	else if(pigun.state == STATE_CAL_GRID){
+		pigun_calgrid_t* grid = &service_calgrid;
+
+		if ((pigun_button_newpress & 1) && pigun.detector.error) { // no sample without beacons
+			printf("PIGUN: calibration point not taken, beacons not visible\n");
+		}
+		else if ((pigun_button_newpress & 1) && pigun.aim_reject) { // nor from a quad the aimer threw away
+			printf("PIGUN: calibration point not taken, beacon quad rejected (condition number %f)\n", pigun.aim_cond);
+		}
+		else if (pigun_button_newpress & 1) { // on TRG take the sample for the current grid point
+			
+			grid->samples[grid->count] = pigun.aim_normalised;
+			printf("PIGUN: calibration point %i/%i {%f, %f}\n", grid->count + 1, grid->n * grid->n,
+				pigun.aim_normalised.x, pigun.aim_normalised.y);
+			grid->count++;
+
+			if (grid->count < grid->n * grid->n) {
+				pigun_aimpoint_t t = pigun_calgrid_target(grid->n, grid->count);
+				printf("PIGUN: aim at {%.2f, %.2f} of the play area\n", t.x, t.y);
+			}
+			else {
+				// all points taken: fit the warp table, use it and save the samples
+				// with the gyro the aim output runs on the gyro thread: swap the table under its lock
+				if (pigun_calgrid_fit(grid) == 0) {
+					pigun_imu_lock();
+					pigun.calgrid = *grid;
+					pigun_imu_unlock();
+					pigun_calibration_save();
+					printf("PIGUN: grid calibration done\n");
+				}
+				else printf("PIGUN ERROR: grid calibration failed, keeping the previous one\n");
 
+				// back to idle mode
+				pigun.state = STATE_IDLE;
+				bcm2835_gpio_write(PIN_OUT_CAL, LOW);
+			}
+		}
+		else if (pigun_button_newpress & MASK_CAL){
+			pigun_service_off();
+		}
+	}
 
 
-	// after the desired time, SOL 555 trigger goes off
-	if (pigun.recoilPulseTimer == 0) bcm2835_gpio_write(PIN_OUT_SOL, SOL_HOLD);
-	else if (pigun.recoilPulseTimer < 0) pigun.recoilPulseTimer++;
 
 	// *********************************************************************
 
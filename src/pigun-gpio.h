@@ -1,6 +1,7 @@
 #include <bcm2835.h>
 #include <stdint.h>
 #include "pigun-hid.h"
+#include "pigun-solenoid.h"
 
 
 #ifndef PIGUN_GPIO
@@ -27,10 +28,17 @@
 #define MASK_MAG UINT16_C(0x0004)
 
 #define MASK_BT0 UINT16_C(0x0008)
+#define MASK_BTU UINT16_C(0x0010)
+#define MASK_BTD UINT16_C(0x0020)
+#define MASK_BTL UINT16_C(0x0040)
+#define MASK_BTR UINT16_C(0x0080)
 
 
 #define MASK_CAL UINT16_C(0x0100)
 
+#define PIGUN_BUTTONS 9		// buttons, in the order of the masks
+
+extern int pigun_button_pin[PIGUN_BUTTONS];
 //extern uint16_t pigun_button_newpress;
 
 
@@ -60,6 +68,9 @@
 
 
 
+extern const pigun_solenoid_pin_t pigun_solenoid_gpio;
+
+
 // functions
 int pigun_GPIO_init();
 int pigun_GPIO_stop();
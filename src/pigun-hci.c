@@ -0,0 +1,154 @@
+/*
+* HCI transport on a Linux bluetooth device, through the HCI user channel (pigun.exe --hci <n>).
+*
+* BTstack gets the whole controller hciN for itself, as it does with the Pi UART, but the controller
+* can be anything the kernel knows: a USB dongle, or a virtual one made by btvirt (BlueZ emulator)
+* or /dev/vhci. With two linked btvirt controllers, the gun and a host (tools/pigun-peer) run on the
+* same box without radio, to measure the bluetooth path (see tools/vhci-bench.sh).
+* The socket gives one H4 packet per read, with the packet type in front: no UART framing here.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "btstack.h"
+
+#include "pigun-hci.h"
+
+
+// from the kernel bluetooth headers, not needed anywhere else
+#define HCI_BTPROTO 1
+#define HCI_USER_CHANNEL 1
+#define HCI_DEVDOWN _IOW('H', 202, int)
+
+struct uchan_sockaddr {
+	sa_family_t hci_family;
+	unsigned short hci_dev;
+	unsigned short hci_channel;
+};
+
+
+static int uchan_dev = 0;
+static uint8_t uchan_sent = 0;	// a packet was written, the packet sent event is pending
+static btstack_data_source_t uchan_source;
+static void (*uchan_handler)(uint8_t packet_type, uint8_t* packet, uint16_t size);
+static uint8_t uchan_buffer[HCI_INCOMING_PRE_BUFFER_SIZE + 1 + HCI_INCOMING_PACKET_BUFFER_SIZE];
+
+
+static void uchan_process(btstack_data_source_t* ds, btstack_data_source_callback_type_t callback_type) {
+
+	if (callback_type == DATA_SOURCE_CALLBACK_WRITE) {
+		// the socket took the packet: tell hci.c it can send the next one
+		static uint8_t packet_sent[] = { HCI_EVENT_TRANSPORT_PACKET_SENT, 0 };
+		btstack_run_loop_disable_data_source_callbacks(ds, DATA_SOURCE_CALLBACK_WRITE);
+		uchan_sent = 0;
+		uchan_handler(HCI_EVENT_PACKET, packet_sent, sizeof(packet_sent));
+		return;
+	}
+
+	if (callback_type != DATA_SOURCE_CALLBACK_READ) return;
+
+	uint8_t* packet = &uchan_buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
+	ssize_t n = read(ds->source.fd, packet, 1 + HCI_INCOMING_PACKET_BUFFER_SIZE);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) printf("PIGUN ERROR: hci%i read failed (%s)\n", uchan_dev, strerror(errno));
+		return;
+	}
+	if (n < 2) return;
+	uchan_handler(packet[0], &packet[1], n - 1);
+}
+
+
+static void uchan_init(const void* config) {
+	UNUSED(config);
+}
+
+static int uchan_open() {
+
+	int fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, HCI_BTPROTO);
+	if (fd < 0) {
+		printf("PIGUN ERROR: no bluetooth sockets (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	// the user channel wants the device down: the kernel stack lets go of it
+	ioctl(fd, HCI_DEVDOWN, uchan_dev);
+
+	struct uchan_sockaddr addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = uchan_dev;
+	addr.hci_channel = HCI_USER_CHANNEL;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		printf("PIGUN ERROR: unable to take hci%i (%s), stop bluetoothd or power it off with btmgmt\n", uchan_dev, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	printf("PIGUN: using hci%i through the HCI user channel\n", uchan_dev);
+
+	uchan_sent = 0;
+	btstack_run_loop_set_data_source_fd(&uchan_source, fd);
+	btstack_run_loop_set_data_source_handler(&uchan_source, &uchan_process);
+	btstack_run_loop_enable_data_source_callbacks(&uchan_source, DATA_SOURCE_CALLBACK_READ);
+	btstack_run_loop_add_data_source(&uchan_source);
+	return 0;
+}
+
+static int uchan_close() {
+
+	btstack_run_loop_remove_data_source(&uchan_source);
+	close(uchan_source.source.fd);
+	uchan_source.source.fd = -1;
+	return 0;
+}
+
+static void uchan_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t* packet, uint16_t size)) {
+	uchan_handler = handler;
+}
+
+static int uchan_can_send_packet_now(uint8_t packet_type) {
+	UNUSED(packet_type);
+	return !uchan_sent;
+}
+
+static int uchan_send_packet(uint8_t packet_type, uint8_t* packet, int size) {
+
+	struct iovec iov[2] = {
+		{ &packet_type, 1 },
+		{ packet, size }
+	};
+	if (writev(uchan_source.source.fd, iov, 2) != size + 1) {
+		printf("PIGUN ERROR: hci%i write failed (%s)\n", uchan_dev, strerror(errno));
+		return -1;
+	}
+
+	// packet sent event from the run loop, as the UART transports do
+	uchan_sent = 1;
+	btstack_run_loop_enable_data_source_callbacks(&uchan_source, DATA_SOURCE_CALLBACK_WRITE);
+	return 0;
+}
+
+static const hci_transport_t uchan_transport = {
+	.name = "HCI user channel",
+	.init = &uchan_init,
+	.open = &uchan_open,
+	.close = &uchan_close,
+	.register_packet_handler = &uchan_register_packet_handler,
+	.can_send_packet_now = &uchan_can_send_packet_now,
+	.send_packet = &uchan_send_packet,
+};
+
+
+/// @brief HCI transport on the Linux bluetooth device hci<dev>.
+/// @param dev index of the device, as in hciconfig or btmgmt.
+/// @return the transport for hci_init.
+const hci_transport_t* pigun_hci_transport(int dev) {
+	uchan_dev = dev;
+	return &uchan_transport;
+}
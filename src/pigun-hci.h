@@ -0,0 +1,12 @@
+#include <stdint.h>
+
+#include "btstack.h"
+
+#ifndef PIGUN_HCI
+#define PIGUN_HCI
+
+
+const hci_transport_t* pigun_hci_transport(int dev);
+
+
+#endif
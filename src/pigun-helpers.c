@@ -48,11 +48,36 @@ extern "C" {
 		return 0;
 	}
 
+	/**
+	 * Set the sensor gains
+	 * @param camera Pointer to camera component
+	 * @param analog_gain, digital_gain gains x100, 0 gives that gain back to the automatic control
+	 * @return 0 if successful, non-zero if something went wrong
+	 */
 	int pigun_camera_gains(MMAL_COMPONENT_T* camera, int analog_gain, int digital_gain) {
 		MMAL_RATIONAL_T again = { analog_gain, 100 };
 		MMAL_RATIONAL_T dgain = { digital_gain, 100 };
-		mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x59, again);
-		mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x5A, dgain);
+		if (mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x59, again) != MMAL_SUCCESS)
+			return 1;
+		if (mmal_port_parameter_set_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x5A, dgain) != MMAL_SUCCESS)
+			return 1;
+		return 0;
+	}
+
+	/**
+	 * Read back the sensor gains set on the camera
+	 * @param camera Pointer to camera component
+	 * @param analog_gain, digital_gain output: gains x100, 0 if automatic
+	 * @return 0 if successful, non-zero if something went wrong
+	 */
+	int pigun_camera_get_gains(MMAL_COMPONENT_T* camera, int* analog_gain, int* digital_gain) {
+		MMAL_RATIONAL_T again, dgain;
+		if (mmal_port_parameter_get_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x59, &again) != MMAL_SUCCESS)
+			return 1;
+		if (mmal_port_parameter_get_rational(camera->control, MMAL_PARAMETER_GROUP_CAMERA + 0x5A, &dgain) != MMAL_SUCCESS)
+			return 1;
+		*analog_gain = (again.den > 0) ? again.num * 100 / again.den : 0;
+		*digital_gain = (dgain.den > 0) ? dgain.num * 100 / dgain.den : 0;
 		return 0;
 	}
 
@@ -98,6 +123,66 @@ extern "C" {
 		return 0;
 	}
 
+
+	/**
+	 * Set the shutter speed
+	 * @param camera Pointer to camera component
+	 * @param speed shutter speed in us, 0 for automatic
+	 * @return 0 if successful, non-zero if something went wrong
+	 */
+	int pigun_camera_shutter(MMAL_COMPONENT_T* camera, uint32_t speed) {
+
+		if (!camera)
+			return 1;
+
+		if (mmal_port_parameter_set_uint32(camera->control, MMAL_PARAMETER_SHUTTER_SPEED, speed) != MMAL_SUCCESS)
+			return 1;
+		return 0;
+	}
+
+
+	/**
+	 * Set the frame rate of a running video port
+	 * @param port Camera video port
+	 * @param fps frames per second
+	 * @return 0 if successful, non-zero if something went wrong
+	 */
+	int pigun_camera_framerate(MMAL_PORT_T* port, int fps) {
+
+		if (!port)
+			return 1;
+
+		MMAL_PARAMETER_FPS_RANGE_T range = { {MMAL_PARAMETER_FPS_RANGE, sizeof(range)}, {fps, 1}, {fps, 1} };
+		if (mmal_port_parameter_set(port, &range.hdr) != MMAL_SUCCESS)
+			return 1;
+		return 0;
+	}
+
+
+	/**
+	 * Set the sensor region that is scaled into the video output
+	 * @param camera Pointer to camera component
+	 * @param x,y,w,h crop rectangle, normalised on the full sensor area (0 to 1)
+	 * @return 0 if successful, non-zero if something went wrong
+	 */
+	int pigun_camera_crop(MMAL_COMPONENT_T* camera, float x, float y, float w, float h) {
+
+		if (!camera)
+			return 1;
+
+		MMAL_PARAMETER_INPUT_CROP_T crop = { {MMAL_PARAMETER_INPUT_CROP, sizeof(crop)} };
+
+		// MMAL wants the rectangle in 16.16 fixed point
+		crop.rect.x = (int32_t)(x * 65536);
+		crop.rect.y = (int32_t)(y * 65536);
+		crop.rect.width = (int32_t)(w * 65536);
+		crop.rect.height = (int32_t)(h * 65536);
+
+		if (mmal_port_parameter_set(camera->control, &crop.hdr) != MMAL_SUCCESS)
+			return 1;
+		return 0;
+	}
+
 #ifdef __cplusplus
 }
 #endif
@@ -41,95 +41,45 @@
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "btstack.h"
 
 #include "pigun.h"
 #include "pigun-gpio.h" // this is mine!
 #include "pigun-hid.h" // this is mine!
+#include "pigun-descriptor.h"
+#include "pigun-link.h"
+#include "pigun-reconnect.h"
+#include "pigun-param.h"
+#include "pigun-seqlock.h"
 
-/// @brief HID descriptor for joystick with extra output report (data)
-const uint8_t hid_descriptor_joystick_mode[] = {
-	0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
-	0x09, 0x04,        // Usage (Joystick)
-	0xA1, 0x01,        // Collection (Application)
-		0x09, 0x01,        //   Usage (Pointer)
-		0xA1, 0x00,        //   Collection (Physical)
-			0x85, PIGUN_REPORT_ID,		   // 	Report ID 3
-
-			0x05, 0x01,        // Usage Page (Generic Desktop Ctrls)
-			0x16, 0x01, 0x80,  //   Logical Minimum 0x8001 (-32767)  
-			0x26, 0xFF, 0x7F,  //   Logical Maximum 0x7FFF (32767)
-			0x09, 0x30,        //     Usage (X)
-			0x09, 0x31,        //     Usage (Y)
-			0x75, 0x10,        //     Report Size (16)
-			0x95, 0x02,        //     Report Count (2)
-			0x81, 0x02,        //     Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
-
-			0x05, 0x09,        //   Usage Page (Button)
-			0x19, 0x01,        //   Usage Minimum (0x01)
-			0x29, 0x08,        //   Usage Maximum (0x08)
-			0x15, 0x00,        //   Logical Minimum (0)
-			0x25, 0x01,        //   Logical Maximum (1)
-			0x75, 0x01,        //   Report Size (1)
-			0x95, 0x08,        //   Report Count (8)
-			0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
-
-
-			0x09, 0x03,		  	// usage ID vendor defined
-			0x15, 0x00,			// Logical Minimum (0)
-			0x26, 0xFF, 0x00,  	// Logical Maximum (1)
-			0x75, 0x08,        	// Report Size (8)
-			0x95, 0x01,        	// Report Count (1)
-			0x91, 0x02,			// output (data,Var,Abs)
-
-		0xC0,              //   End Collection   --- 27 bytes
-	0xC0              // End Collection --- 44 bytes
-};
-
-pigun_blinker_t *pigun_blinkers;
-static void blinker_autoconnect(void);
+// the descriptor is in pigun-descriptor.h, shared with the host tools
+const uint8_t* const hid_descriptor_joystick_mode = pigun_descriptor;
+const uint16_t hid_descriptor_joystick_mode_size = sizeof(pigun_descriptor);
+
+pigun_blinker_t pigun_blinkers[HID_BLINKERS];
 static void blinker_connectLED(void); // switches the OK LED
 
 /// @brief Callback for custom blinkers.
-/// @param ts 
-void pigun_blinker_event(btstack_timer_source_t *ts) {
-
-	pigun_blinker_t *blk = NULL;
+/// @param timer the blinker timer, its context is the blinker.
+void pigun_blinker_event(pigun_timer_t *timer) {
 
-	// find the global blinker with this timersource
-	for(int i=0; i<10; i++){
-		if(ts == &(pigun_blinkers[i].timer)){
-			blk = &(pigun_blinkers[i]);
-			break;
-		}
-	}
-
-	if(blk == NULL) return;
-	
-	if(blk->cancelled){
-		blk->active = 0;
-		return;
-	}
+	pigun_blinker_t *blk = (pigun_blinker_t*)timer->context;
 
 	//printf("PIGUN-BLINKER[%i]: %i/%i\n", blk, blk->counter, blk->nblinks);
 	
 	// perform the custom action
 	blk->callback();
 
+	// the timer is periodic: it only has to be stopped after the last blink
 	if(blk->nblinks > 0) {
 		blk->counter++;
 		if(blk->counter == blk->nblinks) {
+			pigun_timer_cancel(&(blk->timer));
 			blk->active = 0;
-			return;
 		}
 	}
-
-	// code here => we have to schedule another blink
-	btstack_run_loop_set_timer(&(blk->timer), blk->timeout);
-	btstack_run_loop_add_timer(&(blk->timer));
-	
-
 }
 
 int pigun_blinker_create(uint8_t nblinks, uint16_t timeout, blinker_callback_t callback) {
@@ -138,7 +88,7 @@ int pigun_blinker_create(uint8_t nblinks, uint16_t timeout, blinker_callback_t c
 	int bID = -1;
 
 	// find the first inactive blinker
-	for(int i=0; i<10; i++){
+	for(int i=0; i<HID_BLINKERS; i++){
 		if(!pigun_blinkers[i].active){
 			bID = i;
 			blk = &(pigun_blinkers[i]);
@@ -151,19 +101,18 @@ int pigun_blinker_create(uint8_t nblinks, uint16_t timeout, blinker_callback_t c
 	blk->active = 1;
 	blk->nblinks = nblinks;
 	blk->counter = 0;
-	blk->cancelled = 0;
 	blk->timeout = timeout;
 
 	blk->callback = callback;
-	blk->timer.process = &(pigun_blinker_event);
-
-	btstack_run_loop_set_timer(&(blk->timer), timeout);
-	btstack_run_loop_add_timer(&(blk->timer));
+	pigun_timer_setup(&(blk->timer), &pigun_blinker_event, blk);
+	pigun_timer_start(&(blk->timer), timeout * 1000, timeout * 1000);
 
 	return bID;
 }
 void pigun_blinker_stop(int bID) {
-	pigun_blinkers[bID].cancelled = 1;
+	if(bID < 0 || bID >= HID_BLINKERS) return;
+	pigun_timer_cancel(&(pigun_blinkers[bID].timer));
+	pigun_blinkers[bID].active = 0;
 }
 
 int blinkID_greenLED = -1;
@@ -184,59 +133,350 @@ static enum {
 } app_state = APP_BOOTING;
 
 
+// Bluetooth transport: the slot comes with the HID_SUBEVENT_CAN_SEND_NOW event
+static uint8_t bt_connected() {
+	return app_state == APP_CONNECTED;
+}
+
+static void bt_request() {
+	hid_device_request_can_send_now_event(hid_cid);
+}
+
+static int bt_send(const uint8_t* report, uint16_t size) {
 
+	// first byte is a1=device to host request type, then the report with its ID
+	// the slot came with CAN_SEND_NOW, so the stack takes it
+	uint8_t message[1 + HID_MAXREPORT];
+	message[0] = 0xa1;
+	memcpy(&message[1], report, size);
+	hid_device_send_interrupt_message(hid_cid, &message[0], size + 1);
+	return 0;
+}
 
+const pigun_transport_t pigun_transport_bt = { "bluetooth", &bt_connected, &bt_request, &bt_send };
 
-int compare_servers(bd_addr_t a, bd_addr_t b) {
-	for (int i = 0; i < 6; i++) {
-		if (a[i] != b[i]) return 0;
+static const pigun_transport_t* transport = &pigun_transport_bt;
+
+
+
+
+
+// HID Report sending
+// The camera, button and gyro threads call pigun_hid_signal when they change the report: this wakes up
+// the BTstack run loop through an eventfd, and a send slot is requested. Only a report that differs
+// from the last one sent goes out, plus a keepalive when nothing changed for a while.
+static btstack_data_source_t report_source;
+static pigun_timer_t keepalive_timer;
+static uint16_t keepalive_ms = HID_KEEPALIVE;
+static uint8_t send_pending = 0;	// a send slot was requested
+static uint8_t send_forced = 0;		// the next slot sends even if nothing changed (keepalive)
+static pigun_report_t report_lastsent;
+static pigun_hid_stats_t hid_stats;
+static int64_t down_since = 0;	// when the host was lost (or the start), 0 once the first report went out after it
+static uint32_t down_count = 0;	// times the transport lost the host
+
+// Telemetry report
+// Sent every telemetry_ms, or once when the host asks (0x21 data command, or GET_REPORT on ID 4).
+// It takes a send slot only when the joystick report does not need it.
+static pigun_timer_t telemetry_timer;
+static uint16_t telemetry_ms = 0;
+static uint8_t telemetry_pending = 0;	// the telemetry goes out with the next free slot
+
+static int send_report(const pigun_report_t* report, const pigun_frame_t* aimed);
+static void send_telemetry(void);
+
+
+// Report handoff between threads
+// The report has two groups, each with a single writer: the aim (x, y and the frame it came from),
+// written by the camera thread or by the gyro thread when it runs, and the buttons, written by the
+// GPIO input thread (pigun-input.c) as soon as it takes an edge, or by the camera thread at each frame
+// (pigun_buttons_poll) only when the input thread is not running - never both.
+// The aim is protected by a seqlock (pigun-seqlock.h): the writer makes the sequence odd, writes,
+// and makes it even again; the reader retries if the sequence was odd or changed while it was
+// reading. tools/pigun-seqlock-stress hammers the same code on a PC. The buttons are a single byte,
+// stored atomically. Nothing ever blocks the writers.
+static uint32_t report_seq = 0;
+
+/// @brief Writes the aim in the report. Only one thread at a time can call this.
+/// @param x report x.
+/// @param y report y.
+/// @param frame camera frame the aim comes from, NULL if it is not from a new frame (gyro).
+void pigun_report_set_aim(int16_t x, int16_t y, const pigun_frame_t* frame) {
+
+	uint8_t changed = (x != pigun.report.x || y != pigun.report.y);
+	if (!changed && frame == NULL) return;
+
+	pigun_seqlock_write_begin(&report_seq);
+
+	pigun.report.x = x;
+	pigun.report.y = y;
+	if (frame != NULL) {
+		pigun.timing.aimed = *frame;
+		pigun.timing.aimed.t_aim = pigun_now_us();
 	}
-	return 1;
+
+	pigun_seqlock_write_end(&report_seq);
+
+	if (changed) pigun_hid_signal();
 }
 
-void pigun_server_load(){
+/// @brief Writes the buttons in the report. Only one thread at a time can call this.
+void pigun_report_set_buttons(uint8_t buttons) {
 
-	pigun.nServers = 0;
-	
-	FILE* fin = fopen("servers.bin", "rb");
-	if (fin == NULL) {
-		// if file not found, create a file with no servers
-		fin = fopen("servers.bin", "wb");
-		fwrite(&(pigun.nServers), sizeof(int), 1, fin);
-		fclose(fin);
-		// and open it
-		fin = fopen("servers.bin", "rb");
+	if (buttons == __atomic_load_n(&(pigun.report.buttons), __ATOMIC_RELAXED)) return;
+	__atomic_store_n(&(pigun.report.buttons), buttons, __ATOMIC_RELEASE);
+	pigun_hid_signal();
+}
+
+/// @brief Takes a consistent copy of the report, without blocking the writers.
+/// @param report output report.
+/// @param aimed output frame the aim comes from, can be NULL.
+void pigun_report_get(pigun_report_t* report, pigun_frame_t* aimed) {
+
+	uint32_t seq;
+	do {
+		seq = pigun_seqlock_read_begin(&report_seq);
+		report->x = pigun.report.x;
+		report->y = pigun.report.y;
+		if (aimed != NULL) *aimed = pigun.timing.aimed;
+	} while (pigun_seqlock_read_retry(&report_seq, seq));
+
+	report->buttons = __atomic_load_n(&(pigun.report.buttons), __ATOMIC_ACQUIRE);
+}
+
+// asks the stack for a send slot, if there is not one coming already
+static void report_request() {
+	if (!transport->connected() || send_pending) return;
+	send_pending = 1;
+	transport->request();
+}
+
+// time to first report: how long the gun could not be used, from the start or a link loss
+static void first_report(int64_t since) {
+
+	uint32_t ms = (uint32_t)((pigun_now_us() - since) / 1000);
+	if (hid_stats.ttfr_start == 0) {
+		hid_stats.ttfr_start = (ms > 0) ? ms : 1;
+		printf("PIGUN-HID: first report %u ms after the start\n", ms);
+		return;
 	}
-	fread(&(pigun.nServers), sizeof(int), 1, fin);
-	
-	printf("PIGUN-HID: previous hosts: %i\n", pigun.nServers);
-	for (int i = 0; i < pigun.nServers; i++) {
-		fread(pigun.servers[i], sizeof(bd_addr_t), 1, fin);
-		printf("\thost[%i]: %s\n", i, bd_addr_to_str(pigun.servers[i]));
+	hid_stats.reconnects++;
+	hid_stats.ttfr_last = ms;
+	if (ms > hid_stats.ttfr_max) hid_stats.ttfr_max = ms;
+	printf("PIGUN-HID: first report %u ms after the link loss\n", ms);
+}
+
+static void report_keepalive(pigun_timer_t* timer) {
+	UNUSED(timer);
+	send_forced = 1;
+	report_request();
+}
+
+static void report_keepalive_restart() {
+	if (keepalive_ms == 0) pigun_timer_cancel(&keepalive_timer);
+	else pigun_timer_start(&keepalive_timer, keepalive_ms * 1000, 0);
+}
+
+// the report changed: the eventfd counter says how many times since the last wake up
+static void report_changed(btstack_data_source_t* ds, btstack_data_source_callback_type_t callback_type) {
+
+	uint64_t count;
+	if (callback_type != DATA_SOURCE_CALLBACK_READ) return;
+	if (read(ds->source.fd, &count, sizeof(count)) != sizeof(count)) return;
+
+	if (send_pending) hid_stats.coalesced += count;	// a slot is coming already
+	else hid_stats.coalesced += count - 1;
+	report_request();
+}
+
+/// @brief The transport can send a report now: sends it if there is something new.
+/// Called by the transport in the BTstack thread, after it was asked for a slot.
+void pigun_hid_send_slot() {
+
+	pigun_report_t report;
+	pigun_frame_t aimed;
+	pigun_report_get(&report, &aimed);
+
+	send_pending = 0;
+	if (!send_forced && report.x == report_lastsent.x && report.y == report_lastsent.y && report.buttons == report_lastsent.buttons) {
+		// the joystick report does not need the slot: use it for the telemetry
+		if (telemetry_pending) send_telemetry();
+		else hid_stats.suppressed++;
+		return;
+	}
+	if (send_forced) hid_stats.keepalives++;
+	else pigun_link_activity();
+	send_forced = 0;
+
+	uint32_t downs = down_count;
+	if (send_report(&report, &aimed) == 0) hid_stats.sent++;
+	report_keepalive_restart();
+
+	// the first report since the host was lost, unless the transport lost it again while sending
+	if (down_since && down_count == downs) {
+		first_report(down_since);
+		down_since = 0;
 	}
-	fclose(fin);
+
+	// the telemetry waits for the next slot
+	if (telemetry_pending) report_request();
 }
 
+static void telemetry_tick(pigun_timer_t* timer) {
+	UNUSED(timer);
+	if (telemetry_ms == 0) return;
 
+	telemetry_pending = 1;
+	report_request();
+}
 
-// HID Report sending
-static void send_report() {
 
-	// this is the report to send
-	// I do now know that the first byte is there for?!
-	//uint8_t hid_report[] = { 0xa1, 0, 0, 0, 0, 0 };
-	uint8_t hid_report[] = { 0xa1, PIGUN_REPORT_ID, 0, 0, 0, 0, 0 }; // first byte is a1=device to host request type, second byte is report ID
+/// @brief Tells the bluetooth thread that the report changed. Can be called from any thread.
+void pigun_hid_signal() {
 
-	
-	hid_report[2] = (pigun.report.x) & 0xff;
-	hid_report[3] = (pigun.report.x >> 8) & 0xff;
-	hid_report[4] = (pigun.report.y) & 0xff;
-	hid_report[5] = (pigun.report.y >> 8) & 0xff;
-	hid_report[6] = pigun.report.buttons;
-	
+	uint64_t one = 1;
+	if (report_source.source.fd > 0) write(report_source.source.fd, &one, sizeof(one));
+}
 
-	//printf("sending x=%i (%i %i) y=%i (%i %i) \n", pigun.report.x, hid_report[1], hid_report[2], pigun.report.y, hid_report[3], hid_report[4]);
-	hid_device_send_interrupt_message(hid_cid, &hid_report[0], 7); // 6 = sizeof(hid_report)
+/// @brief Copies the transmission counters.
+void pigun_hid_stats(pigun_hid_stats_t* stats) {
+	*stats = hid_stats;
+}
+
+/// @brief Sets the keepalive period. Call from the BTstack thread.
+/// @param ms time without changes before the report is sent anyway, 0 to disable.
+void pigun_hid_keepalive(uint16_t ms) {
+
+	keepalive_ms = ms;
+	// the timer running has the old period: start it again with the new one (or stop it)
+	if (transport->connected()) report_keepalive_restart();
+}
+
+uint16_t pigun_hid_get_keepalive() {
+	return keepalive_ms;
+}
+
+/// @brief Sets the telemetry report period. Call from the BTstack thread.
+/// @param ms time between two telemetry reports, 0 to only send them on request.
+void pigun_hid_telemetry(uint16_t ms) {
+
+	telemetry_ms = ms;
+	if (ms == 0) pigun_timer_cancel(&telemetry_timer);
+	else pigun_timer_start(&telemetry_timer, ms * 1000, ms * 1000);
+}
+
+uint16_t pigun_hid_get_telemetry() {
+	return telemetry_ms;
+}
+
+
+/// @brief Fills the telemetry report (without report ID).
+///
+/// All values are little endian.
+///   0-3	frame counter of the aim in the joystick report
+///   4-7	sensor timestamp of that frame, us (lower 32 bits of the monotonic clock)
+///   8-9	sensor to aim latency of that frame, us
+///  10-11	age of that frame now, us (saturated)
+///  12		number of beacons found in the last frame
+///  13		tracking quality: 0=lost, 255=best quad
+///  14		flags (pigun_telemetry_flags_t)
+///  15		frames rejected by the aimer (wraps around)
+static void telemetry_build(uint8_t* out) {
+
+	pigun_report_t report;
+	pigun_frame_t aimed;
+	pigun_report_get(&report, &aimed);
+
+	int64_t lat = aimed.t_aim - aimed.t_sensor;
+	int64_t age = pigun_now_us() - aimed.t_sensor;
+	lat = (lat < 0) ? 0 : (lat > 0xFFFF) ? 0xFFFF : lat;
+	age = (age < 0) ? 0 : (age > 0xFFFF) ? 0xFFFF : age;
+
+	// the quality goes down with the condition number of the quad, up to the rejection threshold
+	uint8_t flags = 0;
+	float q = 1 - (pigun.aim_cond - 1) / (AIMER_MAXCOND - 1);
+	q = (q < 0) ? 0 : (q > 1) ? 1 : q;
+	if (pigun.detector.error) {
+		flags |= TELEMETRY_LOST;
+		q = 0;
+	}
+	if (pigun.timing.deadline.degraded) flags |= TELEMETRY_DEGRADED;
+	if (pigun.timing.deadline.skipping) flags |= TELEMETRY_SKIPPING;
+
+	little_endian_store_32(out, 0, aimed.id);
+	little_endian_store_32(out, 4, (uint32_t)aimed.t_sensor);
+	little_endian_store_16(out, 8, (uint16_t)lat);
+	little_endian_store_16(out, 10, (uint16_t)age);
+	out[12] = pigun.detector.npeaks;
+	out[13] = (uint8_t)(q * 255);
+	out[14] = flags;
+	out[15] = (uint8_t)pigun.aim_rejected;
+}
+
+static void send_telemetry() {
+
+	uint8_t hid_report[1 + HID_TELEMETRY_SIZE] = { PIGUN_TELEMETRY_ID };
+	telemetry_build(&hid_report[1]);
+	transport->send(&hid_report[0], sizeof(hid_report));
+
+	telemetry_pending = 0;
+	hid_stats.telemetry++;
+}
+
+// called when the host asks for a report (GET_REPORT)
+static int get_report(uint16_t hid_cid, hid_report_type_t report_type, uint16_t report_id, int* out_report_size, uint8_t* out_report) {
+	UNUSED(hid_cid);
+
+	if (report_type == HID_REPORT_TYPE_FEATURE && report_id == PIGUN_PARAM_ID) {
+		pigun_param_answer(out_report);
+		*out_report_size = HID_PARAM_SIZE;
+		return HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL;
+	}
+	if (report_type != HID_REPORT_TYPE_INPUT) return HID_HANDSHAKE_PARAM_TYPE_ERR_INVALID_REPORT_ID;
+
+	if (report_id == PIGUN_TELEMETRY_ID) {
+		telemetry_build(out_report);
+		*out_report_size = HID_TELEMETRY_SIZE;
+		return HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL;
+	}
+	if (report_id == PIGUN_REPORT_ID) {
+		pigun_report_t report;
+		pigun_report_get(&report, NULL);
+		little_endian_store_16(out_report, 0, (uint16_t)report.x);
+		little_endian_store_16(out_report, 2, (uint16_t)report.y);
+		out_report[4] = report.buttons;
+		*out_report_size = 5;
+		return HID_HANDSHAKE_PARAM_TYPE_SUCCESSFUL;
+	}
+	return HID_HANDSHAKE_PARAM_TYPE_ERR_INVALID_REPORT_ID;
+}
+
+
+// returns 0 if the report went out: only then it is the last one sent, or a lost report would never be sent again
+static int send_report(const pigun_report_t* report, const pigun_frame_t* aimed) {
+
+	// this is the report to send, the first byte is the report ID
+	uint8_t hid_report[] = { PIGUN_REPORT_ID, 0, 0, 0, 0, 0 };
+
+	hid_report[1] = (report->x) & 0xff;
+	hid_report[2] = (report->x >> 8) & 0xff;
+	hid_report[3] = (report->y) & 0xff;
+	hid_report[4] = (report->y >> 8) & 0xff;
+	hid_report[5] = report->buttons;
+
+	//printf("sending x=%i y=%i bt=%d\n", report->x, report->y, report->buttons);
+	if (transport->send(&hid_report[0], sizeof(hid_report)) != 0) return 1;
+
+	report_lastsent = *report;
+
+	// measure sensor-to-air latency, only the first time a frame goes out
+	uint32_t fid = aimed->id;
+	if (fid != pigun.timing.lastsent) {
+		pigun.timing.lastsent = fid;
+		pigun.timing.t_lastsent = pigun_now_us();
+		pigun_latency_add(&pigun.timing.send, pigun.timing.t_lastsent - aimed->t_sensor);
+	}
+	return 0;
 }
 
 // called when host sends an output report
@@ -252,11 +492,55 @@ void set_report(uint16_t hid_cid, hid_report_type_t report_type, int report_size
 	}
 	printf("\n");*/
 
-	// any report would just trigger the solenoid if possible
+	// parameter request, the host reads the answer with GET_REPORT
+	if (report_type == HID_REPORT_TYPE_FEATURE) {
+		if (report_size > 1 && report[0] == PIGUN_PARAM_ID) pigun_param_request(&report[1], report_size - 1);
+		return;
+	}
+
+	// any other report would just trigger the solenoid if possible
 	if(pigun.recoilMode == RECOIL_HID) pigun_recoil_fire();
 }
 
 
+/// @brief Executes a data command from the host, the same on every transport.
+/// @param data the command byte.
+///
+/// The high-half is the command, the low-half the parameter.
+/// 
+/// 0x[0][1]: fire the solenoid once
+/// 0x[1][k]: set solenoid mode: k=0,1,2,3 (pigun_recoilmode_t)
+/// 0x[2][k]: telemetry report: k=0 stop, k=1 send one now, k>1 send every k*HID_TELEMETRY_STEP ms
+/// 0x[3][k]: recoil burst: k pulses one period apart, k=0 drops the shots not fired yet
+void pigun_hid_command(uint8_t data) {
+
+	uint8_t cmd = data>>4;
+	uint8_t par = data & 0x0F;
+	if(cmd == HID_CMD_RECOIL){
+		if(par >= 0 && par <= RECOIL_OFF){
+			pigun.recoilMode = par;
+			printf("PIGUN-HID: recoil mode is now %i\n", par);
+		}
+		else
+			printf("PIGUN-HID: invalid recoil mode [%i]\n", par);
+	}else if(cmd == HID_CMD_FIRE){
+		if(par == 1 && pigun.recoilMode == RECOIL_HID)
+			pigun_recoil_fire();
+	}else if(cmd == HID_CMD_TELEMETRY){
+		if(par == 1) {
+			telemetry_pending = 1;
+			report_request();
+		}
+		else pigun_hid_telemetry(par * HID_TELEMETRY_STEP);
+	}else if(cmd == HID_CMD_BURST){
+		if(pigun.recoilMode == RECOIL_HID)
+			pigun_solenoid_fire(par, 1);
+	}
+	else{
+		printf("PIGUN-HID: invalid data %x\n",data);
+	}
+}
+
 /// @brief Called when host sends an HID data message.
 /// @param hid_cid the HID device ID
 /// @param report_type HID report type (should be DATA)
@@ -264,10 +548,7 @@ void set_report(uint16_t hid_cid, hid_report_type_t report_type, int report_size
 /// @param report_size size in bytes (should be 1)
 /// @param report the report bytes
 ///
-/// The report is one byte. The high-half is the command, the low-half the parameter.
-/// 
-/// 0x[0][1]: fire the solenoid once
-/// 0x[1][k]: set solenoid mode: k=0,1,2,3 (pigun_recoilmode_t)
+/// The report is one byte, see pigun_hid_command.
 void set_data(uint16_t hid_cid, hid_report_type_t report_type, uint16_t report_id, int report_size, uint8_t *report){
 	
 	printf("Host HID output DATA:\n");
@@ -281,22 +562,8 @@ void set_data(uint16_t hid_cid, hid_report_type_t report_type, uint16_t report_i
 	}
 	printf("\n");
 
-	uint8_t cmd = report[0]>>4;
-	uint8_t par = report[0] & 0x0F;
-	if(cmd == 1){ // set recoil mode
-		if(par >= 0 && par <= RECOIL_OFF){
-			pigun.recoilMode = par;
-			printf("PIGUN-HID: recoil mode is now %i\n", par);
-		}
-		else
-			printf("PIGUN-HID: invalid recoil mode [%i]\n", par);
-	}else if(cmd == 0){
-		if(par == 1 && pigun.recoilMode == RECOIL_HID)
-			pigun_recoil_fire();
-	}
-	else{
-		printf("PIGUN-HID: invalid data %x\n",report[0]);
-	}
+	if (report_size < 1) return;
+	pigun_hid_command(report[0]);
 }
 
 
@@ -314,6 +581,7 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 	case BTSTACK_EVENT_STATE:
 		if (btstack_event_state_get_state(packet) != HCI_STATE_WORKING) return;
 		app_state = APP_NOT_CONNECTED;
+		pigun_reconnect_start();
 		break;
 
 	case HCI_EVENT_USER_CONFIRMATION_REQUEST:
@@ -329,13 +597,13 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 		case HID_SUBEVENT_CONNECTION_OPENED:
 			status = hid_subevent_connection_opened_get_status(packet);
 			if (status != ERROR_CODE_SUCCESS) {
-				// outgoing connection failed
+				// outgoing connection failed: page the next host
 				printf("PIGUN-HID: connection failed, status 0x%x\n", status);
-				app_state = APP_NOT_CONNECTED;
-				hid_cid = 0;
-
-				// re-register timer
-				pigun_blinker_create(1, 1000, &blinker_autoconnect);
+				if (app_state != APP_CONNECTED) {
+					app_state = APP_NOT_CONNECTED;
+					hid_cid = 0;
+				}
+				pigun_reconnect_failed(status);
 				return;
 			}
 
@@ -344,62 +612,36 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 			bd_addr_t host_addr;
 			hid_subevent_connection_opened_get_bd_addr(packet, host_addr);
 
-			
-			// save the server address - if not already there
-			// rewrite the past servers list, putting the current one on top
-			// only write 3 of them
-			uint8_t isThere = 0;
-			for (int i = 0; i < pigun.nServers; i++) {
-				if (compare_servers(host_addr, pigun.servers[i])) {
-					isThere = 1;
-					break;
-				}
-			}
-			uint32_t ns = pigun.nServers;
-			if (!isThere) ns++;
-			if (ns > 3) ns = 3;
-			int written = 1;
-			bd_addr_t newlist[3];
-
-			FILE* fout = fopen("servers.bin", "wb");
-			fwrite(&ns, sizeof(int), 1, fout);
-			fwrite(host_addr, sizeof(bd_addr_t), 1, fout);
-			memcpy(newlist[0], host_addr, sizeof(bd_addr_t));
-
-			for (int i = 0; i < pigun.nServers; i++) {
-				if (!compare_servers(host_addr, pigun.servers[i])) {
-					fwrite(pigun.servers[i], sizeof(bd_addr_t), 1, fout);
-					memcpy(newlist[written], pigun.servers[i], sizeof(bd_addr_t));
-					written++;
-					if (written == 3) break;
-				}
-			}
-			fclose(fout);
-			memcpy(pigun.servers[0], newlist[0], sizeof(bd_addr_t)*3);
-			pigun.nServers = ns;
-			
+			// stop paging, and put this host on top of the list
+			pigun_reconnect_connected(host_addr);
+
 			// once connected turn off the green LED to save power
 			pigun_blinker_stop(blinkID_greenLED);
 			pigun_GPIO_output_set(PIN_OUT_AOK, 0); // make sure it turns off
 
 			printf("PIGUN-HID: connected to %s, pigunning now...\n", bd_addr_to_str(host_addr));
-			hid_device_request_can_send_now_event(hid_cid); // request a sendnow
+
+			// send the current report straight away, then only when it changes
+			pigun_hid_connected();
 			break;
 		case HID_SUBEVENT_CONNECTION_CLOSED:
 			printf("PIGUN-HID: disconnected\n");
 			app_state = APP_NOT_CONNECTED;
 			hid_cid = 0;
+			send_pending = 0;
+			telemetry_pending = 0;
+			pigun_timer_cancel(&keepalive_timer);
+			pigun_hid_disconnected();
 
-			// start blinking of the green LED again
+			// start blinking of the green LED again, and get the host back
 			blinkID_greenLED = pigun_blinker_create(0, 800, &blinker_connectLED);
+			pigun_reconnect_start();
 
 			break;
 		case HID_SUBEVENT_CAN_SEND_NOW:
-			// when the stack raises can_send_now event, we send a report... because we can!
-			send_report(); // uses the global variable with gun data
-
-			// and then we request another can_send_now because we are greedy! need to send moooar!
-			hid_device_request_can_send_now_event(hid_cid);
+			// send the report if it changed since the last one (or the keepalive is due)
+			// the next slot is requested when the report changes again
+			pigun_hid_send_slot();
 			break;
 
 		default:
@@ -415,6 +657,43 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
 
 
 
+/// @brief Sets up the report sending on a transport. Call from the BTstack thread, before it runs.
+/// @param t the transport: pigun_transport_bt or pigun_transport_usb.
+void pigun_hid_init(const pigun_transport_t* t) {
+
+	transport = t;
+	printf("PIGUN-HID: reports go out on %s\n", transport->name);
+
+	// the other threads wake up the run loop when the report changes
+	int efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0) printf("PIGUN-HID ERROR: unable to create the report eventfd\n");
+	else {
+		btstack_run_loop_set_data_source_fd(&report_source, efd);
+		btstack_run_loop_set_data_source_handler(&report_source, &report_changed);
+		btstack_run_loop_enable_data_source_callbacks(&report_source, DATA_SOURCE_CALLBACK_READ);
+		btstack_run_loop_add_data_source(&report_source);
+	}
+	pigun_timer_setup(&keepalive_timer, &report_keepalive, NULL);
+	pigun_timer_setup(&telemetry_timer, &telemetry_tick, NULL);
+
+	// the time to first report counts from here
+	down_since = pigun_now_us();
+}
+
+/// @brief The transport got connected: the current report goes out straight away, then only when it changes.
+void pigun_hid_connected() {
+	send_pending = 0;
+	send_forced = 1;
+	report_request();
+}
+
+/// @brief The transport lost the host: the time to first report of the next connection counts from now.
+void pigun_hid_disconnected() {
+	down_count++;
+	if (!down_since) down_since = pigun_now_us();
+}
+
+
 /* @section Main Application Setup
  *
  * @text Listing MainConfiguration shows main application code. 
@@ -435,8 +714,8 @@ int btstack_main(int argc, const char * argv[]) {
 	gap_set_class_of_device(0x2504);
 	// set local name to be identified - zeroes will be replaced by actual BD ADDR
 	gap_set_local_name("PiGun 1F"); // ("PiGun 00:00:00:00:00:00");
-	// allow for role switch in general and sniff mode
-	gap_set_default_link_policy_settings( LM_LINK_POLICY_ENABLE_ROLE_SWITCH | LM_LINK_POLICY_ENABLE_SNIFF_MODE );
+	// allow for role switch in general, sniff mode is only allowed while idle (see pigun-link.c)
+	gap_set_default_link_policy_settings( LM_LINK_POLICY_ENABLE_ROLE_SWITCH );
 	// allow for role switch on outgoing connections - this allow HID Host to become master when we re-connect to it
 	gap_set_allow_role_switch(true);
 
@@ -460,7 +739,7 @@ int btstack_main(int argc, const char * argv[]) {
 		hid_boot_device, 
 		0xFFFF, 0xFFFF, 3200,
 		hid_descriptor_joystick_mode,
-		sizeof(hid_descriptor_joystick_mode), 
+		hid_descriptor_joystick_mode_size, 
 		hid_device_name
 	};
 	
@@ -476,54 +755,40 @@ int btstack_main(int argc, const char * argv[]) {
 	sdp_register_service(device_id_sdp_service_buffer);
 
 	// HID Device
-	hid_device_init(hid_boot_device, sizeof(hid_descriptor_joystick_mode), hid_descriptor_joystick_mode);
+	hid_device_init(hid_boot_device, hid_descriptor_joystick_mode_size, hid_descriptor_joystick_mode);
 	
 	// register for HCI events
 	hci_event_callback_registration.callback = &packet_handler;
 	hci_add_event_handler(&hci_event_callback_registration);
 
+	// low latency link while in use, sniff when idle
+	pigun_link_init();
+
+	// page the known hosts as soon as the stack is up
+	pigun_reconnect_init();
+
 	// register for HID events
 	hid_device_register_packet_handler(&packet_handler);
 
 	// sign up for host output reports?
 	hid_device_register_set_report_callback(&set_report);
 	hid_device_register_report_data_callback(&set_data);
+	hid_device_register_report_request_callback(&get_report);
 
 	// turn on!
 	hci_power_control(HCI_POWER_ON);
 
-	// allocate blinkers
-	pigun_blinkers = (pigun_blinker_t*)calloc(10, sizeof(pigun_blinker_t));
+	// reports go out on bluetooth
+	pigun_hid_init(&pigun_transport_bt);
 
-	// read the previous server addresses from servers.bin
-	pigun_server_load();
-	
 	// start blinking of the green LED
 	blinkID_greenLED = pigun_blinker_create(0, 800, &blinker_connectLED);
 
-	// set one-shot timer for autoreconnect of there are servers in the list
-	if (pigun.nServers != 0)
-		pigun_blinker_create(1, 5000, &blinker_autoconnect);
-
 	return 0;
 }
 
 
 
-static void blinker_autoconnect(){
-	
-	// increment counter
-	static int snum = 0;
-
-	if (app_state == APP_NOT_CONNECTED && pigun.nServers != 0) {
-
-		// try connecting to a server
-		printf("PIGUN-HID: trying to connect to %s...\n", bd_addr_to_str(pigun.servers[snum]));
-		hid_device_connect(pigun.servers[snum], &hid_cid);
-
-		snum++; if (snum == pigun.nServers)snum = 0;
-	}
-}
 static void blinker_connectLED() {
 
 	static uint8_t s = 0;
@@ -1,10 +1,15 @@
 #include <stdint.h>
 
+#include "pigun-timing.h"
+#include "pigun-report.h"
+#include "pigun-timer.h"
+
 #ifndef PIGUN_HID
 #define PIGUN_HID
 
 
-#define PIGUN_REPORT_ID 0x03
+#define HID_KEEPALIVE 100	// default ms without changes before the report is sent again anyway
+#define HID_BLINKERS 10		// blinkers running at the same time, at most
 
 
 // data container for the HID joystick report
@@ -16,6 +21,34 @@ struct pigun_report_t {
 	uint8_t buttons;
 };
 
+/// @brief Report transmission counters.
+typedef struct {
+	uint32_t sent;			// reports sent
+	uint32_t suppressed;	// send slots where the report turned out to be the same as the last one sent
+	uint32_t coalesced;		// report changes merged in a later send
+	uint32_t keepalives;	// reports sent because nothing changed for a while
+	uint32_t telemetry;		// telemetry reports sent
+
+	uint32_t ttfr_start;	// ms from the start to the first report, 0 until it went out
+	uint32_t ttfr_last;		// ms from the last link loss to the first report after it
+	uint32_t ttfr_max;		// longest time to first report after a link loss, ms
+	uint32_t reconnects;	// link losses recovered
+} pigun_hid_stats_t;
+
+/// @brief A way to send the reports to the host.
+/// The sending logic asks for a slot with request, and the transport calls pigun_hid_send_slot when
+/// it can take a report. send gets the report starting with its ID, and returns 0 if it went out.
+typedef struct {
+	const char* name;
+	uint8_t (*connected)(void);
+	void (*request)(void);
+	int (*send)(const uint8_t* report, uint16_t size);
+} pigun_transport_t;
+
+extern const pigun_transport_t pigun_transport_bt;
+extern const uint8_t* const hid_descriptor_joystick_mode;
+extern const uint16_t hid_descriptor_joystick_mode_size;
+
 typedef struct pigun_blinker_t pigun_blinker_t;
 typedef void (*blinker_callback_t)(void);
 
@@ -24,10 +57,9 @@ struct pigun_blinker_t {
 	uint8_t 	active;
 	uint8_t 	nblinks;	// 0=infinite blinks
 	uint8_t 	counter;
-	uint8_t		cancelled;	// turn to 1 when pigun_blinker_stop is called
 	uint16_t 	timeout; 	// in ms
 
-	btstack_timer_source_t timer;
+	pigun_timer_t timer;	// periodic, the blinker is its context
 	blinker_callback_t callback;
 
 };
@@ -38,5 +70,22 @@ void* pigun_cycle(void*);
 int pigun_blinker_create(uint8_t nblinks, uint16_t timeout, blinker_callback_t callback);
 void pigun_blinker_stop(int bID);
 
+void pigun_report_set_aim(int16_t x, int16_t y, const pigun_frame_t* frame);
+void pigun_report_set_buttons(uint8_t buttons);
+void pigun_report_get(pigun_report_t* report, pigun_frame_t* aimed);
+
+void pigun_hid_init(const pigun_transport_t* t);
+void pigun_hid_connected(void);
+void pigun_hid_disconnected(void);
+void pigun_hid_send_slot(void);
+void pigun_hid_command(uint8_t data);
+
+void pigun_hid_signal(void);
+void pigun_hid_stats(pigun_hid_stats_t* stats);
+void pigun_hid_keepalive(uint16_t ms);
+uint16_t pigun_hid_get_keepalive(void);
+void pigun_hid_telemetry(uint16_t ms);
+uint16_t pigun_hid_get_telemetry(void);
+
 
 #endif
@@ -0,0 +1,234 @@
+/*
+* Bluetooth LE transport: HID over GATT (HOGP), started with pigun.exe --ble instead of classic HID.
+*
+* The HID service has the same report map as classic bluetooth, and the joystick reports go out as
+* notifications of its first input report. Many hosts let a LE HID device use a 7.5 ms connection
+* interval, with more regular timing than classic and much less power: pigun-link.c asks for it
+* while the gun is in use, and for a slower one when idle.
+* The HID service declares every report of the map: the host writes the data commands (recoil,
+* telemetry) in the output report 3, one byte as on classic, and the parameter requests
+* (pigun-param.c) in the feature report 5; hids_device passes both on with HIDS_SUBEVENT_SET_REPORT.
+* The telemetry report is declared but not sent on LE.
+* The PiGun service has the same two for hosts that talk GATT without a HID driver: the data
+* commands in its first characteristic, the parameter requests in the second, and reading the
+* second gives the answer of the last request.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack.h"
+
+#include "pigun.h"
+#include "pigun-gpio.h"
+#include "pigun-link.h"
+#include "pigun-timer.h"
+#include "pigun-hogp.h"
+#include "pigun-param.h"
+#include "pigun-hogp-db.h"	// made from pigun-hogp.gatt
+
+
+static btstack_packet_callback_registration_t hogp_hci_registration;
+static btstack_packet_callback_registration_t hogp_sm_registration;
+static pigun_timer_t hogp_stats_timer;
+static hci_con_handle_t hogp_handle = HCI_CON_HANDLE_INVALID;
+static uint8_t hogp_enabled = 0;	// the host enabled the input report notifications
+static uint32_t hogp_lastsent = 0;
+static int hogp_blinker = -1;
+static hids_device_report_t hogp_reports[HOGP_REPORTS];	// filled by hids_device from the Report characteristics
+
+static uint8_t hogp_adv_data[] = {
+	0x02, BLUETOOTH_DATA_TYPE_FLAGS, 0x06,
+	0x09, BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME, 'P', 'i', 'G', 'u', 'n', ' ', '1', 'F',
+	0x03, BLUETOOTH_DATA_TYPE_COMPLETE_LIST_OF_16_BIT_SERVICE_CLASS_UUIDS, 0x12, 0x18,
+	0x03, BLUETOOTH_DATA_TYPE_APPEARANCE, 0xC4, 0x03,	// joystick
+};
+
+
+// HOGP transport: the slot comes with the HIDS_SUBEVENT_CAN_SEND_NOW event
+static uint8_t hogp_connected() {
+	return hogp_handle != HCI_CON_HANDLE_INVALID && hogp_enabled;
+}
+
+static void hogp_request() {
+	hids_device_request_can_send_now_event(hogp_handle);
+}
+
+static int hogp_send(const uint8_t* report, uint16_t size) {
+
+	// the input report characteristic says the report ID already
+	if (report[0] != PIGUN_REPORT_ID) return 1;
+	hids_device_send_input_report(hogp_handle, &report[1], size - 1);
+	return 0;
+}
+
+const pigun_transport_t pigun_transport_hogp = { "bluetooth LE", &hogp_connected, &hogp_request, &hogp_send };
+
+
+static void hogp_blink() {
+
+	static uint8_t s = 0;
+	if (hogp_connected()) return;
+	s = (s) ? 0 : 1;
+	pigun_GPIO_output_set(PIN_OUT_AOK, s);
+}
+
+// logs the report rate against the connection interval
+static void hogp_stats(pigun_timer_t* timer) {
+	UNUSED(timer);
+
+	pigun_hid_stats_t hs;
+	pigun_hid_stats(&hs);
+
+	if (hogp_connected()) {
+		pigun_link_info_t li;
+		pigun_link_info(&li);
+		printf("PIGUN-HOGP: %.1f reports/s, interval %.2f ms latency %u\n",
+			(hs.sent - hogp_lastsent) * 1000.0f / HOGP_STATS, li.le_interval * 1.25f, li.le_latency);
+	}
+	hogp_lastsent = hs.sent;
+}
+
+
+static uint16_t hogp_att_read(hci_con_handle_t con_handle, uint16_t att_handle, uint16_t offset, uint8_t* buffer, uint16_t buffer_size) {
+	UNUSED(con_handle);
+
+	if (att_handle != ATT_CHARACTERISTIC_50494755_4E02_4000_A000_000000000000_01_VALUE_HANDLE) return 0;
+
+	uint8_t answer[HID_PARAM_SIZE];
+	pigun_param_answer(answer);
+	return att_read_callback_handle_blob(answer, sizeof(answer), offset, buffer, buffer_size);
+}
+
+static int hogp_att_write(hci_con_handle_t con_handle, uint16_t att_handle, uint16_t transaction_mode, uint16_t offset, uint8_t* buffer, uint16_t buffer_size) {
+	UNUSED(con_handle);
+	UNUSED(offset);
+
+	if (transaction_mode != ATT_TRANSACTION_MODE_NONE) return 0;
+	if (att_handle == ATT_CHARACTERISTIC_50494755_4E02_4000_A000_000000000000_01_VALUE_HANDLE) {
+		pigun_param_request(buffer, buffer_size);
+		return 0;
+	}
+	if (att_handle != ATT_CHARACTERISTIC_50494755_4E01_4000_A000_000000000000_01_VALUE_HANDLE) return 0;
+	if (buffer_size != 1) return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+
+	pigun_hid_command(buffer[0]);
+	return 0;
+}
+
+
+static void hogp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packet, uint16_t size) {
+	UNUSED(channel);
+	UNUSED(size);
+
+	if (packet_type != HCI_EVENT_PACKET) return;
+
+	switch (hci_event_packet_get_type(packet)) {
+
+	case HCI_EVENT_DISCONNECTION_COMPLETE:
+		if (hci_event_disconnection_complete_get_connection_handle(packet) != hogp_handle) break;
+		printf("PIGUN-HOGP: disconnected\n");
+		hogp_handle = HCI_CON_HANDLE_INVALID;
+		if (hogp_enabled) {
+			hogp_blinker = pigun_blinker_create(0, 800, &hogp_blink);
+			pigun_hid_disconnected();
+		}
+		hogp_enabled = 0;
+		break;
+
+	case SM_EVENT_JUST_WORKS_REQUEST:
+		sm_just_works_confirm(sm_event_just_works_request_get_handle(packet));
+		break;
+
+	case HCI_EVENT_HIDS_META:
+		switch (hci_event_hids_meta_get_subevent_code(packet)) {
+
+		case HIDS_SUBEVENT_INPUT_REPORT_ENABLE:
+			hogp_handle = hids_subevent_input_report_enable_get_con_handle(packet);
+			if (hogp_enabled == hids_subevent_input_report_enable_get_enable(packet)) break;
+			hogp_enabled = hids_subevent_input_report_enable_get_enable(packet);
+			printf("PIGUN-HOGP: input reports %s\n", hogp_enabled ? "enabled, pigunning now..." : "disabled");
+			if (!hogp_enabled) {
+				hogp_blinker = pigun_blinker_create(0, 800, &hogp_blink);
+				pigun_hid_disconnected();
+				break;
+			}
+
+			pigun_blinker_stop(hogp_blinker);
+			pigun_GPIO_output_set(PIN_OUT_AOK, 0);
+			pigun_hid_connected();
+			break;
+
+		case HIDS_SUBEVENT_CAN_SEND_NOW:
+			pigun_hid_send_slot();
+			break;
+
+		// the host wrote the output or the feature report
+		case HIDS_SUBEVENT_SET_REPORT: {
+			uint8_t id = hids_subevent_set_report_get_report_id(packet);
+			uint8_t length = hids_subevent_set_report_get_report_length(packet);
+			const uint8_t* data = hids_subevent_set_report_get_report_data(packet);
+			switch (hids_subevent_set_report_get_report_type(packet)) {
+			case HID_REPORT_TYPE_OUTPUT:
+				if (id == PIGUN_REPORT_ID && length == 1) pigun_hid_command(data[0]);
+				break;
+			case HID_REPORT_TYPE_FEATURE:
+				if (id == PIGUN_PARAM_ID) pigun_param_request(data, length);
+				break;
+			default:
+				break;
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/// @brief Starts the HID device on bluetooth LE. Replaces btstack_main in HOGP mode.
+void pigun_hogp_main() {
+
+	l2cap_init();
+
+	// just works pairing with bonding, like a mouse
+	sm_init();
+	sm_set_io_capabilities(IO_CAPABILITY_NO_INPUT_NO_OUTPUT);
+	sm_set_authentication_requirements(SM_AUTHREQ_SECURE_CONNECTION | SM_AUTHREQ_BONDING);
+
+	att_server_init(profile_data, &hogp_att_read, &hogp_att_write);
+	battery_service_server_init(100);
+	device_information_service_server_init();
+	hids_device_init_with_storage(0, hid_descriptor_joystick_mode, hid_descriptor_joystick_mode_size, HOGP_REPORTS, hogp_reports);
+
+	// advertise as a joystick with the HID service
+	bd_addr_t null_addr;
+	memset(null_addr, 0, 6);
+	gap_advertisements_set_params(HOGP_ADV_INTERVAL, HOGP_ADV_INTERVAL, 0, 0, null_addr, 0x07, 0x00);
+	gap_advertisements_set_data(sizeof(hogp_adv_data), hogp_adv_data);
+	gap_advertisements_enable(1);
+
+	hogp_hci_registration.callback = &hogp_packet_handler;
+	hci_add_event_handler(&hogp_hci_registration);
+	hogp_sm_registration.callback = &hogp_packet_handler;
+	sm_add_event_handler(&hogp_sm_registration);
+	hids_device_register_packet_handler(&hogp_packet_handler);
+
+	// fast connection interval while in use, slower when idle
+	pigun_link_init();
+
+	hci_power_control(HCI_POWER_ON);
+
+	pigun_hid_init(&pigun_transport_hogp);
+	hogp_blinker = pigun_blinker_create(0, 800, &hogp_blink);
+
+	pigun_timer_setup(&hogp_stats_timer, &hogp_stats, NULL);
+	pigun_timer_start(&hogp_stats_timer, HOGP_STATS * 1000, HOGP_STATS * 1000);
+}
@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+#include "pigun-hid.h"
+
+#ifndef PIGUN_HOGP
+#define PIGUN_HOGP
+
+
+#define HOGP_ADV_INTERVAL 0x0030	// advertising interval, in units of 0.625 ms (30 ms)
+#define HOGP_STATS 10000			// ms between two logs of the report rate
+#define HOGP_REPORTS 4				// Report characteristics in the HID service (pigun-hogp.gatt)
+
+
+extern const pigun_transport_t pigun_transport_hogp;
+
+void pigun_hogp_main(void);
+
+
+#endif
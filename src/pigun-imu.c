@@ -0,0 +1,208 @@
+/*
+* Optional gyro (MPU-6050 class, on I2C) for aim updates between camera frames.
+* Build with PIGUN_GYRO to use it.
+*
+* A thread samples the gyro at IMU_RATE and feeds the fusion core (pigun-fusion.c), the camera
+* thread feeds it the aim of each frame. While the fusion is usable, the gyro thread writes the
+* fused aim in the HID report at the gyro rate, and the camera only corrects the drift.
+* If the gyro fails, or the camera loses the beacons for too long, the camera thread takes over again.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+
+#include "pigun.h"
+#include "pigun-imu.h"
+#include "pigun-fusion.h"
+#include "pigun-pose.h"
+
+
+// MPU-6050 registers
+#define MPU_SMPLRT_DIV 0x19
+#define MPU_CONFIG 0x1A
+#define MPU_GYRO_CONFIG 0x1B
+#define MPU_GYRO_XOUT_H 0x43
+#define MPU_PWR_MGMT_1 0x6B
+#define MPU_WHO_AM_I 0x75
+
+
+static int imu_fd = -1;
+static pthread_t imu_thread;
+static volatile int imu_running = 0;
+static volatile int imu_ready = 0;		// 1 while the gyro thread produces samples
+static int imu_owner = 0;				// 1 while the gyro thread writes the aim (changed by the camera thread)
+
+static pigun_fusion_t imu_fusion;
+static pthread_mutex_t imu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int imu_write(uint8_t reg, uint8_t value) {
+	uint8_t buf[2] = { reg, value };
+	return (write(imu_fd, buf, 2) == 2) ? 0 : 1;
+}
+
+static int imu_read(uint8_t reg, uint8_t* data, int n) {
+	if (write(imu_fd, &reg, 1) != 1) return 1;
+	return (read(imu_fd, data, n) == n) ? 0 : 1;
+}
+
+// reads the 3 gyro axes, in rad/s
+static int imu_gyro(float* rates) {
+
+	uint8_t data[6];
+	if (imu_read(MPU_GYRO_XOUT_H, data, 6)) return 1;
+	for (int i = 0; i < 3; i++) {
+		int16_t raw = (int16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+		rates[i] = raw / IMU_GYRO_SCALE * (float)(M_PI / 180);
+	}
+	return 0;
+}
+
+
+static void* imu_cycle(void* nullargs) {
+
+	float rates[3], bias[3] = { 0, 0, 0 };
+	int errors = 0;
+
+	// gyro bias: average of the first samples, with the gun still
+	for (int i = 0; i < IMU_BIAS_SAMPLES && imu_running; i++) {
+		if (imu_gyro(rates) == 0)
+			for (int k = 0; k < 3; k++) bias[k] += rates[k] / IMU_BIAS_SAMPLES;
+		usleep(1000000 / IMU_RATE);
+	}
+	printf("PIGUN: gyro bias %f %f %f rad/s\n", bias[0], bias[1], bias[2]);
+	imu_ready = 1;
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (imu_running) {
+
+		next.tv_nsec += 1000000000 / IMU_RATE;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		if (imu_gyro(rates)) {
+			if (++errors == IMU_MAXERRORS) {
+				printf("PIGUN ERROR: gyro not responding, going back to camera only\n");
+				break;
+			}
+			continue;
+		}
+		errors = 0;
+		int64_t t = pigun_now_us();
+
+		// rotation rates -> boresight motion on the image
+		float yaw = IMU_YAW_SIGN * (rates[IMU_YAW_AXIS] - bias[IMU_YAW_AXIS]);
+		float pitch = IMU_PITCH_SIGN * (rates[IMU_PITCH_AXIS] - bias[IMU_PITCH_AXIS]);
+
+		// the report is written under the lock, so the camera thread never writes it at the same time
+		float x, y;
+		pthread_mutex_lock(&imu_mutex);
+		pigun_fusion_gyro(&imu_fusion, t, POSE_FX * yaw, POSE_FY * pitch);
+		if (imu_owner && pigun_fusion_aim(&imu_fusion, t, &x, &y) == 0)
+			pigun_aim_output(x, y, NULL);
+		pthread_mutex_unlock(&imu_mutex);
+	}
+
+	imu_ready = 0;
+	return NULL;
+}
+
+
+/// @brief Opens the gyro and starts sampling it.
+/// @return 0 if everything went fine, otherwise the aim comes from the camera only.
+int pigun_imu_init() {
+
+	imu_fd = open(IMU_DEVICE, O_RDWR);
+	if (imu_fd < 0) {
+		printf("PIGUN ERROR: unable to open %s\n", IMU_DEVICE);
+		return 1;
+	}
+
+	uint8_t id = 0;
+	if (ioctl(imu_fd, I2C_SLAVE, IMU_ADDRESS) < 0 || imu_read(MPU_WHO_AM_I, &id, 1) || (id & 0x7E) != 0x68) {
+		printf("PIGUN ERROR: no gyro found at 0x%02x\n", IMU_ADDRESS);
+		close(imu_fd);
+		imu_fd = -1;
+		return 1;
+	}
+
+	// wake up with the gyro clock, 1 kHz internal rate with ~100 Hz low-pass, +-500 deg/s
+	int error = imu_write(MPU_PWR_MGMT_1, 0x01);
+	error |= imu_write(MPU_SMPLRT_DIV, 0x00);
+	error |= imu_write(MPU_CONFIG, 0x02);
+	error |= imu_write(MPU_GYRO_CONFIG, 0x08);
+	if (error) {
+		printf("PIGUN ERROR: unable to configure the gyro\n");
+		close(imu_fd);
+		imu_fd = -1;
+		return 1;
+	}
+
+	pigun_fusion_init(&imu_fusion);
+	imu_running = 1;
+	if (pthread_create(&imu_thread, NULL, imu_cycle, NULL) != 0) {
+		printf("PIGUN ERROR: unable to start the gyro thread\n");
+		imu_running = 0;
+		close(imu_fd);
+		imu_fd = -1;
+		return 1;
+	}
+
+	printf("PIGUN: gyro started at %i Hz, keep the gun still for a moment\n", IMU_RATE);
+	return 0;
+}
+
+void pigun_imu_stop() {
+
+	if (!imu_running) return;
+	imu_running = 0;
+	pthread_join(imu_thread, NULL);
+	close(imu_fd);
+	imu_fd = -1;
+}
+
+
+/// @brief Keeps the gyro thread from writing the aim, while the settings it uses change
+/// (filter, calibration). Cheap when there is no gyro.
+void pigun_imu_lock() {
+	pthread_mutex_lock(&imu_mutex);
+}
+
+void pigun_imu_unlock() {
+	pthread_mutex_unlock(&imu_mutex);
+}
+
+
+/// @brief Passes the camera aim of one frame to the fusion.
+/// Called by the camera thread for each good frame.
+/// @param t_sensor sensor timestamp of the frame, in us.
+/// @param x normalised aim.
+/// @param y normalised aim.
+/// @param H homography of the frame, row-major 3x3.
+/// @param bcol boresight pixel column.
+/// @param brow boresight pixel row.
+/// @return 1 if the gyro thread writes the aim in the report, 0 if the camera should do it.
+int pigun_imu_camera(int64_t t_sensor, float x, float y, const float* H, float bcol, float brow) {
+
+	// only this thread hands the report over, under the lock, so there is always one writer of the aim
+	pthread_mutex_lock(&imu_mutex);
+	if (imu_running) pigun_fusion_camera(&imu_fusion, t_sensor, x, y, H, bcol, brow);
+	imu_owner = imu_running && imu_ready;
+	int owner = imu_owner;
+	pthread_mutex_unlock(&imu_mutex);
+
+	return owner;
+}
@@ -0,0 +1,33 @@
+#include <stdint.h>
+
+#ifndef PIGUN_IMU
+#define PIGUN_IMU
+
+
+#define IMU_DEVICE "/dev/i2c-1"
+#define IMU_ADDRESS 0x68		// MPU-6050 with AD0 low
+#define IMU_RATE 500			// gyro samples per second
+#define IMU_BIAS_SAMPLES 500	// samples averaged at startup for the gyro bias (the gun should be still)
+#define IMU_MAXERRORS 10		// consecutive read errors before the IMU is given up
+#define IMU_GYRO_SCALE 65.5f	// LSB per deg/s, at +-500 deg/s full scale
+
+// how the gyro is mounted: axis (0=x, 1=y, 2=z) and sign giving the yaw rate (turning right)
+// and the pitch rate (nose down). The default is the chip flat, x towards the muzzle, z up.
+#ifndef IMU_YAW_AXIS
+#define IMU_YAW_AXIS 2
+#define IMU_YAW_SIGN -1
+#endif
+#ifndef IMU_PITCH_AXIS
+#define IMU_PITCH_AXIS 1
+#define IMU_PITCH_SIGN 1
+#endif
+
+
+int pigun_imu_init(void);
+void pigun_imu_stop(void);
+void pigun_imu_lock(void);
+void pigun_imu_unlock(void);
+int pigun_imu_camera(int64_t t_sensor, float x, float y, const float* H, float bcol, float brow);
+
+
+#endif
@@ -0,0 +1,238 @@
+/*
+* Button input thread: edge events from the GPIO character device, debounced in time.
+*
+* The kernel timestamps each edge in its interrupt. The first edge after a quiet period is taken
+* right away (a press is reported at the first contact, not after the bouncing), then the button
+* is locked for the debounce time: the edges in between are only noted, and when the lock ends the
+* level is read again and taken if it changed, timed by the last edge noted (when the level got
+* there, as far as we know) rather than by the read. The state goes in the HID report as soon as
+* it changes, so a trigger pull does not wait for the next camera frame.
+*
+* The camera thread still runs the button actions (service mode, calibration, recoil): it takes the
+* state and the presses collected since the last frame with pigun_input_take.
+* If the character device is not there, pigun_buttons_process polls the pins once per frame as before.
+*/
+
+#define _GNU_SOURCE	// ppoll
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include <bcm2835.h>
+
+#include "pigun.h"
+#include "pigun-gpio.h"
+#include "pigun-input.h"
+
+
+static int input_fd = -1;
+static pthread_t input_thread;
+static volatile int input_running = 0;
+static volatile uint32_t input_debounce = INPUT_DEBOUNCE;
+
+// input thread only
+static uint16_t input_state = 0;			// debounced state, bit i = button i pressed
+static uint16_t input_dirty = 0;			// edges seen while locked: the level is read when the lock ends
+static int64_t input_changed[PIGUN_BUTTONS];	// time of the last change taken, us
+static int64_t input_lastedge[PIGUN_BUTTONS];	// kernel time of the last edge seen while locked, us
+
+// shared with the camera thread
+static uint16_t input_shared_state = 0;
+static uint16_t input_newpress = 0;			// presses not taken yet
+
+
+// takes a change of button i
+static void input_change(int i, uint8_t pressed, int64_t t) {
+
+	uint16_t bit = (uint16_t)(1 << i);
+	if (pressed) input_state |= bit;
+	else input_state &= ~bit;
+	input_changed[i] = t;
+
+	__atomic_store_n(&input_shared_state, input_state, __ATOMIC_RELEASE);
+	if (pressed) __atomic_fetch_or(&input_newpress, bit, __ATOMIC_RELEASE);
+	pigun_report_set_buttons((uint8_t)input_state);
+
+	// kernel timestamp to report hand-off
+	pigun_latency_add(&pigun.timing.button, pigun_now_us() - t);
+}
+
+static void input_edge(const struct gpio_v2_line_event* ev) {
+
+	int i = 0;
+	while (i < PIGUN_BUTTONS && pigun_button_pin[i] != (int)ev->offset) i++;
+	if (i == PIGUN_BUTTONS) return;
+
+	int64_t t = (int64_t)(ev->timestamp_ns / 1000);
+	uint16_t bit = (uint16_t)(1 << i);
+
+	// bouncing: look at the level when the lock ends
+	if (t - input_changed[i] < input_debounce) {
+		input_dirty |= bit;
+		input_lastedge[i] = t;
+		return;
+	}
+
+	// the lines are active low: rising is a press
+	uint8_t pressed = (ev->id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+	if (pressed != ((input_state & bit) != 0)) input_change(i, pressed, t);
+}
+
+// reads the level of the buttons whose lock ended with edges in it, returns the us to the next lock end
+static int64_t input_settle(int64_t now) {
+
+	int64_t next = -1;
+	if (!input_dirty) return next;
+
+	struct gpio_v2_line_values values;
+	values.mask = (1 << PIGUN_BUTTONS) - 1;
+	if (ioctl(input_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) return next;
+
+	for (int i = 0; i < PIGUN_BUTTONS; i++) {
+		uint16_t bit = (uint16_t)(1 << i);
+		if (!(input_dirty & bit)) continue;
+
+		int64_t left = input_changed[i] + input_debounce - now;
+		if (left > 0) {
+			if (next < 0 || left < next) next = left;
+			continue;
+		}
+		input_dirty &= ~bit;
+		uint8_t pressed = (values.bits >> i) & 1;
+		if (pressed != ((input_state & bit) != 0)) {
+			input_change(i, pressed, input_lastedge[i]);
+			// a change starts a new lock from that edge: check once more at its end
+			input_dirty |= bit;
+			left = input_lastedge[i] + input_debounce - now;
+			if (left < 0) left = 0;
+			if (next < 0 || left < next) next = left;
+		}
+	}
+	return next;
+}
+
+static void* input_cycle(void* nullargs) {
+
+	struct gpio_v2_line_event events[INPUT_EVENTS];
+
+	while (input_running) {
+
+		// wake up for the edges, at the end of a lock, and now and then to see if we should stop
+		int64_t wait = input_settle(pigun_now_us());
+		if (wait < 0 || wait > 100000) wait = 100000;
+		struct timespec timeout = { 0, (long)wait * 1000 };
+
+		struct pollfd pfd = { input_fd, POLLIN, 0 };
+		int r = ppoll(&pfd, 1, &timeout, NULL);
+		if (r < 0 && errno != EINTR) {
+			// back to the polling, which needs the bcm2835 edge detection
+			printf("PIGUN ERROR: button events stopped (%s), buttons polled at each frame\n", strerror(errno));
+			for (int i = 0; i < PIGUN_BUTTONS; i++) bcm2835_gpio_fen(pigun_button_pin[i]);
+			break;
+		}
+		if (r <= 0) continue;
+
+		ssize_t n = read(input_fd, events, sizeof(events));
+		for (int k = 0; k < n / (ssize_t)sizeof(struct gpio_v2_line_event); k++)
+			input_edge(&events[k]);
+	}
+
+	input_running = 0;
+	return NULL;
+}
+
+
+/// @brief Requests the button lines with edge events and starts the input thread.
+/// @param chip GPIO character device, e.g. INPUT_CHIP (or a gpio-sim chip to test).
+/// @return 0 if everything went fine, otherwise the buttons are polled at each frame.
+int pigun_input_init(const char* chip) {
+
+	int fd = open(chip, O_RDONLY);
+	if (fd < 0) {
+		printf("PIGUN ERROR: unable to open %s (%s), buttons polled at each frame\n", chip, strerror(errno));
+		return 1;
+	}
+
+	// the kernel owns the edge detection now: the bcm2835 one would steal its events
+	for (int i = 0; i < PIGUN_BUTTONS; i++) bcm2835_gpio_clr_fen(pigun_button_pin[i]);
+
+	struct gpio_v2_line_request req;
+	memset(&req, 0, sizeof(req));
+	for (int i = 0; i < PIGUN_BUTTONS; i++) req.offsets[i] = pigun_button_pin[i];
+	req.num_lines = PIGUN_BUTTONS;
+	req.event_buffer_size = INPUT_EVENTS * PIGUN_BUTTONS;
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_ACTIVE_LOW | GPIO_V2_LINE_FLAG_BIAS_PULL_UP
+		| GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	strncpy(req.consumer, "pigun", sizeof(req.consumer) - 1);
+
+	int r = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+	close(fd);
+	if (r < 0) {
+		printf("PIGUN ERROR: unable to request the button lines on %s (%s), buttons polled at each frame\n", chip, strerror(errno));
+		for (int i = 0; i < PIGUN_BUTTONS; i++) bcm2835_gpio_fen(pigun_button_pin[i]);
+		return 1;
+	}
+	input_fd = req.fd;
+
+	// start from the current levels, without presses
+	struct gpio_v2_line_values values;
+	values.mask = (1 << PIGUN_BUTTONS) - 1;
+	values.bits = 0;
+	ioctl(input_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values);
+	input_state = (uint16_t)values.bits;
+	input_shared_state = input_state;
+	memset(input_changed, 0, sizeof(input_changed));
+	memset(input_lastedge, 0, sizeof(input_lastedge));
+
+	input_running = 1;
+	if (pthread_create(&input_thread, NULL, input_cycle, NULL) != 0) {
+		printf("PIGUN ERROR: unable to start the input thread\n");
+		input_running = 0;
+		close(input_fd);
+		input_fd = -1;
+		return 1;
+	}
+
+	printf("PIGUN: button events from %s, debounce %u us\n", chip, input_debounce);
+	return 0;
+}
+
+void pigun_input_stop() {
+
+	if (input_fd < 0) return;
+	input_running = 0;
+	pthread_join(input_thread, NULL);
+	close(input_fd);
+	input_fd = -1;
+}
+
+/// @brief Tells if the buttons come from the input thread.
+uint8_t pigun_input_running() {
+	return input_running;
+}
+
+/// @brief Gets the button state and the presses since the last call. Called by the camera thread.
+/// @param state output debounced state.
+/// @param newpress output buttons pressed since the last call.
+void pigun_input_take(uint16_t* state, uint16_t* newpress) {
+
+	*newpress = __atomic_exchange_n(&input_newpress, 0, __ATOMIC_ACQUIRE);
+	*state = __atomic_load_n(&input_shared_state, __ATOMIC_ACQUIRE);
+}
+
+/// @brief Sets the debounce time.
+void pigun_input_debounce(uint32_t us) {
+	input_debounce = us;
+}
+
+uint32_t pigun_input_get_debounce() {
+	return input_debounce;
+}
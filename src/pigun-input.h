@@ -0,0 +1,22 @@
+#include <stdint.h>
+
+#ifndef PIGUN_INPUT
+#define PIGUN_INPUT
+
+
+#define INPUT_CHIP "/dev/gpiochip0"	// GPIO character device of the buttons (the line offsets are the BCM numbers)
+#define INPUT_DEBOUNCE 5000			// default us a button stays locked after a change
+#define INPUT_MAXDEBOUNCE 50000		// longest debounce allowed, us
+#define INPUT_EVENTS 16				// edge events read at once
+
+
+int pigun_input_init(const char* chip);
+void pigun_input_stop(void);
+uint8_t pigun_input_running(void);
+void pigun_input_take(uint16_t* state, uint16_t* newpress);
+
+void pigun_input_debounce(uint32_t us);
+uint32_t pigun_input_get_debounce(void);
+
+
+#endif
@@ -0,0 +1,331 @@
+/*
+* Bluetooth link tuning.
+*
+* While the gun is in use, the ACL link to the host runs a low latency profile: sniff mode disabled,
+* a guaranteed QoS with a short latency requested, and a short automatic flush timeout, so that a
+* report the radio could not deliver in time is dropped instead of delaying the newer ones.
+* After LINK_IDLE ms without aim/button changes, sniff is allowed again and requested to save power;
+* the next change brings the link back to active mode.
+*
+* The commands are queued and sent one at a time when the controller can take them. Mode changes,
+* QoS results and the flush timeout read back from the controller are logged.
+*
+* On a bluetooth LE connection (HOGP mode) the same idea goes through the connection parameters:
+* the shortest interval and no slave latency while in use, a longer interval with some latency when idle.
+* All of this runs in the BTstack thread.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack.h"
+
+#include "pigun-link.h"
+#include "pigun-timer.h"
+
+
+// HCI command descriptors not exported by every BTstack version
+// all link policy commands are OGF 0x02: with 0x01 (link control) 0x0003/0x0004 are the periodic inquiry ones
+#define LINK_OPCODE(ogf, ocf) (((ogf) << 10) | (ocf))
+
+static const hci_cmd_t link_cmd_write_policy = { LINK_OPCODE(0x02, 0x000D), "H2" };		// handle, link policy settings
+static const hci_cmd_t link_cmd_qos_setup = { LINK_OPCODE(0x02, 0x0007), "H114444" };	// handle, flags, service type, token rate, peak bandwidth, latency, delay variation
+static const hci_cmd_t link_cmd_sniff = { LINK_OPCODE(0x02, 0x0003), "H2222" };			// handle, max/min interval, attempt, timeout
+static const hci_cmd_t link_cmd_exit_sniff = { LINK_OPCODE(0x02, 0x0004), "H" };			// handle
+static const hci_cmd_t link_cmd_write_flush = { LINK_OPCODE(0x03, 0x0028), "H2" };		// handle, flush timeout
+static const hci_cmd_t link_cmd_read_flush = { LINK_OPCODE(0x03, 0x0027), "H" };			// handle
+
+#define LINK_POLICY_ACTIVE 0x0001	// role switch only
+#define LINK_POLICY_IDLE 0x0005		// role switch and sniff
+#define LINK_SERVICE_GUARANTEED 0x02
+#define LINK_RATE 2000				// token rate and peak bandwidth requested, in bytes/s (~200 reports/s)
+#define LINK_POLL 1000				// idle check period when the idle time is 0, in ms
+
+
+// commands waiting to be sent, in the order they go out
+enum {
+	LINK_CMD_EXIT_SNIFF = 0x01,
+	LINK_CMD_POLICY_ACTIVE = 0x02,
+	LINK_CMD_QOS = 0x04,
+	LINK_CMD_WRITE_FLUSH = 0x08,
+	LINK_CMD_READ_FLUSH = 0x10,
+	LINK_CMD_POLICY_IDLE = 0x20,
+	LINK_CMD_SNIFF = 0x40
+};
+#define LINK_CMDS_ACTIVE (LINK_CMD_EXIT_SNIFF | LINK_CMD_POLICY_ACTIVE | LINK_CMD_QOS | LINK_CMD_WRITE_FLUSH | LINK_CMD_READ_FLUSH)
+#define LINK_CMDS_IDLE (LINK_CMD_POLICY_IDLE | LINK_CMD_SNIFF)
+
+
+static btstack_packet_callback_registration_t link_callback_registration;
+static pigun_timer_t link_idle_timer;
+static pigun_link_info_t link;
+static uint8_t link_pending = 0;
+static uint32_t link_idle_ms = LINK_IDLE;
+static uint32_t link_t_activity = 0;
+
+
+// sends the next queued command, if the controller can take it
+static void link_commands_run() {
+
+	if (link.handle == HCI_CON_HANDLE_INVALID) {
+		link_pending = 0;
+		return;
+	}
+
+	while (link_pending && hci_can_send_command_packet_now()) {
+
+		uint8_t cmd = link_pending & (~link_pending + 1);	// lowest bit first
+		link_pending &= ~cmd;
+
+		switch (cmd) {
+		case LINK_CMD_EXIT_SNIFF:
+			if (link.mode != LINK_MODE_SNIFF) continue;
+			hci_send_cmd(&link_cmd_exit_sniff, link.handle);
+			break;
+		case LINK_CMD_POLICY_ACTIVE:
+			hci_send_cmd(&link_cmd_write_policy, link.handle, LINK_POLICY_ACTIVE);
+			break;
+		case LINK_CMD_QOS:
+			hci_send_cmd(&link_cmd_qos_setup, link.handle, 0, LINK_SERVICE_GUARANTEED, LINK_RATE, LINK_RATE, LINK_LATENCY, LINK_LATENCY);
+			break;
+		case LINK_CMD_WRITE_FLUSH:
+			hci_send_cmd(&link_cmd_write_flush, link.handle, LINK_FLUSH);
+			break;
+		case LINK_CMD_READ_FLUSH:
+			hci_send_cmd(&link_cmd_read_flush, link.handle);
+			break;
+		case LINK_CMD_POLICY_IDLE:
+			hci_send_cmd(&link_cmd_write_policy, link.handle, LINK_POLICY_IDLE);
+			break;
+		case LINK_CMD_SNIFF:
+			if (link.mode == LINK_MODE_SNIFF) continue;
+			hci_send_cmd(&link_cmd_sniff, link.handle, LINK_SNIFF_MAX, LINK_SNIFF_MIN, LINK_SNIFF_ATTEMPT, LINK_SNIFF_TIMEOUT);
+			break;
+		}
+		return; // one at a time, the next goes with the command complete/status event
+	}
+}
+
+// LE: asks the host for the connection parameters of the profile
+static void link_le_request() {
+
+	if (link.lowlatency)
+		gap_request_connection_parameter_update(link.handle, LINK_LE_FAST, LINK_LE_FAST, 0, LINK_LE_TIMEOUT);
+	else
+		gap_request_connection_parameter_update(link.handle, LINK_LE_IDLE_MIN, LINK_LE_IDLE_MAX, LINK_LE_IDLE_LATENCY, LINK_LE_TIMEOUT);
+}
+
+// switches between the low latency and the idle profile
+static void link_profile(uint8_t lowlatency) {
+
+	link.lowlatency = lowlatency;
+	if (link.le) {
+		printf("PIGUN-HID: link %s\n", lowlatency ? "in low latency profile" : "idle, slower interval");
+		link_le_request();
+		return;
+	}
+	if (lowlatency) {
+		link_pending = (link_pending & ~LINK_CMDS_IDLE) | LINK_CMD_EXIT_SNIFF | LINK_CMD_POLICY_ACTIVE;
+		printf("PIGUN-HID: link in low latency profile\n");
+	}
+	else {
+		link_pending = (link_pending & ~LINK_CMDS_ACTIVE) | LINK_CMDS_IDLE;
+		printf("PIGUN-HID: link idle, sniff allowed\n");
+	}
+	link_commands_run();
+}
+
+static void link_idle_arm(uint32_t ms) {
+	if (link.handle == HCI_CON_HANDLE_INVALID) pigun_timer_cancel(&link_idle_timer);
+	else pigun_timer_start(&link_idle_timer, ((ms == 0) ? LINK_POLL : ms) * 1000, 0);
+}
+
+// checks for idle: the timer is not moved at every report, it is re-armed for the remaining time
+static void link_idle_check(pigun_timer_t* timer) {
+	UNUSED(timer);
+
+	if (!link.lowlatency) return;
+
+	uint32_t idle = link_idle_ms;
+	uint32_t elapsed = btstack_run_loop_get_time_ms() - link_t_activity;
+	if (idle == 0) link_idle_arm(0);
+	else if (elapsed < idle) link_idle_arm(idle - elapsed);
+	else link_profile(0);
+}
+
+
+static void link_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packet, uint16_t size) {
+	UNUSED(channel);
+	UNUSED(size);
+
+	if (packet_type != HCI_EVENT_PACKET) return;
+
+	switch (hci_event_packet_get_type(packet)) {
+
+	case HCI_EVENT_CONNECTION_COMPLETE:
+		// only the ACL link to the host
+		if (hci_event_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS) break;
+		if (hci_event_connection_complete_get_link_type(packet) != 0x01) break;
+
+		memset(&link, 0, sizeof(link));
+		link.handle = hci_event_connection_complete_get_connection_handle(packet);
+		link.qos_status = 0xFF;
+		link.mode = LINK_MODE_ACTIVE;
+		link.lowlatency = 1;
+		link_t_activity = btstack_run_loop_get_time_ms();
+
+		// the full low latency setup once, then only the policy/sniff switches
+		link_pending = LINK_CMDS_ACTIVE;
+		link_commands_run();
+		link_idle_arm(link_idle_ms);
+		break;
+
+	case HCI_EVENT_LE_META:
+		switch (hci_event_le_meta_get_subevent_code(packet)) {
+		case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+			if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS) break;
+
+			memset(&link, 0, sizeof(link));
+			link.handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+			link.le = 1;
+			link.qos_status = 0xFF;
+			link.lowlatency = 1;
+			link.le_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+			link_t_activity = btstack_run_loop_get_time_ms();
+			printf("PIGUN-HID: LE link interval %.2f ms\n", link.le_interval * 1.25f);
+
+			link_le_request();
+			link_idle_arm(link_idle_ms);
+			break;
+
+		case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+			if (hci_subevent_le_connection_update_complete_get_connection_handle(packet) != link.handle) break;
+			link.le_interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+			link.le_latency = hci_subevent_le_connection_update_complete_get_conn_latency(packet);
+			link.le_updates++;
+			printf("PIGUN-HID: LE link interval %.2f ms latency %u\n", link.le_interval * 1.25f, link.le_latency);
+			break;
+
+		default:
+			break;
+		}
+		break;
+
+	case L2CAP_EVENT_CONNECTION_PARAMETER_UPDATE_RESPONSE:
+		// the host said no: the interval stays what it is
+		if (l2cap_event_connection_parameter_update_response_get_result(packet) != 0)
+			printf("PIGUN-HID: LE connection parameters rejected by the host\n");
+		break;
+
+	case HCI_EVENT_DISCONNECTION_COMPLETE:
+		if (hci_event_disconnection_complete_get_connection_handle(packet) != link.handle) break;
+		link.handle = HCI_CON_HANDLE_INVALID;
+		link_pending = 0;
+		pigun_timer_cancel(&link_idle_timer);
+		break;
+
+	case HCI_EVENT_MODE_CHANGE:
+		if (hci_event_mode_change_get_handle(packet) != link.handle) break;
+		if (hci_event_mode_change_get_status(packet) != ERROR_CODE_SUCCESS) {
+			printf("PIGUN-HID: link mode change failed, status 0x%02x\n", hci_event_mode_change_get_status(packet));
+			break;
+		}
+		link.mode = hci_event_mode_change_get_mode(packet);
+		link.interval = hci_event_mode_change_get_interval(packet);
+		if (link.mode == LINK_MODE_SNIFF) {
+			link.nsniff++;
+			printf("PIGUN-HID: link in sniff mode, interval %.2f ms\n", link.interval * 0.625f);
+		}
+		else printf("PIGUN-HID: link in %s mode\n", (link.mode == LINK_MODE_ACTIVE) ? "active" : "hold");
+
+		// the host put it in sniff while the gun is in use: take it back
+		if (link.mode == LINK_MODE_SNIFF && link.lowlatency) {
+			link_pending |= LINK_CMD_EXIT_SNIFF;
+			link_commands_run();
+		}
+		break;
+
+	case HCI_EVENT_QOS_SETUP_COMPLETE:
+		if (little_endian_read_16(packet, 3) != link.handle) break;
+		link.qos_status = packet[2];
+		link.qos_service = packet[6];
+		link.qos_rate = little_endian_read_32(packet, 7);
+		link.qos_bandwidth = little_endian_read_32(packet, 11);
+		link.qos_latency = little_endian_read_32(packet, 15);
+		link.qos_variation = little_endian_read_32(packet, 19);
+		if (link.qos_status != ERROR_CODE_SUCCESS)
+			printf("PIGUN-HID: QoS setup failed, status 0x%02x\n", link.qos_status);
+		else
+			printf("PIGUN-HID: QoS service %u rate %u B/s bandwidth %u B/s latency %u us variation %u us\n",
+				link.qos_service, link.qos_rate, link.qos_bandwidth, link.qos_latency, link.qos_variation);
+		break;
+
+	case HCI_EVENT_COMMAND_COMPLETE:
+		if (hci_event_command_complete_get_command_opcode(packet) == link_cmd_read_flush.opcode) {
+			const uint8_t* ret = hci_event_command_complete_get_return_parameters(packet);
+			if (ret[0] == ERROR_CODE_SUCCESS && little_endian_read_16(ret, 1) == link.handle) {
+				link.flush = little_endian_read_16(ret, 3);
+				printf("PIGUN-HID: link flush timeout %.2f ms\n", link.flush * 0.625f);
+			}
+		}
+		else if (hci_event_command_complete_get_command_opcode(packet) == link_cmd_write_flush.opcode) {
+			const uint8_t* ret = hci_event_command_complete_get_return_parameters(packet);
+			if (ret[0] != ERROR_CODE_SUCCESS)
+				printf("PIGUN-HID: unable to set the flush timeout, status 0x%02x\n", ret[0]);
+		}
+		link_commands_run();
+		break;
+
+	case HCI_EVENT_COMMAND_STATUS:
+		if (hci_event_command_status_get_status(packet) != ERROR_CODE_SUCCESS) {
+			uint16_t opcode = hci_event_command_status_get_command_opcode(packet);
+			if (opcode == link_cmd_qos_setup.opcode || opcode == link_cmd_sniff.opcode || opcode == link_cmd_exit_sniff.opcode)
+				printf("PIGUN-HID: link command 0x%04x rejected, status 0x%02x\n", opcode, hci_event_command_status_get_status(packet));
+		}
+		link_commands_run();
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+/// @brief Registers the link tuning for the HCI events. Call before powering on the stack.
+void pigun_link_init() {
+
+	memset(&link, 0, sizeof(link));
+	link.handle = HCI_CON_HANDLE_INVALID;
+	link.qos_status = 0xFF;
+
+	pigun_timer_setup(&link_idle_timer, &link_idle_check, NULL);
+	link_callback_registration.callback = &link_packet_handler;
+	hci_add_event_handler(&link_callback_registration);
+}
+
+/// @brief Tells the link that the report changed: it goes back to low latency if it was idle.
+/// Called by the BTstack thread when a new report is sent.
+void pigun_link_activity() {
+
+	link_t_activity = btstack_run_loop_get_time_ms();
+	if (link.handle == HCI_CON_HANDLE_INVALID || link.lowlatency) return;
+
+	link_profile(1);
+	link_idle_arm(link_idle_ms);
+}
+
+/// @brief Copies the link state and the negotiated parameters.
+void pigun_link_info(pigun_link_info_t* info) {
+	*info = link;
+}
+
+/// @brief Sets the time without changes before the link goes to sniff.
+/// @param ms idle time, 0 to never use sniff. Takes effect at the next check.
+void pigun_link_idle(uint32_t ms) {
+	link_idle_ms = ms;
+}
+
+uint32_t pigun_link_get_idle() {
+	return link_idle_ms;
+}
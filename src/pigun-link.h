@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+#ifndef PIGUN_LINK
+#define PIGUN_LINK
+
+
+#define LINK_IDLE 30000			// default ms without aim/button changes before the link goes to sniff, 0=never
+#define LINK_LATENCY 5000		// latency requested with the QoS setup, in us
+#define LINK_FLUSH 16			// automatic flush timeout in slots of 0.625 ms (10 ms): older reports are dropped
+#define LINK_SNIFF_MAX 160		// sniff interval range while idle, in slots of 0.625 ms
+#define LINK_SNIFF_MIN 80
+#define LINK_SNIFF_ATTEMPT 4	// sniff attempt and timeout, in slots
+#define LINK_SNIFF_TIMEOUT 1
+
+#define LINK_LE_FAST 6			// LE connection interval while in use, in units of 1.25 ms (7.5 ms)
+#define LINK_LE_IDLE_MIN 24		// LE connection interval range while idle (30-50 ms)
+#define LINK_LE_IDLE_MAX 40
+#define LINK_LE_IDLE_LATENCY 4	// LE connection events the gun can skip while idle
+#define LINK_LE_TIMEOUT 300		// LE supervision timeout, in units of 10 ms
+
+
+/// @brief Link power modes, as in the HCI mode change event.
+typedef enum {
+	LINK_MODE_ACTIVE = 0,
+	LINK_MODE_HOLD = 1,
+	LINK_MODE_SNIFF = 2
+} pigun_link_mode_t;
+
+/// @brief State and negotiated parameters of the ACL link to the host.
+typedef struct {
+	uint16_t handle;		// connection handle, 0xFFFF when not connected
+	uint8_t le;				// 1 for a bluetooth LE connection (HOGP mode)
+	uint8_t lowlatency;		// 1 when the low latency profile is requested, 0 when idle
+	uint8_t mode;			// current pigun_link_mode_t
+	uint16_t interval;		// sniff interval in slots, when in sniff mode
+
+	uint8_t qos_status;		// HCI status of the QoS setup, 0xFF if not done
+	uint8_t qos_service;	// negotiated service type (0=no traffic, 1=best effort, 2=guaranteed)
+	uint32_t qos_rate;		// negotiated token rate, in bytes/s
+	uint32_t qos_bandwidth;	// negotiated peak bandwidth, in bytes/s
+	uint32_t qos_latency;	// negotiated latency, in us
+	uint32_t qos_variation;	// negotiated delay variation, in us
+
+	uint16_t flush;			// automatic flush timeout read back from the controller, in slots (0=infinite)
+	uint32_t nsniff;		// times the link entered sniff mode
+
+	uint16_t le_interval;	// LE connection interval, in units of 1.25 ms
+	uint16_t le_latency;	// LE slave latency
+	uint32_t le_updates;	// LE connection parameter updates
+} pigun_link_info_t;
+
+
+void pigun_link_init(void);
+void pigun_link_activity(void);
+void pigun_link_info(pigun_link_info_t* info);
+void pigun_link_idle(uint32_t ms);
+uint32_t pigun_link_get_idle(void);
+
+
+#endif
@@ -6,6 +6,7 @@ Here are all the PiGun functions related to camera stuff with libmmal.
 #include "pigun-detector.h"
 #include "pigun-mmal.h"
 #include "pigun-gpio.h"
+#include "pigun-timing.h"
 
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
@@ -15,9 +16,101 @@ Here are all the PiGun functions related to camera stuff with libmmal.
 #include "interface/mmal/util/mmal_connection.h"
 
 
+MMAL_COMPONENT_T* pigun_camera;
 MMAL_PORT_T* pigun_video_port;
 MMAL_POOL_T* pigun_video_port_pool;
 
+// camera settings: requested from any thread, applied by the camera thread
+static pigun_camera_params_t camera_params = {
+	.exposure = 1,
+	.shutter = 0,
+	.again = 0,
+	.dgain = 0,
+	.blur = 1,
+	.fps = PIGUN_FPS
+};
+static uint8_t camera_pending = 0; // CAMERA_SET_* flags of the settings that changed
+static volatile uint8_t camera_fps = PIGUN_FPS; // frame rate applied, read by the frame callback without the lock
+static pthread_mutex_t camera_params_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// @brief Sends camera settings to the running camera.
+/// @param params the settings.
+/// @param mask CAMERA_SET_* flags of the settings to apply.
+static void pigun_mmal_apply(const pigun_camera_params_t* params, uint8_t mask) {
+
+	if (!pigun_camera) return;
+
+	// careful: the helper turns the exposure mode OFF when called with 1
+	if (mask & CAMERA_SET_EXPOSURE) pigun_camera_exposuremode(pigun_camera, params->exposure ? 0 : 1);
+	if (mask & CAMERA_SET_SHUTTER) pigun_camera_shutter(pigun_camera, params->shutter);
+	if (mask & CAMERA_SET_GAINS) {
+		if (params->again || params->dgain) {
+			pigun_camera_gains(pigun_camera,
+				params->again ? params->again : 100,
+				params->dgain ? params->dgain : 100);
+		}
+		else {
+			// both 0: back to automatic, the AGC only runs once the manual gains are cleared
+			int again = -1, dgain = -1;
+			if (pigun_camera_gains(pigun_camera, 0, 0) || pigun_camera_get_gains(pigun_camera, &again, &dgain) || again != 0 || dgain != 0)
+				printf("PIGUN ERROR: unable to give the gains back to the automatic control (camera has %i/%i)\n", again, dgain);
+		}
+	}
+	if (mask & CAMERA_SET_BLUR) pigun_camera_blur(pigun_camera, params->blur);
+	if (mask & CAMERA_SET_FPS) pigun_camera_framerate(pigun_video_port, params->fps);
+}
+
+
+/// @brief Requests new camera settings. Can be called from any thread:
+/// the settings are applied by the camera thread within a frame or two.
+/// @param params new settings (only the ones in mask are used).
+/// @param mask CAMERA_SET_* flags of the settings to change.
+void pigun_camera_set(const pigun_camera_params_t* params, uint8_t mask) {
+
+	pthread_mutex_lock(&camera_params_mutex);
+	if (mask & CAMERA_SET_EXPOSURE) camera_params.exposure = params->exposure;
+	if (mask & CAMERA_SET_SHUTTER) camera_params.shutter = params->shutter;
+	if (mask & CAMERA_SET_GAINS) {
+		camera_params.again = params->again;
+		camera_params.dgain = params->dgain;
+	}
+	if (mask & CAMERA_SET_BLUR) camera_params.blur = params->blur;
+	if (mask & CAMERA_SET_FPS) camera_params.fps = params->fps;
+	camera_pending |= mask;
+	pthread_mutex_unlock(&camera_params_mutex);
+}
+
+/// @brief Gets the current camera settings (including the ones not applied yet).
+void pigun_camera_get(pigun_camera_params_t* params) {
+
+	pthread_mutex_lock(&camera_params_mutex);
+	*params = camera_params;
+	pthread_mutex_unlock(&camera_params_mutex);
+}
+
+/// @brief Gets the frame rate applied on the camera. Does not lock: for the frame callback.
+uint8_t pigun_camera_fps() {
+	return camera_fps;
+}
+
+/// @brief Applies the pending camera settings. Called periodically by the camera thread,
+/// outside of the frame callback.
+void pigun_camera_update() {
+
+	pthread_mutex_lock(&camera_params_mutex);
+	pigun_camera_params_t params = camera_params;
+	uint8_t mask = camera_pending;
+	camera_pending = 0;
+	pthread_mutex_unlock(&camera_params_mutex);
+
+	if (mask == 0) return;
+	pigun_mmal_apply(&params, mask);
+	if (mask & CAMERA_SET_FPS) camera_fps = params.fps;
+	printf("PIGUN: camera settings applied: exposure %s, shutter %u us, gains %u/%u, blur %u, %u fps\n",
+		params.exposure ? "auto" : "off", params.shutter, params.again, params.dgain, params.blur, params.fps);
+}
+
 
 void video_buffer_release(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
 
@@ -41,46 +134,34 @@ void video_buffer_release(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
 }
 
 
-/// @brief Called each time a camera frame is ready for processing.
-/// buffer->data has the pixel values in the chosen encoding (I420).
+/// @brief Measures the offset between the camera clock (STC) and the monotonic clock.
+/// Buffer timestamps are in STC, this is what we need to move them to the system time.
 /// @param port MMAL port object.
-/// @param buffer Camera frame buffer object.
-static void video_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
+static void video_clock_sync(MMAL_PORT_T* port) {
 
-	pigun.framedata = buffer->data;
+	uint64_t stc;
+	int64_t t0 = pigun_now_us();
+	if (mmal_port_parameter_get_uint64(port, MMAL_PARAMETER_SYSTEM_TIME, &stc) != MMAL_SUCCESS) return;
+	int64_t t1 = pigun_now_us();
 
-	if(pigun.state == STATE_SHUTDOWN){
-		video_buffer_release(port, buffer);
-		return;
-	}
-
-    // call the peak detector function *************************************
-	// if there was a detector error, error LED goes on, otherwise off
-	// the switch only happens when the detector return value changes
-	uint8_t ce = pigun.detector.error;
-	pigun_detector_run(pigun.framedata);
-	if(pigun.detector.error != ce) {
-		// if the error flag changed, flip the LED state
-		pigun_GPIO_output_set(PIN_OUT_ERR, pigun.detector.error);
-	}
-
-	// the peaks are supposed to be ordered by the detector function
-
-	// TODO: maybe add a mutex/semaphore so that the main bluetooth thread
-	// will wait until this is done with the x/y aim before reading the HID report
+	// assume the STC was read halfway through the call
+	pigun.timing.stc_offset = (t0 + t1) / 2 - (int64_t)stc;
+}
 
-	// compute aiming position from the detected peaks
-	pigun_calculate_aim();
 
-    // *********************************************************************
-	// check the buttons ***************************************************
+/// @brief Called each time a camera frame is ready for processing.
+/// buffer->data has the pixel values in the chosen encoding (I420).
+/// @param port MMAL port object.
+/// @param buffer Camera frame buffer object.
+static void video_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) {
 
-	pigun_buttons_process();
+	// the sensor timestamp is in camera clock, move it to the system clock
+	if (pigun.timing.frame.id % TIMING_STC_SYNC == 0) video_clock_sync(port);
 
-	// TODO: maybe add a mutex/semaphore so that the main bluetooth thread
-	// will wait until this is done with the buttons before reading the HID report
+	int64_t t_sensor = -1;
+	if (buffer->pts != MMAL_TIME_UNKNOWN) t_sensor = buffer->pts + pigun.timing.stc_offset;
 
-	// *********************************************************************
+	pigun_frame_process(buffer->data, t_sensor);
 
 	// we are done with this buffer, we can release it!
 	video_buffer_release(port, buffer);
@@ -109,15 +190,20 @@ int pigun_mmal_init() {
 
 	MMAL_STATUS_T status;
 
-	// I guess this starts the driver?
-	bcm_host_init();
-	printf("PIGUN: BCM Host initialized.\n");
+	// I guess this starts the driver? only needed once, even if the camera is restarted
+	static int bcm_host_ready = 0;
+	if (!bcm_host_ready) {
+		bcm_host_init();
+		bcm_host_ready = 1;
+		printf("PIGUN: BCM Host initialized.\n");
+	}
 
 	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
 	if (status != MMAL_SUCCESS) {
 		printf("PIGUN ERROR: create camera returned %x\n", status);
 		return -1;
 	}
+	pigun_camera = camera; // saved now so pigun_mmal_stop can clean up if something fails later
 
 	// connect ports
 	camera_preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
@@ -137,7 +223,7 @@ int pigun_mmal_init() {
 			.num_preview_video_frames = 3,
 			.stills_capture_circular_buffer_height = 0,
 			.fast_preview_resume = 0,
-			.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+			.use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC // same clock as MMAL_PARAMETER_SYSTEM_TIME
 		};
 		mmal_port_parameter_set(camera->control, &cam_config.hdr);
 	}
@@ -155,7 +241,7 @@ int pigun_mmal_init() {
 	format->es->video.crop.y = 0;
 	format->es->video.crop.width = PIGUN_RES_X;
 	format->es->video.crop.height = PIGUN_RES_Y;
-	format->es->video.frame_rate.num = PIGUN_FPS;
+	format->es->video.frame_rate.num = camera_params.fps;
 	format->es->video.frame_rate.den = 1;
 
 	camera_video_port->buffer_size = camera_video_port->buffer_size_recommended;
@@ -178,6 +264,8 @@ int pigun_mmal_init() {
 		camera_video_port->buffer_size
 	);
 	camera_video_port->userdata = (struct MMAL_PORT_USERDATA_T*)camera_video_port_pool;
+	pigun_video_port = camera_video_port;
+	pigun_video_port_pool = camera_video_port_pool;
 
 	// the port is enabled with the given callback function
 	// the callback is called when a complete frame is ready at the camera.video output port
@@ -194,22 +282,16 @@ int pigun_mmal_init() {
 
 	printf("PIGUN: setting up parameters\n");
 	
-	// Disable exposure mode
-	pigun_camera_exposuremode(camera, 0);
-
-	// Set gains
-	//if (argc == 3) {
-		//int analog_gain = atoi(argv[1]);
-		//int digital_gain = atoi(argv[2]);
-		//pigun_camera_gains(camera, analog_gain, digital_gain);
-	//}
-	//
-	// Setup automatic white balance
+	// apply all the current settings - the defaults, or whatever was set before a restart
+	// automatic white balance is not used:
 	//pigun_camera_awb(camera, 0);
 	//pigun_camera_awb_gains(camera, 1, 1);
+	pthread_mutex_lock(&camera_params_mutex);
+	pigun_camera_params_t params = camera_params;
+	camera_pending = 0;
+	pthread_mutex_unlock(&camera_params_mutex);
+	pigun_mmal_apply(&params, CAMERA_SET_ALL);
 
-	// Setup blur
-	pigun_camera_blur(camera, 1);
 	printf("PIGUN: parameters set\n");
 
 	// send the buffers to the camera.video output port so it can start filling them frame data
@@ -235,11 +317,26 @@ int pigun_mmal_init() {
 		return -1;
 	}
 
-	// save necessary stuff to global vars
-	pigun_video_port = camera_video_port;
-	pigun_video_port_pool = camera_video_port_pool;
-
 	printf("PIGUN: camera initialised.\n");
 	return 0;
 }
 
+
+/// @brief Stops the camera and releases all MMAL resources, so that pigun_mmal_init can start it again.
+void pigun_mmal_stop() {
+
+	if (pigun_video_port && pigun_video_port->is_enabled) {
+		mmal_port_parameter_set_boolean(pigun_video_port, MMAL_PARAMETER_CAPTURE, 0);
+		mmal_port_disable(pigun_video_port); // buffers coming back after this are not sent to the port again
+	}
+	if (pigun_camera) mmal_component_disable(pigun_camera);
+	if (pigun_video_port_pool) mmal_port_pool_destroy(pigun_video_port, pigun_video_port_pool);
+	if (pigun_camera) mmal_component_destroy(pigun_camera);
+
+	pigun_camera = NULL;
+	pigun_video_port = NULL;
+	pigun_video_port_pool = NULL;
+
+	printf("PIGUN: camera stopped.\n");
+}
+
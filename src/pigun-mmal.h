@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include "interface/mmal/mmal.h"
+
 #ifndef PIGUN_MMAL
 #define PIGUN_MMAL
 
@@ -12,6 +15,11 @@
 #define PIGUN_CAM_Y 1232
 #define PIGUN_FPS 40
 
+// Camera watchdog: the camera is restarted when no frames arrive for this many frame intervals
+#define PIGUN_WATCHDOG_FRAMES 5
+#define PIGUN_WATCHDOG_STARTUP 2000000	// time allowed for the first frame after a (re)start, in us
+#define PIGUN_WATCHDOG_POLL 10000		// watchdog check interval, in us
+
 // Camera output settings: these are ~1/4th of the camera acquisition. The
 // vertical resolution needs to be a multiple of 16, and the horizontal
 // resolution needs to be a multiple of 32!
@@ -22,7 +30,38 @@
 #define PIGUN_NPX 133120
 
 
+// flags for the camera settings to change
+#define CAMERA_SET_EXPOSURE 0x01
+#define CAMERA_SET_SHUTTER 0x02
+#define CAMERA_SET_GAINS 0x04
+#define CAMERA_SET_BLUR 0x08
+#define CAMERA_SET_FPS 0x10
+#define CAMERA_SET_ALL 0x1F
+
+/// @brief Camera settings that can be changed while the camera is running.
+typedef struct {
+	uint8_t		exposure;	// 1 for automatic exposure, 0 for off
+	uint32_t	shutter;	// shutter speed in us, 0 for automatic
+	uint16_t	again;		// analog gain x100, 0 to leave it to the camera
+	uint16_t	dgain;		// digital gain x100, 0 to leave it to the camera
+	uint8_t		blur;		// 1 to apply the blur image effect
+	uint8_t		fps;		// frame rate
+} pigun_camera_params_t;
+
+
+extern MMAL_COMPONENT_T* pigun_camera;
+
 int pigun_mmal_init(void);
+void pigun_mmal_stop(void);
+
+void pigun_camera_set(const pigun_camera_params_t* params, uint8_t mask);
+void pigun_camera_get(pigun_camera_params_t* params);
+void pigun_camera_update(void);
+uint8_t pigun_camera_fps(void);
+
+// synthetic camera source, used instead of MMAL when built with PIGUN_FAKECAM
+int pigun_fakecam_init(void);
+void pigun_fakecam_stop(void);
 
 
 
@@ -0,0 +1,375 @@
+/*
+* Runtime parameters: a registry of the detector, camera, filter, predictor and button settings that can be
+* tuned while the gun is in use, from the control socket or with the parameter feature report (ID 5).
+*
+* A new value is checked against the range of the parameter and staged. SET releases it, together with
+* any parameter staged before it with STAGE. The camera thread applies the released ones that the frame
+* processing uses (PARAM_FRAME) at the start of the next frame: a frame never sees half of a change, like
+* a new filter cutoff with the old beta. With the gyro the aim output runs on the gyro thread, so they
+* are applied under its lock. The others have thread safe setters (PARAM_NOW) and are applied
+* on release, so the camera settings also get through while no frames come (the watchdog applies them).
+*
+* Feature report protocol (layout in pigun-report.h): the host writes a request with the protocol
+* version, the operation, the parameter ID and the value, then reads the report back to get that
+* parameter: status, the value in use, range, decimals and name. A GET only addresses the parameter.
+* The requests and answers run in the BTstack thread, the staging is shared with the camera thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "pigun.h"
+#include "pigun-mmal.h"
+#include "pigun-param.h"
+#include "pigun-input.h"
+#include "pigun-imu.h"
+#include "pigun-solenoid.h"
+
+
+// *** ACCESSORS ***
+// the camera thread calls the PARAM_FRAME setters between two frames, so they can touch the live objects
+
+static int32_t get_threshold() { return pigun.detector.threshold; }
+static void set_threshold(int32_t v) { pigun.detector.threshold = v; }
+
+static int32_t get_stride() { return pigun.detector.dx; }
+static void set_stride(int32_t v) { pigun.detector.dx = v; }
+
+
+// camera settings have their own queue to the camera, see pigun_camera_update
+static int32_t get_camera(uint8_t mask) {
+
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	switch (mask) {
+	case CAMERA_SET_EXPOSURE: return c.exposure;
+	case CAMERA_SET_SHUTTER: return c.shutter;
+	case CAMERA_SET_BLUR: return c.blur;
+	case CAMERA_SET_FPS: return c.fps;
+	}
+	return 0;
+}
+
+static void set_camera(uint8_t mask, int32_t v) {
+
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	switch (mask) {
+	case CAMERA_SET_EXPOSURE: c.exposure = v; break;
+	case CAMERA_SET_SHUTTER: c.shutter = v; break;
+	case CAMERA_SET_BLUR: c.blur = v; break;
+	case CAMERA_SET_FPS: c.fps = v; break;
+	}
+	pigun_camera_set(&c, mask);
+}
+
+static int32_t get_exposure() { return get_camera(CAMERA_SET_EXPOSURE); }
+static void set_exposure(int32_t v) { set_camera(CAMERA_SET_EXPOSURE, v); }
+static int32_t get_shutter() { return get_camera(CAMERA_SET_SHUTTER); }
+static void set_shutter(int32_t v) { set_camera(CAMERA_SET_SHUTTER, v); }
+static int32_t get_blur() { return get_camera(CAMERA_SET_BLUR); }
+static void set_blur(int32_t v) { set_camera(CAMERA_SET_BLUR, v); }
+static int32_t get_fps() { return get_camera(CAMERA_SET_FPS); }
+static void set_fps(int32_t v) { set_camera(CAMERA_SET_FPS, v); }
+
+static int32_t get_again() {
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	return c.again;
+}
+
+static void set_again(int32_t v) {
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	c.again = v;
+	pigun_camera_set(&c, CAMERA_SET_GAINS);
+}
+
+static int32_t get_dgain() {
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	return c.dgain;
+}
+
+static void set_dgain(int32_t v) {
+	pigun_camera_params_t c;
+	pigun_camera_get(&c);
+	c.dgain = v;
+	pigun_camera_set(&c, CAMERA_SET_GAINS);
+}
+
+
+// tuning a filter parameter turns its stage on, as in the control socket
+static int32_t get_mincutoff() { return lroundf(pigun.filter.params.mincutoff * 1000); }
+static void set_mincutoff(int32_t v) {
+	pigun.filter.params.mincutoff = v / 1000.0f;
+	pigun.filter.params.stages |= FILTER_ONEEURO;
+}
+
+static int32_t get_beta() { return lroundf(pigun.filter.params.beta * 100); }
+static void set_beta(int32_t v) {
+	pigun.filter.params.beta = v / 100.0f;
+	pigun.filter.params.stages |= FILTER_ONEEURO;
+}
+
+static int32_t get_dcutoff() { return lroundf(pigun.filter.params.dcutoff * 1000); }
+static void set_dcutoff(int32_t v) {
+	pigun.filter.params.dcutoff = v / 1000.0f;
+	pigun.filter.params.stages |= FILTER_ONEEURO;
+}
+
+static int32_t get_deadzone() {
+	pigun_filter_params_t* p = &(pigun.filter.params);
+	return (p->stages & FILTER_DEADZONE) ? lroundf(p->deadzone * 10000) : 0;
+}
+static void set_deadzone(int32_t v) {
+	pigun_filter_params_t* p = &(pigun.filter.params);
+	p->deadzone = v / 10000.0f;
+	if (v > 0) p->stages |= FILTER_DEADZONE;
+	else p->stages &= ~FILTER_DEADZONE;
+}
+
+// a profile replaces all the filter parameters at once
+static int32_t get_profile() { return pigun.filter.profile; }
+static void set_profile(int32_t v) { pigun_filter_profile(&(pigun.filter), pigun_filter_profiles[v].name); }
+
+static int32_t get_horizon() { return pigun.predictor.horizon; }
+static void set_horizon(int32_t v) { pigun.predictor.horizon = v; }
+
+static int32_t get_debounce() { return pigun_input_get_debounce(); }
+static void set_debounce(int32_t v) { pigun_input_debounce(v); }
+
+static int32_t get_pulse() { return pigun_solenoid_get_pulse(); }
+static void set_pulse(int32_t v) { pigun_solenoid_pulse(v); }
+static int32_t get_period() { return pigun_solenoid_get_period(); }
+static void set_period(int32_t v) { pigun_solenoid_period(v); }
+static int32_t get_duty() { return pigun_solenoid_get_duty(); }
+static void set_duty(int32_t v) { pigun_solenoid_duty(v); }
+
+
+// *** REGISTRY ***
+// the position is the ID the host uses: new parameters go at the end
+static const pigun_param_t param_registry[] = {
+	{ "threshold",	1,	255,		0,	PARAM_FRAME, &get_threshold,	&set_threshold },	// detector pixel threshold
+	{ "stride",		1,	16,			0,	PARAM_FRAME, &get_stride,	&set_stride },		// detector coarse search step, px
+	{ "exposure",	0,	1,			0,	PARAM_NOW, &get_exposure,	&set_exposure },	// automatic exposure
+	{ "shutter",	0,	1000000,	0,	PARAM_NOW, &get_shutter,	&set_shutter },		// us, 0 = automatic
+	{ "again",		0,	1600,		2,	PARAM_NOW, &get_again,		&set_again },		// analog gain, 0 = automatic
+	{ "dgain",		0,	6400,		2,	PARAM_NOW, &get_dgain,		&set_dgain },		// digital gain, 0 = automatic
+	{ "blur",		0,	1,			0,	PARAM_NOW, &get_blur,		&set_blur },
+	{ "fps",		1,	90,			0,	PARAM_NOW, &get_fps,		&set_fps },
+	{ "mincutoff",	1,	100000,		3,	PARAM_FRAME, &get_mincutoff,	&set_mincutoff },	// Hz
+	{ "beta",		0,	100000,		2,	PARAM_FRAME, &get_beta,		&set_beta },
+	{ "dcutoff",	1,	100000,		3,	PARAM_FRAME, &get_dcutoff,	&set_dcutoff },		// Hz
+	{ "deadzone",	0,	499,		4,	PARAM_FRAME, &get_deadzone,	&set_deadzone },	// normalised units
+	{ "horizon",	0,	PREDICT_MAXHORIZON, 0, PARAM_FRAME, &get_horizon, &set_horizon },	// us
+	{ "debounce",	0,	INPUT_MAXDEBOUNCE, 0, PARAM_NOW, &get_debounce, &set_debounce },	// us, buttons on the input thread
+	{ "pulse",		1000, SOLENOID_MAXPULSE, 0, PARAM_NOW, &get_pulse,	&set_pulse },		// us, solenoid pulse width
+	{ "period",		SOLENOID_MINPERIOD, 1000000, 0, PARAM_NOW, &get_period, &set_period },	// us, auto fire and bursts
+	{ "duty",		1,	SOLENOID_MAXDUTY, 0, PARAM_NOW, &get_duty,		&set_duty },		// %, solenoid duty cycle budget
+	{ "profile",	0,	FILTER_PROFILES - 1, 0, PARAM_FRAME, &get_profile, &set_profile },	// filter profile, index in pigun_filter_profiles
+};
+static const int param_count = sizeof(param_registry) / sizeof(pigun_param_t);
+
+
+// staged values: held until a commit, then ready for the camera thread
+static pthread_mutex_t param_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int32_t param_held_values[PARAM_MAX];
+static int32_t param_ready_values[PARAM_MAX];
+static uint32_t param_held = 0;
+static uint32_t param_ready = 0;
+
+// last feature request, the answer is about its parameter
+static uint8_t param_addressed = 0;
+static uint8_t param_status = PARAM_OK;
+
+
+/// @brief Number of parameters in the registry.
+int pigun_param_count() {
+	return param_count;
+}
+
+/// @brief Gets a parameter description.
+/// @return NULL if there is no parameter with this ID.
+const pigun_param_t* pigun_param_info(uint8_t id) {
+	return (id < param_count) ? &param_registry[id] : NULL;
+}
+
+/// @brief Looks up a parameter by name.
+/// @return the parameter ID, -1 if there is none with this name.
+int pigun_param_find(const char* name) {
+
+	for (int i = 0; i < param_count; i++)
+		if (strcmp(param_registry[i].name, name) == 0) return i;
+	return -1;
+}
+
+/// @brief Stages a new value. Can be called from any thread.
+/// @param id the parameter ID.
+/// @param value the new value (setting x 10^decimals).
+/// @param hold 1 to keep it until pigun_param_commit, 0 to release it now with the held ones.
+/// @return PARAM_PENDING, or PARAM_ERR_* if nothing changed.
+uint8_t pigun_param_set(uint8_t id, int32_t value, uint8_t hold) {
+
+	const pigun_param_t* p = pigun_param_info(id);
+	if (p == NULL) return PARAM_ERR_ID;
+	if (value < p->min || value > p->max) return PARAM_ERR_RANGE;
+
+	pthread_mutex_lock(&param_mutex);
+	param_held_values[id] = value;
+	param_held |= (1u << id);
+	pthread_mutex_unlock(&param_mutex);
+
+	if (!hold) pigun_param_commit();
+	return PARAM_PENDING;
+}
+
+// calls the setters of the parameters in the mask
+static void param_apply(uint32_t mask, const int32_t* values) {
+
+	char text[16];
+	for (int i = 0; i < param_count; i++) {
+		if (!(mask & (1u << i))) continue;
+		param_registry[i].set(values[i]);
+		pigun_param_format(&param_registry[i], values[i], text, sizeof(text));
+		printf("PIGUN: parameter %s = %s\n", param_registry[i].name, text);
+	}
+}
+
+/// @brief Releases the held values: the PARAM_NOW ones are applied here, the camera thread applies
+/// the PARAM_FRAME ones together at the next frame.
+void pigun_param_commit() {
+
+	uint32_t now = 0;
+	pthread_mutex_lock(&param_mutex);
+	for (int i = 0; i < param_count; i++) {
+		if (!(param_held & (1u << i))) continue;
+		if (param_registry[i].when == PARAM_NOW) now |= (1u << i);
+		else param_ready_values[i] = param_held_values[i];
+	}
+	param_ready |= param_held & ~now;
+	param_held = 0;
+
+	// under the lock, so two commits from different threads apply in order
+	param_apply(now, param_held_values);
+	pthread_mutex_unlock(&param_mutex);
+}
+
+/// @brief Drops the held values.
+void pigun_param_discard() {
+
+	pthread_mutex_lock(&param_mutex);
+	param_held = 0;
+	pthread_mutex_unlock(&param_mutex);
+}
+
+/// @brief Tells if a parameter has a new value that is not in use yet.
+uint8_t pigun_param_pending(uint8_t id) {
+
+	pthread_mutex_lock(&param_mutex);
+	uint8_t pending = ((param_held | param_ready) >> id) & 1;
+	pthread_mutex_unlock(&param_mutex);
+	return pending;
+}
+
+/// @brief Applies the released PARAM_FRAME values. Called by the camera thread before it processes a frame.
+void pigun_param_update() {
+
+	// cheap check first, this runs every frame
+	if (param_ready == 0) return;
+
+	int32_t values[PARAM_MAX];
+	pthread_mutex_lock(&param_mutex);
+	uint32_t ready = param_ready;
+	memcpy(values, param_ready_values, sizeof(values));
+	param_ready = 0;
+	pthread_mutex_unlock(&param_mutex);
+
+	// with the gyro, the aim output (and its filter) runs on the gyro thread
+	pigun_imu_lock();
+	param_apply(ready, values);
+	pigun_imu_unlock();
+}
+
+
+/// @brief Converts a setting from text, like "1.25", to the parameter value.
+int32_t pigun_param_parse(const pigun_param_t* p, const char* text) {
+	return (int32_t)lround(atof(text) * pow(10, p->decimals));
+}
+
+/// @brief Writes a parameter value as text, with its decimals.
+/// @return the length of the text, as snprintf.
+int pigun_param_format(const pigun_param_t* p, int32_t value, char* text, int maxlen) {
+
+	if (p->decimals == 0) return snprintf(text, maxlen, "%i", value);
+	return snprintf(text, maxlen, "%.*f", p->decimals, value / pow(10, p->decimals));
+}
+
+
+/// @brief Runs a request from the parameter feature report.
+/// @param request the report, without the report ID.
+/// @param size bytes in the report.
+void pigun_param_request(const uint8_t* request, int size) {
+
+	if (size < PARAM_AT_VALUE + 4) {
+		param_status = PARAM_ERR_OP;
+		return;
+	}
+
+	param_addressed = request[PARAM_AT_ID];
+	if (request[PARAM_AT_VERSION] != HID_PARAM_VERSION) {
+		param_status = PARAM_ERR_VERSION;
+		return;
+	}
+
+	int32_t value = (int32_t)little_endian_read_32(request, PARAM_AT_VALUE);
+	switch (request[PARAM_AT_OP]) {
+	case PARAM_OP_GET:
+		param_status = (pigun_param_info(param_addressed) != NULL) ? PARAM_OK : PARAM_ERR_ID;
+		break;
+	case PARAM_OP_SET:
+	case PARAM_OP_STAGE:
+		param_status = pigun_param_set(param_addressed, value, request[PARAM_AT_OP] == PARAM_OP_STAGE);
+		if (param_status != PARAM_PENDING)
+			printf("PIGUN-HID: parameter %u not set to %i, error 0x%x\n", param_addressed, value, param_status);
+		break;
+	case PARAM_OP_COMMIT:
+		pigun_param_commit();
+		param_status = PARAM_OK;
+		break;
+	case PARAM_OP_DISCARD:
+		pigun_param_discard();
+		param_status = PARAM_OK;
+		break;
+	default:
+		param_status = PARAM_ERR_OP;
+		break;
+	}
+}
+
+/// @brief Builds the answer to the last request: the parameter it addressed, with the value in use.
+/// @param answer buffer for HID_PARAM_SIZE bytes, without the report ID.
+void pigun_param_answer(uint8_t* answer) {
+
+	memset(answer, 0, HID_PARAM_SIZE);
+	answer[PARAM_AT_VERSION] = HID_PARAM_VERSION;
+	answer[PARAM_AT_ID] = param_addressed;
+	answer[PARAM_AT_COUNT] = param_count;
+
+	const pigun_param_t* p = pigun_param_info(param_addressed);
+	if (p == NULL || param_status >= PARAM_ERR_VERSION) {
+		answer[PARAM_AT_STATUS] = (p == NULL && param_status < PARAM_ERR_VERSION) ? PARAM_ERR_ID : param_status;
+		return;
+	}
+
+	// a staged value may have been applied since the request
+	answer[PARAM_AT_STATUS] = pigun_param_pending(param_addressed) ? PARAM_PENDING : PARAM_OK;
+	little_endian_store_32(answer, PARAM_AT_VALUE, (uint32_t)p->get());
+	little_endian_store_32(answer, PARAM_AT_MIN, (uint32_t)p->min);
+	little_endian_store_32(answer, PARAM_AT_MAX, (uint32_t)p->max);
+	answer[PARAM_AT_DECIMALS] = p->decimals;
+	strncpy((char*)&answer[PARAM_AT_NAME], p->name, PARAM_NAMELEN - 1);
+}
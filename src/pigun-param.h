@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+#include "pigun-report.h"
+
+#ifndef PIGUN_PARAM
+#define PIGUN_PARAM
+
+
+#define PARAM_MAX 32	// parameters in the registry at most (one bit each in the pending masks)
+
+#define PARAM_FRAME 0	// applied by the camera thread, between two frames
+#define PARAM_NOW 1		// thread safe setter, applied as soon as the value is released
+
+
+/// @brief A runtime parameter. The ID is the position in the registry.
+/// Values are integers: the setting x 10^decimals.
+typedef struct {
+	const char*	name;
+	int32_t		min, max;
+	uint8_t		decimals;
+	uint8_t		when;					// PARAM_FRAME or PARAM_NOW
+	int32_t		(*get)(void);			// value in use, from any thread
+	void		(*set)(int32_t value);	// called as `when` says
+} pigun_param_t;
+
+
+int pigun_param_count(void);
+const pigun_param_t* pigun_param_info(uint8_t id);
+int pigun_param_find(const char* name);
+uint8_t pigun_param_set(uint8_t id, int32_t value, uint8_t hold);
+void pigun_param_commit(void);
+void pigun_param_discard(void);
+uint8_t pigun_param_pending(uint8_t id);
+void pigun_param_update(void);
+
+int32_t pigun_param_parse(const pigun_param_t* p, const char* text);
+int pigun_param_format(const pigun_param_t* p, int32_t value, char* text, int maxlen);
+
+void pigun_param_request(const uint8_t* request, int size);
+void pigun_param_answer(uint8_t* answer);
+
+
+#endif
@@ -0,0 +1,189 @@
+/*
+* Gun pose from the four beacons (planar PnP).
+*
+* The homography from the aimer maps camera pixels to the unit square of the beacon rectangle.
+* Its inverse, with the camera intrinsics and the real size of the rectangle, gives
+*	K^-1 . H^-1 . diag(1/W, 1/H, 1) = lambda [r1 r2 t]
+* where r1, r2 are the first two columns of the rotation and t the translation from the beacon
+* frame to the camera frame. The columns are normalised and made orthogonal, r3 = r1 x r2.
+*
+* With the pose, the aim is where the barrel line of sight hits the screen plane. The line starts
+* at the barrel origin (an offset from the camera) and goes in the direction of the boresight pixel.
+* The aimer only takes the parallax from it: the shift between the line from the barrel origin and
+* the one from the camera. That is added to the homography aim, so the nominal intrinsics and the
+* orthogonalisation do not move the aim, and no offset gives exactly the homography aim.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pigun-mmal.h"
+#include "pigun-pose.h"
+
+
+static const float pose_cx = PIGUN_RES_X / 2.0f;
+static const float pose_cy = PIGUN_RES_Y / 2.0f;
+
+
+static inline float vec_norm(const float* v) {
+	return sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+static inline void vec_cross(const float* a, const float* b, float* c) {
+	c[0] = a[1] * b[2] - a[2] * b[1];
+	c[1] = a[2] * b[0] - a[0] * b[2];
+	c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+
+void pigun_pose_init(pigun_pose_t* pose) {
+
+	memset(pose, 0, sizeof(pigun_pose_t));
+	pose->beacon_w = POSE_BEACON_W;
+	pose->beacon_h = POSE_BEACON_H;
+}
+
+
+/// @brief Computes the camera pose from the aimer homography.
+/// @param pose pose, with the beacon size set.
+/// @param homography camera px (full frame) -> unit beacon square, row-major 3x3.
+/// @return 0 if the pose is valid.
+int pigun_pose_solve(pigun_pose_t* pose, const float* homography) {
+
+	const float* h = homography;
+	pose->valid = 0;
+
+	// invert the homography: unit square -> camera px (the scale does not matter)
+	float g[9] = {
+		h[4] * h[8] - h[5] * h[7],	h[2] * h[7] - h[1] * h[8],	h[1] * h[5] - h[2] * h[4],
+		h[5] * h[6] - h[3] * h[8],	h[0] * h[8] - h[2] * h[6],	h[2] * h[3] - h[0] * h[5],
+		h[3] * h[7] - h[4] * h[6],	h[1] * h[6] - h[0] * h[7],	h[0] * h[4] - h[1] * h[3]
+	};
+
+	// apply K^-1 on the left and the rectangle size on the right: columns are r1, r2, t (scaled)
+	float c1[3], c2[3], c3[3];
+	for (int i = 0; i < 3; i++) {
+		float* gi = g + 3 * i;
+		float sc = (i == 0) ? POSE_FX : (i == 1) ? POSE_FY : 1;
+		float off = (i == 0) ? pose_cx : (i == 1) ? pose_cy : 0;
+		c1[i] = (gi[0] - off * g[6]) / sc / pose->beacon_w;
+		c2[i] = (gi[1] - off * g[7]) / sc / pose->beacon_h;
+		c3[i] = (gi[2] - off * g[8]) / sc;
+	}
+
+	float n1 = vec_norm(c1), n2 = vec_norm(c2);
+	if (n1 < 1e-9f || n2 < 1e-9f) return 1;
+
+	// the beacons are in front of the camera: t.z > 0
+	float lambda = 2.0f / (n1 + n2);
+	if (c3[2] < 0) lambda = -lambda;
+
+	float r1[3], r2[3], r3[3];
+	for (int i = 0; i < 3; i++) {
+		r1[i] = c1[i] / n1 * ((lambda > 0) ? 1 : -1);
+		r2[i] = c2[i] / n2 * ((lambda > 0) ? 1 : -1);
+		pose->t[i] = c3[i] * lambda;
+	}
+
+	// closest orthonormal pair: split the difference symmetrically around the bisector
+	float a[3], b[3], n[3];
+	vec_cross(r1, r2, n);
+	for (int i = 0; i < 3; i++) a[i] = r1[i] + r2[i];
+	vec_cross(n, a, b);
+	float na = vec_norm(a), nb = vec_norm(b);
+	if (na < 1e-6f || nb < 1e-6f) return 1;
+	for (int i = 0; i < 3; i++) {
+		a[i] /= na;
+		b[i] /= nb;
+		r1[i] = (a[i] - b[i]) * (float)M_SQRT1_2;
+		r2[i] = (a[i] + b[i]) * (float)M_SQRT1_2;
+	}
+	vec_cross(r1, r2, r3);
+
+	for (int i = 0; i < 3; i++) {
+		pose->R[3 * i + 0] = r1[i];
+		pose->R[3 * i + 1] = r2[i];
+		pose->R[3 * i + 2] = r3[i];
+	}
+
+	// camera position in the beacon frame: -R^T t
+	for (int i = 0; i < 3; i++)
+		pose->position[i] = -(pose->R[i] * pose->t[0] + pose->R[3 + i] * pose->t[1] + pose->R[6 + i] * pose->t[2]);
+
+	float center[3];
+	for (int i = 0; i < 3; i++)
+		center[i] = pose->R[3 * i] * pose->beacon_w / 2 + pose->R[3 * i + 1] * pose->beacon_h / 2 + pose->t[i];
+	pose->distance = vec_norm(center);
+
+	pose->valid = 1;
+	return 0;
+}
+
+
+/// @brief Intersects the barrel line of sight with the screen plane.
+/// @param pose a valid pose.
+/// @param col column of the boresight pixel (full frame px).
+/// @param row row of the boresight pixel.
+/// @param x output aim in the normalised beacon frame.
+/// @param y output aim in the normalised beacon frame.
+/// @return 0 if the line hits the plane in front of the gun.
+int pigun_pose_aim(const pigun_pose_t* pose, float col, float row, float* x, float* y) {
+
+	if (!pose->valid) return 1;
+
+	float d[3] = { (col - pose_cx) / POSE_FX, (row - pose_cy) / POSE_FY, 1 };
+	const float* R = pose->R;
+
+	// origin and direction in the beacon frame: R^T (o - t), R^T d
+	float o[3], dir[3];
+	for (int i = 0; i < 3; i++) {
+		o[i] = R[i] * (pose->barrel[0] - pose->t[0]) + R[3 + i] * (pose->barrel[1] - pose->t[1]) + R[6 + i] * (pose->barrel[2] - pose->t[2]);
+		dir[i] = R[i] * d[0] + R[3 + i] * d[1] + R[6 + i] * d[2];
+	}
+
+	// plane z = 0
+	if (fabsf(dir[2]) < 1e-6f) return 1;
+	float s = -o[2] / dir[2];
+	if (s <= 0) return 1;
+
+	*x = (o[0] + s * dir[0]) / pose->beacon_w;
+	*y = (o[1] + s * dir[1]) / pose->beacon_h;
+	return 0;
+}
+
+
+/// @brief Parallax of the barrel: how much the barrel offset moves the aim on the screen plane.
+/// @param pose a valid pose.
+/// @param col column of the boresight pixel (full frame px).
+/// @param row row of the boresight pixel.
+/// @param dx output shift of the aim in the normalised beacon frame.
+/// @param dy output shift of the aim in the normalised beacon frame.
+/// @return 0 if both lines hit the plane in front of the gun.
+int pigun_pose_parallax(const pigun_pose_t* pose, float col, float row, float* dx, float* dy) {
+
+	pigun_pose_t camera = *pose;
+	memset(camera.barrel, 0, sizeof(camera.barrel));
+
+	float bx, by, cx, cy;
+	if (pigun_pose_aim(pose, col, row, &bx, &by) || pigun_pose_aim(&camera, col, row, &cx, &cy))
+		return 1;
+	*dx = bx - cx;
+	*dy = by - cy;
+	return 0;
+}
+
+
+/// @brief Orientation of the gun with respect to the screen.
+/// @param pose a valid pose.
+/// @param yaw output angle to the right of the screen normal, in degrees.
+/// @param pitch output angle above the screen normal, in degrees.
+/// @param roll output rotation around the camera axis, clockwise, in degrees.
+void pigun_pose_angles(const pigun_pose_t* pose, float* yaw, float* pitch, float* roll) {
+
+	// camera axis in the beacon frame: third row of R
+	const float* a = pose->R + 6;
+	*yaw = atan2f(a[0], a[2]) * 180 / M_PI;
+	*pitch = atan2f(-a[1], sqrtf(a[0] * a[0] + a[2] * a[2])) * 180 / M_PI;
+	*roll = atan2f(-pose->R[3], pose->R[0]) * 180 / M_PI;
+}
@@ -0,0 +1,44 @@
+#include <stdint.h>
+
+#ifndef PIGUN_POSE
+#define PIGUN_POSE
+
+
+// camera intrinsics at the output resolution: PiCamera v2.1 (3.04 mm lens, 1.12 um pixels)
+// binned to 1640x1232 and scaled to PIGUN_RES_X x PIGUN_RES_Y
+#ifndef POSE_FX
+#define POSE_FX 344.2f		// focal length in px, horizontal
+#endif
+#ifndef POSE_FY
+#define POSE_FY 352.5f		// focal length in px, vertical (the output is not scaled uniformly)
+#endif
+
+#define POSE_BEACON_W 0.80f	// default width of the beacon rectangle, in m
+#define POSE_BEACON_H 0.45f	// default height of the beacon rectangle, in m
+
+
+/// @brief Pose of the gun camera with respect to the beacon rectangle.
+/// The beacon frame has the origin on the top-left beacon, x to the right, y down and z into the screen,
+/// all in m. The camera frame has x to the right, y down and z forward.
+typedef struct {
+
+	float		beacon_w, beacon_h;	// size of the beacon rectangle, in m
+	float		barrel[3];			// origin of the barrel line of sight in the camera frame, in m
+
+	uint8_t		valid;				// 1 if the last solve worked
+	float		R[9];				// rotation beacon frame -> camera frame, row-major
+	float		t[3];				// beacon frame origin in the camera frame
+	float		position[3];		// camera position in the beacon frame
+	float		distance;			// camera to the center of the beacon rectangle, in m
+
+} pigun_pose_t;
+
+
+void pigun_pose_init(pigun_pose_t* pose);
+int pigun_pose_solve(pigun_pose_t* pose, const float* homography);
+int pigun_pose_aim(const pigun_pose_t* pose, float col, float row, float* x, float* y);
+int pigun_pose_parallax(const pigun_pose_t* pose, float col, float row, float* dx, float* dy);
+void pigun_pose_angles(const pigun_pose_t* pose, float* yaw, float* pitch, float* roll);
+
+
+#endif
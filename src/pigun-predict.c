@@ -0,0 +1,171 @@
+/*
+* Latency-compensating aim predictor.
+*
+* The aim computed from a frame describes where the gun pointed when the frame was exposed,
+* but the report reaches the host one frame or more later. The predictor runs a constant-velocity
+* Kalman filter on each axis of the normalised aim, and extrapolates it by the configured horizon
+* from the sensor timestamp of the frame.
+*
+* The filter restarts when the measurements stop for more than PREDICT_GAP (beacons lost, quads
+* rejected, camera restarted), so it never extrapolates with a velocity from before the gap.
+*
+* The last PREDICT_TRACE measurements are kept so they can be replayed with different horizons:
+* the prediction made at each frame is compared with the measured aim at the predicted time,
+* which gives the error versus horizon on real data.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "pigun-predict.h"
+
+
+static void kalman_reset(pigun_kalman_t* k, float z, float r) {
+	k->p = z;
+	k->v = 0;
+	k->p00 = r;
+	k->p01 = 0;
+	k->p11 = 1.0f; // velocity unknown: up to ~1 frame width per second
+}
+
+static void kalman_step(pigun_kalman_t* k, float z, float dt, float q, float r) {
+
+	// predict
+	float dt2 = dt * dt;
+	k->p += k->v * dt;
+	k->p00 += 2 * dt * k->p01 + dt2 * k->p11 + q * dt2 * dt / 3;
+	k->p01 += dt * k->p11 + q * dt2 / 2;
+	k->p11 += q * dt;
+
+	// update
+	float s = k->p00 + r;
+	float k0 = k->p00 / s;
+	float k1 = k->p01 / s;
+	float y = z - k->p;
+	k->p += k0 * y;
+	k->v += k1 * y;
+	k->p11 -= k1 * k->p01;
+	k->p00 *= (1 - k0);
+	k->p01 *= (1 - k0);
+}
+
+
+void pigun_predict_init(pigun_predictor_t* pr) {
+
+	memset(pr, 0, sizeof(pigun_predictor_t));
+	pr->horizon = PREDICT_HORIZON;
+	pr->q = PREDICT_Q;
+	pr->r = PREDICT_R;
+}
+
+/// @brief Forgets the filter state: the next measurement starts it again.
+void pigun_predict_reset(pigun_predictor_t* pr) {
+	pr->ready = 0;
+}
+
+
+/// @brief Feeds one measurement and extrapolates it.
+/// @param pr predictor.
+/// @param x normalised aim x, replaced by the prediction.
+/// @param y normalised aim y, replaced by the prediction.
+/// @param t sensor timestamp of the measurement, in us.
+void pigun_predict_run(pigun_predictor_t* pr, float* x, float* y, int64_t t) {
+
+	pigun_predict_sample_t* s = &(pr->trace[pr->ntrace % PREDICT_TRACE]);
+	s->t = t;
+	s->x = *x;
+	s->y = *y;
+	pr->ntrace++;
+
+	int64_t dt = t - pr->t_last;
+	pr->t_last = t;
+
+	if (!pr->ready || dt <= 0 || dt > PREDICT_GAP) {
+		kalman_reset(&(pr->kx), *x, pr->r);
+		kalman_reset(&(pr->ky), *y, pr->r);
+		pr->ready = 1;
+		pr->nresets++;
+		return;
+	}
+
+	kalman_step(&(pr->kx), *x, dt * 1.0e-6f, pr->q, pr->r);
+	kalman_step(&(pr->ky), *y, dt * 1.0e-6f, pr->q, pr->r);
+
+	float h = pr->horizon * 1.0e-6f;
+	*x = pr->kx.p + pr->kx.v * h;
+	*y = pr->ky.p + pr->ky.v * h;
+}
+
+
+/// @brief Copies the recorded measurements in chronological order.
+/// Called from the control thread: the last few samples may be overwritten by the camera thread
+/// meanwhile, which only affects a replay marginally.
+/// @param pr predictor.
+/// @param out output array, PREDICT_TRACE samples long.
+/// @return number of samples copied.
+int pigun_predict_trace(const pigun_predictor_t* pr, pigun_predict_sample_t* out) {
+
+	uint32_t total = pr->ntrace;
+	int ns = (total < PREDICT_TRACE) ? total : PREDICT_TRACE;
+	for (int i = 0; i < ns; i++)
+		out[i] = pr->trace[(total - ns + i) % PREDICT_TRACE];
+	return ns;
+}
+
+
+/// @brief Replays the recorded measurements with different horizons.
+/// For each frame, the aim sent without prediction (hold) and with prediction are compared with
+/// the measured aim at the frame time + horizon, interpolated between the frames around it.
+/// @param pr predictor, its noise parameters are used for the replay.
+/// @param horizons list of horizons to test, in us.
+/// @param n number of horizons.
+/// @param err_hold output RMS error without prediction, for each horizon.
+/// @param err_pred output RMS error with prediction, for each horizon.
+/// @return number of measurements replayed.
+int pigun_predict_score(const pigun_predictor_t* pr, const int32_t* horizons, int n, float* err_hold, float* err_pred) {
+
+	static pigun_predict_sample_t replay[PREDICT_TRACE];
+	int ns = pigun_predict_trace(pr, replay);
+
+	for (int k = 0; k < n; k++) {
+
+		pigun_kalman_t kx, ky;
+		double sh = 0, sp = 0;
+		int count = 0, j = 0;
+		float h = horizons[k] * 1.0e-6f;
+
+		for (int i = 0; i < ns; i++) {
+
+			pigun_predict_sample_t* s = &(replay[i]);
+			if (i == 0 || s->t - replay[i - 1].t > PREDICT_GAP || s->t <= replay[i - 1].t) {
+				kalman_reset(&kx, s->x, pr->r);
+				kalman_reset(&ky, s->y, pr->r);
+				continue;
+			}
+			float dt = (s->t - replay[i - 1].t) * 1.0e-6f;
+			kalman_step(&kx, s->x, dt, pr->q, pr->r);
+			kalman_step(&ky, s->y, dt, pr->q, pr->r);
+
+			// find the measurements around the target time, without crossing a gap
+			int64_t target = s->t + horizons[k];
+			if (j < i) j = i;
+			while (j + 1 < ns && replay[j + 1].t < target && replay[j + 1].t - replay[j].t <= PREDICT_GAP) j++;
+			if (j + 1 >= ns || replay[j + 1].t - replay[j].t > PREDICT_GAP) continue;
+
+			float a = (float)(target - replay[j].t) / (replay[j + 1].t - replay[j].t);
+			float tx = replay[j].x + a * (replay[j + 1].x - replay[j].x);
+			float ty = replay[j].y + a * (replay[j + 1].y - replay[j].y);
+
+			float px = kx.p + kx.v * h, py = ky.p + ky.v * h;
+			sh += (s->x - tx) * (s->x - tx) + (s->y - ty) * (s->y - ty);
+			sp += (px - tx) * (px - tx) + (py - ty) * (py - ty);
+			count++;
+		}
+
+		err_hold[k] = (count > 0) ? sqrt(sh / count) : 0;
+		err_pred[k] = (count > 0) ? sqrt(sp / count) : 0;
+	}
+
+	return ns;
+}
@@ -0,0 +1,53 @@
+#include <stdint.h>
+
+#ifndef PIGUN_PREDICT
+#define PIGUN_PREDICT
+
+
+#define PREDICT_HORIZON 20000	// default prediction horizon from the sensor timestamp, in us (0 = no prediction)
+#define PREDICT_MAXHORIZON 100000	// longest horizon allowed, in us
+#define PREDICT_GAP 100000		// a gap in the measurements longer than this resets the filter, in us
+#define PREDICT_Q 5.0f			// process noise: white acceleration density, in (normalised units)^2/s^3
+#define PREDICT_R 1.0e-6f		// measurement noise variance of the normalised aim
+#define PREDICT_TRACE 512		// measurements kept for the replay score (~13 s at 40 fps)
+
+
+/// @brief Constant-velocity Kalman filter on one axis.
+typedef struct {
+	float p, v;				// position and velocity (units/s)
+	float p00, p01, p11;	// covariance
+} pigun_kalman_t;
+
+/// @brief One measurement of the normalised aim.
+typedef struct {
+	int64_t t;		// sensor timestamp, in us
+	float x, y;
+} pigun_predict_sample_t;
+
+/// @brief Aim predictor: extrapolates the normalised aim to the time the report goes out.
+typedef struct {
+
+	int32_t			horizon;	// how far ahead to predict, in us
+	float			q, r;		// noise parameters
+
+	pigun_kalman_t	kx, ky;
+	int64_t			t_last;		// sensor time of the last measurement
+	uint8_t			ready;		// 0 until the first measurement after a reset
+	uint32_t		nresets;	// times the filter was restarted
+
+	// recent measurements, to replay them with different horizons
+	pigun_predict_sample_t	trace[PREDICT_TRACE];
+	uint32_t		ntrace;		// total measurements recorded, the ring index is ntrace % PREDICT_TRACE
+
+} pigun_predictor_t;
+
+
+void pigun_predict_init(pigun_predictor_t* pr);
+void pigun_predict_reset(pigun_predictor_t* pr);
+void pigun_predict_run(pigun_predictor_t* pr, float* x, float* y, int64_t t);
+
+int pigun_predict_trace(const pigun_predictor_t* pr, pigun_predict_sample_t* out);
+int pigun_predict_score(const pigun_predictor_t* pr, const int32_t* horizons, int n, float* err_hold, float* err_pred);
+
+
+#endif
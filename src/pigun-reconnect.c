@@ -0,0 +1,274 @@
+/*
+* Reconnection to the known hosts (classic bluetooth).
+*
+* The last RECONNECT_HOSTS hosts are kept in RECONNECT_FILE, most recent first. At start and after a
+* link loss, a round pages them in that order: the most recent one with a page timeout long enough for
+* both page trains over a standard 1.28 s page scan, the others with a shorter one, so a host that is
+* off costs little. The controller pages one host at a time, so the hosts are tried in sequence.
+* After each round nothing is paged for a while: BTstack's hid_device has a single connection, and
+* refuses a host that connects in while another one is being paged. Meanwhile the gun stays
+* connectable with a fast interlaced page scan, so a host connecting in gets through quickly;
+* the page scan goes back to the standard interval once connected, to leave the radio to the reports.
+*
+* Page timeouts and page scan settings are HCI commands, queued and sent one at a time like in pigun-link.c.
+* All of this runs in the BTstack thread.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btstack.h"
+
+#include "pigun.h"
+#include "pigun-reconnect.h"
+#include "pigun-timer.h"
+
+
+// HCI command descriptors not exported by every BTstack version
+#define RECONNECT_OPCODE(ogf, ocf) (((ogf) << 10) | (ocf))
+
+static const hci_cmd_t reconnect_cmd_page_timeout = { RECONNECT_OPCODE(0x03, 0x0018), "2" };	// page timeout
+static const hci_cmd_t reconnect_cmd_scan_activity = { RECONNECT_OPCODE(0x03, 0x001C), "22" };	// page scan interval, window
+static const hci_cmd_t reconnect_cmd_scan_type = { RECONNECT_OPCODE(0x03, 0x0047), "1" };		// 0=standard, 1=interlaced
+
+#define RECONNECT_SCAN_INTERLACED 0x01
+
+// commands waiting to be sent, in the order they go out
+enum {
+	RECONNECT_CMD_SCAN_FAST = 0x01,
+	RECONNECT_CMD_SCAN_SLOW = 0x02,
+	RECONNECT_CMD_SCAN_TYPE = 0x04,
+	RECONNECT_CMD_PAGE_TIMEOUT = 0x08
+};
+
+static enum {
+	RECONNECT_IDLE,			// connected, or no host to page
+	RECONNECT_SETUP,		// page timeout being written, then the page starts
+	RECONNECT_PAGING,		// waiting for the connection to the host
+	RECONNECT_LISTENING		// pause between rounds
+} reconnect_state = RECONNECT_IDLE;
+
+static btstack_packet_callback_registration_t reconnect_callback_registration;
+static pigun_timer_t reconnect_timer;
+static pigun_reconnect_info_t reconnect;
+static uint8_t reconnect_pending = 0;	// commands to send
+static uint16_t reconnect_timeout;		// page timeout of the next page
+static uint16_t reconnect_cid;
+
+
+// sends the queued commands, while the controller takes them
+static void reconnect_send() {
+
+	while (reconnect_pending && hci_can_send_command_packet_now()) {
+
+		uint8_t cmd = reconnect_pending & (~reconnect_pending + 1);	// lowest bit first
+		reconnect_pending &= ~cmd;
+
+		switch (cmd) {
+		case RECONNECT_CMD_SCAN_FAST:
+			hci_send_cmd(&reconnect_cmd_scan_activity, RECONNECT_SCAN_FAST, RECONNECT_SCAN_WINDOW);
+			break;
+		case RECONNECT_CMD_SCAN_SLOW:
+			hci_send_cmd(&reconnect_cmd_scan_activity, RECONNECT_SCAN_SLOW, RECONNECT_SCAN_WINDOW);
+			break;
+		case RECONNECT_CMD_SCAN_TYPE:
+			hci_send_cmd(&reconnect_cmd_scan_type, RECONNECT_SCAN_INTERLACED);
+			break;
+		case RECONNECT_CMD_PAGE_TIMEOUT:
+			hci_send_cmd(&reconnect_cmd_page_timeout, reconnect_timeout);
+			break;
+		}
+	}
+}
+
+static void reconnect_listen(uint32_t ms) {
+
+	reconnect_state = RECONNECT_LISTENING;
+	pigun_timer_start(&reconnect_timer, ms * 1000, 0);
+}
+
+// pages the next host of the round, or pauses at the end of it
+static void reconnect_next() {
+
+	if (reconnect.host >= reconnect.hosts) {
+		reconnect.rounds++;
+		reconnect.host = 0;
+		reconnect_listen((reconnect.rounds < RECONNECT_ROUNDS) ? RECONNECT_LISTEN : RECONNECT_LISTEN_SLOW);
+		return;
+	}
+
+	// the page starts when the controller has the timeout for this host
+	reconnect_timeout = (reconnect.host == 0) ? RECONNECT_PAGE_MRU : RECONNECT_PAGE_OTHER;
+	reconnect_state = RECONNECT_SETUP;
+	reconnect_pending |= RECONNECT_CMD_PAGE_TIMEOUT;
+	reconnect_send();
+}
+
+static void reconnect_page() {
+
+	bd_addr_t addr;
+	memcpy(addr, pigun.servers[reconnect.host], sizeof(bd_addr_t));
+	printf("PIGUN-HID: paging host[%i] %s, timeout %u ms\n", reconnect.host, bd_addr_to_str(addr), reconnect_timeout * 5 / 8);
+
+	reconnect_state = RECONNECT_PAGING;
+	reconnect.paging = 1;
+	reconnect.pages++;
+	uint8_t status = hid_device_connect(addr, &reconnect_cid);
+	if (status != ERROR_CODE_SUCCESS) {
+		// busy, likely with a host connecting in: if it does not, the next round starts later
+		printf("PIGUN-HID: page not started, status 0x%x\n", status);
+		reconnect.paging = 0;
+		reconnect.host = 0;
+		reconnect_listen(RECONNECT_LISTEN);
+	}
+}
+
+static void reconnect_tick(pigun_timer_t* timer) {
+	UNUSED(timer);
+	if (reconnect_state != RECONNECT_LISTENING) return;
+	reconnect_next();
+}
+
+
+static void reconnect_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packet, uint16_t size) {
+	UNUSED(channel);
+	UNUSED(size);
+
+	if (packet_type != HCI_EVENT_PACKET) return;
+
+	switch (hci_event_packet_get_type(packet)) {
+
+	case HCI_EVENT_COMMAND_COMPLETE:
+		if (hci_event_command_complete_get_command_opcode(packet) == reconnect_cmd_page_timeout.opcode
+			&& reconnect_state == RECONNECT_SETUP)
+			reconnect_page();
+		reconnect_send();
+		break;
+
+	case HCI_EVENT_COMMAND_STATUS:
+		reconnect_send();
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+// reads the host list, most recent first
+static void reconnect_load() {
+
+	int n = 0;
+	pigun.nServers = 0;
+
+	FILE* fin = fopen(RECONNECT_FILE, "rb");
+	if (fin == NULL) {
+		printf("PIGUN-HID: no previous hosts\n");
+		return;
+	}
+	if (fread(&n, sizeof(int), 1, fin) != 1 || n < 0) n = 0;
+	if (n > RECONNECT_HOSTS) n = RECONNECT_HOSTS;
+
+	printf("PIGUN-HID: previous hosts: %i\n", n);
+	for (int i = 0; i < n; i++) {
+		if (fread(pigun.servers[i], sizeof(bd_addr_t), 1, fin) != 1) break;
+		printf("\thost[%i]: %s\n", i, bd_addr_to_str(pigun.servers[i]));
+		pigun.nServers++;
+	}
+	fclose(fin);
+}
+
+// puts the host on top of the list, and writes it
+static void reconnect_save(bd_addr_t host) {
+
+	bd_addr_t list[RECONNECT_HOSTS];
+	int n = 1;
+
+	memcpy(list[0], host, sizeof(bd_addr_t));
+	for (int i = 0; i < pigun.nServers && n < RECONNECT_HOSTS; i++) {
+		if (bd_addr_cmp(host, pigun.servers[i]) == 0) continue;
+		memcpy(list[n++], pigun.servers[i], sizeof(bd_addr_t));
+	}
+	memcpy(pigun.servers[0], list[0], n * sizeof(bd_addr_t));
+	pigun.nServers = n;
+
+	FILE* fout = fopen(RECONNECT_FILE, "wb");
+	if (fout == NULL) {
+		printf("PIGUN ERROR: unable to write %s\n", RECONNECT_FILE);
+		return;
+	}
+	fwrite(&n, sizeof(int), 1, fout);
+	fwrite(list, sizeof(bd_addr_t), n, fout);
+	fclose(fout);
+}
+
+
+/// @brief Reads the known hosts and gets ready to page them. Call before the stack is powered on.
+void pigun_reconnect_init() {
+
+	reconnect_load();
+	pigun_timer_setup(&reconnect_timer, &reconnect_tick, NULL);
+
+	reconnect_callback_registration.callback = &reconnect_packet_handler;
+	hci_add_event_handler(&reconnect_callback_registration);
+}
+
+/// @brief Starts a round of pages from the most recent host, at start and after a link loss.
+void pigun_reconnect_start() {
+
+	// a new round: the connection counters stay
+	reconnect.hosts = pigun.nServers;
+	reconnect.paging = 0;
+	reconnect.host = 0;
+	reconnect.pages = 0;
+	reconnect.rounds = 0;
+
+	// hosts connecting in get through quickly
+	gap_connectable_control(1);
+	reconnect_pending |= RECONNECT_CMD_SCAN_TYPE | RECONNECT_CMD_SCAN_FAST;
+	reconnect_send();
+
+	if (reconnect.hosts == 0) {
+		reconnect_state = RECONNECT_IDLE;
+		return;
+	}
+	reconnect_next();
+}
+
+/// @brief A host connected: stops paging and puts it on top of the list.
+/// @param host the host address.
+void pigun_reconnect_connected(bd_addr_t host) {
+
+	uint8_t paged = reconnect.paging && bd_addr_cmp(host, pigun.servers[reconnect.host]) == 0;
+	if (paged) reconnect.outgoing++;
+	else reconnect.incoming++;
+	printf("PIGUN-HID: %s connection after %u pages\n", paged ? "outgoing" : "incoming", reconnect.pages);
+
+	reconnect_state = RECONNECT_IDLE;
+	reconnect.paging = 0;
+	pigun_timer_cancel(&reconnect_timer);
+
+	reconnect_save(host);
+	reconnect.hosts = pigun.nServers;
+
+	reconnect_pending &= ~(RECONNECT_CMD_SCAN_FAST | RECONNECT_CMD_PAGE_TIMEOUT);
+	reconnect_pending |= RECONNECT_CMD_SCAN_SLOW;
+	reconnect_send();
+}
+
+/// @brief The page of the current host failed: goes to the next one.
+/// @param status HCI status of the failed connection.
+void pigun_reconnect_failed(uint8_t status) {
+
+	if (reconnect_state != RECONNECT_PAGING) return;
+	printf("PIGUN-HID: host[%i] not reached, status 0x%x\n", reconnect.host, status);
+	reconnect.paging = 0;
+	reconnect.host++;
+	reconnect_next();
+}
+
+/// @brief Copies the reconnection state.
+void pigun_reconnect_info(pigun_reconnect_info_t* info) {
+	*info = reconnect;
+}
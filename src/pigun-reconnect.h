@@ -0,0 +1,40 @@
+#include <stdint.h>
+
+#include "btstack.h"
+
+#ifndef PIGUN_RECONNECT
+#define PIGUN_RECONNECT
+
+
+#define RECONNECT_FILE "servers.bin"	// hosts the gun was connected to, most recent first
+#define RECONNECT_HOSTS 3				// hosts remembered
+#define RECONNECT_PAGE_MRU 0x1000		// page timeout for the most recent host, in slots of 0.625 ms (2.56 s)
+#define RECONNECT_PAGE_OTHER 0x0800		// page timeout for the other hosts (1.28 s)
+#define RECONNECT_LISTEN 2000			// ms without paging after each round, for the hosts that connect in
+#define RECONNECT_LISTEN_SLOW 10000		// the same after RECONNECT_ROUNDS rounds without a connection
+#define RECONNECT_ROUNDS 5
+#define RECONNECT_SCAN_FAST 0x0200		// page scan interval while not connected, in slots (320 ms)
+#define RECONNECT_SCAN_SLOW 0x0800		// page scan interval while connected (1.28 s, the default)
+#define RECONNECT_SCAN_WINDOW 0x0012	// page scan window (11.25 ms)
+
+
+/// @brief State of the reconnection to the known hosts.
+typedef struct {
+	uint8_t hosts;			// hosts in the list
+	uint8_t paging;			// 1 while a host is being paged
+	uint8_t host;			// host paged (or next to page) in the round
+	uint32_t pages;			// pages since the link went down
+	uint32_t rounds;		// rounds since the link went down
+	uint32_t incoming;		// connections made by the host
+	uint32_t outgoing;		// connections made by paging
+} pigun_reconnect_info_t;
+
+
+void pigun_reconnect_init(void);
+void pigun_reconnect_start(void);
+void pigun_reconnect_connected(bd_addr_t host);
+void pigun_reconnect_failed(uint8_t status);
+void pigun_reconnect_info(pigun_reconnect_info_t* info);
+
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdint.h>
+
+#ifndef PIGUN_REPORT
+#define PIGUN_REPORT
+
+// HID reports of the gun, as the host sees them on any transport.
+// No BTstack in here: the host tools in tools/ use this too.
+
+
+#define PIGUN_REPORT_ID 0x03
+#define PIGUN_TELEMETRY_ID 0x04	// vendor report with the tracking telemetry
+#define PIGUN_PARAM_ID 0x05		// vendor feature report of the runtime parameters
+#define HID_REPORT_SIZE 5		// bytes in the joystick report (without the report ID): x, y, buttons
+#define HID_TELEMETRY_SIZE 16	// bytes in the telemetry report (without the report ID)
+#define HID_TELEMETRY_STEP 50	// telemetry period step for the 0x2k host command, in ms
+#define HID_PARAM_SIZE 32		// bytes in the parameter report (without the report ID)
+#define HID_MAXREPORT 33		// longest report, with its ID
+
+// data commands: one byte in the output report (ID 3), command in the high nibble, parameter in the low one
+#define HID_CMD_FIRE 0x0		// 1 = fire the solenoid, in recoil mode RECOIL_HID
+#define HID_CMD_RECOIL 0x1		// set the recoil mode
+#define HID_CMD_TELEMETRY 0x2	// 1 = send one telemetry report, k = one every k*HID_TELEMETRY_STEP ms, 0 = stop
+#define HID_CMD_BURST 0x3		// k = fire k pulses one period apart, 0 = drop the shots waiting, in recoil mode RECOIL_HID
+
+// parameter feature report (ID 5): the host writes a request, and reads back the parameter it addressed.
+// On usb the gadget does not serve GET_REPORT: the answer also comes as an input report with the same ID.
+// Parameter IDs never change, new ones go at the end: a host lists them with GET from 0 until PARAM_ERR_ID.
+#define HID_PARAM_VERSION 1		// protocol version, in the first byte of every request and answer
+
+#define PARAM_AT_VERSION 0		// byte offsets in the report
+#define PARAM_AT_OP 1
+#define PARAM_AT_ID 2
+#define PARAM_AT_STATUS 3		// answer only
+#define PARAM_AT_VALUE 4		// int32, little endian: the setting x 10^decimals
+#define PARAM_AT_MIN 8			// int32, answer only
+#define PARAM_AT_MAX 12			// int32, answer only
+#define PARAM_AT_DECIMALS 16	// answer only
+#define PARAM_AT_COUNT 17		// number of parameters, answer only
+#define PARAM_AT_NAME 18		// NUL padded, answer only
+#define PARAM_NAMELEN 14
+
+#define PARAM_OP_GET 0			// only address the parameter
+#define PARAM_OP_SET 1			// set it, applied with the staged ones (between two frames for the frame processing ones)
+#define PARAM_OP_STAGE 2		// set it, held until the next SET or COMMIT
+#define PARAM_OP_COMMIT 3		// apply the staged parameters (between two frames for the frame processing ones)
+#define PARAM_OP_DISCARD 4		// drop the staged parameters
+
+#define PARAM_OK 0				// the value read back is the one in use
+#define PARAM_PENDING 1			// a new value is staged or waiting for the next frame
+#define PARAM_ERR_VERSION 0x80	// unknown protocol version
+#define PARAM_ERR_OP 0x81		// unknown operation
+#define PARAM_ERR_ID 0x82		// no parameter with this ID
+#define PARAM_ERR_RANGE 0x83	// value out of range, nothing changed
+
+
+/// @brief Flags in the telemetry report.
+typedef enum {
+	TELEMETRY_LOST = 0x01,		// the last frame did not have 4 beacons
+	TELEMETRY_DEGRADED = 0x02,	// the detector is in fast mode to keep up
+	TELEMETRY_SKIPPING = 0x04	// frames are being skipped
+} pigun_telemetry_flags_t;
+
+
+#endif
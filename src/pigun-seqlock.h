@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+#ifndef PIGUN_SEQLOCK
+#define PIGUN_SEQLOCK
+
+
+// Sequence lock: one writer, any number of readers, nobody blocks.
+// The writer makes the sequence odd, writes, and makes it even again; the reader copies the data
+// between pigun_seqlock_read_begin and pigun_seqlock_read_retry, and copies again if the sequence
+// was odd or changed meanwhile. Header only, so tools/pigun-seqlock-stress runs the same code.
+
+/// @brief Starts a write. Only one thread at a time can write.
+static inline void pigun_seqlock_write_begin(uint32_t* seq) {
+
+	uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/// @brief Ends a write: the readers can take the new data.
+static inline void pigun_seqlock_write_end(uint32_t* seq) {
+
+	uint32_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELEASE);
+}
+
+/// @brief Starts a read.
+/// @return the sequence, to pass to pigun_seqlock_read_retry.
+static inline uint32_t pigun_seqlock_read_begin(const uint32_t* seq) {
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/// @brief Ends a read.
+/// @return 1 if the copy may be torn and must be taken again.
+static inline int pigun_seqlock_read_retry(const uint32_t* seq, uint32_t start) {
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (start & 1) || start != __atomic_load_n(seq, __ATOMIC_RELAXED);
+}
+
+
+#endif
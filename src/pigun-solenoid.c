@@ -0,0 +1,343 @@
+/*
+* Solenoid pulse generator: a thread of its own drives the solenoid pin on a timerfd, so the pulse
+* width and the auto fire period are in us and do not depend on the camera frame rate.
+*
+* Shots are queued by the other threads (trigger, host commands) and the thread fires them:
+*	single shots at least pulse + SOLENOID_GAP apart
+*	bursts (host command) and auto fire (trigger held) one every period, never less than pulse + SOLENOID_GAP
+* Every pulse is checked against a duty cycle budget: the last pulses are kept, and a pulse only
+* fires if the on time in the SOLENOID_WINDOW ending with it stays within duty x SOLENOID_WINDOW.
+* A shot that does not fit is dropped, so the solenoid is never on more than duty over any window,
+* whatever the host sends.
+*
+* The thread asks for real time priority, and runs at normal priority if it cannot get it.
+* The pin is swappable: pigun_solenoid_sim records the edges instead of driving a GPIO, to measure
+* the pulses without hardware.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+
+#include "pigun.h"
+#include "pigun-solenoid.h"
+
+
+static int solenoid_fd = -1;
+static pthread_t solenoid_thread;
+static volatile int solenoid_running = 0;
+
+// everything below is protected by the mutex
+static pthread_mutex_t solenoid_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const pigun_solenoid_pin_t* solenoid_pin = NULL;
+
+static uint32_t solenoid_pulse = SOLENOID_PULSE;
+static uint32_t solenoid_period = SOLENOID_PERIOD;
+static uint8_t solenoid_duty = SOLENOID_DUTY;
+
+static uint8_t solenoid_on = 0;
+static uint8_t solenoid_burst = 0;		// the queued shots are a burst: one every period
+static uint8_t solenoid_holding = 0;	// auto fire
+static uint32_t solenoid_queued = 0;
+static int64_t solenoid_t_off = 0;		// end of the pulse being fired
+static int64_t solenoid_t_next = 0;		// earliest start of the next pulse
+static int64_t solenoid_t_wake = 0;		// time the timer was set for, 0 if woken up on request
+static int64_t solenoid_history[SOLENOID_HISTORY];	// start of the last pulses, us
+static uint32_t solenoid_history_width[SOLENOID_HISTORY];
+static uint32_t solenoid_npulses = 0;	// pulses in the history so far (wraps around)
+static pigun_solenoid_stats_t solenoid_stats;
+
+// simulated pin
+static pigun_solenoid_edge_t solenoid_edges[SOLENOID_EDGES];
+static uint32_t solenoid_nedges = 0;
+
+
+static void sim_write(uint8_t fire) {
+
+	pigun_solenoid_edge_t* e = &solenoid_edges[solenoid_nedges % SOLENOID_EDGES];
+	e->t = pigun_now_us();
+	e->fire = fire;
+	solenoid_nedges++;
+}
+
+const pigun_solenoid_pin_t pigun_solenoid_sim = { "sim", sim_write };
+
+
+// sets the timer at the absolute time t (us, monotonic clock), or as soon as possible if t is 0
+static void solenoid_arm(int64_t t) {
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	solenoid_t_wake = t;
+	if (t > 0) {
+		its.it_value.tv_sec = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+		timerfd_settime(solenoid_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+	else {
+		its.it_value.tv_nsec = 1;
+		timerfd_settime(solenoid_fd, 0, &its, NULL);
+	}
+}
+
+static void solenoid_write(uint8_t fire) {
+	if (solenoid_pin != NULL) solenoid_pin->write(fire);
+	solenoid_on = fire;
+}
+
+// on time in the window that ends at t_end, from the pulses fired so far
+static int64_t solenoid_ontime(int64_t t_end) {
+
+	int64_t t_start = t_end - SOLENOID_WINDOW;
+	int64_t on = 0;
+	uint32_t n = (solenoid_npulses < SOLENOID_HISTORY) ? solenoid_npulses : SOLENOID_HISTORY;
+	for (uint32_t i = 0; i < n; i++) {
+		int64_t a = solenoid_history[i];
+		int64_t b = a + solenoid_history_width[i];
+		if (a < t_start) a = t_start;
+		if (b > t_end) b = t_end;
+		if (b > a) on += b - a;
+	}
+	return on;
+}
+
+// runs the pulses at time now, sets the timer for the next edge
+static void solenoid_run(int64_t now) {
+
+	if (solenoid_t_wake > 0 && now - solenoid_t_wake > solenoid_stats.late_max)
+		solenoid_stats.late_max = now - solenoid_t_wake;
+
+	if (solenoid_on && now >= solenoid_t_off) solenoid_write(0);
+
+	if (!solenoid_on && (solenoid_queued || solenoid_holding) && now >= solenoid_t_next) {
+
+		// the pulse must fit in the budget of the window that ends with it
+		int64_t budget = (int64_t)solenoid_duty * SOLENOID_WINDOW / 100;
+		uint8_t repeat = solenoid_burst || solenoid_holding;
+		if (solenoid_ontime(now + solenoid_pulse) + solenoid_pulse <= budget) {
+			solenoid_write(1);
+			solenoid_t_off = now + solenoid_pulse;
+			solenoid_history[solenoid_npulses % SOLENOID_HISTORY] = now;
+			solenoid_history_width[solenoid_npulses % SOLENOID_HISTORY] = solenoid_pulse;
+			solenoid_npulses++;
+			solenoid_stats.pulses++;
+		}
+		else solenoid_stats.denied++;
+
+		// the coil always gets a rest between two pulses, whatever the period
+		uint32_t spacing = solenoid_pulse + SOLENOID_GAP;
+		if (repeat && solenoid_period > spacing) spacing = solenoid_period;
+		solenoid_t_next = now + spacing;
+
+		if (solenoid_queued > 0 && --solenoid_queued == 0) solenoid_burst = 0;
+	}
+
+	if (solenoid_on) solenoid_arm(solenoid_t_off);
+	else if (solenoid_queued || solenoid_holding) solenoid_arm(solenoid_t_next);
+	else {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(solenoid_fd, 0, &its, NULL);
+		solenoid_t_wake = 0;
+	}
+}
+
+static void* solenoid_cycle(void* nullargs) {
+
+	uint64_t expirations;
+
+	while (solenoid_running) {
+
+		ssize_t r = read(solenoid_fd, &expirations, sizeof(expirations));
+		if (r < 0 && errno != EINTR) {
+			printf("PIGUN ERROR: solenoid timer failed (%s)\n", strerror(errno));
+			break;
+		}
+		if (!solenoid_running) break;
+
+		pthread_mutex_lock(&solenoid_mutex);
+		solenoid_run(pigun_now_us());
+		pthread_mutex_unlock(&solenoid_mutex);
+	}
+
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_write(0);
+	pthread_mutex_unlock(&solenoid_mutex);
+
+	solenoid_running = 0;
+	return NULL;
+}
+
+
+/// @brief Starts the pulse thread.
+/// @param pin the solenoid output (the GPIO one, or pigun_solenoid_sim).
+/// @return 0 if everything went fine, otherwise the solenoid does not fire.
+int pigun_solenoid_init(const pigun_solenoid_pin_t* pin) {
+
+	solenoid_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (solenoid_fd < 0) {
+		printf("PIGUN ERROR: unable to create the solenoid timer (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	solenoid_pin = pin;
+	solenoid_write(0);
+	memset(&solenoid_stats, 0, sizeof(solenoid_stats));
+	solenoid_npulses = 0;
+
+	// real time priority if we are allowed, so the pulse edges are not late behind the camera
+	pthread_attr_t attr;
+	struct sched_param sp = { .sched_priority = SOLENOID_PRIORITY };
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &sp);
+
+	solenoid_running = 1;
+	int r = pthread_create(&solenoid_thread, &attr, solenoid_cycle, NULL);
+	pthread_attr_destroy(&attr);
+	if (r == EPERM) {
+		printf("PIGUN: no real time priority for the solenoid thread\n");
+		r = pthread_create(&solenoid_thread, NULL, solenoid_cycle, NULL);
+	}
+	if (r != 0) {
+		printf("PIGUN ERROR: unable to start the solenoid thread\n");
+		solenoid_running = 0;
+		close(solenoid_fd);
+		solenoid_fd = -1;
+		return 1;
+	}
+
+	printf("PIGUN: solenoid on %s, pulse %u us, period %u us, duty %u%%\n", pin->name, solenoid_pulse, solenoid_period, solenoid_duty);
+	return 0;
+}
+
+void pigun_solenoid_stop() {
+
+	if (solenoid_fd < 0) return;
+	solenoid_running = 0;
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_arm(0);
+	pthread_mutex_unlock(&solenoid_mutex);
+	pthread_join(solenoid_thread, NULL);
+	close(solenoid_fd);
+	solenoid_fd = -1;
+}
+
+/// @brief Changes the solenoid output. A pulse being fired is ended on the old one.
+void pigun_solenoid_output(const pigun_solenoid_pin_t* pin) {
+
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_write(0);
+	solenoid_pin = pin;
+	pthread_mutex_unlock(&solenoid_mutex);
+	printf("PIGUN: solenoid on %s\n", pin->name);
+}
+
+const pigun_solenoid_pin_t* pigun_solenoid_get_output() {
+	return solenoid_pin;
+}
+
+/// @brief Queues shots, from any thread.
+/// @param count number of shots, 0 drops the ones waiting.
+/// @param burst 1 to fire them one every period, 0 as single shots.
+void pigun_solenoid_fire(uint8_t count, uint8_t burst) {
+
+	pthread_mutex_lock(&solenoid_mutex);
+	if (count == 0) {
+		solenoid_queued = 0;
+		solenoid_burst = 0;
+	}
+	else {
+		if (solenoid_queued + count > SOLENOID_QUEUE) {
+			solenoid_stats.dropped += solenoid_queued + count - SOLENOID_QUEUE;
+			count = SOLENOID_QUEUE - solenoid_queued;
+		}
+		solenoid_queued += count;
+		if (burst) solenoid_burst = 1;
+		if (solenoid_running) solenoid_arm(0);
+	}
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+/// @brief Starts or stops the auto fire.
+void pigun_solenoid_hold(uint8_t on) {
+
+	if (on == solenoid_holding) return;
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_holding = on;
+	if (on && solenoid_running) solenoid_arm(0);
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+/// @brief Sets the pulse width, from the next pulse. The period is raised if it leaves no rest.
+void pigun_solenoid_pulse(uint32_t us) {
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_pulse = us;
+	if (solenoid_period < us + SOLENOID_GAP) {
+		solenoid_period = us + SOLENOID_GAP;
+		printf("PIGUN: solenoid period raised to %u us\n", solenoid_period);
+	}
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+uint32_t pigun_solenoid_get_pulse() {
+	return solenoid_pulse;
+}
+
+/// @brief Sets the period of auto fire and bursts, at least pulse + SOLENOID_GAP.
+void pigun_solenoid_period(uint32_t us) {
+	pthread_mutex_lock(&solenoid_mutex);
+	if (us < solenoid_pulse + SOLENOID_GAP) {
+		us = solenoid_pulse + SOLENOID_GAP;
+		printf("PIGUN: solenoid period raised to %u us\n", us);
+	}
+	solenoid_period = us;
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+uint32_t pigun_solenoid_get_period() {
+	return solenoid_period;
+}
+
+/// @brief Sets the duty cycle budget, in %. The pulses already fired count against the new one.
+void pigun_solenoid_duty(uint8_t percent) {
+
+	pthread_mutex_lock(&solenoid_mutex);
+	solenoid_duty = percent;
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+uint8_t pigun_solenoid_get_duty() {
+	return solenoid_duty;
+}
+
+void pigun_solenoid_stats(pigun_solenoid_stats_t* stats) {
+
+	pthread_mutex_lock(&solenoid_mutex);
+	*stats = solenoid_stats;
+	stats->credit = (int64_t)solenoid_duty * SOLENOID_WINDOW / 100 - solenoid_ontime(pigun_now_us());
+	stats->queued = solenoid_queued;
+	stats->hold = solenoid_holding;
+	pthread_mutex_unlock(&solenoid_mutex);
+}
+
+/// @brief Gets the last edges of the simulated pin, oldest first.
+/// @return the number of edges copied.
+int pigun_solenoid_edges(pigun_solenoid_edge_t* edges, int maxedges) {
+
+	pthread_mutex_lock(&solenoid_mutex);
+	uint32_t n = solenoid_nedges;
+	if (n > SOLENOID_EDGES) n = SOLENOID_EDGES;
+	if (n > (uint32_t)maxedges) n = maxedges;
+	for (uint32_t i = 0; i < n; i++)
+		edges[i] = solenoid_edges[(solenoid_nedges - n + i) % SOLENOID_EDGES];
+	pthread_mutex_unlock(&solenoid_mutex);
+	return n;
+}
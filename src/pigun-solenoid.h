@@ -0,0 +1,66 @@
+#include <stdint.h>
+
+#ifndef PIGUN_SOLENOID
+#define PIGUN_SOLENOID
+
+
+#define SOLENOID_PULSE 30000		// default pulse width, us
+#define SOLENOID_MAXPULSE 100000	// longest pulse allowed, us
+#define SOLENOID_GAP 20000			// shortest off time between two single shots, us
+#define SOLENOID_PERIOD 150000		// default period of auto fire and bursts, us
+#define SOLENOID_MINPERIOD 40000	// shortest period allowed, us
+#define SOLENOID_DUTY 25			// default duty cycle budget, %
+#define SOLENOID_MAXDUTY 60			// highest budget allowed, %
+#define SOLENOID_WINDOW 2000000		// the budget is the duty cycle over this time, us
+#define SOLENOID_HISTORY 128		// pulses kept for the budget: more than fit in a window (SOLENOID_WINDOW / SOLENOID_GAP)
+#define SOLENOID_QUEUE 15			// shots waiting at most (a burst is up to 15 pulses)
+#define SOLENOID_PRIORITY 50		// SCHED_FIFO priority of the pulse thread
+#define SOLENOID_EDGES 64			// edges remembered by the simulated pin
+
+
+/// @brief Output driving the solenoid. The pulse thread is the only caller.
+typedef struct {
+	const char*	name;
+	void		(*write)(uint8_t fire);	// 1 = solenoid on
+} pigun_solenoid_pin_t;
+
+/// @brief An edge recorded by the simulated pin.
+typedef struct {
+	int64_t		t;		// pigun_now_us when the pin was written
+	uint8_t		fire;
+} pigun_solenoid_edge_t;
+
+/// @brief Counters of the pulse generator.
+typedef struct {
+	uint32_t	pulses;		// pulses fired
+	uint32_t	denied;		// shots dropped because the duty cycle budget was used up
+	uint32_t	dropped;	// shots dropped because the queue was full
+	int64_t		credit;		// on time left in the budget of the last window, us
+	int64_t		late_max;	// worst delay of an edge after its time, us
+	uint32_t	queued;		// shots waiting
+	uint8_t		hold;		// auto fire on
+} pigun_solenoid_stats_t;
+
+
+extern const pigun_solenoid_pin_t pigun_solenoid_sim;
+
+int pigun_solenoid_init(const pigun_solenoid_pin_t* pin);
+void pigun_solenoid_stop(void);
+void pigun_solenoid_output(const pigun_solenoid_pin_t* pin);
+const pigun_solenoid_pin_t* pigun_solenoid_get_output(void);
+
+void pigun_solenoid_fire(uint8_t count, uint8_t burst);
+void pigun_solenoid_hold(uint8_t on);
+
+void pigun_solenoid_pulse(uint32_t us);
+uint32_t pigun_solenoid_get_pulse(void);
+void pigun_solenoid_period(uint32_t us);
+uint32_t pigun_solenoid_get_period(void);
+void pigun_solenoid_duty(uint8_t percent);
+uint8_t pigun_solenoid_get_duty(void);
+
+void pigun_solenoid_stats(pigun_solenoid_stats_t* stats);
+int pigun_solenoid_edges(pigun_solenoid_edge_t* edges, int maxedges);
+
+
+#endif
@@ -0,0 +1,266 @@
+/*
+* Timer service: a hierarchical timer wheel on one timerfd, in the BTstack run loop.
+*
+* The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. A timer due within TIMER_SLOTS ticks is
+* in the slot of its tick at level 0, a later one at the level where its distance fits, in the
+* slot of its tick >> (TIMER_BITS x level). When level 0 wraps around, the slot of level 1 that
+* comes up is spread back into level 0, and so on up (cascade). Start and cancel only link or
+* unlink the timer in a slot, a timer is moved at most once per level before it expires.
+*
+* A bitmap per level marks the slots in use, so the next tick with something to do (an expiry or a
+* cascade) is a few bit scans away: the timerfd is set for it and the run loop sleeps until then,
+* there is no periodic tick. On wake up the wheel jumps from one such tick to the next.
+*
+* Timers can be started and cancelled from any thread, the callbacks run on the BTstack thread.
+* A periodic timer keeps its phase: the next expiry is the previous one plus the period.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "btstack.h"
+
+#include "pigun.h"
+#include "pigun-timer.h"
+
+
+#define TIMER_NONE UINT64_MAX
+
+
+static btstack_data_source_t timer_source;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t timer_base = 0;			// monotonic time of tick 0, us
+static uint64_t timer_now = 0;			// last tick the wheel went through
+static uint64_t timer_armed = TIMER_NONE;	// tick the timerfd is set for
+
+static pigun_timer_t* timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t timer_used[TIMER_LEVELS];	// bit i is set if slot i is not empty
+static pigun_timer_t* timer_expired = NULL;	// due, callback not called yet
+
+
+static void timer_link(pigun_timer_t** head, pigun_timer_t* timer) {
+
+	timer->next = *head;
+	if (*head != NULL) (*head)->pprev = &(timer->next);
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void timer_unlink(pigun_timer_t* timer) {
+
+	*(timer->pprev) = timer->next;
+	if (timer->next != NULL) timer->next->pprev = timer->pprev;
+
+	if (timer->slot >= 0) {
+		int level = timer->slot / TIMER_SLOTS;
+		int slot = timer->slot % TIMER_SLOTS;
+		if (timer_wheel[level][slot] == NULL) timer_used[level] &= ~(UINT64_C(1) << slot);
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+// puts the timer in its slot, from where the wheel is now
+static void timer_place(pigun_timer_t* timer) {
+
+	uint64_t delta = (timer->expires > timer_now) ? timer->expires - timer_now : 0;
+	uint64_t tick = timer->expires;
+
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (UINT64_C(1) << (TIMER_BITS * (level + 1)))) level++;
+
+	// too far for the wheel: it waits at the far end of the last level, and is placed again from there
+	if (delta >= (UINT64_C(1) << (TIMER_BITS * TIMER_LEVELS)))
+		tick = timer_now + (UINT64_C(1) << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+	int slot = (tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+	timer->slot = (int16_t)(level * TIMER_SLOTS + slot);
+	timer_link(&timer_wheel[level][slot], timer);
+	timer_used[level] |= UINT64_C(1) << slot;
+}
+
+// the next tick after timer_now where a slot expires or cascades
+static uint64_t timer_next() {
+
+	uint64_t next = TIMER_NONE;
+	for (int level = 0; level < TIMER_LEVELS; level++) {
+
+		if (!timer_used[level]) continue;
+
+		// the slots come up in the blocks after the current one: find the first one in use from there
+		int shift = TIMER_BITS * level;
+		uint64_t block = (timer_now >> shift) + 1;
+		int r = block & (TIMER_SLOTS - 1);
+		uint64_t used = (r == 0) ? timer_used[level] : ((timer_used[level] >> r) | (timer_used[level] << (TIMER_SLOTS - r)));
+		uint64_t tick = (block + __builtin_ctzll(used)) << shift;
+		if (tick < next) next = tick;
+	}
+	return next;
+}
+
+// goes through a tick: cascades the slots that come up, and moves the due timers to the expired list
+static void timer_tick(uint64_t tick) {
+
+	timer_now = tick;
+
+	for (int level = 1; level < TIMER_LEVELS; level++) {
+
+		// a level moves only when the one below wraps around
+		if ((tick >> (TIMER_BITS * (level - 1))) & (TIMER_SLOTS - 1)) break;
+
+		int slot = (tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+		pigun_timer_t* t = timer_wheel[level][slot];
+		timer_wheel[level][slot] = NULL;
+		timer_used[level] &= ~(UINT64_C(1) << slot);
+		while (t != NULL) {
+			pigun_timer_t* next = t->next;
+			timer_place(t);
+			t = next;
+		}
+	}
+
+	int slot = tick & (TIMER_SLOTS - 1);
+	pigun_timer_t* t = timer_wheel[0][slot];
+	timer_wheel[0][slot] = NULL;
+	timer_used[0] &= ~(UINT64_C(1) << slot);
+	while (t != NULL) {
+		pigun_timer_t* next = t->next;
+		t->slot = -1;
+		timer_link(&timer_expired, t);
+		t = next;
+	}
+}
+
+static uint64_t timer_current_tick() {
+	return (uint64_t)(pigun_now_us() - timer_base) / TIMER_TICK;
+}
+
+// sets the timerfd for the next tick with something to do, if it is earlier than the one set
+static void timer_arm() {
+
+	uint64_t next = timer_next();
+	if (next >= timer_armed) return;
+
+	timer_armed = next;
+	int64_t t = timer_base + (int64_t)next * TIMER_TICK;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = t / 1000000;
+	its.it_value.tv_nsec = (t % 1000000) * 1000;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+	timerfd_settime(timer_source.source.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void timer_process(btstack_data_source_t* ds, btstack_data_source_callback_type_t callback_type) {
+	UNUSED(callback_type);
+
+	uint64_t expirations;
+	if (read(ds->source.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) return;
+
+	pthread_mutex_lock(&timer_mutex);
+	timer_armed = TIMER_NONE;
+
+	// jump through the ticks with something to do, up to now
+	uint64_t now = timer_current_tick();
+	while (timer_now < now) {
+		uint64_t next = timer_next();
+		if (next > now) {
+			timer_now = now;
+			break;
+		}
+		timer_tick(next);
+	}
+
+	// the callbacks run without the lock: they can start and cancel timers
+	pigun_timer_t* t;
+	while ((t = timer_expired) != NULL) {
+
+		timer_unlink(t);
+		if (t->period) {
+			t->expires += t->period;
+			if (t->expires <= timer_now) t->expires += ((timer_now - t->expires) / t->period + 1) * t->period;
+			timer_place(t);
+		}
+
+		pigun_timer_callback_t callback = t->callback;
+		pthread_mutex_unlock(&timer_mutex);
+		callback(t);
+		pthread_mutex_lock(&timer_mutex);
+	}
+
+	timer_arm();
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+
+/// @brief Sets up the timer service in the BTstack run loop. Call before starting any timer.
+/// @return 0 if everything went fine.
+int pigun_timer_init() {
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		printf("PIGUN ERROR: unable to create the timer wheel timerfd (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	timer_base = pigun_now_us();
+	timer_now = 0;
+	timer_armed = TIMER_NONE;
+
+	btstack_run_loop_set_data_source_fd(&timer_source, fd);
+	btstack_run_loop_set_data_source_handler(&timer_source, &timer_process);
+	btstack_run_loop_enable_data_source_callbacks(&timer_source, DATA_SOURCE_CALLBACK_READ);
+	btstack_run_loop_add_data_source(&timer_source);
+	return 0;
+}
+
+/// @brief Prepares a timer, before its first start.
+/// @param callback called when the timer expires, on the BTstack thread.
+/// @param context anything the callback needs (timer->context).
+void pigun_timer_setup(pigun_timer_t* timer, pigun_timer_callback_t callback, void* context) {
+
+	if (timer->pprev != NULL) pigun_timer_cancel(timer);
+	memset(timer, 0, sizeof(pigun_timer_t));
+	timer->slot = -1;
+	timer->callback = callback;
+	timer->context = context;
+}
+
+/// @brief Starts a timer, or moves it if it is running. Can be called from any thread.
+/// @param delay_us time to the first expiry (rounded up to TIMER_TICK).
+/// @param period_us time between the next expiries, 0 for a one shot timer.
+void pigun_timer_start(pigun_timer_t* timer, uint32_t delay_us, uint32_t period_us) {
+
+	int64_t t = pigun_now_us() - timer_base + delay_us;
+
+	pthread_mutex_lock(&timer_mutex);
+	if (timer->pprev != NULL) timer_unlink(timer);
+
+	timer->expires = (uint64_t)(t + TIMER_TICK - 1) / TIMER_TICK;
+	if (timer->expires <= timer_now) timer->expires = timer_now + 1;
+	timer->period = (period_us + TIMER_TICK - 1) / TIMER_TICK;
+	timer_place(timer);
+	timer_arm();
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+/// @brief Stops a timer. Can be called from any thread, and on a timer that is not running.
+/// The callback is not called after this returns, unless it is already running on the BTstack thread.
+void pigun_timer_cancel(pigun_timer_t* timer) {
+
+	pthread_mutex_lock(&timer_mutex);
+	if (timer->pprev != NULL) timer_unlink(timer);
+	pthread_mutex_unlock(&timer_mutex);
+}
+
+/// @brief Tells if the timer is running.
+uint8_t pigun_timer_pending(const pigun_timer_t* timer) {
+	return timer->pprev != NULL;
+}
@@ -0,0 +1,39 @@
+#include <stdint.h>
+
+#ifndef PIGUN_TIMER
+#define PIGUN_TIMER
+
+
+#define TIMER_TICK 1000			// resolution of the wheel, us
+#define TIMER_BITS 6			// each level of the wheel has 1 << TIMER_BITS slots
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4			// the wheel spans 2^24 ticks (4.6 h), later timers wait in the last level
+
+
+typedef struct pigun_timer_t pigun_timer_t;
+typedef void (*pigun_timer_callback_t)(pigun_timer_t* timer);
+
+/// @brief A timer of the wheel. The owner keeps it (usually static), the wheel only links it.
+struct pigun_timer_t {
+
+	pigun_timer_t*	next;		// next timer in the same slot
+	pigun_timer_t**	pprev;		// the pointer to this timer, NULL if it is not in the wheel
+	int16_t			slot;		// level x TIMER_SLOTS + slot, -1 in the expired list
+
+	uint64_t		expires;	// tick
+	uint32_t		period;		// ticks, 0 = one shot
+
+	pigun_timer_callback_t callback;	// runs on the BTstack thread
+	void*			context;
+
+};
+
+
+int pigun_timer_init(void);
+void pigun_timer_setup(pigun_timer_t* timer, pigun_timer_callback_t callback, void* context);
+void pigun_timer_start(pigun_timer_t* timer, uint32_t delay_us, uint32_t period_us);
+void pigun_timer_cancel(pigun_timer_t* timer);
+uint8_t pigun_timer_pending(const pigun_timer_t* timer);
+
+
+#endif
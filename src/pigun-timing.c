@@ -0,0 +1,143 @@
+/*
+* Timestamps and latency statistics for the camera -> detector -> aimer -> HID pipeline.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "pigun.h"
+#include "pigun-timing.h"
+#include "pigun-mmal.h"
+
+
+/// @brief Current time on the monotonic clock.
+/// @return time in us.
+int64_t pigun_now_us() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void pigun_latency_reset(pigun_latency_t* lat) {
+	lat->count = 0;
+	lat->sum = 0;
+	lat->min = INT64_MAX;
+	lat->max = 0;
+	lat->last = 0;
+}
+
+void pigun_latency_add(pigun_latency_t* lat, int64_t value) {
+	lat->count++;
+	lat->sum += value;
+	if (value < lat->min) lat->min = value;
+	if (value > lat->max) lat->max = value;
+	lat->last = value;
+}
+
+void pigun_latency_print(const char* name, const pigun_latency_t* lat) {
+
+	if (lat->count == 0) {
+		printf("\t%s: no data\n", name);
+		return;
+	}
+	printf("\t%s: avg %lli us, min %lli, max %lli (%u frames)\n", name,
+		(long long)(lat->sum / lat->count), (long long)lat->min, (long long)lat->max, lat->count);
+}
+
+
+/// @brief Prints the latency from sensor exposure to each stage, then starts collecting again.
+void pigun_timing_print() {
+
+	printf("PIGUN LATENCY (from sensor timestamp), last frame %u:\n", pigun.timing.frame.id);
+	pigun_latency_print("detector", &pigun.timing.detect);
+	pigun_latency_print("aimer   ", &pigun.timing.aim);
+	pigun_latency_print("HID send", &pigun.timing.send);
+	if (pigun.timing.button.count) pigun_latency_print("button edge to report", &pigun.timing.button);
+	printf("\tframes skipped: %u, degraded: %u (budget %lli us over %lli us camera latency)\n",
+		pigun.timing.deadline.nskipped, pigun.timing.deadline.ndegraded,
+		(long long)pigun.timing.deadline.budget, (long long)pigun.timing.deadline.floor);
+
+	pigun_hid_stats_t hs;
+	pigun_hid_stats(&hs);
+	printf("\treports sent: %u, suppressed: %u, coalesced: %u, keepalives: %u, telemetry: %u\n",
+		hs.sent, hs.suppressed, hs.coalesced, hs.keepalives, hs.telemetry);
+	printf("\ttime to first report: %u ms from the start, %u reconnects (last %u ms, worst %u ms)\n",
+		hs.ttfr_start, hs.reconnects, hs.ttfr_last, hs.ttfr_max);
+
+	pigun_latency_reset(&pigun.timing.detect);
+	pigun_latency_reset(&pigun.timing.aim);
+	pigun_latency_reset(&pigun.timing.send);
+	pigun_latency_reset(&pigun.timing.button);
+}
+
+
+void pigun_deadline_init(pigun_deadline_t* dl) {
+
+	memset(dl, 0, sizeof(pigun_deadline_t));
+	dl->floor = dl->floornext = INT64_MAX;
+	pigun_deadline_fps(dl, pigun_camera_fps());
+}
+
+/// @brief Sets the budget for a camera frame rate: DEADLINE_FRAMES frame periods.
+void pigun_deadline_fps(pigun_deadline_t* dl, uint8_t fps) {
+
+	if (fps == 0) fps = 1;
+	dl->fps = fps;
+	dl->budget = (int64_t)DEADLINE_FRAMES * 1000000 / fps;
+}
+
+
+/// @brief Checks the age of a frame against the budget, and switches the detector
+/// between normal and fast mode.
+/// @param dl deadline monitor.
+/// @param frame the frame that just arrived.
+/// @return 1 if the frame is stale and should be skipped.
+int pigun_deadline_check(pigun_deadline_t* dl, const pigun_frame_t* frame) {
+
+	int64_t age = frame->t_callback - frame->t_sensor;
+
+	// the frame rate can change at runtime (control interface, parameters): the budget follows it
+	// once the camera thread applied it, without taking the camera settings lock
+	uint8_t fps = pigun_camera_fps();
+	if (fps != dl->fps) pigun_deadline_fps(dl, fps);
+
+	// track the camera latency: minimum age over the current and the previous window
+	if (age < dl->floornext) dl->floornext = age;
+	if (age < dl->floor) dl->floor = age;
+	if (++dl->window == DEADLINE_WINDOW) {
+		dl->floor = dl->floornext;
+		dl->floornext = INT64_MAX;
+		dl->window = 0;
+	}
+
+	int64_t delay = age - dl->floor;
+
+	if (delay > dl->budget) {
+
+		// falling behind: go cheap until we catch up
+		dl->degraded = 1;
+		dl->calm = 0;
+		pigun.detector.fast = 1;
+
+		// drop the stale frame, unless we already dropped too many in a row
+		if (dl->skipping < DEADLINE_MAXSKIP) {
+			dl->skipping++;
+			dl->nskipped++;
+			return 1;
+		}
+	}
+	else if (dl->degraded && delay < dl->budget / 2) {
+		if (++dl->calm == DEADLINE_RECOVER) {
+			dl->degraded = 0;
+			pigun.detector.fast = 0;
+		}
+	}
+
+	dl->skipping = 0;
+	if (dl->degraded) dl->ndegraded++;
+	return 0;
+}
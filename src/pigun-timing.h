@@ -0,0 +1,92 @@
+#include <stdint.h>
+
+#ifndef PIGUN_TIMING
+#define PIGUN_TIMING
+
+
+#define TIMING_STC_SYNC 200	// frames between two syncs of the camera clock with the system clock
+
+#define DEADLINE_FRAMES 1		// budget for the queueing delay of a frame, in frame periods at the camera fps
+#define DEADLINE_MAXSKIP 2		// max number of consecutive frames that can be skipped
+#define DEADLINE_RECOVER 20		// frames within budget needed to leave the degraded mode
+#define DEADLINE_WINDOW 256		// frames over which the minimum frame age is tracked
+
+
+/// @brief Timestamps of one camera frame along the pipeline.
+/// All times are in us on the monotonic clock (see pigun_now_us).
+typedef struct {
+
+	uint32_t	id;			// frame counter, +1 for each frame delivered by the camera
+	int64_t		t_sensor;	// sensor timestamp of the frame (buffer->pts moved to the monotonic clock)
+	int64_t		t_callback;	// frame received by the buffer callback
+	int64_t		t_detect;	// detector done
+	int64_t		t_aim;		// aim computed and written in the report
+
+} pigun_frame_t;
+
+/// @brief Running statistics of a latency, in us.
+typedef struct {
+	uint32_t	count;
+	int64_t		sum;
+	int64_t		min;
+	int64_t		max;
+	int64_t		last;
+} pigun_latency_t;
+
+/// @brief Frame-deadline monitor.
+/// The age of a frame when it reaches the callback is the pipeline latency of the camera
+/// (exposure, readout, ISP), which is about constant, plus the time it waited in the queue
+/// behind slower frames. The latter is compared to the budget.
+typedef struct {
+
+	int64_t		budget;		// max queueing delay before frames are skipped, in us
+	uint8_t		fps;		// camera frame rate the budget was derived from
+	int64_t		floor;		// smallest frame age seen recently = latency of the camera itself
+	int64_t		floornext;	// smallest frame age in the current window
+	uint16_t	window;		// frames seen in the current window
+
+	uint8_t		skipping;	// number of consecutive frames skipped
+	uint8_t		degraded;	// 1 if the detector was switched to fast mode
+	uint16_t	calm;		// consecutive frames well within budget while degraded
+
+	uint32_t	nskipped;	// total frames skipped
+	uint32_t	ndegraded;	// total frames processed in degraded mode
+
+} pigun_deadline_t;
+
+/// @brief Timing information of the whole pipeline.
+typedef struct {
+
+	pigun_frame_t	frame;		// frame being processed by the camera thread
+	pigun_frame_t	aimed;		// frame that produced the aim currently in the report
+	int64_t			stc_offset;	// monotonic clock - camera clock, in us
+
+	uint32_t		lastsent;	// id of the last frame that went out in a report (BT thread)
+	int64_t			t_lastsent;	// when it was sent
+
+	// latency from the sensor timestamp to the end of each stage
+	pigun_latency_t	detect;
+	pigun_latency_t	aim;
+	pigun_latency_t	send;
+	// latency from a button edge (kernel timestamp) to the report, input thread
+	pigun_latency_t	button;
+
+	pigun_deadline_t deadline;
+
+} pigun_timing_t;
+
+
+int64_t pigun_now_us(void);
+
+void pigun_latency_reset(pigun_latency_t* lat);
+void pigun_deadline_fps(pigun_deadline_t* dl, uint8_t fps);
+void pigun_latency_add(pigun_latency_t* lat, int64_t value);
+void pigun_latency_print(const char* name, const pigun_latency_t* lat);
+
+void pigun_timing_print(void);
+
+void pigun_deadline_init(pigun_deadline_t* dl);
+int pigun_deadline_check(pigun_deadline_t* dl, const pigun_frame_t* frame);
+
+
+#endif
@@ -0,0 +1,111 @@
+/*
+* Wired transport: the gun is a USB HID device through the Linux configfs gadget (see usb-gadget.sh).
+*
+* The reports are written in /dev/hidg0, which the host polls every 1 ms (125 us at high speed, see
+* usb-gadget.sh). A write only goes out
+* when the previous report was collected, so the send slot comes when the device is writable:
+* the changes in between are merged, like on bluetooth. The output reports from the host are read
+* from the same device and run as the bluetooth data commands (recoil, telemetry).
+* The gadget does not answer GET_REPORT, so the answer to a parameter request (feature report ID 5)
+* is sent back as an input report with the same ID.
+* All of this runs in the BTstack run loop, without the bluetooth controller.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "btstack.h"
+
+#include "pigun.h"
+#include "pigun-gpio.h"
+#include "pigun-usb.h"
+#include "pigun-param.h"
+
+
+static btstack_data_source_t usb_source;
+static uint8_t usb_online = 0;	// 1 when the last report went through
+
+
+static uint8_t usb_connected() {
+	return usb_source.source.fd >= 0;
+}
+
+static void usb_request() {
+	btstack_run_loop_enable_data_source_callbacks(&usb_source, DATA_SOURCE_CALLBACK_WRITE);
+}
+
+static int usb_send(const uint8_t* report, uint16_t size) {
+
+	if (write(usb_source.source.fd, report, size) == size) {
+		if (!usb_online) printf("PIGUN-USB: host connected\n");
+		usb_online = 1;
+		return 0;
+	}
+
+	// no host, or the gadget is not bound: the report is not taken as sent, the next slot
+	// (a change or the keepalive) tries it again
+	if (usb_online) printf("PIGUN-USB: host disconnected (%s)\n", strerror(errno));
+	usb_online = 0;
+	pigun_hid_disconnected();
+	return 1;
+}
+
+const pigun_transport_t pigun_transport_usb = { "usb", &usb_connected, &usb_request, &usb_send };
+
+
+// answers a parameter request right away, the host waits for it
+static void usb_param(const uint8_t* request, int size) {
+
+	uint8_t answer[1 + HID_PARAM_SIZE] = { PIGUN_PARAM_ID };
+	pigun_param_request(request, size);
+	pigun_param_answer(&answer[1]);
+	if (write(usb_source.source.fd, answer, sizeof(answer)) != sizeof(answer))
+		printf("PIGUN-USB: parameter answer not sent (%s)\n", strerror(errno));
+}
+
+static void usb_process(btstack_data_source_t* ds, btstack_data_source_callback_type_t callback_type) {
+
+	if (callback_type == DATA_SOURCE_CALLBACK_WRITE) {
+		// writable: this is the send slot, then wait for the next request
+		btstack_run_loop_disable_data_source_callbacks(ds, DATA_SOURCE_CALLBACK_WRITE);
+		pigun_hid_send_slot();
+		return;
+	}
+
+	if (callback_type != DATA_SOURCE_CALLBACK_READ) return;
+
+	// output report: report ID and the data command, or a parameter request
+	uint8_t data[HID_MAXREPORT];
+	ssize_t n = read(ds->source.fd, data, sizeof(data));
+	if (n == 2 && data[0] == PIGUN_REPORT_ID) pigun_hid_command(data[1]);
+	else if (n > 1 && data[0] == PIGUN_PARAM_ID) usb_param(&data[1], n - 1);
+	else if (n > 0) printf("PIGUN-USB: invalid output report, %i bytes\n", (int)n);
+}
+
+
+/// @brief Opens the HID gadget and sends the reports there instead of bluetooth.
+/// @return 0 if everything went fine.
+int pigun_usb_init() {
+
+	int fd = open(USB_DEVICE, O_RDWR | O_NONBLOCK);
+	if (fd < 0) {
+		printf("PIGUN ERROR: unable to open %s, run usb-gadget.sh first (%s)\n", USB_DEVICE, strerror(errno));
+		return 1;
+	}
+
+	btstack_run_loop_set_data_source_fd(&usb_source, fd);
+	btstack_run_loop_set_data_source_handler(&usb_source, &usb_process);
+	btstack_run_loop_enable_data_source_callbacks(&usb_source, DATA_SOURCE_CALLBACK_READ);
+	btstack_run_loop_add_data_source(&usb_source);
+
+	pigun_hid_init(&pigun_transport_usb);
+
+	// no pairing on the wire: the LED goes off and the report goes out as soon as the host polls
+	pigun_GPIO_output_set(PIN_OUT_AOK, 0);
+	pigun_hid_connected();
+	return 0;
+}
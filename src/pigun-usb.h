@@ -0,0 +1,17 @@
+#include <stdint.h>
+
+#include "pigun-hid.h"
+
+#ifndef PIGUN_USB
+#define PIGUN_USB
+
+
+#define USB_DEVICE "/dev/hidg0"	// HID gadget made by usb-gadget.sh
+
+
+extern const pigun_transport_t pigun_transport_usb;
+
+int pigun_usb_init(void);
+
+
+#endif
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <bcm2835.h>
 
@@ -28,6 +29,7 @@
 #include "pigun-hid.h"
 #include "pigun-mmal.h"
 #include "pigun-detector.h"
+#include "pigun-param.h"
 
 
 #include <math.h>
@@ -41,41 +43,207 @@ pigun_object_t pigun;
 pthread_mutex_t pigun_mutex;
 
 
-/// @brief Save the calibration data for future use.
-void pigun_calibration_save(){
-	
-	FILE* fbin = fopen("cdata.bin", "wb");
-	fwrite(&(pigun.cal_topleft),  sizeof(pigun_aimpoint_t), 1, fbin);
-	fwrite(&(pigun.cal_lowright), sizeof(pigun_aimpoint_t), 1, fbin);
-	fclose(fbin);
+static void preview_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) { mmal_buffer_header_release(buffer); }
+
+
+// *** SENSOR CROP ***
+// the decision is in pigun-crop.c, this applies it on the camera
+
+static const pigun_rect_t crop_full = { 0, 0, 1, 1 };
+
+static void pigun_crop_init() {
+
+#ifdef PIGUN_SENSOR_CROP
+	pigun.crop.enabled = 1;
+#else
+	pigun.crop.enabled = 0;
+#endif
+	pigun.crop.settle = 0;
+	pigun.crop.lost = 0;
+	pigun.crop.current = crop_full;
 }
 
+/// @brief Maps peak positions from the cropped frame to the full frame.
+/// @param crop crop that was applied to the frame where the peaks were found.
+/// @param peaks peaks to transform (in place).
+/// @param npeaks number of peaks.
+static void pigun_crop_to_full(const pigun_rect_t* crop, pigun_peak_t* peaks, int npeaks) {
 
-static void preview_buffer_callback(MMAL_PORT_T* port, MMAL_BUFFER_HEADER_T* buffer) { mmal_buffer_header_release(buffer); }
+	for (int i = 0; i < npeaks; i++) {
+		peaks[i].col = crop->x * PIGUN_RES_X + peaks[i].col * crop->w;
+		peaks[i].row = crop->y * PIGUN_RES_Y + peaks[i].row * crop->h;
+		peaks[i].total = peaks[i].row * PIGUN_RES_X + peaks[i].col;
+	}
+}
+
+/// @brief Runs the crop controller on the current frame, after the detector.
+/// Peaks are moved to full frame coordinates and the camera crop is updated if needed.
+/// @return 1 if the peaks can be used for aiming, 0 if the frame was taken while the crop was changing.
+static int pigun_crop_process() {
+
+	if (!pigun.crop.enabled) return 1;
+
+	// frames in the pipeline still have the old crop, and we cannot tell which is which
+	if (pigun.crop.settle > 0) {
+		pigun.crop.settle--;
+		return 0;
+	}
+
+	// bounding box of the beacons, normalised on the full frame
+	pigun_rect_t beacons = { 0, 0, 0, 0 };
+	if (pigun.detector.error) {
+		if (pigun.crop.lost < UINT16_MAX) pigun.crop.lost++;
+	}
+	else {
+		pigun.crop.lost = 0;
+		pigun_crop_to_full(&pigun.crop.current, pigun.detector.peaks, DETECTOR_NBLOBS);
+
+		float x0 = 1, y0 = 1, x1 = 0, y1 = 0;
+		for (int i = 0; i < DETECTOR_NBLOBS; i++) {
+			float x = pigun.detector.peaks[i].col / PIGUN_RES_X;
+			float y = pigun.detector.peaks[i].row / PIGUN_RES_Y;
+			if (x < x0) x0 = x;
+			if (x > x1) x1 = x;
+			if (y < y0) y0 = y;
+			if (y > y1) y1 = y;
+		}
+		beacons.x = x0;
+		beacons.y = y0;
+		beacons.w = x1 - x0;
+		beacons.h = y1 - y0;
+	}
+
+	pigun_rect_t next;
+	if (pigun_crop_next(&pigun.crop.current, &beacons, pigun.detector.error, pigun.crop.lost, &next)) {
+
+		if (pigun_camera_crop(pigun_camera, next.x, next.y, next.w, next.h) == 0) {
+#ifdef PIGUN_DEBUG
+			printf("PIGUN: crop -> [%f %f %f %f]\n", next.x, next.y, next.w, next.h);
+#endif
+			pigun.crop.current = next;
+			pigun.crop.settle = CROP_SETTLE;
+
+			// the old peaks are in the old crop coordinates, they would only mislead the detector
+			memset(pigun.detector.oldpeaks, 0, sizeof(pigun_peak_t) * 4);
+		}
+	}
+
+	return 1;
+}
+
+
+
+
+/// @brief Processes one camera frame: detection, aiming and buttons.
+/// Called by the camera source (MMAL callback or fake camera) for each frame.
+/// @param data Y channel of the frame (PIGUN_RES_X x PIGUN_RES_Y bytes).
+/// @param t_sensor sensor timestamp of the frame on the monotonic clock (us), negative if unknown.
+void pigun_frame_process(unsigned char* data, int64_t t_sensor) {
+
+	// stamp the frame
+	pigun_frame_t* frame = &(pigun.timing.frame);
+	frame->id++;
+	frame->t_callback = pigun_now_us();
+	frame->t_sensor = (t_sensor < 0) ? frame->t_callback : t_sensor;
+
+	pigun.framedata = data;
+
+	if(pigun.state == STATE_SHUTDOWN) return;
 
+	// parameters changed by the host take effect here, all at once
+	pigun_param_update();
 
+	// if this frame waited too long in the queue, drop it and catch up with the next one
+	// buttons are still processed so they are not delayed
+	if (pigun_deadline_check(&(pigun.timing.deadline), frame)) {
+		pigun_buttons_process();
+		return;
+	}
+
+	// call the peak detector function *************************************
+	// if there was a detector error, error LED goes on, otherwise off
+	// the switch only happens when the detector return value changes
+	uint8_t ce = pigun.detector.error;
+	pigun_detector_run(pigun.framedata);
+	if(pigun.detector.error != ce) {
+		// if the error flag changed, flip the LED state
+		pigun_GPIO_output_set(PIN_OUT_ERR, pigun.detector.error);
+	}
+	frame->t_detect = pigun_now_us();
+	pigun_latency_add(&pigun.timing.detect, frame->t_detect - frame->t_sensor);
+
+	// the peaks are supposed to be ordered by the detector function
+
+	// move the peaks to full frame coordinates and let the crop follow them
+	// compute aiming position from the detected peaks (unless the crop was changing)
+	// if the quad is degenerate, the report keeps the last good aim
+	// the report is handed to the bluetooth thread without locks, see pigun_report_get
+	if (pigun_crop_process() && pigun_calculate_aim() == 0) {
+		frame->t_aim = pigun_now_us();
+		pigun_latency_add(&pigun.timing.aim, frame->t_aim - frame->t_sensor);
+	}
+
+	// *********************************************************************
+	// check the buttons ***************************************************
+
+	pigun_buttons_process();
+
+	// *********************************************************************
+}
+
+
+/// @brief Starts the camera source: the PiCamera, or synthetic frames with PIGUN_FAKECAM.
+/// @return 0 if everything went fine.
+static int pigun_camera_start() {
+#ifdef PIGUN_FAKECAM
+	return pigun_fakecam_init();
+#else
+	return pigun_mmal_init();
+#endif
+}
+
+static void pigun_camera_stop() {
+#ifdef PIGUN_FAKECAM
+	pigun_fakecam_stop();
+#else
+	pigun_mmal_stop();
+#endif
+}
+
+/// @brief Resets the tracking state after a camera restart: the new camera starts with the full FoV
+/// and the old peaks are too old to be useful. Calibration and settings are kept.
+static void pigun_camera_reset_tracking() {
+
+	memset(pigun.detector.oldpeaks, 0, sizeof(pigun_peak_t) * 4);
+	pigun.detector.fast = 0;
+	pigun_crop_init();
+	pigun_deadline_init(&(pigun.timing.deadline));
+	pigun_predict_reset(&(pigun.predictor));
+	pigun_filter_reset(&(pigun.filter));
+}
 
 
 //void * test_main(int argc, char** argv) {
 void* pigun_cycle(void* nullargs) {
 
 	pigun.state = STATE_IDLE;
-	pigun.recoilCooldownTimer = 0;
-	pigun.recoilPulseTimer = 0;
 	pigun_detector_init();
+	pigun_crop_init();
+
+	memset(&(pigun.timing), 0, sizeof(pigun_timing_t));
+	pigun_latency_reset(&(pigun.timing.detect));
+	pigun_latency_reset(&(pigun.timing.aim));
+	pigun_latency_reset(&(pigun.timing.send));
+	pigun_deadline_init(&(pigun.timing.deadline));
 
-	// reset calibration
-	pigun.cal_topleft.x = pigun.cal_topleft.y = 0;
-	pigun.cal_lowright.x = pigun.cal_lowright.y = 1;
+	pigun.aim_cond = 0;
+	pigun.aim_rejected = 0;
+	pigun.aim_reject = 0;
+	pigun_predict_init(&(pigun.predictor));
+	pigun_filter_init(&(pigun.filter));
 	
-	// load calibration data if available
-	FILE* fbin = fopen("cdata.bin", "rb");
-	if (fbin == NULL) printf("PIGUN: no calibration data found\n");
-	else {
-		fread(&(pigun.cal_topleft), sizeof(pigun_aimpoint_t), 1, fbin);
-		fread(&(pigun.cal_lowright), sizeof(pigun_aimpoint_t), 1, fbin);
-		fclose(fbin);
-	}
+	// reset calibration and load calibration data if available
+	pigun_calibration_load();
 
 
 	// pins should be initialised using the function in the GPIO module
@@ -83,15 +251,22 @@ void* pigun_cycle(void* nullargs) {
 	// because the bluetooth (HID) part also uses the LEDs to inform about connection status
 	
 	// Initialize the camera system
-	int error = pigun_mmal_init();
-	if (error != 0) {
-		pigun_GPIO_output_set(PIN_OUT_ERR, 1);
-		return NULL;
-	}
-	printf("PIGUN: MMAL started correctly.\n");
+	// if it fails, the watchdog below will keep trying
+	int error = pigun_camera_start();
+	if (error != 0) pigun_GPIO_output_set(PIN_OUT_ERR, 1);
+	else printf("PIGUN: camera started correctly.\n");
 	
 	// repeat forever and ever!
 	// there could be a graceful shutdown?
+	// this loop is also the camera watchdog: if frames stop coming, the camera is restarted
+	// the bluetooth thread is not affected
+	pigun_camera_params_t camparams;
+	int64_t timeout = PIGUN_WATCHDOG_STARTUP;	// the first frame can take a while
+	int64_t t_lastframe = pigun_now_us();		// last time the frame counter moved
+	int64_t t_stall = 0;						// when the frames stopped
+	uint32_t lastid = pigun.timing.frame.id;
+	uint8_t restarts = 0;						// restarts since the frames stopped
+
 	int cameraON;
 	while (1) {
 		
@@ -108,8 +283,47 @@ void* pigun_cycle(void* nullargs) {
 		
 		// if this thread could get the mutex lock, then the main thread is signalling a stop!
 		if (cameraON) break;
+
+		usleep(PIGUN_WATCHDOG_POLL);
+
+		// apply camera settings changed by service mode or the control interface
+		pigun_camera_update();
+
+		int64_t now = pigun_now_us();
+		uint32_t id = pigun.timing.frame.id;
+		if (id != lastid) {
+			lastid = id;
+			t_lastframe = now;
+			pigun_camera_get(&camparams);
+			timeout = PIGUN_WATCHDOG_FRAMES * 1000000 / camparams.fps;
+
+			if (restarts > 0) {
+				printf("PIGUN: camera recovered in %lli ms (%i restarts)\n", (long long)(now - t_stall) / 1000, restarts);
+				pigun_GPIO_output_set(PIN_OUT_ERR, pigun.detector.error);
+				restarts = 0;
+			}
+			continue;
+		}
+		if (now - t_lastframe < timeout) continue;
+
+		// code here => no frames for too long
+		if (restarts == 0) {
+			t_stall = t_lastframe;
+			printf("PIGUN: no frames for %lli ms, restarting the camera\n", (long long)(now - t_lastframe) / 1000);
+		}
+		if (restarts < UINT8_MAX) restarts++;
+		pigun_GPIO_output_set(PIN_OUT_ERR, 1);
+
+		pigun_camera_stop();
+		pigun_camera_reset_tracking();
+		if (pigun_camera_start() != 0)
+			printf("PIGUN ERROR: camera restart failed\n");
+
+		t_lastframe = pigun_now_us();
+		timeout = PIGUN_WATCHDOG_STARTUP;
 	}
 	
+	pigun_camera_stop();
 	pigun_detector_free();
 
 	pthread_exit((void*)0);
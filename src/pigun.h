@@ -30,6 +30,11 @@
 
 #include "pigun-hid.h"
 #include "pigun-detector.h"
+#include "pigun-crop.h"
+#include "pigun-timing.h"
+#include "pigun-predict.h"
+#include "pigun-filter.h"
+#include "pigun-pose.h"
 
 
 #ifndef PIGUN
@@ -45,6 +50,7 @@ typedef enum {
    STATE_SERVICE,
    STATE_CAL_TL,
    STATE_CAL_BR,
+   STATE_CAL_GRID,
 
    STATE_BLINKING,
    STATE_SHUTDOWN
@@ -62,6 +68,30 @@ typedef struct {
 	float x, y;
 }pigun_aimpoint_t;
 
+/// @brief 3x3 projective transform, row-major: {x', y', w'} = m . {x, y, 1}.
+typedef struct {
+	float m[9];
+}pigun_homography_t;
+
+#define CAL_GRID_MAX 5		// largest calibration grid (5x5)
+#define CAL_LUT_N 17		// nodes per side of the screen warp table
+#define CAL_LUT_MARGIN 0.25f	// the table extends beyond the calibration points by this fraction of their span
+
+/// @brief Grid calibration: samples and the screen warp table fitted on them.
+typedef struct {
+
+	uint8_t				n;			// grid size (3 or 5), 0 if the 2-point calibration is used
+	uint8_t				count;		// samples taken so far, while calibrating
+	pigun_aimpoint_t	samples[CAL_GRID_MAX * CAL_GRID_MAX]; // normalised aim at each grid point, row by row
+
+	float				x0, y0;		// normalised coordinates of the first node of the table
+	float				dx, dy;		// node spacing
+	pigun_aimpoint_t	lut[CAL_LUT_N][CAL_LUT_N]; // screen point of each node, [row][col]
+
+}pigun_calgrid_t;
+
+#define AIMER_MAXCOND 200.0f	// quads with a larger condition number are rejected (a good one is ~10)
+
 
 
 typedef struct {
@@ -72,10 +102,7 @@ typedef struct {
 
    /// @brief Current recoil mode (self, auto, hid, off)
    pigun_recoilmode_t recoilMode;
-   /// @brief Solenoid cooldown time (for auto mode)
-   int8_t recoilCooldownTimer;
-   /// @brief Timer for the 555 trigger pulse
-   int8_t recoilPulseTimer;
+   // the pulses are timed by the solenoid thread (pigun-solenoid.c)
    // *********************
 
 
@@ -86,6 +113,7 @@ typedef struct {
    // stores the current camera frame
    unsigned char     *framedata;
    pigun_detector_t  detector;
+   pigun_crop_t      crop;
 
 
    // *** AIMING CALCULATOR ***
@@ -95,6 +123,23 @@ typedef struct {
    // calibration points in normalised frame of reference
    pigun_aimpoint_t  cal_topleft;
    pigun_aimpoint_t  cal_lowright;
+   // grid calibration, replaces the 2 points when present
+   pigun_calgrid_t   calgrid;
+
+   // camera point the sights are aligned with, as fraction of the full frame - default is the center
+   pigun_aimpoint_t  boresight;
+   // camera (full frame px) -> normalised frame, from the last good quad
+   pigun_homography_t homography;
+   float             aim_cond;      // condition number of the last quad
+   uint32_t          aim_rejected;  // frames that did not produce an aim
+   uint8_t           aim_reject;    // 1 if the last frame was rejected (aim_normalised is from an older one)
+   // gun pose with respect to the beacons, from the same homography
+   pigun_pose_t      pose;
+
+   // extrapolates the aim to the time the report is sent
+   pigun_predictor_t predictor;
+   // removes the jitter from the aim
+   pigun_filter_t    filter;
 
 
    // *** CONNECTIVITY ***
@@ -107,6 +152,9 @@ typedef struct {
 
    pigun_report_t    report; // 
 
+   // *** PIPELINE TIMING ***
+   pigun_timing_t    timing;
+
 
    
 
@@ -117,18 +165,31 @@ extern pigun_object_t pigun;
 
 
 void pigun_calibration_save(void);
+void pigun_calibration_load(void);
+pigun_aimpoint_t pigun_calibration_apply(float x, float y);
+pigun_aimpoint_t pigun_calgrid_target(int n, int k);
+int pigun_calgrid_fit(pigun_calgrid_t* grid);
+
 
+void pigun_frame_process(unsigned char* data, int64_t t_sensor);
 
 // these function define how aiming works
-void pigun_calculate_aim();
+int pigun_calculate_aim();
+void pigun_aim_output(float aim_x, float aim_y, const pigun_frame_t* frame);
+int pigun_homography_compute(const pigun_peak_t* peaks, pigun_homography_t* H, float* cond);
+pigun_aimpoint_t pigun_homography_apply(const pigun_homography_t* H, float x, float y);
 
 
 // HELPER FUNCTIONS
 int pigun_camera_gains(MMAL_COMPONENT_T *camera, int analog_gain, int digital_gain);
+int pigun_camera_get_gains(MMAL_COMPONENT_T *camera, int *analog_gain, int *digital_gain);
 int pigun_camera_awb(MMAL_COMPONENT_T *camera, int on);
 int pigun_camera_awb_gains(MMAL_COMPONENT_T *camera, float r_gain, float b_gain);
 int pigun_camera_blur(MMAL_COMPONENT_T *camera, int on);
 int pigun_camera_exposuremode(MMAL_COMPONENT_T *camera, int on);
+int pigun_camera_shutter(MMAL_COMPONENT_T *camera, uint32_t speed);
+int pigun_camera_framerate(MMAL_PORT_T *port, int fps);
+int pigun_camera_crop(MMAL_COMPONENT_T *camera, float x, float y, float w, float h);
 
 
 #endif
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Creates the USB HID gadget for the wired mode (pigun.exe --usb), using the same report descriptor
+# as bluetooth. Run as root, with dtoverlay=dwc2 in /boot/config.txt (or dummy_hcd to test on a PC).
+#
+# usage: usb-gadget.sh [path to pigun.exe]	create the gadget and bind it
+#        usb-gadget.sh remove			unbind and remove it
+
+set -e
+
+GADGET=/sys/kernel/config/usb_gadget/pigun
+PIGUN=${1:-./pigun.exe}
+
+if [ "$1" = "remove" ]; then
+	[ -d $GADGET ] || exit 0
+	echo "" > $GADGET/UDC || true
+	rm $GADGET/configs/c.1/hid.usb0
+	rmdir $GADGET/configs/c.1/strings/0x409 $GADGET/configs/c.1
+	rmdir $GADGET/functions/hid.usb0
+	rmdir $GADGET/strings/0x409
+	rmdir $GADGET
+	exit 0
+fi
+
+modprobe libcomposite
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+mkdir -p $GADGET
+cd $GADGET
+
+echo 0x1d6b > idVendor		# Linux Foundation
+echo 0x0104 > idProduct		# multifunction composite gadget
+echo 0x0100 > bcdDevice
+echo 0x0200 > bcdUSB
+
+mkdir -p strings/0x409
+echo "pigun" > strings/0x409/manufacturer
+echo "PiGun 1F" > strings/0x409/product
+echo "0001" > strings/0x409/serialnumber
+
+# HID function: reports up to 33 bytes (parameter answer with its ID), descriptor from pigun itself
+mkdir -p functions/hid.usb0
+echo 0 > functions/hid.usb0/protocol
+echo 0 > functions/hid.usb0/subclass
+echo 33 > functions/hid.usb0/report_length
+# without the OUT endpoint all the host reports come through SET_REPORT, feature reports included
+[ -f functions/hid.usb0/no_out_endpoint ] && echo 1 > functions/hid.usb0/no_out_endpoint
+$PIGUN --dump-descriptor > functions/hid.usb0/report_desc
+# bInterval of the IN endpoint, where the kernel lets us choose: at full speed it counts 1 ms frames,
+# at high speed 2^(interval-1) microframes of 125 us. 1 polls every 1 ms at full speed and every
+# 125 us at high speed (4 would be 1 ms there)
+[ -f functions/hid.usb0/interval ] && echo 1 > functions/hid.usb0/interval
+
+mkdir -p configs/c.1/strings/0x409
+echo "PiGun" > configs/c.1/strings/0x409/configuration
+echo 100 > configs/c.1/MaxPower
+ln -sf $GADGET/functions/hid.usb0 configs/c.1/
+
+# bind to the first device controller
+ls /sys/class/udc | head -n 1 > UDC
+echo "PiGun gadget ready on /dev/hidg0"
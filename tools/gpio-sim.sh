@@ -0,0 +1,59 @@
+#!/bin/sh
+# Simulated buttons for the input thread: a gpio-sim chip (kernel module gpio-sim, configfs) with the
+# same line offsets as the BCM pins, so pigun.exe --gpiochip /dev/gpiochipN takes its edges from it.
+# A press pulls the line down, like a button to ground. Run as root.
+#
+# usage: gpio-sim.sh up                      make the chip, print its device
+#        gpio-sim.sh press <line> [ms]       press for ms (default 100) and release
+#        gpio-sim.sh bounce <line> [n] [us]  press with n bounces (default 5) us apart (default 300), then release
+#        gpio-sim.sh down                    remove the chip
+
+set -e
+
+SIM=/sys/kernel/config/gpio-sim/pigun
+LINES=28
+
+line() {
+	echo /sys/devices/platform/$(cat $SIM/dev_name)/$(cat $SIM/bank0/chip_name)/sim_gpio$1/pull
+}
+
+case "$1" in
+up)
+	modprobe gpio-sim
+	mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+	mkdir -p $SIM/bank0
+	echo $LINES > $SIM/bank0/num_lines
+	echo 1 > $SIM/live
+	echo "/dev/$(cat $SIM/bank0/chip_name)"
+	;;
+press)
+	P=$(line $2)
+	echo pull-down > $P
+	sleep $(awk "BEGIN { print ${3:-100} / 1000 }")
+	echo pull-up > $P
+	;;
+bounce)
+	P=$(line $2)
+	N=${3:-5}
+	S=$(awk "BEGIN { print ${4:-300} / 1000000 }")
+	for i in $(seq $N); do
+		echo pull-down > $P; sleep $S
+		echo pull-up > $P; sleep $S
+	done
+	echo pull-down > $P
+	sleep 0.1
+	for i in $(seq $N); do
+		echo pull-up > $P; sleep $S
+		echo pull-down > $P; sleep $S
+	done
+	echo pull-up > $P
+	;;
+down)
+	echo 0 > $SIM/live
+	rmdir $SIM/bank0 $SIM
+	;;
+*)
+	sed -n '2,10p' $0
+	exit 1
+	;;
+esac
@@ -0,0 +1,367 @@
+/*
+* Report stream analyzer: reads a hidraw device (the gun on bluetooth or USB, or pigun-vgun) and
+* measures what the host gets: report rate, inter-arrival jitter, duplicate reports and axis noise.
+* It can also send data commands, and time the round trip of telemetry requests (0x21), which the
+* gun answers with a telemetry report. The reply carries nothing that ties it to the request, so the
+* periodic telemetry is stopped while the requests run.
+*
+* With the periodic telemetry on (-c 2k, or -T when it was set from the control interface) the frame
+* counter of two reports in a row moves by about one period of camera frames: a larger jump is a
+* telemetry report that did not arrive.
+*
+* The timestamps are taken when the report is read, so they include the scheduling of this program:
+* run it with a real time priority (chrt -f 50) for sub-ms figures.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "pigun-descriptor.h"
+
+#define ANALYZE_INTERVAL 1.0	// default seconds between statistics
+#define ANALYZE_BIN 10			// inter-arrival histogram bin, in us
+#define ANALYZE_BINS 20000		// histogram range: 200 ms, longer gaps go in the last bin
+#define ANALYZE_PING_GAP 100	// ms between round trip requests
+#define ANALYZE_PING_TIMEOUT 500	// ms before a round trip request is given up
+#define ANALYZE_FPS 40			// default camera frame rate of the gun (PIGUN_FPS)
+
+
+/// @brief Statistics of the joystick reports over a time window.
+typedef struct {
+	uint32_t reports;
+	uint32_t duplicates;	// same bytes as the previous joystick report
+	uint32_t telemetry;
+	uint32_t other;			// reports with other IDs
+	uint32_t gaps;			// periodic telemetry reports missing, from the jumps of the frame counter
+	uint32_t buttons;		// button changes
+
+	// inter-arrival of the joystick reports, us
+	uint32_t nint;
+	double sum, sum2;
+	uint64_t min, max;
+	uint32_t hist[ANALYZE_BINS];
+
+	// successive differences of the axes, for the noise
+	uint32_t ndiff;
+	double dx2, dy2;
+} stats_t;
+
+static struct {
+	int fd;
+	FILE* record;
+	uint64_t t0;
+
+	uint8_t last[1 + HID_REPORT_SIZE];
+	uint64_t t_last;		// arrival of the last joystick report, 0=none yet
+	uint32_t frame;			// last telemetry frame counter
+	uint8_t has_frame;
+	uint32_t telemetry_ms;	// period of the periodic telemetry, 0 = off (or not known)
+	uint32_t fps;			// camera frame rate of the gun
+
+	stats_t window;
+	stats_t total;
+
+	// round trip of the telemetry requests
+	uint32_t pings;			// requests left to send
+	uint64_t t_ping;		// time the pending request was sent, 0=none
+	uint64_t t_nextping;
+	uint32_t npong, nlost;
+	double rtt_sum;
+	uint64_t rtt_min, rtt_max;
+} an;
+
+static volatile sig_atomic_t an_stop = 0;
+
+static void an_sigint(int sig) {
+	(void)sig;
+	an_stop = 1;
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stats_reset(stats_t* s) {
+	memset(s, 0, sizeof(*s));
+	s->min = UINT64_MAX;
+}
+
+static double percentile(const stats_t* s, double p) {
+
+	uint64_t n = (uint64_t)ceil(p * s->nint);
+	uint64_t c = 0;
+	for (int i = 0; i < ANALYZE_BINS; i++) {
+		c += s->hist[i];
+		if (c >= n && c > 0) return (i + 0.5) * ANALYZE_BIN;
+	}
+	return 0;
+}
+
+static void stats_print(const char* title, const stats_t* s, double seconds) {
+
+	printf("%s %.1f s: %u reports (%.1f/s), %u duplicates, %u button changes",
+		title, seconds, s->reports, s->reports / seconds, s->duplicates, s->buttons);
+	if (s->telemetry && an.telemetry_ms) printf(", %u telemetry (%u missing)", s->telemetry, s->gaps);
+	else if (s->telemetry) printf(", %u telemetry", s->telemetry);
+	if (s->other) printf(", %u other", s->other);
+	printf("\n");
+
+	if (s->nint > 1) {
+		double mean = s->sum / s->nint;
+		double sd = sqrt(fmax(0, s->sum2 / s->nint - mean * mean));
+		printf("  inter-arrival us: mean %.0f sd %.0f min %llu p50 %.0f p99 %.0f max %llu\n",
+			mean, sd, (unsigned long long)s->min, percentile(s, 0.5), percentile(s, 0.99), (unsigned long long)s->max);
+	}
+	// rms of the successive differences over sqrt(2): the sd of white noise, and mostly blind to slow aim changes
+	if (s->ndiff > 0)
+		printf("  axis noise: x %.1f y %.1f (report units)\n", sqrt(s->dx2 / s->ndiff / 2), sqrt(s->dy2 / s->ndiff / 2));
+}
+
+static void stats_add_interval(stats_t* s, uint64_t dt) {
+
+	s->nint++;
+	s->sum += dt;
+	s->sum2 += (double)dt * dt;
+	if (dt < s->min) s->min = dt;
+	if (dt > s->max) s->max = dt;
+	uint64_t b = dt / ANALYZE_BIN;
+	s->hist[(b < ANALYZE_BINS) ? b : ANALYZE_BINS - 1]++;
+}
+
+
+static int send_command(uint8_t data) {
+
+	uint8_t report[2] = { PIGUN_REPORT_ID, data };
+	if (write(an.fd, report, sizeof(report)) != sizeof(report)) {
+		fprintf(stderr, "ANALYZE ERROR: unable to send %02x (%s)\n", data, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void handle_report(const uint8_t* report, int size, uint64_t t) {
+
+	if (an.record) {
+		fprintf(an.record, "%llu", (unsigned long long)(t - an.t0));
+		for (int i = 0; i < size; i++) fprintf(an.record, " %02x", report[i]);
+		fprintf(an.record, "\n");
+	}
+
+	stats_t* ss[2] = { &an.window, &an.total };
+
+	if (report[0] == PIGUN_TELEMETRY_ID && size == 1 + HID_TELEMETRY_SIZE) {
+		uint32_t frame = report[1] | (report[2] << 8) | (report[3] << 16) | ((uint32_t)report[4] << 24);
+		// a report every telemetry_ms: the counter moves by that many frames, about
+		int gap = 0;
+		if (an.telemetry_ms && an.has_frame) {
+			uint32_t expected = an.telemetry_ms * an.fps / 1000;
+			if (expected < 1) expected = 1;
+			gap = (frame - an.frame > expected + expected / 2);
+		}
+		an.frame = frame;
+		an.has_frame = 1;
+		for (int i = 0; i < 2; i++) {
+			ss[i]->telemetry++;
+			ss[i]->gaps += gap;
+		}
+
+		if (an.t_ping) {
+			uint64_t rtt = t - an.t_ping;
+			an.t_ping = 0;
+			an.npong++;
+			an.rtt_sum += rtt;
+			if (rtt < an.rtt_min) an.rtt_min = rtt;
+			if (rtt > an.rtt_max) an.rtt_max = rtt;
+		}
+		return;
+	}
+
+	if (report[0] != PIGUN_REPORT_ID || size != 1 + HID_REPORT_SIZE) {
+		for (int i = 0; i < 2; i++) ss[i]->other++;
+		return;
+	}
+
+	int dup = an.t_last && memcmp(report, an.last, size) == 0;
+	int16_t x = (int16_t)(report[1] | (report[2] << 8));
+	int16_t y = (int16_t)(report[3] | (report[4] << 8));
+	int16_t lx = (int16_t)(an.last[1] | (an.last[2] << 8));
+	int16_t ly = (int16_t)(an.last[3] | (an.last[4] << 8));
+
+	for (int i = 0; i < 2; i++) {
+		stats_t* s = ss[i];
+		s->reports++;
+		s->duplicates += dup;
+		if (!an.t_last) continue;
+
+		stats_add_interval(s, t - an.t_last);
+		if (report[5] != an.last[5]) s->buttons++;
+		if (!dup) {
+			s->ndiff++;
+			s->dx2 += (double)(x - lx) * (x - lx);
+			s->dy2 += (double)(y - ly) * (y - ly);
+		}
+	}
+
+	memcpy(an.last, report, size);
+	an.t_last = t;
+}
+
+
+// prints the device and checks its report descriptor against the gun
+static void describe() {
+
+	char name[256] = "";
+	struct hidraw_devinfo info;
+	int size = 0;
+
+	ioctl(an.fd, HIDIOCGRAWNAME(sizeof(name)), name);
+	if (ioctl(an.fd, HIDIOCGRAWINFO, &info) == 0)
+		printf("ANALYZE: %s, bus %i, %04x:%04x\n", name, info.bustype, info.vendor & 0xFFFF, info.product & 0xFFFF);
+
+	struct hidraw_report_descriptor rd;
+	if (ioctl(an.fd, HIDIOCGRDESCSIZE, &size) != 0) return;
+	rd.size = size;
+	if (ioctl(an.fd, HIDIOCGRDESC, &rd) != 0) return;
+
+	int same = rd.size == sizeof(pigun_descriptor) && memcmp(rd.value, pigun_descriptor, rd.size) == 0;
+	printf("ANALYZE: report descriptor %u bytes, %s\n", rd.size, same ? "same as the gun" : "NOT the one of this gun version");
+}
+
+
+static void usage() {
+	printf("usage: pigun-analyze [options] /dev/hidrawN\n");
+	printf("  -t s        run for s seconds (default until ctrl-c)\n");
+	printf("  -i s        print the statistics every s seconds (default %.0f)\n", ANALYZE_INTERVAL);
+	printf("  -w file     record the reports, to replay them with pigun-vgun -r\n");
+	printf("  -c hex      send a data command at the start (e.g. 11 = recoil mode 1, 01 = fire)\n");
+	printf("  -p n        time the round trip of n telemetry requests (stops the periodic telemetry)\n");
+	printf("  -T ms       the periodic telemetry was set from the control interface, with this period\n");
+	printf("  -f fps      camera frame rate of the gun (default %i)\n", ANALYZE_FPS);
+}
+
+int main(int argc, char* argv[]) {
+
+	double duration = 0;
+	double interval = ANALYZE_INTERVAL;
+	int command = -1;
+	int opt;
+
+	an.fps = ANALYZE_FPS;
+	while ((opt = getopt(argc, argv, "t:i:w:c:p:T:f:h")) != -1) {
+		switch (opt) {
+		case 't': duration = atof(optarg); break;
+		case 'i': interval = atof(optarg); break;
+		case 'w':
+			an.record = fopen(optarg, "w");
+			if (!an.record) {
+				fprintf(stderr, "ANALYZE ERROR: unable to open %s (%s)\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'c': command = (int)strtol(optarg, NULL, 16) & 0xFF; break;
+		case 'p': an.pings = atoi(optarg); break;
+		case 'T': an.telemetry_ms = atoi(optarg); break;
+		case 'f': an.fps = atoi(optarg); break;
+		default: usage(); return 1;
+		}
+	}
+	if (optind >= argc || an.fps == 0) {
+		usage();
+		return 1;
+	}
+	if (command >= 0 && (command >> 4) == HID_CMD_TELEMETRY) {
+		int k = command & 0x0F;
+		an.telemetry_ms = (k >= 2) ? k * HID_TELEMETRY_STEP : 0;
+	}
+	if (an.pings && an.telemetry_ms) {
+		fprintf(stderr, "ANALYZE ERROR: -p stops the periodic telemetry, its replies could not be told apart\n");
+		return 1;
+	}
+	if (interval <= 0) interval = ANALYZE_INTERVAL;
+
+	an.fd = open(argv[optind], O_RDWR);
+	if (an.fd < 0) {
+		fprintf(stderr, "ANALYZE ERROR: unable to open %s (%s)\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	describe();
+
+	signal(SIGINT, an_sigint);
+	signal(SIGTERM, an_sigint);
+
+	stats_reset(&an.window);
+	stats_reset(&an.total);
+	an.rtt_min = UINT64_MAX;
+	an.t0 = now_us();
+	if (an.record) fprintf(an.record, "# pigun-analyze recording of %s: t_us report bytes\n", argv[optind]);
+
+	if (command >= 0) send_command((uint8_t)command);
+
+	uint64_t t_window = an.t0;
+	an.t_nextping = an.t0;
+	if (an.pings) {
+		// any telemetry report closes the pending request: no periodic ones, and let the last one arrive
+		send_command(HID_CMD_TELEMETRY << 4);
+		an.t_nextping = an.t0 + ANALYZE_PING_GAP * 1000;
+	}
+	uint8_t report[64];
+
+	while (!an_stop) {
+
+		uint64_t now = now_us();
+		if (duration > 0 && now - an.t0 >= duration * 1e6) break;
+
+		if (now - t_window >= interval * 1e6) {
+			stats_print("window", &an.window, (now - t_window) / 1e6);
+			stats_reset(&an.window);
+			t_window = now;
+		}
+
+		// round trip: one telemetry request at a time
+		if (an.t_ping && now - an.t_ping > ANALYZE_PING_TIMEOUT * 1000) {
+			an.t_ping = 0;
+			an.nlost++;
+		}
+		if (an.pings && !an.t_ping && now >= an.t_nextping) {
+			an.pings--;
+			an.t_nextping = now + ANALYZE_PING_GAP * 1000;
+			if (send_command((HID_CMD_TELEMETRY << 4) | 1) == 0) an.t_ping = now_us();
+		}
+
+		struct pollfd pfd = { an.fd, POLLIN, 0 };
+		int r = poll(&pfd, 1, 10);
+		if (r < 0 && errno != EINTR) break;
+		if (r <= 0) continue;
+		if (pfd.revents & (POLLHUP | POLLERR)) {
+			fprintf(stderr, "ANALYZE: device gone\n");
+			break;
+		}
+
+		int n = read(an.fd, report, sizeof(report));
+		if (n <= 0) continue;
+		handle_report(report, n, now_us());
+	}
+
+	double seconds = (now_us() - an.t0) / 1e6;
+	stats_print("total", &an.total, seconds);
+	if (an.npong || an.nlost)
+		printf("  round trip us: %u replies, %u lost, mean %.0f min %llu max %llu\n", an.npong, an.nlost,
+			an.npong ? an.rtt_sum / an.npong : 0, (unsigned long long)(an.npong ? an.rtt_min : 0), (unsigned long long)an.rtt_max);
+
+	if (an.record) fclose(an.record);
+	close(an.fd);
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+* Button state machine check and benchmark: runs the register state machine of the gun
+* (src/pigun-buttons.c, built in) on fake GPIO registers next to the per-pin logic it replaced,
+* and checks that both give the same pressed buttons and new presses on random samples.
+* Then it times both, and counts the register accesses per sample, which is what costs on the Pi
+* (each one is a read or write on the peripheral bus).
+*
+* It exits with 1 if the two ever disagree.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pigun-buttons.h"
+
+#define BENCH_SAMPLES 1000000	// default random samples compared
+#define BENCH_TIMED 10000000	// samples timed
+#define BENCH_DELAY 3			// default recharge, in samples (button_delay in pigun-gpio.c)
+#define BENCH_BUTTONS 9
+
+
+// the default pins of pigun-gpio.h, in the order of the masks
+static const int bench_pins[BENCH_BUTTONS] = { 17, 27, 22, 24, 10, 12, 25, 23, 15 };
+
+
+// *** FAKE REGISTERS ***
+
+static uint32_t reg_level, reg_events;
+static uint64_t reg_accesses;
+
+static uint32_t fake_level() {
+	reg_accesses++;
+	return reg_level;
+}
+static uint32_t fake_events() {
+	reg_accesses++;
+	return reg_events;
+}
+static void fake_clear(uint32_t pins) {
+	reg_accesses++;
+	reg_events &= ~pins;
+}
+static const pigun_buttons_regs_t fake_regs = { fake_level, fake_events, fake_clear };
+
+
+// *** PER-PIN LOGIC ***
+// the polled buttons before the state machine, one libbcm2835 call per register access:
+// bcm2835_gpio_eds, bcm2835_gpio_set_eds and bcm2835_gpio_lev on each pin
+
+// status=0: ready to be pressed
+// status=1: button is currently pressed
+// status<0: button has been released as is "recharging"
+static int pin_status[BENCH_BUTTONS];
+static uint16_t pin_state;
+
+static uint16_t pins_sample(int delay, uint16_t* newpress) {
+
+	*newpress = 0;
+	for (int i = 0; i < BENCH_BUTTONS; i++) {
+
+		uint32_t bit = UINT32_C(1) << bench_pins[i];
+		if (fake_events() & bit) {
+			fake_clear(bit);
+			if (pin_status[i] == 0) {
+				*newpress |= (uint16_t)(1 << i);
+				pin_state |= (uint16_t)(1 << i);
+				pin_status[i] = 1;
+				continue;
+			}
+		}
+
+		if ((fake_level() & bit) && pin_status[i] == 1) {
+			pin_status[i] = -delay;
+			pin_state &= ~(uint16_t)(1 << i);
+			continue;
+		}
+
+		if (pin_status[i] < 0) pin_status[i]++;
+	}
+	return pin_state;
+}
+
+
+// random registers: pins mostly high (released), some edges, noise on the other pins
+static void random_registers(uint32_t pinmask) {
+
+	reg_level = (uint32_t)rand() & ~pinmask;
+	reg_events = (uint32_t)rand() & ~pinmask;
+	for (int i = 0; i < BENCH_BUTTONS; i++) {
+		if (rand() % 3) reg_level |= UINT32_C(1) << bench_pins[i];
+		if (rand() % 4 == 0) reg_events |= UINT32_C(1) << bench_pins[i];
+	}
+}
+
+static double elapsed_ns(const struct timespec* t0, const struct timespec* t1) {
+	return (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+}
+
+
+static void usage() {
+	printf("usage: pigun-buttons-bench [options]\n");
+	printf("  -n samples  random samples compared (default %i)\n", BENCH_SAMPLES);
+	printf("  -d delay    recharge after a release, in samples (default %i, at most %i)\n", BENCH_DELAY, BUTTONS_MAXDELAY);
+	printf("  -s seed     random seed (default 1)\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	int nsamples = BENCH_SAMPLES;
+	int delay = BENCH_DELAY;
+	unsigned seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:d:s:h")) != -1) {
+		switch (opt) {
+		case 'n': nsamples = atoi(optarg); break;
+		case 'd': delay = atoi(optarg); break;
+		case 's': seed = (unsigned)atoi(optarg); break;
+		default: usage(); return 1;
+		}
+	}
+	if (nsamples < 1 || delay < 0 || delay > BUTTONS_MAXDELAY) {
+		usage();
+		return 1;
+	}
+
+	pigun_buttons_t b;
+	pigun_buttons_init(&b, &fake_regs, bench_pins, BENCH_BUTTONS, (uint8_t)delay);
+	srand(seed);
+
+	// same registers for both: the state machine clears the events, so they are set again in between
+	long mismatches = 0;
+	for (int n = 0; n < nsamples; n++) {
+
+		random_registers(b.pinmask);
+		uint32_t level = reg_level, events = reg_events;
+
+		uint16_t press_sm, press_pins;
+		uint16_t state_sm = pigun_buttons_sample(&b, &press_sm);
+		reg_level = level;
+		reg_events = events;
+		uint16_t state_pins = pins_sample(delay, &press_pins);
+
+		if (state_sm != state_pins || press_sm != press_pins) {
+			if (mismatches < 10)
+				printf("sample %i: state machine %03x/%03x, per pin %03x/%03x (pressed/new)\n", n, state_sm, press_sm, state_pins, press_pins);
+			mismatches++;
+		}
+	}
+	printf("%i samples, delay %i: %ld mismatches\n", nsamples, delay, mismatches);
+
+	// timing, on a fixed pattern of edges and levels
+	struct timespec t0, t1;
+	uint16_t press;
+	volatile uint16_t sink = 0;
+
+	reg_accesses = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (uint32_t n = 0; n < BENCH_TIMED; n++) {
+		reg_events = n * 2654435761u;
+		reg_level = ~reg_events;
+		sink += pigun_buttons_sample(&b, &press);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("state machine: %.1f ns/sample, %.2f register accesses/sample\n",
+		elapsed_ns(&t0, &t1) / BENCH_TIMED, (double)reg_accesses / BENCH_TIMED);
+
+	reg_accesses = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (uint32_t n = 0; n < BENCH_TIMED; n++) {
+		reg_events = n * 2654435761u;
+		reg_level = ~reg_events;
+		sink += pins_sample(delay, &press);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("per pin:       %.1f ns/sample, %.2f register accesses/sample\n",
+		elapsed_ns(&t0, &t1) / BENCH_TIMED, (double)reg_accesses / BENCH_TIMED);
+
+	return (mismatches > 0) ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+* Sensor crop simulation: runs the crop decision of the gun (src/pigun-crop.c, built in) frame by
+* frame on synthetic beacon trajectories, with the same settle and lost counting as the frame loop
+* in pigun.c, and checks what the crop does with them:
+*	move		the beacons swing across the sensor, close and far: every crop set must contain
+*				them, and they must never get out of the crop while it follows them
+*	lose		the beacons disappear: the crop must go back to the full view, in time
+*	reacquire	they come back somewhere else: the crop must find them from the full view and
+*				zoom in again
+*
+* The detector is ideal: it finds the 4 beacons if they are all inside the crop, and nothing
+* otherwise. Positions are normalised on the full frame, as in pigun-crop.c.
+* It exits with 1 if a check failed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "pigun-crop.h"
+
+#define SIM_FPS 40				// frames per second (PIGUN_FPS)
+#define SIM_SPEED 0.4			// default top speed of the beacons, full view widths per second
+#define SIM_MOVE 12.0			// seconds of the move phase
+#define SIM_LOST 1.0			// seconds without beacons
+#define SIM_REACQUIRE 2.0		// seconds after the beacons come back
+#define SIM_BEACON_W 0.35		// default size of the beacon rectangle on the full view, at the
+#define SIM_BEACON_H 0.25		// middle distance
+
+
+/// @brief Counters of the run and of each check.
+typedef struct {
+	uint32_t frames;
+	uint32_t tracked;		// frames where the detector found the beacons
+	uint32_t changes;		// crops set on the camera
+	uint32_t outside;		// crops set that did not contain the beacons
+	uint32_t escaped;		// frames where the beacons were on the sensor but out of the crop
+	int full_after;			// frames from the loss to the full view, -1 if it never went back
+	int zoom_after;			// frames from the reacquire to the first crop, -1 if it never cropped
+	float size_min;			// smallest crop used
+} sim_stats_t;
+
+
+static pigun_rect_t crop = { 0, 0, 1, 1 };
+static uint8_t settle = 0;
+static uint16_t lost = 0;
+static sim_stats_t stats;
+static int verbose = 0;
+
+
+static int rect_inside(const pigun_rect_t* in, const pigun_rect_t* out) {
+	return in->x >= out->x && in->y >= out->y &&
+		in->x + in->w <= out->x + out->w && in->y + in->h <= out->y + out->h;
+}
+
+static int crop_isfull() {
+	return crop.w >= 1 && crop.h >= 1;
+}
+
+
+// one frame through the crop, as pigun_crop_process in pigun.c
+// beacons: where the beacons are, NULL if they are not in view
+static void sim_frame(int frame, const pigun_rect_t* beacons) {
+
+	stats.frames++;
+
+	// the frames with the old crop are not used
+	if (settle > 0) {
+		settle--;
+		return;
+	}
+
+	uint8_t error = 1;
+	if (beacons) {
+		pigun_rect_t sensor = { 0, 0, 1, 1 };
+		if (rect_inside(beacons, &crop)) error = 0;
+		else if (rect_inside(beacons, &sensor)) {
+			stats.escaped++;
+			if (verbose) printf("frame %i: beacons out of the crop [%.3f %.3f %.3f]\n", frame, crop.x, crop.y, crop.w);
+		}
+	}
+	if (error) {
+		if (lost < UINT16_MAX) lost++;
+	}
+	else {
+		lost = 0;
+		stats.tracked++;
+	}
+
+	pigun_rect_t next;
+	if (!pigun_crop_next(&crop, beacons ? beacons : &crop, error, lost, &next)) return;
+
+	if (!error && !rect_inside(beacons, &next)) {
+		stats.outside++;
+		printf("frame %i: crop [%.3f %.3f %.3f] does not contain the beacons [%.3f %.3f %.3f %.3f]\n",
+			frame, next.x, next.y, next.w, beacons->x, beacons->y, beacons->w, beacons->h);
+	}
+	if (verbose) printf("frame %i: crop -> [%.3f %.3f %.3f]\n", frame, next.x, next.y, next.w);
+
+	crop = next;
+	settle = CROP_SETTLE;
+	stats.changes++;
+	if (crop.w < stats.size_min) stats.size_min = crop.w;
+}
+
+
+// beacon rectangle centered on (cx, cy), at a distance that scales it by zoom
+static pigun_rect_t beacons_at(double cx, double cy, double zoom, double bw, double bh) {
+
+	pigun_rect_t r;
+	r.w = (float)(bw * zoom);
+	r.h = (float)(bh * zoom);
+	r.x = (float)(cx - r.w / 2);
+	r.y = (float)(cy - r.h / 2);
+	return r;
+}
+
+
+static void usage() {
+	printf("usage: pigun-crop-sim [options]\n");
+	printf("  -v speed    top speed of the beacons, full view widths per second (default %.1f)\n", SIM_SPEED);
+	printf("  -w size     width of the beacon rectangle on the full view (default %.2f)\n", SIM_BEACON_W);
+	printf("  -d          print every crop change\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	double speed = SIM_SPEED;
+	double bw = SIM_BEACON_W;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "v:w:dh")) != -1) {
+		switch (opt) {
+		case 'v': speed = atof(optarg); break;
+		case 'w': bw = atof(optarg); break;
+		case 'd': verbose = 1; break;
+		default: usage(); return 1;
+		}
+	}
+	if (speed <= 0 || bw <= 0 || bw > 0.6) {
+		usage();
+		return 1;
+	}
+	double bh = bw * SIM_BEACON_H / SIM_BEACON_W;
+
+	// beacons that need more than CROP_SHRINK of the view with the margins are never cropped
+	int cropping = (bw + 2 * CROP_MARGIN < CROP_SHRINK);
+
+	stats.full_after = -1;
+	stats.zoom_after = -1;
+	stats.size_min = 1;
+	int frame = 0;
+
+	// move: a slow lissajous around the sensor, while the gun goes closer and further
+	// the amplitude keeps the beacons on the sensor at the closest point
+	double ax = (1 - 1.3 * bw) / 2, ay = (1 - 1.3 * bh) / 2;
+	double w = speed / ax;	// rad/s of the horizontal swing, for the top speed
+	int nmove = (int)(SIM_MOVE * SIM_FPS);
+	pigun_rect_t b;
+	for (int n = 0; n < nmove; n++, frame++) {
+		double t = (double)n / SIM_FPS;
+		double zoom = 1 + 0.3 * sin(0.15 * w * t);
+		b = beacons_at(0.5 + ax * sin(w * t), 0.5 + ay * sin(0.7 * w * t + 1), zoom, bw, bh);
+		sim_frame(frame, &b);
+	}
+	uint32_t move_changes = stats.changes;
+	uint32_t move_tracked = stats.tracked;
+
+	// lose: the beacons are gone
+	int loss = frame;
+	int nlost = (int)(SIM_LOST * SIM_FPS);
+	for (int n = 0; n < nlost; n++, frame++) {
+		sim_frame(frame, NULL);
+		if (stats.full_after < 0 && crop_isfull() && settle == 0) stats.full_after = frame - loss;
+	}
+
+	// reacquire: they come back in a corner
+	int back = frame;
+	int nback = (int)(SIM_REACQUIRE * SIM_FPS);
+	b = beacons_at(0.05 + bw / 2, 0.95 - bh / 2, 1, bw, bh);
+	for (int n = 0; n < nback; n++, frame++) {
+		sim_frame(frame, &b);
+		if (stats.zoom_after < 0 && !crop_isfull()) stats.zoom_after = frame - back;
+	}
+
+	printf("move: %i frames at up to %.2f view/s, %u tracked, %u crop changes, smallest crop %.2f\n",
+		nmove, speed, move_tracked, move_changes, stats.size_min);
+	printf("lose: back to the full view after %i frames (at most %i)\n", stats.full_after, CROP_SETTLE + CROP_LOST + 1);
+	printf("reacquire: cropped again after %i frames\n", stats.zoom_after);
+	if (!cropping) printf("the beacons are too large for a crop, only the full view is expected\n");
+	printf("checks: %u crops without the beacons, %u frames with the beacons out of the crop\n", stats.outside, stats.escaped);
+
+	int fail = 0;
+	if (stats.outside > 0) {
+		printf("FAIL: a crop did not contain the beacons it was set for\n");
+		fail = 1;
+	}
+	if (stats.escaped > 0) {
+		printf("FAIL: the crop did not keep up with the beacons\n");
+		fail = 1;
+	}
+	if (cropping && (move_changes == 0 || stats.size_min >= 1)) {
+		printf("FAIL: the crop never followed the beacons\n");
+		fail = 1;
+	}
+	if (stats.full_after < 0 || stats.full_after > CROP_SETTLE + CROP_LOST + 1) {
+		printf("FAIL: the crop did not go back to the full view after the loss\n");
+		fail = 1;
+	}
+	if ((cropping && stats.zoom_after < 0) || !rect_inside(&b, &crop)) {
+		printf("FAIL: the crop did not find the beacons again\n");
+		fail = 1;
+	}
+	if (!fail) printf("OK\n");
+	return fail;
+}
@@ -0,0 +1,295 @@
+/*
+* Gyro + camera fusion replay: runs a stream of gyro samples and camera frames through the fusion
+* core of the gun (src/pigun-fusion.c, built in) and measures the fused aim against a reference.
+*
+* The stream is synthetic by default: the gun swings in front of the beacons, the gyro has a bias
+* and noise, the camera frames come with noise and arrive some ms after their exposure. A recorded
+* or hand made stream can be replayed instead, one event per line:
+*	g <t_us> <dcol> <drow>										gyro sample, boresight px/s as in pigun-imu.c
+*	c <t_us> <t_sensor_us> <x> <y> <bcol> <brow> <H0> ... <H8>	camera frame arriving at t_us
+*	r <t_us> <x> <y>											reference aim, the error is measured here
+* in time order, '#' starts a comment. -w writes the synthetic stream in this format.
+*
+* At each reference the fused aim is compared with it, and so is the last camera aim, which is what
+* the gun reports without the gyro (before prediction): the difference is what the fusion buys.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "pigun-fusion.h"
+#include "pigun-pose.h"
+
+#define REPLAY_DURATION 10.0	// default seconds of synthetic stream
+#define REPLAY_GYRO 500			// default gyro samples per second (IMU_RATE)
+#define REPLAY_FPS 60			// default camera frames per second
+#define REPLAY_LATENCY 25		// default ms from the exposure to the frame processing
+#define REPLAY_SPAN_X 300.0f	// px between the beacons on the image, horizontally
+#define REPLAY_SPAN_Y 220.0f	// px between the beacons on the image, vertically
+#define REPLAY_BCOL 208.0f		// boresight pixel (center of the image)
+#define REPLAY_BROW 160.0f
+
+
+/// @brief Error statistics of one aim source against the reference.
+typedef struct {
+	uint32_t n;
+	uint32_t missing;	// references where the source had no aim
+	double sum2;
+	double max;
+} replay_error_t;
+
+/// @brief Synthetic gun and sensors.
+typedef struct {
+	double duration;
+	int gyro_rate;
+	int fps;
+	int latency;		// us
+	double amplitude;	// swing, rad
+	double swing;		// swing frequency, Hz
+	double bias;		// gyro bias, rad/s
+	double gyro_noise;	// rad/s rms
+	double cam_noise;	// px rms
+} replay_synth_t;
+
+
+static pigun_fusion_t fusion;
+static replay_error_t err_fused, err_camera;
+static uint8_t camera_seen = 0;
+static float camera_x, camera_y;	// last camera aim
+static FILE* record = NULL;
+
+
+static double gauss() {
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static void error_add(replay_error_t* e, int ok, float x, float y, float rx, float ry) {
+
+	if (!ok) {
+		e->missing++;
+		return;
+	}
+	double d = hypot(x - rx, y - ry);
+	e->sum2 += d * d;
+	if (d > e->max) e->max = d;
+	e->n++;
+}
+
+static void error_print(const char* name, const replay_error_t* e) {
+	printf("%-8s rms %.5f max %.5f (%u references, %u without aim)\n",
+		name, (e->n > 0) ? sqrt(e->sum2 / e->n) : 0.0, e->max, e->n, e->missing);
+}
+
+
+// *** EVENTS ***
+// the same path for the synthetic and the replayed streams
+
+static void event_gyro(int64_t t, float dcol, float drow) {
+	pigun_fusion_gyro(&fusion, t, dcol, drow);
+	if (record) fprintf(record, "g %lld %.4f %.4f\n", (long long)t, dcol, drow);
+}
+
+static void event_camera(int64_t t, int64_t t_sensor, float x, float y, float bcol, float brow, const float* H) {
+
+	pigun_fusion_camera(&fusion, t_sensor, x, y, H, bcol, brow);
+	camera_seen = 1;
+	camera_x = x;
+	camera_y = y;
+	if (record) {
+		fprintf(record, "c %lld %lld %.6f %.6f %.2f %.2f", (long long)t, (long long)t_sensor, x, y, bcol, brow);
+		for (int k = 0; k < 9; k++) fprintf(record, " %.8g", H[k]);
+		fprintf(record, "\n");
+	}
+}
+
+static void event_reference(int64_t t, float rx, float ry) {
+
+	float x = 0, y = 0;
+	int ok = (pigun_fusion_aim(&fusion, t, &x, &y) == 0);
+	error_add(&err_fused, ok, x, y, rx, ry);
+	error_add(&err_camera, camera_seen, camera_x, camera_y, rx, ry);
+	if (record) fprintf(record, "r %lld %.6f %.6f\n", (long long)t, rx, ry);
+}
+
+
+// *** SYNTHETIC STREAM ***
+
+// gun orientation (rad) and its rate at time t (s): a swing with a slower vertical motion
+static void synth_pose(const replay_synth_t* s, double t, double* yaw, double* pitch, double* dyaw, double* dpitch) {
+
+	double w = 2 * M_PI * s->swing;
+	*yaw = s->amplitude * (sin(w * t) + 0.5 * sin(2.3 * w * t + 1));
+	*dyaw = s->amplitude * w * (cos(w * t) + 1.15 * cos(2.3 * w * t + 1));
+	*pitch = 0.5 * s->amplitude * sin(0.7 * w * t);
+	*dpitch = 0.35 * s->amplitude * w * cos(0.7 * w * t);
+}
+
+// true aim: the boresight moves by the focal length x the angle, over the beacon span
+static void synth_aim(double yaw, double pitch, float* x, float* y) {
+	*x = 0.5f + (float)(POSE_FX * yaw / REPLAY_SPAN_X);
+	*y = 0.5f + (float)(POSE_FY * pitch / REPLAY_SPAN_Y);
+}
+
+static void synth_run(const replay_synth_t* s) {
+
+	int64_t gyro_dt = 1000000 / s->gyro_rate;
+	int64_t frame_dt = 1000000 / s->fps;
+	int64_t t_end = (int64_t)(s->duration * 1e6);
+	int64_t t_frame = 0;	// exposure of the next frame
+	double yaw, pitch, dyaw, dpitch;
+
+	for (int64_t t = 0; t <= t_end; t += gyro_dt) {
+
+		// the frames processed by now
+		while (t_frame + s->latency <= t) {
+
+			synth_pose(s, t_frame * 1e-6, &yaw, &pitch, &dyaw, &dpitch);
+			float x, y;
+			synth_aim(yaw, pitch, &x, &y);
+			x += (float)(s->cam_noise * gauss() / REPLAY_SPAN_X);
+			y += (float)(s->cam_noise * gauss() / REPLAY_SPAN_Y);
+
+			// the beacon rectangle as the homography sees it: the boresight lands on the aim
+			float H[9] = {
+				1 / REPLAY_SPAN_X, 0, x - REPLAY_BCOL / REPLAY_SPAN_X,
+				0, 1 / REPLAY_SPAN_Y, y - REPLAY_BROW / REPLAY_SPAN_Y,
+				0, 0, 1 };
+			event_camera(t_frame + s->latency, t_frame, x, y, REPLAY_BCOL, REPLAY_BROW, H);
+			t_frame += frame_dt;
+		}
+
+		synth_pose(s, t * 1e-6, &yaw, &pitch, &dyaw, &dpitch);
+		double gyaw = dyaw + s->bias + s->gyro_noise * gauss();
+		double gpitch = dpitch + s->bias + s->gyro_noise * gauss();
+		event_gyro(t, (float)(POSE_FX * gyaw), (float)(POSE_FY * gpitch));
+
+		float rx, ry;
+		synth_aim(yaw, pitch, &rx, &ry);
+		event_reference(t, rx, ry);
+	}
+}
+
+
+// *** RECORDED STREAM ***
+
+static int replay_file(const char* path) {
+
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "REPLAY ERROR: unable to open %s (%s)\n", path, strerror(errno));
+		return 1;
+	}
+
+	char line[512];
+	int nline = 0;
+	while (fgets(line, sizeof(line), f)) {
+
+		nline++;
+		char* p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == 0) continue;
+
+		long long t, ts;
+		float a, b, c, d, H[9];
+		int ok = 0;
+		switch (*p) {
+		case 'g':
+			if ((ok = (sscanf(p + 1, "%lld %f %f", &t, &a, &b) == 3))) event_gyro(t, a, b);
+			break;
+		case 'c':
+			ok = (sscanf(p + 1, "%lld %lld %f %f %f %f %f %f %f %f %f %f %f %f %f", &t, &ts, &a, &b, &c, &d,
+				&H[0], &H[1], &H[2], &H[3], &H[4], &H[5], &H[6], &H[7], &H[8]) == 15);
+			if (ok) event_camera(t, ts, a, b, c, d, H);
+			break;
+		case 'r':
+			if ((ok = (sscanf(p + 1, "%lld %f %f", &t, &a, &b) == 3))) event_reference(t, a, b);
+			break;
+		}
+		if (!ok) fprintf(stderr, "REPLAY ERROR: line %i not understood, skipped\n", nline);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+static void usage() {
+	printf("usage: pigun-fusion-replay [options]\n");
+	printf("  -r file     replay a stream file instead of the synthetic one\n");
+	printf("  -w file     write the synthetic stream to a file\n");
+	printf("  -k gain     camera correction gain (default %.2f)\n", FUSION_GAIN);
+	printf("  synthetic stream:\n");
+	printf("  -t s        duration (default %.0f)\n", REPLAY_DURATION);
+	printf("  -g hz       gyro rate (default %i)\n", REPLAY_GYRO);
+	printf("  -f fps      camera frame rate (default %i)\n", REPLAY_FPS);
+	printf("  -l ms       camera latency, exposure to processing (default %i)\n", REPLAY_LATENCY);
+	printf("  -a deg      swing amplitude (default 5)\n");
+	printf("  -s hz       swing frequency (default 1)\n");
+	printf("  -b deg/s    gyro bias (default 0.5)\n");
+	printf("  -n deg/s    gyro noise rms (default 0.05)\n");
+	printf("  -c px       camera noise rms (default 0.3)\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	replay_synth_t s = {
+		REPLAY_DURATION, REPLAY_GYRO, REPLAY_FPS, REPLAY_LATENCY * 1000,
+		5 * M_PI / 180, 1.0, 0.5 * M_PI / 180, 0.05 * M_PI / 180, 0.3 };
+	const char* input = NULL;
+	float gain = FUSION_GAIN;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:w:k:t:g:f:l:a:s:b:n:c:h")) != -1) {
+		switch (opt) {
+		case 'r': input = optarg; break;
+		case 'w':
+			record = fopen(optarg, "w");
+			if (!record) {
+				fprintf(stderr, "REPLAY ERROR: unable to open %s (%s)\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'k': gain = atof(optarg); break;
+		case 't': s.duration = atof(optarg); break;
+		case 'g': s.gyro_rate = atoi(optarg); break;
+		case 'f': s.fps = atoi(optarg); break;
+		case 'l': s.latency = atoi(optarg) * 1000; break;
+		case 'a': s.amplitude = atof(optarg) * M_PI / 180; break;
+		case 's': s.swing = atof(optarg); break;
+		case 'b': s.bias = atof(optarg) * M_PI / 180; break;
+		case 'n': s.gyro_noise = atof(optarg) * M_PI / 180; break;
+		case 'c': s.cam_noise = atof(optarg); break;
+		default: usage(); return 1;
+		}
+	}
+	if (s.gyro_rate <= 0 || s.fps <= 0 || s.latency < 0) {
+		usage();
+		return 1;
+	}
+
+	pigun_fusion_init(&fusion);
+	fusion.gain = gain;
+	srand(1);
+
+	if (input) {
+		if (replay_file(input)) return 1;
+	}
+	else {
+		if (record) fprintf(record, "# pigun-fusion-replay synthetic stream, %.1f s, gyro %i Hz, camera %i fps, latency %i ms\n",
+			s.duration, s.gyro_rate, s.fps, s.latency / 1000);
+		synth_run(&s);
+	}
+	if (record) fclose(record);
+
+	printf("aim error in normalised units (1 = the beacon rectangle), gain %.2f\n", gain);
+	error_print("fused", &err_fused);
+	error_print("camera", &err_camera);
+	return 0;
+}
@@ -0,0 +1,298 @@
+/*
+* Runtime parameter tool: reads and tunes the gun parameters (detector, camera, filter, predictor) through
+* the parameter feature report (ID 5) of a hidraw device, while the gun is in use.
+*
+* Examples:
+*	pigun-param /dev/hidraw3						list the parameters with their values and ranges
+*	pigun-param /dev/hidraw3 shutter=2000 again=2		set them, applied together
+*	pigun-param -f ghoulpt.txt /dev/hidraw3			set the ones in a file ("name value" lines), e.g. per game
+*
+* The gun answers a request with the feature report, or with an input report of the same ID when
+* it is on USB, where the gadget does not answer GET_REPORT: both are tried.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "pigun-report.h"
+
+#define PARAM_TIMEOUT 500	// ms to wait for an answer
+#define PARAM_MAXSET 64		// parameters set in one go
+
+
+/// @brief A parameter as the gun describes it.
+typedef struct {
+	uint8_t id;
+	uint8_t status;
+	int32_t value, min, max;
+	uint8_t decimals;
+	char name[PARAM_NAMELEN + 1];
+} param_t;
+
+static int param_fd;
+static int param_count = 0;
+static param_t params[256];
+
+
+static uint64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int32_t read_32(const uint8_t* b) {
+	return (int32_t)(b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24));
+}
+
+static void decode(const uint8_t* a, param_t* p) {
+
+	p->id = a[PARAM_AT_ID];
+	p->status = a[PARAM_AT_STATUS];
+	p->value = read_32(&a[PARAM_AT_VALUE]);
+	p->min = read_32(&a[PARAM_AT_MIN]);
+	p->max = read_32(&a[PARAM_AT_MAX]);
+	p->decimals = a[PARAM_AT_DECIMALS];
+	memcpy(p->name, &a[PARAM_AT_NAME], PARAM_NAMELEN);
+	p->name[PARAM_NAMELEN] = 0;
+}
+
+static void format(const param_t* p, int32_t value, char* text, int maxlen) {
+
+	if (p->decimals == 0) snprintf(text, maxlen, "%i", value);
+	else snprintf(text, maxlen, "%.*f", p->decimals, value / pow(10, p->decimals));
+}
+
+
+// sends a request and waits for the answer (without the report ID)
+static int transact(uint8_t op, uint8_t id, int32_t value, uint8_t* answer) {
+
+	uint8_t buf[1 + HID_PARAM_SIZE];
+
+	// drop the reports that arrived before the request
+	struct pollfd pfd = { param_fd, POLLIN, 0 };
+	while (poll(&pfd, 1, 0) > 0 && read(param_fd, buf, sizeof(buf)) > 0);
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = PIGUN_PARAM_ID;
+	buf[1 + PARAM_AT_VERSION] = HID_PARAM_VERSION;
+	buf[1 + PARAM_AT_OP] = op;
+	buf[1 + PARAM_AT_ID] = id;
+	for (int i = 0; i < 4; i++) buf[1 + PARAM_AT_VALUE + i] = ((uint32_t)value >> (8 * i)) & 0xFF;
+	if (ioctl(param_fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+		fprintf(stderr, "PARAM ERROR: request not sent (%s)\n", strerror(errno));
+		return 1;
+	}
+
+	// bluetooth: GET_REPORT. The USB gadget answers it with zeros, so the version tells
+	memset(buf, 0, sizeof(buf));
+	buf[0] = PIGUN_PARAM_ID;
+	if (ioctl(param_fd, HIDIOCGFEATURE(sizeof(buf)), buf) > PARAM_AT_VERSION + 1 && buf[1 + PARAM_AT_VERSION] != 0) {
+		memcpy(answer, &buf[1], HID_PARAM_SIZE);
+		return 0;
+	}
+
+	// USB: the answer comes as an input report
+	uint64_t t_end = now_ms() + PARAM_TIMEOUT;
+	uint8_t report[64];
+	while (now_ms() < t_end) {
+		if (poll(&pfd, 1, (int)(t_end - now_ms())) <= 0) continue;
+		int n = read(param_fd, report, sizeof(report));
+		if (n == 1 + HID_PARAM_SIZE && report[0] == PIGUN_PARAM_ID) {
+			memcpy(answer, &report[1], HID_PARAM_SIZE);
+			return 0;
+		}
+	}
+	fprintf(stderr, "PARAM ERROR: no answer from the gun\n");
+	return 1;
+}
+
+static const char* status_text(uint8_t status) {
+	switch (status) {
+	case PARAM_OK: return "";
+	case PARAM_PENDING: return " (pending)";
+	case PARAM_ERR_VERSION: return " ERROR: protocol version not supported by the gun";
+	case PARAM_ERR_OP: return " ERROR: operation not supported";
+	case PARAM_ERR_ID: return " ERROR: unknown parameter";
+	case PARAM_ERR_RANGE: return " ERROR: out of range";
+	}
+	return " ERROR";
+}
+
+// reads the list of parameters from the gun
+static int list_load() {
+
+	uint8_t answer[HID_PARAM_SIZE];
+	int count = 1;
+
+	for (int id = 0; id < count && id < 256; id++) {
+		if (transact(PARAM_OP_GET, id, 0, answer)) return 1;
+		if (answer[PARAM_AT_VERSION] != HID_PARAM_VERSION) {
+			fprintf(stderr, "PARAM ERROR: the gun speaks version %u, this tool %u\n", answer[PARAM_AT_VERSION], HID_PARAM_VERSION);
+			return 1;
+		}
+		count = answer[PARAM_AT_COUNT];
+		if (answer[PARAM_AT_STATUS] == PARAM_ERR_ID) break;
+		decode(answer, &params[id]);
+		param_count = id + 1;
+	}
+	return 0;
+}
+
+static void print(const param_t* p) {
+
+	char value[16], lo[16], hi[16];
+	format(p, p->value, value, sizeof(value));
+	format(p, p->min, lo, sizeof(lo));
+	format(p, p->max, hi, sizeof(hi));
+	printf("%3u %-14s %12s   [%s, %s]%s\n", p->id, p->name, value, lo, hi, status_text(p->status));
+}
+
+static param_t* find(const char* name) {
+
+	for (int i = 0; i < param_count; i++)
+		if (strcmp(params[i].name, name) == 0) return &params[i];
+	return NULL;
+}
+
+
+// a setting to send: the parameter and its raw value
+typedef struct {
+	param_t* p;
+	int32_t value;
+} setting_t;
+
+static setting_t settings[PARAM_MAXSET];
+static int nsettings = 0;
+
+static int setting_add(const char* name, const char* text) {
+
+	param_t* p = find(name);
+	if (p == NULL) {
+		fprintf(stderr, "PARAM ERROR: unknown parameter %s\n", name);
+		return 1;
+	}
+	if (nsettings == PARAM_MAXSET) {
+		fprintf(stderr, "PARAM ERROR: more than %i settings\n", PARAM_MAXSET);
+		return 1;
+	}
+	int32_t value = (int32_t)lround(atof(text) * pow(10, p->decimals));
+	if (value < p->min || value > p->max) {
+		char lo[16], hi[16];
+		format(p, p->min, lo, sizeof(lo));
+		format(p, p->max, hi, sizeof(hi));
+		fprintf(stderr, "PARAM ERROR: %s must be within %s-%s\n", name, lo, hi);
+		return 1;
+	}
+	settings[nsettings].p = p;
+	settings[nsettings].value = value;
+	nsettings++;
+	return 0;
+}
+
+static int file_load(const char* path) {
+
+	FILE* fin = fopen(path, "r");
+	if (fin == NULL) {
+		fprintf(stderr, "PARAM ERROR: unable to open %s (%s)\n", path, strerror(errno));
+		return 1;
+	}
+	char line[256], name[64], value[64];
+	int err = 0;
+	while (!err && fgets(line, sizeof(line), fin)) {
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%63s %63s", name, value) != 2) continue;
+		err = setting_add(name, value);
+	}
+	fclose(fin);
+	return err;
+}
+
+
+static void usage() {
+	printf("usage: pigun-param [options] /dev/hidrawN [name | name=value ...]\n");
+	printf("  without names, all the parameters are listed\n");
+	printf("  -f file     set the parameters in the file, one \"name value\" per line\n");
+	printf("  all the values given are set together (the frame processing ones between two frames)\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	const char* file = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:h")) != -1) {
+		switch (opt) {
+		case 'f': file = optarg; break;
+		default: usage(); return 1;
+		}
+	}
+	if (optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	param_fd = open(argv[optind], O_RDWR);
+	if (param_fd < 0) {
+		fprintf(stderr, "PARAM ERROR: unable to open %s (%s)\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	if (list_load()) return 1;
+
+	// names to print, and settings
+	int nshow = 0;
+	if (file && file_load(file)) return 1;
+	for (int i = optind + 1; i < argc; i++) {
+		char* eq = strchr(argv[i], '=');
+		if (eq == NULL) {
+			param_t* p = find(argv[i]);
+			if (p == NULL) {
+				fprintf(stderr, "PARAM ERROR: unknown parameter %s\n", argv[i]);
+				return 1;
+			}
+			print(p);
+			nshow++;
+			continue;
+		}
+		*eq = 0;
+		if (setting_add(argv[i], eq + 1)) return 1;
+	}
+
+	if (nsettings == 0) {
+		if (nshow == 0)
+			for (int i = 0; i < param_count; i++) print(&params[i]);
+		return 0;
+	}
+
+	// all staged, the last one releases them together
+	uint8_t answer[HID_PARAM_SIZE];
+	for (int i = 0; i < nsettings; i++) {
+		setting_t* s = &settings[i];
+		uint8_t op = (i == nsettings - 1) ? PARAM_OP_SET : PARAM_OP_STAGE;
+		int err = transact(op, s->p->id, s->value, answer);
+		if (!err && answer[PARAM_AT_STATUS] < PARAM_ERR_VERSION) continue;
+
+		// all or nothing: the ones staged before are dropped
+		if (!err) printf("%s%s\n", s->p->name, status_text(answer[PARAM_AT_STATUS]));
+		transact(PARAM_OP_DISCARD, 0, 0, answer);
+		return 1;
+	}
+
+	// read back after the next frame
+	usleep(100000);
+	for (int i = 0; i < nsettings; i++) {
+		if (transact(PARAM_OP_GET, settings[i].p->id, 0, answer)) return 1;
+		decode(answer, settings[i].p);
+		print(settings[i].p);
+	}
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+* Scripted HID host for the bluetooth benchmark: connects to the gun with the kernel bluetooth
+* stack (HID control and interrupt channels), receives the input reports and sends output reports,
+* then disconnects and does it again. See vhci-bench.sh to run it against the gun on a virtual
+* controller of the same box.
+*
+* It measures, per session:
+* - connect time, and time to the first report after the channels are open
+* - report rate and inter-arrival times
+* - send to receive latency, from the telemetry reports: the gun puts its own clock in them,
+*   which is the same CLOCK_MONOTONIC as ours only when both run on the same box
+* - round trip of the telemetry requests (0x21), as an output report answered by an input one
+*
+* No BlueZ library needed: the few socket definitions are here.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "pigun-report.h"
+
+#define PEER_PSM_CONTROL 0x11
+#define PEER_PSM_INTERRUPT 0x13
+#define PEER_HID_INPUT 0xA1		// HIDP header of an input report on the interrupt channel
+#define PEER_HID_OUTPUT 0xA2	// HIDP header of an output report
+#define PEER_SESSION 10.0		// default seconds per session
+#define PEER_PAUSE 1000			// ms between sessions
+#define PEER_PING_GAP 100		// ms between round trip requests
+#define PEER_PING_TIMEOUT 500	// ms before a round trip request is given up
+#define PEER_MAXSAMPLES 100000	// samples kept per measure, for the percentiles
+
+// from the kernel bluetooth headers
+#define PEER_BTPROTO_L2CAP 0
+#define PEER_SOL_BLUETOOTH 274
+#define PEER_BT_SECURITY 4
+#define PEER_BT_SECURITY_MEDIUM 2
+
+struct peer_sockaddr_l2 {
+	sa_family_t l2_family;
+	unsigned short l2_psm;
+	uint8_t l2_bdaddr[6];
+	unsigned short l2_cid;
+	uint8_t l2_bdaddr_type;
+};
+
+struct peer_bt_security {
+	uint8_t level;
+	uint8_t key_size;
+};
+
+
+/// @brief Samples of one measure, in us.
+typedef struct {
+	double* v;
+	uint32_t n;
+} samples_t;
+
+static struct {
+	uint8_t gun[6];		// gun address, little endian as on the air
+	uint8_t local[6];	// local adapter, all zero for any
+	double session;
+	uint32_t telemetry;	// telemetry period parameter k (k*50 ms), 0=off
+	int ping;
+	int command;		// data command sent at the start of each session, -1=none
+} opt;
+
+static volatile sig_atomic_t peer_stop = 0;
+
+static void peer_sigint(int sig) {
+	(void)sig;
+	peer_stop = 1;
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int parse_addr(const char* s, uint8_t* addr) {
+
+	unsigned int b[6];
+	if (sscanf(s, "%x:%x:%x:%x:%x:%x", &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6) return -1;
+	for (int i = 0; i < 6; i++) addr[i] = (uint8_t)b[i];
+	return 0;
+}
+
+
+static void samples_add(samples_t* s, double v) {
+	if (s->n < PEER_MAXSAMPLES) s->v[s->n++] = v;
+}
+
+static int cmp_double(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static void samples_print(const char* name, samples_t* s) {
+
+	if (s->n == 0) return;
+	double sum = 0, sum2 = 0;
+	for (uint32_t i = 0; i < s->n; i++) {
+		sum += s->v[i];
+		sum2 += s->v[i] * s->v[i];
+	}
+	double mean = sum / s->n;
+	qsort(s->v, s->n, sizeof(double), &cmp_double);
+	printf("  %s us: n %u mean %.0f sd %.0f min %.0f p50 %.0f p99 %.0f max %.0f\n", name, s->n, mean,
+		sqrt(fmax(0, sum2 / s->n - mean * mean)), s->v[0], s->v[s->n / 2], s->v[(uint32_t)(s->n * 0.99)], s->v[s->n - 1]);
+}
+
+
+static int l2cap_connect(uint16_t psm) {
+
+	int fd = socket(AF_BLUETOOTH, SOCK_SEQPACKET, PEER_BTPROTO_L2CAP);
+	if (fd < 0) {
+		fprintf(stderr, "PEER ERROR: no bluetooth sockets (%s)\n", strerror(errno));
+		return -1;
+	}
+
+	struct peer_sockaddr_l2 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	memcpy(addr.l2_bdaddr, opt.local, 6);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "PEER ERROR: unable to bind the local adapter (%s)\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// authenticate like a HID host does: the gun pairs with just works
+	struct peer_bt_security sec = { PEER_BT_SECURITY_MEDIUM, 0 };
+	setsockopt(fd, PEER_SOL_BLUETOOTH, PEER_BT_SECURITY, &sec, sizeof(sec));
+
+	addr.l2_psm = psm;	// little endian hosts only, as the rest of PiGun
+	memcpy(addr.l2_bdaddr, opt.gun, 6);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "PEER ERROR: unable to connect PSM 0x%02x (%s)\n", psm, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int send_command(int fd, uint8_t data) {
+
+	uint8_t report[3] = { PEER_HID_OUTPUT, PIGUN_REPORT_ID, data };
+	return (send(fd, report, sizeof(report), 0) == sizeof(report)) ? 0 : -1;
+}
+
+
+/// @brief Results of the sessions, for the summary.
+static samples_t connects, firsts;
+
+static int session(int num, samples_t* inter, samples_t* latency, samples_t* rtt) {
+
+	inter->n = latency->n = rtt->n = 0;
+
+	uint64_t t0 = now_us();
+	int ctrl = l2cap_connect(PEER_PSM_CONTROL);
+	if (ctrl < 0) return -1;
+	int intr = l2cap_connect(PEER_PSM_INTERRUPT);
+	if (intr < 0) {
+		close(ctrl);
+		return -1;
+	}
+	uint64_t t_open = now_us();
+
+	if (opt.command >= 0) send_command(intr, (uint8_t)opt.command);
+	if (opt.telemetry) send_command(intr, (HID_CMD_TELEMETRY << 4) | opt.telemetry);
+
+	uint32_t reports = 0, telemetry = 0, offclock = 0, lost = 0;
+	uint64_t t_first = 0, t_last = 0, t_ping = 0, t_nextping = 0;
+	uint8_t buf[64];
+
+	while (!peer_stop) {
+
+		uint64_t now = now_us();
+		if (now - t_open >= opt.session * 1e6) break;
+
+		if (opt.ping && t_first) {
+			if (t_ping && now - t_ping > PEER_PING_TIMEOUT * 1000) {
+				t_ping = 0;
+				lost++;
+			}
+			if (!t_ping && now >= t_nextping) {
+				t_nextping = now + PEER_PING_GAP * 1000;
+				if (send_command(intr, (HID_CMD_TELEMETRY << 4) | 1) == 0) t_ping = now_us();
+			}
+		}
+
+		struct pollfd pfd[2] = { { intr, POLLIN, 0 }, { ctrl, POLLIN, 0 } };
+		int r = poll(pfd, 2, 10);
+		if (r < 0 && errno != EINTR) break;
+		if (r <= 0) continue;
+		if ((pfd[0].revents | pfd[1].revents) & (POLLHUP | POLLERR)) {
+			printf("PEER: the gun disconnected\n");
+			break;
+		}
+		if (pfd[1].revents & POLLIN) recv(ctrl, buf, sizeof(buf), 0);	// handshakes, not used
+		if (!(pfd[0].revents & POLLIN)) continue;
+
+		ssize_t n = recv(intr, buf, sizeof(buf), 0);
+		uint64_t t = now_us();
+		if (n < 2 || buf[0] != PEER_HID_INPUT) continue;
+
+		if (!t_first) t_first = t;
+
+		if (buf[1] == PIGUN_REPORT_ID && n == 2 + HID_REPORT_SIZE) {
+			if (t_last) samples_add(inter, t - t_last);
+			t_last = t;
+			reports++;
+		}
+		else if (buf[1] == PIGUN_TELEMETRY_ID && n == 2 + HID_TELEMETRY_SIZE) {
+			telemetry++;
+
+			// the report left the gun at t_sensor + age, on the gun clock (lower 32 bits)
+			uint32_t t_sensor = buf[6] | (buf[7] << 8) | (buf[8] << 16) | ((uint32_t)buf[9] << 24);
+			uint16_t age = buf[12] | (buf[13] << 8);
+			int32_t lat = (int32_t)((uint32_t)t - (t_sensor + age));
+			if (lat >= 0 && lat < 1000000) samples_add(latency, lat);
+			else offclock++;
+
+			if (t_ping) {
+				samples_add(rtt, t - t_ping);
+				t_ping = 0;
+			}
+		}
+	}
+
+	close(intr);
+	close(ctrl);
+
+	double seconds = (now_us() - t_open) / 1e6;
+	printf("session %i: connect %.1f ms, first report after %.1f ms, %u reports (%.1f/s), %u telemetry\n", num,
+		(t_open - t0) / 1e3, t_first ? (t_first - t_open) / 1e3 : -1.0, reports, reports / seconds, telemetry);
+	samples_print("inter-arrival", inter);
+	samples_print("send to receive", latency);
+	if (offclock) printf("  %u telemetry reports with another clock: the gun is not on this box\n", offclock);
+	samples_print("round trip", rtt);
+	if (lost) printf("  %u round trip requests lost\n", lost);
+
+	samples_add(&connects, t_open - t0);
+	if (t_first) samples_add(&firsts, t_first - t_open);
+	return 0;
+}
+
+
+static void usage() {
+	printf("usage: pigun-peer [options] <gun address>\n");
+	printf("  -s addr     local adapter to use (default any)\n");
+	printf("  -t s        seconds per session (default %.0f)\n", PEER_SESSION);
+	printf("  -r n        sessions, with a reconnection in between (default 1)\n");
+	printf("  -T k        ask a telemetry report every k*%i ms, for the send to receive latency\n", HID_TELEMETRY_STEP);
+	printf("  -p          time the round trip of telemetry requests\n");
+	printf("  -c hex      send a data command at the start of each session\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	int sessions = 1;
+	int o;
+
+	opt.session = PEER_SESSION;
+	opt.command = -1;
+
+	while ((o = getopt(argc, argv, "s:t:r:T:pc:h")) != -1) {
+		switch (o) {
+		case 's':
+			if (parse_addr(optarg, opt.local) != 0) { usage(); return 1; }
+			break;
+		case 't': opt.session = atof(optarg); break;
+		case 'r': sessions = atoi(optarg); break;
+		case 'T': opt.telemetry = atoi(optarg) & 0x0F; break;
+		case 'p': opt.ping = 1; break;
+		case 'c': opt.command = (int)strtol(optarg, NULL, 16) & 0xFF; break;
+		default: usage(); return 1;
+		}
+	}
+	if (optind >= argc || parse_addr(argv[optind], opt.gun) != 0) {
+		usage();
+		return 1;
+	}
+	if (opt.telemetry == 1) opt.telemetry = 2;	// 1 is a single report
+
+	signal(SIGINT, peer_sigint);
+	signal(SIGTERM, peer_sigint);
+
+	samples_t inter = { malloc(PEER_MAXSAMPLES * sizeof(double)), 0 };
+	samples_t latency = { malloc(PEER_MAXSAMPLES * sizeof(double)), 0 };
+	samples_t rtt = { malloc(PEER_MAXSAMPLES * sizeof(double)), 0 };
+	connects.v = malloc(PEER_MAXSAMPLES * sizeof(double));
+	firsts.v = malloc(PEER_MAXSAMPLES * sizeof(double));
+
+	int failed = 0;
+	for (int i = 1; i <= sessions && !peer_stop; i++) {
+		if (session(i, &inter, &latency, &rtt) != 0) failed++;
+		if (i < sessions) usleep(PEER_PAUSE * 1000);
+	}
+
+	printf("summary: %i sessions, %i failed\n", sessions, failed);
+	samples_print("connect", &connects);
+	samples_print("first report", &firsts);
+	return failed ? 2 : 0;
+}
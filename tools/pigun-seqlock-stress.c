@@ -0,0 +1,190 @@
+/*
+* Stress test of the report seqlock (src/pigun-seqlock.h, the code the gun uses for the aim):
+* a writer thread rewrites an aim + frame snapshot as fast as it can, reader threads copy it as
+* pigun_report_get does and check that every copy is one whole snapshot, never newer fields
+* mixed with older ones, and that a reader never goes back to an older snapshot.
+*
+* Every field of a snapshot is derived from its number, so a torn copy shows up at once.
+* It exits with 1 if a torn or out of order copy was found.
+* With -u the readers copy without the seqlock: that must tear, or the test has no teeth on this box.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pigun-seqlock.h"
+
+#define STRESS_DURATION 5.0		// default seconds
+#define STRESS_READERS 3		// default reader threads
+#define STRESS_MAXREADERS 16
+
+
+/// @brief The protected data: like the aim in the report and the frame it came from.
+typedef struct {
+	int16_t x, y;
+	uint32_t id;
+	int64_t t[6];
+} stress_snapshot_t;
+
+/// @brief Counters of one reader.
+typedef struct {
+	pthread_t thread;
+	uint64_t reads;
+	uint64_t retries;
+	uint64_t torn;
+	uint64_t backwards;
+} stress_reader_t;
+
+
+static uint32_t stress_seq = 0;
+static stress_snapshot_t stress_data;
+static volatile int stress_running = 1;
+static int stress_unprotected = 0;
+static uint64_t stress_writes = 0;
+
+
+static void snapshot_make(stress_snapshot_t* s, uint32_t n) {
+
+	s->x = (int16_t)n;
+	s->y = (int16_t)~n;
+	s->id = n;
+	for (int k = 0; k < 6; k++) s->t[k] = (int64_t)n * 7 + k;
+}
+
+// 1 if the copy is not one whole snapshot
+static int snapshot_torn(const stress_snapshot_t* s) {
+
+	if (s->x != (int16_t)s->id || s->y != (int16_t)~s->id) return 1;
+	for (int k = 0; k < 6; k++)
+		if (s->t[k] != (int64_t)s->id * 7 + k) return 1;
+	return 0;
+}
+
+
+static void* stress_writer(void* nullargs) {
+
+	uint32_t n = 0;
+	while (stress_running) {
+		n++;
+		pigun_seqlock_write_begin(&stress_seq);
+		snapshot_make(&stress_data, n);
+		pigun_seqlock_write_end(&stress_seq);
+	}
+	stress_writes = n;
+	return NULL;
+}
+
+static void* stress_reader(void* arg) {
+
+	stress_reader_t* r = (stress_reader_t*)arg;
+	stress_snapshot_t s;
+	uint32_t last = 0;
+
+	while (stress_running) {
+
+		if (stress_unprotected) {
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);	// copy again from memory every time
+			s = stress_data;
+		}
+		else {
+			// as pigun_report_get
+			uint32_t seq;
+			int tries = 0;
+			do {
+				seq = pigun_seqlock_read_begin(&stress_seq);
+				s = stress_data;
+				tries++;
+			} while (pigun_seqlock_read_retry(&stress_seq, seq));
+			r->retries += tries - 1;
+		}
+
+		r->reads++;
+		if (snapshot_torn(&s)) r->torn++;
+		else {
+			if (s.id < last) r->backwards++;
+			last = s.id;
+		}
+	}
+	return NULL;
+}
+
+
+static void usage() {
+	printf("usage: pigun-seqlock-stress [options]\n");
+	printf("  -t s        duration (default %.0f)\n", STRESS_DURATION);
+	printf("  -r n        reader threads (default %i, at most %i)\n", STRESS_READERS, STRESS_MAXREADERS);
+	printf("  -u          read without the seqlock, to check that the test can see a torn copy\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	double duration = STRESS_DURATION;
+	int nreaders = STRESS_READERS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:r:uh")) != -1) {
+		switch (opt) {
+		case 't': duration = atof(optarg); break;
+		case 'r': nreaders = atoi(optarg); break;
+		case 'u': stress_unprotected = 1; break;
+		default: usage(); return 1;
+		}
+	}
+	if (nreaders < 1 || nreaders > STRESS_MAXREADERS || duration <= 0) {
+		usage();
+		return 1;
+	}
+
+	snapshot_make(&stress_data, 0);
+	stress_reader_t readers[STRESS_MAXREADERS];
+	memset(readers, 0, sizeof(readers));
+
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, stress_writer, NULL) != 0) {
+		fprintf(stderr, "STRESS ERROR: unable to start the writer\n");
+		return 1;
+	}
+	for (int i = 0; i < nreaders; i++) {
+		if (pthread_create(&readers[i].thread, NULL, stress_reader, &readers[i]) != 0) {
+			fprintf(stderr, "STRESS ERROR: unable to start reader %i\n", i);
+			return 1;
+		}
+	}
+
+	struct timespec ts = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+	nanosleep(&ts, NULL);
+	stress_running = 0;
+
+	pthread_join(writer, NULL);
+	uint64_t torn = 0, backwards = 0;
+	for (int i = 0; i < nreaders; i++) {
+		stress_reader_t* r = &readers[i];
+		pthread_join(r->thread, NULL);
+		printf("reader %i: %llu reads, %llu retries, %llu torn, %llu backwards\n", i,
+			(unsigned long long)r->reads, (unsigned long long)r->retries, (unsigned long long)r->torn, (unsigned long long)r->backwards);
+		torn += r->torn;
+		backwards += r->backwards;
+	}
+	printf("writer: %llu snapshots in %.1f s, %s\n", (unsigned long long)stress_writes, duration,
+		stress_unprotected ? "readers without the seqlock" : "readers with the seqlock");
+
+	if (stress_unprotected) {
+		if (torn == 0) {
+			printf("FAIL: no torn copy without the seqlock, the test cannot tell on this box\n");
+			return 1;
+		}
+		printf("OK: %llu torn copies without the seqlock\n", (unsigned long long)torn);
+		return 0;
+	}
+	if (torn || backwards) {
+		printf("FAIL: %llu torn and %llu out of order copies\n", (unsigned long long)torn, (unsigned long long)backwards);
+		return 1;
+	}
+	printf("OK: every copy was a whole snapshot\n");
+	return 0;
+}
@@ -0,0 +1,418 @@
+/*
+* Virtual PiGun: a Linux uhid device with the report descriptor of the gun, to test the host side
+* without the hardware. It sends a synthetic aim stream, or replays one recorded by pigun-analyze -w,
+* and answers the data commands (recoil, telemetry) like the gun does.
+*
+* Like the gun, the synthetic stream only sends the joystick report when it changes, plus a keepalive.
+* Needs access to /dev/uhid (root, or a udev rule).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+
+#include "pigun-descriptor.h"
+
+#define VGUN_UHID "/dev/uhid"
+#define VGUN_RATE 100		// default synthetic report rate, in Hz
+#define VGUN_KEEPALIVE 100	// ms without changes before the report is sent again, as HID_KEEPALIVE
+#define VGUN_RADIUS 16000	// amplitude of the synthetic patterns, in report units
+#define VGUN_PERIOD 2.0		// period of the synthetic patterns, in s
+
+
+typedef enum {
+	PATTERN_CIRCLE,
+	PATTERN_SWEEP,
+	PATTERN_STILL
+} vgun_pattern_t;
+
+static struct {
+	int fd;
+	int started;		// uhid started the device, input can go
+	uint64_t t0;		// start time, us
+
+	// synthetic stream
+	vgun_pattern_t pattern;
+	double rate;
+	double noise;		// gaussian noise on the axes, sigma in report units
+	uint32_t trigger;	// ms between trigger presses, 0=never
+	uint32_t keepalive;
+	uint8_t last[1 + HID_REPORT_SIZE];
+	uint64_t t_last;	// time of the last joystick report sent, us
+
+	// replay
+	FILE* replay;
+	int loop;
+
+	// answers to the host
+	uint8_t recoil;
+	uint32_t telemetry;	// telemetry period in ms, 0=off
+	uint64_t t_telemetry;
+	uint32_t frame;		// synthetic frame counter
+
+	uint32_t sent;
+	uint32_t commands;
+} vgun;
+
+static volatile sig_atomic_t vgun_stop = 0;
+
+static void vgun_sigint(int sig) {
+	(void)sig;
+	vgun_stop = 1;
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double gauss() {
+	double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static int uhid_write(const struct uhid_event* ev) {
+
+	ssize_t n = write(vgun.fd, ev, sizeof(*ev));
+	if (n != sizeof(*ev)) {
+		fprintf(stderr, "VGUN ERROR: uhid write failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int send_input(const uint8_t* report, uint16_t size) {
+
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = size;
+	memcpy(ev.u.input2.data, report, size);
+	vgun.sent++;
+	return uhid_write(&ev);
+}
+
+
+// joystick report at time t, us from the start
+static void build_report(uint8_t* report, uint64_t t) {
+
+	double s = t / 1e6;
+	double ph = 2 * M_PI * s / VGUN_PERIOD;
+	double x = 0, y = 0;
+
+	switch (vgun.pattern) {
+	case PATTERN_CIRCLE:
+		x = VGUN_RADIUS * cos(ph);
+		y = VGUN_RADIUS * sin(ph);
+		break;
+	case PATTERN_SWEEP:
+		x = VGUN_RADIUS * (2 * fabs(fmod(s / VGUN_PERIOD, 1.0) * 2 - 1) - 1);
+		break;
+	case PATTERN_STILL:
+		break;
+	}
+	if (vgun.noise > 0) {
+		x += vgun.noise * gauss();
+		y += vgun.noise * gauss();
+	}
+	x = (x < -32767) ? -32767 : (x > 32767) ? 32767 : x;
+	y = (y < -32767) ? -32767 : (y > 32767) ? 32767 : y;
+
+	int16_t ix = (int16_t)lround(x);
+	int16_t iy = (int16_t)lround(y);
+	uint8_t buttons = 0;
+	if (vgun.trigger && (t / 1000) % vgun.trigger < 100) buttons |= 1;
+
+	report[0] = PIGUN_REPORT_ID;
+	report[1] = ix & 0xff;
+	report[2] = (ix >> 8) & 0xff;
+	report[3] = iy & 0xff;
+	report[4] = (iy >> 8) & 0xff;
+	report[5] = buttons;
+}
+
+// telemetry report with the synthetic frame counter and clock, see the table in the README
+static void send_telemetry() {
+
+	uint8_t report[1 + HID_TELEMETRY_SIZE];
+	uint64_t t = now_us();
+	memset(report, 0, sizeof(report));
+
+	report[0] = PIGUN_TELEMETRY_ID;
+	for (int i = 0; i < 4; i++) {
+		report[1 + i] = (vgun.frame >> (8 * i)) & 0xff;
+		report[5 + i] = ((uint32_t)t >> (8 * i)) & 0xff;
+	}
+	report[13] = 4;		// beacons
+	report[14] = 255;	// quality
+	send_input(report, sizeof(report));
+}
+
+
+// data command from the host, as pigun_hid_command
+static void command(uint8_t data) {
+
+	uint8_t cmd = data >> 4;
+	uint8_t par = data & 0x0F;
+	vgun.commands++;
+
+	if (cmd == HID_CMD_FIRE) printf("VGUN: fire %i\n", par);
+	else if (cmd == HID_CMD_BURST) printf("VGUN: burst %i\n", par);
+	else if (cmd == HID_CMD_RECOIL) {
+		vgun.recoil = par;
+		printf("VGUN: recoil mode is now %i\n", par);
+	}
+	else if (cmd == HID_CMD_TELEMETRY) {
+		if (par == 1) send_telemetry();
+		else {
+			vgun.telemetry = par * HID_TELEMETRY_STEP;
+			printf("VGUN: telemetry every %u ms\n", vgun.telemetry);
+		}
+	}
+	else printf("VGUN: invalid data %x\n", data);
+}
+
+static void handle_uhid() {
+
+	struct uhid_event ev;
+	ssize_t n = read(vgun.fd, &ev, sizeof(ev));
+	if (n <= 0) return;
+
+	switch (ev.type) {
+	case UHID_START:
+		vgun.started = 1;
+		printf("VGUN: device started\n");
+		break;
+	case UHID_STOP:
+		vgun.started = 0;
+		printf("VGUN: device stopped\n");
+		break;
+	case UHID_OPEN:
+		printf("VGUN: opened by the host\n");
+		break;
+	case UHID_CLOSE:
+		printf("VGUN: closed by the host\n");
+		break;
+
+	case UHID_OUTPUT:
+		// output report: report ID and the data command
+		if (ev.u.output.size == 2 && ev.u.output.data[0] == PIGUN_REPORT_ID) command(ev.u.output.data[1]);
+		else printf("VGUN: invalid output report, %i bytes\n", ev.u.output.size);
+		break;
+
+	case UHID_SET_REPORT: {
+		struct uhid_event r;
+		memset(&r, 0, sizeof(r));
+		r.type = UHID_SET_REPORT_REPLY;
+		r.u.set_report_reply.id = ev.u.set_report.id;
+		if (ev.u.set_report.rnum == PIGUN_REPORT_ID && ev.u.set_report.size == 2) command(ev.u.set_report.data[1]);
+		else r.u.set_report_reply.err = EIO;
+		uhid_write(&r);
+		break;
+	}
+
+	case UHID_GET_REPORT: {
+		struct uhid_event r;
+		memset(&r, 0, sizeof(r));
+		r.type = UHID_GET_REPORT_REPLY;
+		r.u.get_report_reply.id = ev.u.get_report.id;
+		if (ev.u.get_report.rnum == PIGUN_REPORT_ID) {
+			memcpy(r.u.get_report_reply.data, vgun.last, sizeof(vgun.last));
+			r.u.get_report_reply.size = sizeof(vgun.last);
+		}
+		else r.u.get_report_reply.err = EIO;
+		uhid_write(&r);
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+
+// next report of the recording: "<t_us> <id> <bytes...>" in hex, as written by pigun-analyze -w
+static int replay_next(uint64_t* t, uint8_t* report, uint16_t* size) {
+
+	char line[256];
+	while (1) {
+		if (!fgets(line, sizeof(line), vgun.replay)) {
+			if (!vgun.loop) return -1;
+			rewind(vgun.replay);
+			vgun.t0 = now_us();
+			if (!fgets(line, sizeof(line), vgun.replay)) return -1;
+		}
+		if (line[0] == '#' || line[0] == '\n') continue;
+
+		char* p = line;
+		char* end;
+		*t = strtoull(p, &end, 10);
+		if (end == p) continue;
+		p = end;
+
+		*size = 0;
+		while (*size < HID_MAXREPORT) {
+			unsigned long b = strtoul(p, &end, 16);
+			if (end == p) break;
+			report[(*size)++] = (uint8_t)b;
+			p = end;
+		}
+		if (*size > 0) return 0;
+	}
+}
+
+
+static void usage() {
+	printf("usage: pigun-vgun [options]\n");
+	printf("  -p pattern  synthetic aim: circle, sweep or still (default circle)\n");
+	printf("  -f hz       synthetic report rate (default %i)\n", VGUN_RATE);
+	printf("  -n sigma    gaussian noise on the synthetic axes, in report units\n");
+	printf("  -b ms       press the trigger every ms (default never)\n");
+	printf("  -k ms       keepalive when the report does not change (default %i)\n", VGUN_KEEPALIVE);
+	printf("  -r file     replay a recording of pigun-analyze -w instead\n");
+	printf("  -l          loop the recording\n");
+	printf("  -u          show up as a USB device instead of bluetooth\n");
+	printf("  -t s        stop after s seconds\n");
+}
+
+int main(int argc, char* argv[]) {
+
+	double duration = 0;
+	int usb = 0;
+	int opt;
+
+	vgun.pattern = PATTERN_CIRCLE;
+	vgun.rate = VGUN_RATE;
+	vgun.keepalive = VGUN_KEEPALIVE;
+
+	while ((opt = getopt(argc, argv, "p:f:n:b:k:r:lut:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (strcmp(optarg, "circle") == 0) vgun.pattern = PATTERN_CIRCLE;
+			else if (strcmp(optarg, "sweep") == 0) vgun.pattern = PATTERN_SWEEP;
+			else if (strcmp(optarg, "still") == 0) vgun.pattern = PATTERN_STILL;
+			else { usage(); return 1; }
+			break;
+		case 'f': vgun.rate = atof(optarg); break;
+		case 'n': vgun.noise = atof(optarg); break;
+		case 'b': vgun.trigger = atoi(optarg); break;
+		case 'k': vgun.keepalive = atoi(optarg); break;
+		case 'r':
+			vgun.replay = fopen(optarg, "r");
+			if (!vgun.replay) {
+				fprintf(stderr, "VGUN ERROR: unable to open %s (%s)\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'l': vgun.loop = 1; break;
+		case 'u': usb = 1; break;
+		case 't': duration = atof(optarg); break;
+		default: usage(); return 1;
+		}
+	}
+	if (vgun.rate <= 0) vgun.rate = VGUN_RATE;
+
+	vgun.fd = open(VGUN_UHID, O_RDWR | O_CLOEXEC);
+	if (vgun.fd < 0) {
+		fprintf(stderr, "VGUN ERROR: unable to open %s (%s)\n", VGUN_UHID, strerror(errno));
+		return 1;
+	}
+
+	// same descriptor and IDs as the gun: device ID record on bluetooth, the gadget on USB
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name), "PiGun 1F (virtual)");
+	snprintf((char*)ev.u.create2.phys, sizeof(ev.u.create2.phys), "pigun-vgun");
+	memcpy(ev.u.create2.rd_data, pigun_descriptor, sizeof(pigun_descriptor));
+	ev.u.create2.rd_size = sizeof(pigun_descriptor);
+	ev.u.create2.bus = usb ? BUS_USB : BUS_BLUETOOTH;
+	ev.u.create2.vendor = usb ? 0x1d6b : 0x048F;
+	ev.u.create2.product = usb ? 0x0104 : 0x0002;
+	ev.u.create2.version = 1;
+	if (uhid_write(&ev) != 0) return 1;
+
+	signal(SIGINT, vgun_sigint);
+	signal(SIGTERM, vgun_sigint);
+
+	printf("VGUN: created, %s\n", vgun.replay ? "replaying" : "synthetic stream");
+
+	vgun.t0 = now_us();
+	uint64_t t_start = vgun.t0;
+	uint64_t period = (uint64_t)(1e6 / vgun.rate);
+	uint64_t t_next = vgun.t0;
+	uint8_t report[HID_MAXREPORT];
+	uint16_t size = 0;
+	uint64_t t_rec = 0;
+
+	if (vgun.replay && replay_next(&t_rec, report, &size) != 0) {
+		fprintf(stderr, "VGUN ERROR: empty recording\n");
+		vgun_stop = 1;
+	}
+
+	while (!vgun_stop) {
+
+		uint64_t now = now_us();
+		if (duration > 0 && now - t_start > duration * 1e6) break;
+
+		// wait for the next report, serving uhid in the meantime
+		uint64_t t_due = vgun.replay ? vgun.t0 + t_rec : t_next;
+		if (vgun.telemetry && vgun.t_telemetry + vgun.telemetry * 1000 < t_due)
+			t_due = vgun.t_telemetry + vgun.telemetry * 1000;
+
+		int timeout = (t_due > now) ? (int)((t_due - now + 999) / 1000) : 0;
+		struct pollfd pfd = { vgun.fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout) > 0) {
+			handle_uhid();
+			continue;
+		}
+		now = now_us();
+		if (!vgun.started) continue;
+
+		if (vgun.telemetry && now >= vgun.t_telemetry + vgun.telemetry * 1000) {
+			vgun.t_telemetry = now;
+			send_telemetry();
+		}
+
+		if (vgun.replay) {
+			if (now < vgun.t0 + t_rec) continue;
+			send_input(report, size);
+			if (report[0] == PIGUN_REPORT_ID && size == sizeof(vgun.last)) memcpy(vgun.last, report, size);
+			if (replay_next(&t_rec, report, &size) != 0) break;
+			continue;
+		}
+
+		if (now < t_next) continue;
+		t_next += period;
+		if (t_next < now) t_next = now + period;	// do not catch up after a stall
+		vgun.frame++;
+
+		uint8_t r[1 + HID_REPORT_SIZE];
+		build_report(r, now - vgun.t0);
+		if (memcmp(r, vgun.last, sizeof(r)) == 0 && now - vgun.t_last < vgun.keepalive * 1000) continue;
+
+		memcpy(vgun.last, r, sizeof(r));
+		vgun.t_last = now;
+		send_input(r, sizeof(r));
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(&ev);
+	close(vgun.fd);
+
+	printf("VGUN: %u reports sent, %u commands received\n", vgun.sent, vgun.commands);
+	return 0;
+}
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Bluetooth benchmark without radio: two linked virtual controllers made by btvirt (BlueZ emulator),
+# the gun on the first one through the HCI user channel, pigun-peer as the host on the second one.
+# Run as root from tools/, with bluetoothd stopped and pigun.exe built with PIGUN_FAKECAM (moving aim).
+#
+# usage: vhci-bench.sh [seconds per session] [sessions] [path to pigun.exe]
+
+set -e
+
+SESSION=${1:-10}
+SESSIONS=${2:-5}
+PIGUN=${3:-../src/pigun.exe}
+
+hcis() {
+	ls /sys/class/bluetooth | grep -E '^hci[0-9]+$' | sort
+}
+
+addr() {
+	btmgmt --index $1 info | awk '/addr/ { print $2; exit }'
+}
+
+BEFORE=$(hcis)
+btvirt -l2 > /tmp/btvirt.log 2>&1 &
+BTVIRT=$!
+trap 'kill $GUN $BTVIRT 2>/dev/null || true' EXIT
+sleep 1
+
+# the two new controllers: the gun takes the first one
+NEW=""
+for d in $(hcis); do
+	echo "$BEFORE" | grep -qx $d || NEW="$NEW ${d#hci}"
+done
+set -- $NEW
+[ $# -ge 2 ] || { echo "btvirt did not make two controllers"; exit 1; }
+GUN_DEV=$1
+PEER_DEV=$2
+GUN_ADDR=$(addr $GUN_DEV)
+PEER_ADDR=$(addr $PEER_DEV)
+
+# the host side answers the just works pairing by itself when bondable with no IO
+btmgmt --index $PEER_DEV ssp on > /dev/null
+btmgmt --index $PEER_DEV bondable on > /dev/null
+btmgmt --index $PEER_DEV io-cap 3 > /dev/null
+btmgmt --index $PEER_DEV power on > /dev/null
+
+# the HCI traffic of the gun, to check the link tuning commands afterwards
+BTMON=""
+if command -v btmon > /dev/null; then
+	btmon -i hci$GUN_DEV -w /tmp/pigun-vhci.btsnoop > /dev/null 2>&1 &
+	BTMON=$!
+	trap 'kill $GUN $BTMON $BTVIRT 2>/dev/null || true' EXIT
+fi
+
+echo "gun on hci$GUN_DEV ($GUN_ADDR), host on hci$PEER_DEV ($PEER_ADDR)"
+$PIGUN --hci $GUN_DEV > /tmp/pigun-vhci.log 2>&1 &
+GUN=$!
+sleep 3
+
+./pigun-peer -s $PEER_ADDR -t $SESSION -r $SESSIONS -T 2 -p $GUN_ADDR
+
+# link tuning (pigun-link.c): the sniff commands must go out as link policy commands (OGF 0x02),
+# not as the periodic inquiry ones that have the same OCF in link control (OGF 0x01)
+[ -n "$BTMON" ] || exit 0
+kill $GUN 2>/dev/null || true
+sleep 1
+kill $BTMON 2>/dev/null || true
+wait $BTMON 2>/dev/null || true
+btmon -r /tmp/pigun-vhci.btsnoop 2>/dev/null | grep -E "HCI Command: .*\((0x01\|0x000[34]|0x02\|0x000[347d])\)" | sort | uniq -c > /tmp/pigun-vhci-link.txt || true
+echo "link commands sent by the gun:"
+cat /tmp/pigun-vhci-link.txt
+if grep -q "0x01|0x000[34]" /tmp/pigun-vhci-link.txt; then
+	echo "FAIL: periodic inquiry commands sent instead of sniff mode"
+	exit 1
+fi
+grep -q "Sniff Mode (0x02|0x000[34])" /tmp/pigun-vhci-link.txt || { echo "FAIL: no sniff mode command seen"; exit 1; }
+echo "OK: sniff commands sent as link policy commands"